@@ -0,0 +1,496 @@
+/*
+ * Third Space Vest Driver - Packet pipeline benchmarks
+ *
+ * Runs the hot path on the null transport, so no vest is needed, and
+ * prints one JSON object (or CSV with --csv) per run for regression
+ * tracking.
+ *
+ * Usage: thirdspacevest_bench [--iterations N] [--latency-us N] [--filter NAME] [--csv]
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(WIN32)
+#include <time.h>
+#endif
+
+/// Samples kept per benchmark for the percentiles
+#define BENCH_MAX_SAMPLES 100000
+
+typedef struct {
+	const char* name;
+	/// Operations timed together as one sample, > 1 for ops too short
+	/// for the clock to resolve on their own
+	int batch;
+	void (*run)(thirdspacevest_device* dev, uint32_t i, int batch);
+} bench_case;
+
+typedef struct {
+	uint32_t iterations;
+	uint32_t latency_us;
+	const char* filter;
+	int csv;
+} bench_options;
+
+static volatile uint32_t bench_sink;
+static uint64_t bench_samples[BENCH_MAX_SAMPLES];
+
+static uint64_t bench_now_ns()
+{
+#if defined(WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if(!freq.QuadPart)
+	{
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000 +
+		(uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*******************************************************************************
+ *
+ * Cases
+ *
+ ******************************************************************************/
+
+static void bench_checksum(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	uint32_t acc = 0;
+	int j;
+	(void)dev;
+	for(j = 0; j < batch; ++j, ++i)
+	{
+		acc += thirdspacevest_form_checksum(i & 7, (uint8_t)(i >> 3));
+	}
+	bench_sink += acc;
+}
+
+static void bench_encrypt(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	uint8_t cache_key_index;
+	uint32_t key[4];
+	uint32_t v[2];
+	int j;
+	(void)dev;
+	thirdspacevest_form_cache_key(&cache_key_index, key);
+	v[0] = i;
+	v[1] = ~i;
+	for(j = 0; j < batch; ++j)
+	{
+		thirdspacevest_encrypt(v, key);
+	}
+	bench_sink += v[0];
+}
+
+/// Blocks per thirdspacevest_encrypt_n call in the encrypt_n case
+#define BENCH_TEA_BLOCKS 1024
+
+static void bench_encrypt_n(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	static uint32_t blocks[BENCH_TEA_BLOCKS][2];
+	uint8_t cache_key_index;
+	uint32_t key[4];
+	(void)dev;
+	thirdspacevest_form_cache_key(&cache_key_index, key);
+	blocks[0][0] = i;
+	thirdspacevest_encrypt_n(&blocks[0][0], batch, key);
+	bench_sink += blocks[batch - 1][1];
+}
+
+static void bench_packet_uncached(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	int j;
+	(void)dev;
+	for(j = 0; j < batch; ++j, ++i)
+	{
+		thirdspacevest_encode_packet(packet, i & 7, (uint8_t)(i >> 3));
+		bench_sink += packet[9];
+	}
+}
+
+static void bench_packet_cached(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	int j;
+	(void)dev;
+	for(j = 0; j < batch; ++j, ++i)
+	{
+		thirdspacevest_form_packet(packet, i & 7, (uint8_t)(i >> 3));
+		bench_sink += packet[9];
+	}
+}
+
+// Same path a send takes, timing and histogram included, so it
+// compares directly with form_packet_rotating.
+static void bench_packet_device(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	int j;
+	for(j = 0; j < batch; ++j, ++i)
+	{
+		thirdspacevest_form_device_packet(dev, packet, i & 7, (uint8_t)(i >> 3));
+		bench_sink += packet[9];
+	}
+}
+
+static void bench_packet_rotating(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	int j;
+	for(j = 0; j < batch; ++j, ++i)
+	{
+		thirdspacevest_form_device_packet(dev, packet, i & 7, (uint8_t)(i >> 3));
+		bench_sink += packet[9];
+	}
+}
+
+static void bench_project_hit(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	int j;
+	(void)dev;
+	// Walks directions all over the sphere so every lookup isn't the
+	// same table row.
+	for(j = 0; j < batch; ++j, ++i)
+	{
+		thirdspacevest_project_hit((float)(int8_t)i, (float)(int8_t)(i >> 8), (float)(int8_t)(i * 7 + 3), 200, speeds);
+		bench_sink += speeds[i & 7];
+	}
+}
+
+/// Hits per thirdspacevest_project_hits call in the project_hits case
+#define BENCH_HITS 16
+
+static void bench_project_hits(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	thirdspacevest_hit hits[BENCH_HITS];
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	int j;
+	(void)dev;
+	for(j = 0; j < batch; ++j, ++i)
+	{
+		hits[j].x = (float)(int8_t)i;
+		hits[j].y = (float)(int8_t)(i >> 8);
+		hits[j].z = (float)(int8_t)(i * 7 + 3);
+		hits[j].intensity = (uint8_t)(i >> 2);
+	}
+	thirdspacevest_project_hits(hits, batch, THIRDSPACEVEST_BLEND_MAX, speeds);
+	bench_sink += speeds[i & 7];
+}
+
+/// Telemetry channels and frames per block in the dsp_process case
+#define BENCH_DSP_CHANNELS 8
+#define BENCH_DSP_FRAMES 64
+
+static thirdspacevest_dsp* bench_dsp;
+
+static void bench_dsp_process(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	static float block[BENCH_DSP_FRAMES * BENCH_DSP_CHANNELS];
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	int j;
+	(void)dev;
+	for(j = 0; j < batch * BENCH_DSP_CHANNELS; ++j, ++i)
+	{
+		block[j] = (float)(int8_t)(i * 37) / 32.0f;
+	}
+	thirdspacevest_dsp_process(bench_dsp, block, batch);
+	bench_sink += thirdspacevest_dsp_render(bench_dsp, i, speeds);
+}
+
+static void bench_send_sync(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	(void)batch;
+	thirdspacevest_send_effect(dev, i & 7, (uint8_t)(i >> 3));
+}
+
+static void bench_send_no_ack(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	(void)batch;
+	thirdspacevest_set_ack_mode(dev, THIRDSPACEVEST_ACK_NONE);
+	thirdspacevest_send_effect(dev, i & 7, (uint8_t)(i >> 3));
+	thirdspacevest_set_ack_mode(dev, THIRDSPACEVEST_ACK_SYNC);
+}
+
+static void bench_send_frame(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	int j;
+	(void)batch;
+	// Every cell changes every frame, so nothing is skipped.
+	for(j = 0; j < THIRDSPACEVEST_CELL_COUNT; ++j)
+	{
+		speeds[j] = (uint8_t)(i + j);
+	}
+	thirdspacevest_send_frame(dev, speeds, 0xFF);
+}
+
+static void bench_send_async(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	int j;
+	for(j = 0; j < batch; ++j, ++i)
+	{
+		while(thirdspacevest_send_effect_async(dev, i & 7, (uint8_t)(i >> 3), NULL, NULL) == E_NPUTIL_BUSY)
+		{
+			thirdspacevest_handle_events(dev, THIRDSPACEVEST_USB_TIMEOUT);
+		}
+	}
+	while(thirdspacevest_get_pending(dev))
+	{
+		thirdspacevest_handle_events(dev, THIRDSPACEVEST_USB_TIMEOUT);
+	}
+}
+
+static void bench_io_thread(thirdspacevest_device* dev, uint32_t i, int batch)
+{
+	thirdspacevest_queue_stats stats;
+	int j;
+	for(j = 0; j < batch; ++j, ++i)
+	{
+		thirdspacevest_enqueue_effect(dev, i & 7, (uint8_t)(i >> 3));
+	}
+	// Forced effects are either sent or coalesced into a later one, so
+	// the batch is done once those add up to what was queued.
+	for(;;)
+	{
+		thirdspacevest_get_queue_stats(dev, &stats);
+		if(stats.sent + stats.coalesced >= stats.queued)
+		{
+			break;
+		}
+		thirdspacevest_thread_yield();
+	}
+}
+
+static const bench_case bench_cases[] = {
+	{"form_checksum", 1000, bench_checksum},
+	{"encrypt", 1000, bench_encrypt},
+	{"encrypt_n", BENCH_TEA_BLOCKS, bench_encrypt_n},
+	{"form_packet_uncached", 1000, bench_packet_uncached},
+	{"form_packet_cached", 1000, bench_packet_cached},
+	{"form_packet_device", 1000, bench_packet_device},
+	{"form_packet_rotating", 1000, bench_packet_rotating},
+	{"project_hit", 1000, bench_project_hit},
+	{"project_hits_16", BENCH_HITS, bench_project_hits},
+	{"dsp_process_8_channels", BENCH_DSP_FRAMES, bench_dsp_process},
+	{"send_effect_sync", 1, bench_send_sync},
+	{"send_effect_no_ack", 1, bench_send_no_ack},
+	{"send_frame_8_cells", 1, bench_send_frame},
+	{"send_effect_async", THIRDSPACEVEST_MAX_TRANSFERS * 4, bench_send_async},
+	{"io_thread_enqueue", 64, bench_io_thread},
+};
+
+/*******************************************************************************
+ *
+ * Runner
+ *
+ ******************************************************************************/
+
+static int bench_compare(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static int bench_setup(const bench_case* c, thirdspacevest_device* dev)
+{
+	if(c->run == bench_io_thread)
+	{
+		return thirdspacevest_start_io_thread(dev);
+	}
+	if(c->run == bench_packet_rotating)
+	{
+		return thirdspacevest_set_key_mode(dev, THIRDSPACEVEST_KEY_ROTATING);
+	}
+	if(c->run == bench_dsp_process)
+	{
+		// A SimHub style mix: lateral g split left/right, the rest
+		// rectified onto one face each.
+		thirdspacevest_dsp_channel channel = {0x0F, 0xF0, 10, 0, 2.0f, 0.1f, 0.0f, 150.0f};
+		int j;
+		bench_dsp = thirdspacevest_dsp_create(60.0f);
+		if(!bench_dsp)
+		{
+			return E_NPUTIL_DRIVER_ERROR;
+		}
+		for(j = 0; j < BENCH_DSP_CHANNELS; ++j)
+		{
+			thirdspacevest_dsp_add_channel(bench_dsp, &channel);
+			channel.cell_mask = (uint8_t)(0x11 << (j & 3));
+			channel.negative_mask = 0;
+		}
+	}
+	return 0;
+}
+
+static void bench_teardown(const bench_case* c, thirdspacevest_device* dev)
+{
+	if(c->run == bench_io_thread)
+	{
+		thirdspacevest_stop_io_thread(dev);
+	}
+	if(c->run == bench_packet_rotating)
+	{
+		thirdspacevest_set_key_mode(dev, THIRDSPACEVEST_KEY_FIXED);
+	}
+	if(c->run == bench_dsp_process)
+	{
+		thirdspacevest_dsp_delete(bench_dsp);
+		bench_dsp = NULL;
+	}
+}
+
+static void bench_report(const bench_options* opts, const bench_case* c, uint32_t ops, uint64_t total_ns, int samples, int first)
+{
+	// Samples are per batch, so scale them down to per operation.
+	double per_op = (double)total_ns / ops;
+	double p50 = (double)bench_samples[samples / 2] / c->batch;
+	double p99 = (double)bench_samples[(samples * 99) / 100] / c->batch;
+	double max = (double)bench_samples[samples - 1] / c->batch;
+
+	if(opts->csv)
+	{
+		printf("%s,%u,%.1f,%.0f,%.1f,%.1f,%.1f\n", c->name, ops, per_op, 1e9 / per_op, p50, p99, max);
+		return;
+	}
+	printf("%s    {\"name\": \"%s\", \"iterations\": %u, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, "
+		   "\"p50_ns\": %.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f}",
+		   first ? "" : ",\n", c->name, ops, per_op, 1e9 / per_op, p50, p99, max);
+}
+
+static int bench_run(const bench_options* opts, const bench_case* c, thirdspacevest_device* dev, int first)
+{
+	uint32_t batches = (opts->iterations + c->batch - 1) / c->batch;
+	uint64_t total = 0;
+	uint64_t start;
+	uint32_t b;
+	int samples = 0;
+
+	if(batches > BENCH_MAX_SAMPLES)
+	{
+		batches = BENCH_MAX_SAMPLES;
+	}
+	if(bench_setup(c, dev) < 0)
+	{
+		fprintf(stderr, "%s: setup failed\n", c->name);
+		return 1;
+	}
+	// One untimed batch to warm the packet cache and branch predictors.
+	c->run(dev, 0, c->batch);
+	for(b = 0; b < batches; ++b)
+	{
+		start = bench_now_ns();
+		c->run(dev, b * c->batch, c->batch);
+		bench_samples[samples] = bench_now_ns() - start;
+		total += bench_samples[samples++];
+	}
+	bench_teardown(c, dev);
+
+	qsort(bench_samples, samples, sizeof(bench_samples[0]), bench_compare);
+	bench_report(opts, c, batches * c->batch, total, samples, first);
+	return 0;
+}
+
+static int bench_parse(int argc, char** argv, bench_options* opts)
+{
+	int i;
+	opts->iterations = 100000;
+	opts->latency_us = 0;
+	opts->filter = NULL;
+	opts->csv = 0;
+	for(i = 1; i < argc; ++i)
+	{
+		if(!strcmp(argv[i], "--iterations") && i + 1 < argc)
+		{
+			opts->iterations = (uint32_t)strtoul(argv[++i], NULL, 10);
+		}
+		else if(!strcmp(argv[i], "--latency-us") && i + 1 < argc)
+		{
+			opts->latency_us = (uint32_t)strtoul(argv[++i], NULL, 10);
+		}
+		else if(!strcmp(argv[i], "--filter") && i + 1 < argc)
+		{
+			opts->filter = argv[++i];
+		}
+		else if(!strcmp(argv[i], "--csv"))
+		{
+			opts->csv = 1;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--iterations N] [--latency-us N] [--filter NAME] [--csv]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(!opts->iterations)
+	{
+		opts->iterations = 1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	bench_options opts;
+	thirdspacevest_device* dev;
+	unsigned int i;
+	int first = 1;
+	int ret = 0;
+
+	if(bench_parse(argc, argv, &opts))
+	{
+		return 1;
+	}
+	dev = thirdspacevest_create_null(opts.latency_us);
+	if(!dev || thirdspacevest_open(dev, 0) < 0)
+	{
+		fprintf(stderr, "Cannot open null thirdspacevest!\n");
+		return 1;
+	}
+
+	if(opts.csv)
+	{
+		printf("name,iterations,ns_per_op,ops_per_sec,p50_ns,p99_ns,max_ns\n");
+	}
+	else
+	{
+		printf("{\"latency_us\": %u, \"tea\": \"%s\", \"results\": [\n", opts.latency_us, thirdspacevest_tea_impl_name());
+	}
+	for(i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); ++i)
+	{
+		if(opts.filter && !strstr(bench_cases[i].name, opts.filter))
+		{
+			continue;
+		}
+		ret |= bench_run(&opts, &bench_cases[i], dev, first);
+		first = 0;
+	}
+	if(!opts.csv)
+	{
+		printf("\n]}\n");
+	}
+
+	thirdspacevest_close(dev);
+	thirdspacevest_delete(dev);
+	return ret;
+}
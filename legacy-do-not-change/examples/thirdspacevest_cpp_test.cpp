@@ -0,0 +1,106 @@
+#include "thirdspacevest/thirdspacevest.hpp"
+#include <cstdio>
+#include <cstdlib>
+#if !defined(WIN32)
+#include <poll.h>
+#endif
+
+namespace tsv = thirdspacevest;
+
+// Folded at compile time, the steps are a constant array.
+static constexpr auto kick = tsv::then(
+	tsv::effect(tsv::step(tsv::FRONT, 10, 0, 100000)),
+	tsv::effect(tsv::step(tsv::BACK & tsv::UPPER, 6, 0, 80000),
+				tsv::step(tsv::cells<tsv::cell::BACK_LOWER_LEFT>, 3, 40000, 40000)),
+	20000);
+static_assert(kick.duration_us() == 200000);
+static_assert(kick.mask() == (tsv::FRONT | (tsv::BACK - tsv::cells<tsv::cell::BACK_LOWER_RIGHT>)));
+
+// Smallest coroutine type that runs eagerly and frees itself, engines
+// bring their own.
+struct Task
+{
+	struct promise_type
+	{
+		Task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::abort(); }
+	};
+};
+
+static int frames_sent = 0;
+
+static Task sweep(tsv::Vest& vest)
+{
+	for(uint8_t speed = 1; speed <= 4; ++speed)
+	{
+		const tsv::Frame frame = tsv::fill(tsv::TORSO, speed);
+		if(co_await vest.send(frame, tsv::TORSO) < 0)
+		{
+			co_return;
+		}
+		++frames_sent;
+	}
+}
+
+int main(int argc, char**)
+{
+	// Loopback by default, pass "usb" to drive a real vest
+	tsv::Vest vest = argc > 1 ? tsv::Vest::create() : tsv::Vest::create_null();
+	if(!vest)
+	{
+		printf("Cannot initialize USB core!\n");
+		return 1;
+	}
+	if(vest.open() < 0)
+	{
+		printf("Cannot open thirdspacevest!\n");
+		return 1;
+	}
+
+	constexpr tsv::Frame hit = tsv::fill(tsv::LEFT_ARM, 8);
+	if(vest.send_frame(hit) < 0 || vest.send_mask(tsv::RIGHT_ARM, 8) < 0 || vest.send(tsv::cell::FRONT_LOWER_LEFT, 0) < 0)
+	{
+		printf("Send failed!\n");
+		return 1;
+	}
+	// Shot from behind and to the right, slightly below
+	if(vest.send_hit(tsv::project(0.5f, -0.2f, -1.0f, 10)) < 0)
+	{
+		printf("Send failed!\n");
+		return 1;
+	}
+	if(vest.start_sequencer() < 0 || vest.play(kick) < 0)
+	{
+		printf("Cannot play effect!\n");
+		return 1;
+	}
+	printf("Played a %u us effect on %d cells\n", kick.duration_us(), kick.mask().count());
+
+	// One thread waits on the completion handle and resumes the
+	// coroutine between sends, nothing blocks on USB.
+	if(vest.start_completions() < 0)
+	{
+		printf("Cannot start completions!\n");
+		return 1;
+	}
+	sweep(vest);
+	while(frames_sent < 4)
+	{
+#if defined(WIN32)
+		if(WaitForSingleObject(vest.completion_handle(), 1000) != WAIT_OBJECT_0)
+#else
+		struct pollfd fd = {vest.completion_fd(), POLLIN, 0};
+		if(poll(&fd, 1, 1000) <= 0)
+#endif
+		{
+			printf("Timed out waiting for the vest!\n");
+			return 1;
+		}
+		vest.dispatch_completions();
+	}
+	printf("Sent %d frames from a coroutine\n", frames_sent);
+	return 0;
+}
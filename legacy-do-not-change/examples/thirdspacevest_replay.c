@@ -0,0 +1,122 @@
+/*
+ * Replays a trace from thirdspacevest_start_trace and prints the queue
+ * and latency numbers it produced, so two builds can be compared on
+ * exactly the same workload. Runs against the null device unless --usb
+ * is given.
+ */
+
+#include "thirdspacevest/thirdspacevest.h"
+#include <stdio.h>
+#include <stdlib.h>		/* atof, atoi */
+#include <string.h>
+
+static void print_histogram(const char* name, const thirdspacevest_histogram* hist)
+{
+	printf("%-8s %8u samples  p50 %6u us  p99 %6u us  max %6u us\n", name, hist->count,
+		   thirdspacevest_histogram_percentile(hist, 50), thirdspacevest_histogram_percentile(hist, 99),
+		   hist->max_us);
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s TRACE [--speed X] [--latency-us N | --usb] [--io-thread] [--completions] [--trace OUT]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+	thirdspacevest_device* dev;
+	thirdspacevest_stats stats;
+	const char* path = NULL;
+	const char* out = NULL;
+	double speed = 1.0;
+	uint32_t latency_us = 0;
+	int usb = 0, io_thread = 0, completions = 0;
+	int ret, i;
+
+	for(i = 1; i < argc; ++i)
+	{
+		if(!strcmp(argv[i], "--speed") && i + 1 < argc)
+		{
+			speed = atof(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "--latency-us") && i + 1 < argc)
+		{
+			latency_us = (uint32_t)atoi(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "--trace") && i + 1 < argc)
+		{
+			out = argv[++i];
+		}
+		else if(!strcmp(argv[i], "--usb"))
+		{
+			usb = 1;
+		}
+		else if(!strcmp(argv[i], "--io-thread"))
+		{
+			io_thread = 1;
+		}
+		else if(!strcmp(argv[i], "--completions"))
+		{
+			completions = 1;
+		}
+		else if(!path && argv[i][0] != '-')
+		{
+			path = argv[i];
+		}
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(!path)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	dev = usb ? thirdspacevest_create() : thirdspacevest_create_null(latency_us);
+	if(dev == NULL)
+	{
+		printf("Cannot create device!\n");
+		return 1;
+	}
+	if(thirdspacevest_open(dev, 0) < 0)
+	{
+		printf("Cannot open thirdspacevest!\n");
+		thirdspacevest_delete(dev);
+		return 1;
+	}
+	if((io_thread && thirdspacevest_start_io_thread(dev) < 0) ||
+	   (completions && thirdspacevest_start_completions(dev) < 0))
+	{
+		printf("Cannot start background threads!\n");
+		thirdspacevest_delete(dev);
+		return 1;
+	}
+	if(out && thirdspacevest_start_trace(dev, out) < 0)
+	{
+		printf("Cannot write trace %s!\n", out);
+		thirdspacevest_delete(dev);
+		return 1;
+	}
+
+	ret = thirdspacevest_replay_trace(dev, path, speed);
+	thirdspacevest_get_stats(dev, &stats);
+	thirdspacevest_close(dev);
+	thirdspacevest_delete(dev);
+	if(ret < 0)
+	{
+		printf("Cannot replay %s (%d)!\n", path, ret);
+		return 1;
+	}
+
+	printf("Replayed %d commands\n", ret);
+	printf("queue    %8u queued  %u coalesced  %u dropped  %u sent\n",
+		   stats.queue.queued, stats.queue.coalesced, stats.queue.dropped, stats.queue.sent);
+	printf("errors   %8u (%u timeouts)\n", stats.errors, stats.timeouts);
+	print_histogram("encrypt", &stats.encrypt);
+	print_histogram("write", &stats.write);
+	print_histogram("ack", &stats.ack);
+	return 0;
+}
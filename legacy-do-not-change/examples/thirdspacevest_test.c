@@ -16,6 +16,12 @@ int main(int argc, char** argv)
 
 	ret = thirdspacevest_get_count(test);
 
+	// The USB core comes up on first use, so this is where it can fail
+	if(ret < 0)
+	{
+		printf("Cannot initialize USB core!\n");
+		return 1;
+	}
 	if(!ret)
 	{
 		printf("No thirdspacevests connected!\n");
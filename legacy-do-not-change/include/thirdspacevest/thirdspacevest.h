@@ -23,6 +23,8 @@
 #define E_NPUTIL_DRIVER_ERROR -1
 #define E_NPUTIL_NOT_INITED -2
 #define E_NPUTIL_NOT_OPENED -3
+#define E_NPUTIL_BUSY -4
+#define E_NPUTIL_INVALID_PARAM -5
 
 #include <stdint.h>
 
@@ -36,31 +38,919 @@
 #define THIRDSPACEVEST_DECLSPEC
 #endif
 
+#endif
+
+/// Size of every packet sent to or read from the vest
+#define THIRDSPACEVEST_PACKET_SIZE 10
+/// Number of asynchronous effect transfers that can be in flight at once
+#define THIRDSPACEVEST_MAX_TRANSFERS 16
+/// Number of air cells on the vest
+#define THIRDSPACEVEST_CELL_COUNT 8
+/// Cell mask covering every cell on the vest
+#define THIRDSPACEVEST_ALL_CELLS 0xFF
+
+/// Most vests the enumeration cache tracks at once
+#define THIRDSPACEVEST_MAX_DEVICES 16
+/// Shortest time between automatic attempts to reopen a vest that went away
+#define THIRDSPACEVEST_RECONNECT_INTERVAL_MS 250
+/// Alignment storage passed to thirdspacevest_init_inplace needs. malloc
+/// and any 8-byte aligned static or stack buffer meet it.
+#define THIRDSPACEVEST_DEVICE_ALIGN 8
+
+/// Every write waits for the vest's status read before returning (default)
+#define THIRDSPACEVEST_ACK_SYNC 0
+/// Status reads finish in the background, only errors are reported
+#define THIRDSPACEVEST_ACK_ASYNC 1
+/// Writes are fire-and-forget, status reads are skipped entirely
+#define THIRDSPACEVEST_ACK_NONE 2
+
+/// Every packet uses THIRDSPACEVEST_FIXED_KEY_INDEX and comes from the packet cache (default)
+#define THIRDSPACEVEST_KEY_FIXED 0
+/// Every packet is encrypted with a randomly picked cache key
+#define THIRDSPACEVEST_KEY_ROTATING 1
+/// Number of cache keys THIRDSPACEVEST_KEY_ROTATING picks from, must be a power of 2
+#define THIRDSPACEVEST_ROTATING_KEYS 16
+/// Cache key index used in THIRDSPACEVEST_KEY_FIXED mode
+#define THIRDSPACEVEST_FIXED_KEY_INDEX 0x1D
+
+#if defined(WIN32)
+typedef HANDLE thirdspacevest_thread;
+typedef CRITICAL_SECTION thirdspacevest_mutex;
+/// Auto-reset event used to wake library owned threads
+typedef HANDLE thirdspacevest_event;
+#else
+#include <pthread.h>
+typedef pthread_t thirdspacevest_thread;
+typedef pthread_mutex_t thirdspacevest_mutex;
+/// Auto-reset event used to wake library owned threads
+typedef struct {
+	pthread_mutex_t _lock;
+	pthread_cond_t _cond;
+	int _signaled;
+} thirdspacevest_event;
+#endif
+
+typedef struct thirdspacevest_device thirdspacevest_device;
+/// Trace writer behind thirdspacevest_start_trace, private to the library
+typedef struct thirdspacevest_trace thirdspacevest_trace;
+
 /**
- * Structure to hold information about Windows HID devices.
+ * Counters for commands going through the I/O thread. All counts are
+ * cumulative since the device was created.
  *
  * @ingroup CoreFunctions
  */
 typedef struct {
-	/// Windows device handle
-	HANDLE _dev;
-	/// 0 if device is closed, > 0 otherwise
-	int _is_open;
-	/// 0 if device is initialized, > 0 otherwise
-	int _is_inited;
-} thirdspacevest_device;
+	/// Cell commands handed to the I/O thread
+	uint32_t queued;
+	/// Commands replaced by a newer one for the same cell before being sent
+	uint32_t coalesced;
+	/// Always 0, commands are never refused. Kept so existing readers
+	/// of the counters still build.
+	uint32_t dropped;
+	/// Cell packets the I/O thread handed to USB
+	uint32_t sent;
+} thirdspacevest_queue_stats;
+
+/// Number of buckets in a thirdspacevest_histogram
+#define THIRDSPACEVEST_HISTOGRAM_BUCKETS 64
+
+/**
+ * Log-linear latency histogram, in the style of HdrHistogram with 2
+ * bits of precision. Values 0-3 us get a bucket each. After that, every
+ * power of 2 is split into 4 equal buckets, so each bucket is within
+ * 25% of the value it counts. The last bucket also takes everything
+ * from 2^17 us (about 131 ms) up.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Number of samples recorded
+	uint32_t count;
+	/// Largest sample recorded, in microseconds
+	uint32_t max_us;
+	/// Samples per bucket, see thirdspacevest_histogram_bucket_us
+	uint32_t buckets[THIRDSPACEVEST_HISTOGRAM_BUCKETS];
+} thirdspacevest_histogram;
+
+/**
+ * Instrumentation for one device, see thirdspacevest_get_stats. All
+ * counts are cumulative since the device was created or the stats were
+ * last reset.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// I/O thread command counters
+	thirdspacevest_queue_stats queue;
+	/// Transfers that ran into the USB timeout, see thirdspacevest_set_timeout_limits
+	uint32_t timeouts;
+	/// Transfers that failed, timeouts included
+	uint32_t errors;
+	/// Times the vest went away and was reopened
+	uint32_t reconnects;
+	/// Time to form and encrypt each packet
+	thirdspacevest_histogram encrypt;
+	/// Time from handing a packet to USB until the write completed
+	thirdspacevest_histogram write;
+	/// Time from the write completing until the status read completed
+	thirdspacevest_histogram ack;
+} thirdspacevest_stats;
+
+/// Default smoothed round trip above which a device counts as saturated
+#define THIRDSPACEVEST_SATURATION_RTT_US 20000
+
+/**
+ * How far behind a device is, see thirdspacevest_get_backpressure. A
+ * snapshot; the queues move while it is taken.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Cells waiting for the I/O thread, out of THIRDSPACEVEST_CELL_COUNT
+	uint32_t queue_depth;
+	/// Frames on the completion queue, sent or not, until they are
+	/// dispatched. Out of THIRDSPACEVEST_COMPLETION_QUEUE_SIZE.
+	uint32_t completion_depth;
+	/// Transfers submitted to USB and not finished yet
+	uint32_t in_flight;
+	/// Smoothed time for one transfer stage, in microseconds
+	uint32_t rtt_us;
+	/// Smoothed deviation from rtt_us, in microseconds
+	uint32_t rtt_var_us;
+	/// Timeout the next transfer will get, in milliseconds
+	uint32_t timeout_ms;
+	/// Nonzero while the device is saturated, see
+	/// thirdspacevest_set_saturation_callback
+	uint32_t saturated;
+} thirdspacevest_backpressure;
+
+/// Most effects the sequencer can play at the same time
+#define THIRDSPACEVEST_MAX_VOICES 16
+/// Most steps a single sequencer effect can hold
+#define THIRDSPACEVEST_MAX_STEPS 64
+
+/**
+ * One step of a sequencer effect. While the step is live every cell in
+ * cell_mask is driven at speed. Offsets are relative to when the effect
+ * was submitted, so steps can overlap or leave gaps freely.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Cells this step drives, bit n selects cell n
+	uint8_t cell_mask;
+	/// Speed for those cells, overlapping steps and effects mix by maximum
+	uint8_t speed;
+	/// Must be 0
+	uint16_t reserved;
+	/// Start of the step, in microseconds from submission
+	uint32_t start_us;
+	/// How long the step lasts, in microseconds
+	uint32_t duration_us;
+} thirdspacevest_step;
+
+/**
+ * An effect owned by the sequencer thread
+ */
+typedef struct {
+	thirdspacevest_step _steps[THIRDSPACEVEST_MAX_STEPS];
+	int _step_count;
+	/// Sequencer clock time the effect was submitted at
+	uint64_t _start_us;
+	/// Offset at which the last step finishes
+	uint32_t _end_us;
+	/// Bumped on every reuse so stale handles don't cancel new effects
+	uint32_t _generation;
+	/// Nonzero while the effect is playing
+	int _active;
+} thirdspacevest_voice;
+
+/// Most mixer layers a device can have
+#define THIRDSPACEVEST_MAX_LAYERS 8
+/// The layer raises cells to its speed, never lowers them
+#define THIRDSPACEVEST_BLEND_MAX 0
+/// The layer adds its speed to the layers below, clamped at 255
+#define THIRDSPACEVEST_BLEND_SUM 1
+/// The layer overrides whatever the layers below it mixed to
+#define THIRDSPACEVEST_BLEND_REPLACE 2
+
+/**
+ * One source feeding the mixer
+ */
+typedef struct {
+	/// Speed the source wants for each cell
+	uint8_t _speeds[THIRDSPACEVEST_CELL_COUNT];
+	/// Bitmask of cells the source is currently contributing to
+	uint8_t _mask;
+	/// One of the THIRDSPACEVEST_BLEND_* values
+	uint8_t _blend;
+	/// Layers are composited from lowest to highest priority
+	int _priority;
+	/// Nonzero while the layer is in use
+	int _active;
+} thirdspacevest_layer;
+
+/**
+ * One hit for thirdspacevest_project_hits. The direction is where the
+ * hit came from, relative to the wearer: +x right, +y up, +z forward.
+ * It doesn't have to be normalized.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Direction the hit came from, (0, 0, 0) hits every cell
+	float x, y, z;
+	/// Speed for the cell facing the hit, the others get less
+	uint8_t intensity;
+} thirdspacevest_hit;
+
+/**
+ * Completion callback for asynchronous sends
+ *
+ * @param dev Device the transfer was submitted on
+ * @param status 0 if both the write and the status read went through, otherwise < 0
+ * @param user_data Pointer passed at submission time
+ */
+typedef void (*thirdspacevest_async_cb)(thirdspacevest_device* dev, int status, void* user_data);
+
+/**
+ * Called when a device becomes saturated or recovers, see
+ * thirdspacevest_set_saturation_callback
+ *
+ * @param dev Device whose state changed
+ * @param saturated Nonzero if it is now saturated, 0 if it recovered
+ * @param user_data Pointer passed to thirdspacevest_set_saturation_callback
+ */
+typedef void (*thirdspacevest_saturation_cb)(thirdspacevest_device* dev, int saturated, void* user_data);
+
+/**
+ * I/O operations behind a device. thirdspacevest_create uses the
+ * platform's USB backend; anything else is plugged in with
+ * thirdspacevest_create_with_transport, and everything above the
+ * transport (packet cache, ack modes, I/O thread, sequencer, mixer,
+ * stats) runs unchanged on top of it.
+ *
+ * Transports find their own state in the device's _transport_data, and
+ * count their own failures into the stats with the rest of the library.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Short name, e.g. "libusb" or "null"
+	const char* name;
+	/// Number of vests that can be opened, or < 0 if error
+	int (*get_count)(thirdspacevest_device* dev);
+	/// Opens a vest and sets _is_open, 0 if ok, otherwise < 0
+	int (*open)(thirdspacevest_device* dev, uint32_t device_index);
+	/// Releases the vest and clears _is_open. Library threads have
+	/// already been stopped.
+	int (*close)(thirdspacevest_device* dev);
+	/// Blocking write of one packet, >= 0 if ok
+	int (*write)(thirdspacevest_device* dev, uint8_t* output_report);
+	/// Blocking read of one status report, >= 0 if ok
+	int (*read)(thirdspacevest_device* dev, uint8_t* input_report);
+	/// Queues a write and status read, see thirdspacevest_write_data_async.
+	/// May be NULL along with handle_events, in which case the library
+	/// runs queued packets through write/read from
+	/// thirdspacevest_handle_events.
+	int (*write_async)(thirdspacevest_device* dev, const uint8_t* output_report, thirdspacevest_async_cb callback, void* user_data);
+	/// Completes async transfers, see thirdspacevest_handle_events
+	int (*handle_events)(thirdspacevest_device* dev, int timeout_ms);
+	/// Frees _transport_data on thirdspacevest_delete, can be NULL
+	void (*destroy)(thirdspacevest_device* dev);
+	/// Drops the handle of a vest that went away and opens the same vest
+	/// again, 0 if it's back, E_NPUTIL_NOT_INITED if it isn't attached.
+	/// NULL if the transport can't tell it apart from other vests.
+	int (*reopen)(thirdspacevest_device* dev);
+} thirdspacevest_transport;
+
+#if defined(WIN32)
+/// Largest HID report the Win32 backend will read or write
+#define THIRDSPACEVEST_MAX_REPORT 64
+
+/**
+ * Overlapped write/read pair for one asynchronous effect.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Device owning this slot
+	thirdspacevest_device* _dev;
+	/// Overlapped structure with its own manual-reset event
+	OVERLAPPED _overlapped;
+	/// Report ID followed by the effect packet
+	uint8_t _out_buffer[THIRDSPACEVEST_MAX_REPORT];
+	uint8_t _in_buffer[THIRDSPACEVEST_MAX_REPORT];
+	/// 0 if slot is free, 1 while writing, 2 while reading the status report
+	int _in_use;
+	/// GetTickCount when the current stage was issued, for timeouts
+	DWORD _issued;
+	/// thirdspacevest_time_us when the current stage was issued, for stats
+	uint64_t _stage_us;
+	thirdspacevest_async_cb _callback;
+	void* _user_data;
+} thirdspacevest_transfer_slot;
 #else
 #define THIRDSPACEVEST_DECLSPEC
 #include "libusb-1.0/libusb.h"
+
+/**
+ * Preallocated write/read transfer pair for one asynchronous effect.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Device owning this slot
+	thirdspacevest_device* _dev;
+	/// Transfer carrying the effect packet to the vest
+	struct libusb_transfer* _out_transfer;
+	/// Transfer reading back the status report after the write
+	struct libusb_transfer* _in_transfer;
+	uint8_t _out_buffer[THIRDSPACEVEST_PACKET_SIZE];
+	uint8_t _in_buffer[THIRDSPACEVEST_PACKET_SIZE];
+	/// 0 if slot is free, > 0 while a transfer is in flight
+	int _in_use;
+	/// thirdspacevest_time_us when the current stage was submitted, for stats
+	uint64_t _stage_us;
+	thirdspacevest_async_cb _callback;
+	void* _user_data;
+} thirdspacevest_transfer_slot;
+#endif
+
+/// Frames thirdspacevest_send_frame_async can have outstanding per device, must be a power of 2
+#define THIRDSPACEVEST_COMPLETION_QUEUE_SIZE 32
+
+/**
+ * A frame queued with thirdspacevest_send_frame_async
+ *
+ * @ingroup CoreFunctions
+ */
 typedef struct {
+	uint8_t _speeds[THIRDSPACEVEST_CELL_COUNT];
+	uint8_t _mask;
+	/// Nonzero to send the cells even if their speed is unchanged
+	uint8_t _force;
+	thirdspacevest_async_cb _callback;
+	void* _user_data;
+	/// Result of thirdspacevest_send_frame, once sent
+	int _status;
+} thirdspacevest_completion;
+
+/**
+ * Structure to hold information about a vest.
+ *
+ * @ingroup CoreFunctions
+ */
+struct thirdspacevest_device {
+#if defined(WIN32)
+	/// Windows device handle, opened for overlapped I/O
+	HANDLE _dev;
+	/// Overlapped structure for the blocking read/write calls
+	OVERLAPPED _overlapped;
+	/// Report lengths from HidP_GetCaps, cached on open
+	USHORT _input_report_length;
+	USHORT _output_report_length;
+	/// Interface paths of attached vests, in enumeration order
+	TCHAR _known_paths[THIRDSPACEVEST_MAX_DEVICES][MAX_PATH];
+	/// Nonzero while _known_paths matches the system, cleared on device arrival/removal
+	volatile uint32_t _known_valid;
+	/// HCMNOTIFICATION for HID interface arrival/removal, NULL if not registered
+	void* _notification;
+	/// Interface path of the open vest, to find it again after it goes away
+	TCHAR _open_path[MAX_PATH];
+#else
 	struct libusb_context* _context;
+	/// 0 if _context belongs to a thirdspacevest_group, > 0 if the device created it
+	int _owns_context;
 	struct libusb_device_handle* _device;
-	struct libusb_transfer* _in_transfer;
-	struct libusb_transfer* _out_transfer;
+	/// Referenced libusb devices for attached vests, in arrival order
+	struct libusb_device* _known[THIRDSPACEVEST_MAX_DEVICES];
+	/// Nonzero if _known is kept current by hotplug events
+	int _hotplug_registered;
+	libusb_hotplug_callback_handle _hotplug_handle;
+	/// Bus and port chain (at most 7 tiers) the open vest is plugged into
+	uint8_t _bus;
+	uint8_t _ports[7];
+	int _port_count;
+	/// Serial string of the open vest, empty if it doesn't report one
+	char _serial[64];
+#endif
+	/// I/O operations for this device, see thirdspacevest_transport
+	const thirdspacevest_transport* _transport;
+	/// Transport private state
+	void* _transport_data;
+	/// Number of entries in the enumeration cache
+	int _known_count;
+	/// Guards the enumeration cache against hotplug callbacks
+	thirdspacevest_mutex _known_lock;
+	/// Transfer pool, set up on open and torn down on close
+	thirdspacevest_transfer_slot _slots[THIRDSPACEVEST_MAX_TRANSFERS];
+	/// Number of slots currently in flight
+	int _pending;
+	/// 0 if device is closed, > 0 otherwise
 	int _is_open;
+	/// 0 if device is initialized, > 0 otherwise
 	int _is_inited;
-} thirdspacevest_device;
+	/// Nonzero if thirdspacevest_delete frees the device, 0 for caller storage
+	int _owns_storage;
+	/// Set by the transport when the open vest went away, cleared once
+	/// it has been reopened, see thirdspacevest_reconnect
+	volatile uint32_t _lost;
+	/// Set when a vest arrives while _lost, so the next send retries
+	/// without waiting out THIRDSPACEVEST_RECONNECT_INTERVAL_MS
+	volatile uint32_t _arrived;
+	/// Nonzero if sends reopen a lost vest on their own (default)
+	int _auto_reconnect;
+	/// thirdspacevest_time_us of the last reopen attempt
+	uint64_t _reconnect_us;
+	/// Last speed sent to each cell
+	uint8_t _speeds[THIRDSPACEVEST_CELL_COUNT];
+	/// Bitmask of cells whose entry in _speeds matches the vest
+	uint8_t _speeds_known;
+	/// Frame transfers still waiting on their status read
+	int _frame_pending;
+	/// First error seen by the frame currently in flight
+	int _frame_status;
+	/// One of the THIRDSPACEVEST_ACK_* values, see thirdspacevest_set_ack_mode
+	volatile uint32_t _ack_mode;
+	/// First error reported by a background status read, not yet returned
+	int _ack_status;
+	/// One of the THIRDSPACEVEST_KEY_* values, see thirdspacevest_set_key_mode
+	volatile uint32_t _key_mode;
+	/// Counter picking cache keys in THIRDSPACEVEST_KEY_ROTATING mode, see thirdspacevest_next_key_slot
+	volatile uint32_t _key_counter;
+	/// Newest speed queued for each cell, 4 cells per word like _tick_speeds
+	volatile uint32_t _queued_speeds[2];
+	/// Cells waiting for the I/O thread in bits 0-7, the ones to send
+	/// even if unchanged in bits 8-15
+	volatile uint32_t _queued_cells;
+	thirdspacevest_thread _io_thread;
+	/// Signaled by producers when the I/O thread is waiting for work
+	thirdspacevest_event _io_wakeup;
+	/// 0 if the library doesn't own an I/O thread for this device, > 0 otherwise
+	volatile uint32_t _io_running;
+	/// Nonzero while the I/O thread is blocked on _io_wakeup
+	volatile uint32_t _io_sleeping;
+	/// See thirdspacevest_get_queue_stats
+	thirdspacevest_queue_stats _queue_stats;
+	/// See thirdspacevest_get_stats
+	volatile uint32_t _timeouts;
+	volatile uint32_t _errors;
+	volatile uint32_t _reconnects;
+	thirdspacevest_histogram _encrypt_latency;
+	thirdspacevest_histogram _write_latency;
+	thirdspacevest_histogram _ack_latency;
+	/// Smoothed transfer stage time in microseconds, times 8, 0 before
+	/// the first sample
+	volatile uint32_t _rtt_us8;
+	/// Smoothed deviation in microseconds, times 4
+	volatile uint32_t _rtt_var_us4;
+	/// Bounds on the adaptive timeout, see thirdspacevest_set_timeout_limits
+	volatile uint32_t _timeout_min_ms;
+	volatile uint32_t _timeout_max_ms;
+	/// See thirdspacevest_set_saturation_callback
+	volatile uint32_t _saturation_rtt_us;
+	thirdspacevest_saturation_cb _saturation_cb;
+	void* _saturation_data;
+	/// Nonzero while the device is saturated
+	volatile uint32_t _saturated;
+	/// Desired speed per cell for tick mode, 4 cells packed per word so
+	/// any thread can update them atomically
+	volatile uint32_t _tick_speeds[THIRDSPACEVEST_CELL_COUNT / 4];
+	/// Bitmask of cells with an entry in _tick_speeds
+	volatile uint32_t _tick_mask;
+	/// Tick period in microseconds, 0 if tick mode is off
+	volatile uint32_t _tick_period_us;
+	/// Bitmask of cells tick mode has sent at least once
+	uint8_t _tick_sent;
+	/// Nonzero if tick mode started the I/O thread and has to stop it
+	int _tick_owns_io;
+	/// Effects the sequencer is playing or has played, guarded by _seq_lock
+	thirdspacevest_voice _voices[THIRDSPACEVEST_MAX_VOICES];
+	thirdspacevest_mutex _seq_lock;
+	thirdspacevest_thread _seq_thread;
+	/// Signaled when effects are added or cancelled
+	thirdspacevest_event _seq_wakeup;
+	/// 0 if the sequencer thread isn't running, > 0 otherwise
+	volatile uint32_t _seq_running;
+	/// Set when _voices changed since the sequencer thread last looked
+	volatile uint32_t _seq_dirty;
+	/// Nonzero if the sequencer started the I/O thread and has to stop it
+	int _seq_owns_io;
+	/// Last mixed speed the sequencer sent for each cell
+	uint8_t _seq_speeds[THIRDSPACEVEST_CELL_COUNT];
+	/// Mixer sources, guarded by _mix_lock
+	thirdspacevest_layer _layers[THIRDSPACEVEST_MAX_LAYERS];
+	thirdspacevest_mutex _mix_lock;
+	/// Last composited speed the mixer sent for each cell
+	uint8_t _mix_speeds[THIRDSPACEVEST_CELL_COUNT];
+	/// Frames from thirdspacevest_send_frame_async, guarded by _cq_lock.
+	/// _cq_head to _cq_done are sent and wait for
+	/// thirdspacevest_dispatch_completions, _cq_done to _cq_tail wait
+	/// for the sender thread. _cq_head and _cq_tail are stored
+	/// atomically so the back-pressure check can read them unlocked.
+	thirdspacevest_completion _cq[THIRDSPACEVEST_COMPLETION_QUEUE_SIZE];
+	uint32_t _cq_head;
+	uint32_t _cq_done;
+	uint32_t _cq_tail;
+	thirdspacevest_mutex _cq_lock;
+	thirdspacevest_thread _cq_thread;
+	/// Signaled when a frame is queued or the sender thread should stop
+	thirdspacevest_event _cq_wakeup;
+	/// 0 if the sender thread isn't running, > 0 otherwise
+	volatile uint32_t _cq_running;
+#if defined(WIN32)
+	/// Manual-reset event, set while sent frames wait to be dispatched
+	HANDLE _cq_notify;
+#else
+	/// Readable while sent frames wait to be dispatched. An eventfd in
+	/// [0] on Linux, [1] is -1 then; a pipe elsewhere.
+	int _cq_notify[2];
+#endif
+	/// Allocated by the first thirdspacevest_start_trace, kept until
+	/// the device is deleted so racing producers never see it freed
+	thirdspacevest_trace* _trace;
+	/// Nonzero while commands and transfers are being traced
+	volatile uint32_t _trace_running;
+};
+
+/// Most vests a thirdspacevest_group can drive
+#define THIRDSPACEVEST_GROUP_MAX 8
+
+/**
+ * Set of vests sharing one USB context and event loop, so frames can be
+ * sent to all of them concurrently. With libusb the vests' transfers
+ * all complete through that one loop, so drive them from one thread
+ * with thirdspacevest_group_send_frame and
+ * thirdspacevest_group_handle_events. They can't run an I/O thread or
+ * completion sender of their own.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+#if !defined(WIN32)
+	/// Context shared by every device in the group
+	struct libusb_context* _context;
+#endif
+	thirdspacevest_device* _devices[THIRDSPACEVEST_GROUP_MAX];
+	/// Number of opened devices in _devices
+	int _count;
+} thirdspacevest_group;
+
+/// Version written to thirdspacevest_capture_header
+#define THIRDSPACEVEST_CAPTURE_VERSION 1
+/// thirdspacevest_capture_record direction for packets sent to the vest
+#define THIRDSPACEVEST_CAPTURE_OUT 0
+/// thirdspacevest_capture_record direction for status reports read back
+#define THIRDSPACEVEST_CAPTURE_IN 1
+
+/**
+ * Start of a capture file (.tsvc), followed by
+ * thirdspacevest_capture_record entries until the end of the file.
+ * Little-endian.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// "TSVC"
+	uint8_t magic[4];
+	uint16_t version;
+	/// sizeof(thirdspacevest_capture_record)
+	uint16_t record_size;
+	uint32_t reserved;
+} thirdspacevest_capture_header;
+
+/**
+ * One transfer in a capture file.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Microseconds since the recorder was created
+	uint64_t time_us;
+	/// THIRDSPACEVEST_CAPTURE_OUT or THIRDSPACEVEST_CAPTURE_IN
+	uint8_t direction;
+	/// Result of the transfer, 0 if ok, 1 if it failed
+	uint8_t failed;
+	uint8_t data[THIRDSPACEVEST_PACKET_SIZE];
+	uint8_t reserved[4];
+} thirdspacevest_capture_record;
+
+/// Version written to thirdspacevest_trace_header
+#define THIRDSPACEVEST_TRACE_VERSION 1
+/// thirdspacevest_send_effect call
+#define THIRDSPACEVEST_TRACE_EFFECT 1
+/// thirdspacevest_enqueue_effect call
+#define THIRDSPACEVEST_TRACE_ENQUEUE 2
+/// thirdspacevest_send_frame call
+#define THIRDSPACEVEST_TRACE_FRAME 3
+/// thirdspacevest_send_frame_async call
+#define THIRDSPACEVEST_TRACE_FRAME_ASYNC 4
+/// Packet written to the vest, by whichever path sent it
+#define THIRDSPACEVEST_TRACE_WRITE 16
+/// Status report read back
+#define THIRDSPACEVEST_TRACE_READ 17
+/// Records lost because the writer fell behind, count in duration_us
+#define THIRDSPACEVEST_TRACE_DROPPED 32
+
+/**
+ * Start of a trace file (.tsvt), followed by thirdspacevest_trace_record
+ * entries until the end of the file. Little-endian.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// "TSVT"
+	uint8_t magic[4];
+	uint16_t version;
+	/// sizeof(thirdspacevest_trace_record)
+	uint16_t record_size;
+	uint32_t reserved;
+} thirdspacevest_trace_header;
+
+/**
+ * One command or transfer in a trace file. Records are in the order
+ * they finished, which for overlapping calls isn't quite time_us order.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// When the call or transfer started, microseconds since the trace did
+	uint64_t time_us;
+	/// How long it took, or the drop count for THIRDSPACEVEST_TRACE_DROPPED
+	uint32_t duration_us;
+	/// One of the THIRDSPACEVEST_TRACE_* values
+	uint8_t type;
+	/// Cell for effects, cell mask for frames
+	uint8_t cell;
+	/// Speed for effects
+	uint8_t speed;
+	/// What the call returned clamped to -128..127, or 0 / -1 for a
+	/// transfer that went through / failed
+	int8_t status;
+	/// Speeds for frames, indexed by cell
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+} thirdspacevest_trace_record;
+
+/**
+ * On-disk layout of an effect bank (.tsvb). Everything is little-endian
+ * and 4-byte aligned, so a mapped bank can be used in place. The file is
+ * the header, then each of the sections it points to:
+ *
+ * - effects: effect_count thirdspacevest_bank_effect records, indexed
+ *   by effect ID
+ * - steps: step_count thirdspacevest_step records, each effect owns a
+ *   contiguous run of them
+ * - index: index_size uint16_t hash buckets, each 0 or effect ID + 1,
+ *   probed linearly from the FNV-1a hash of the name
+ * - names: NUL-terminated effect names
+ * - packets: optional [8][256][10] table of encrypted packets, the same
+ *   ones thirdspacevest_form_packet produces, for consumers that write
+ *   to the vest without this library
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// "TSVB"
+	char magic[4];
+	/// THIRDSPACEVEST_BANK_VERSION
+	uint16_t version;
+	uint16_t effect_count;
+	/// Total size of the file in bytes
+	uint32_t file_size;
+	uint32_t effects_offset;
+	uint32_t steps_offset;
+	uint32_t step_count;
+	uint32_t index_offset;
+	/// Number of hash buckets, a power of 2
+	uint32_t index_size;
+	uint32_t names_offset;
+	uint32_t names_size;
+	/// 0 if the bank carries no packet table
+	uint32_t packets_offset;
+	/// Must be 0
+	uint32_t reserved;
+} thirdspacevest_bank_header;
+
+/// Format version thirdspacevest_bank_open accepts
+#define THIRDSPACEVEST_BANK_VERSION 1
+
+/**
+ * One effect in a bank
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Offset of the name from the start of the names section
+	uint32_t name_offset;
+	/// FNV-1a hash of the name
+	uint32_t name_hash;
+	/// Index of the effect's first step in the steps section
+	uint32_t first_step;
+	uint16_t step_count;
+	/// Must be 0
+	uint16_t reserved;
+} thirdspacevest_bank_effect;
+
+/**
+ * A mapped, validated effect bank. Read-only, so one bank can be shared
+ * by any number of devices and threads.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Start of the mapping
+	const uint8_t* _data;
+	size_t _size;
+	const thirdspacevest_bank_header* _header;
+	const thirdspacevest_bank_effect* _effects;
+	const thirdspacevest_step* _steps;
+	const uint16_t* _index;
+	const char* _names;
+	/// NULL if the bank carries no packet table
+	const uint8_t* _packets;
+} thirdspacevest_bank;
+
+/// Version written to thirdspacevest_shm_header
+#define THIRDSPACEVEST_SHM_VERSION 1
+/// Largest ring a channel can be created with
+#define THIRDSPACEVEST_SHM_MAX_CAPACITY 65536
+
+/// Set the cells in mask to their entry in speeds
+#define THIRDSPACEVEST_SHM_FRAME 1
+/// Play effect_id from the bank the channel is dispatched with
+#define THIRDSPACEVEST_SHM_BANK_EFFECT 2
+
+/**
+ * One command on a shared memory channel. Producers fill everything
+ * but sequence, which belongs to the ring.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Ring position this entry is valid for, used to hand entries
+	/// between producers and the consumer without locking
+	volatile uint32_t sequence;
+	/// THIRDSPACEVEST_SHM_FRAME or THIRDSPACEVEST_SHM_BANK_EFFECT
+	uint8_t type;
+	/// Cells a frame sets
+	uint8_t mask;
+	/// Effect to play for THIRDSPACEVEST_SHM_BANK_EFFECT
+	uint16_t effect_id;
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+} thirdspacevest_shm_command;
+
+/**
+ * Start of a shared memory channel, followed by capacity commands.
+ * head and tail sit on their own cache lines so producers and the
+ * consumer don't fight over them.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// "TSVQ"
+	uint8_t magic[4];
+	uint16_t version;
+	/// sizeof(thirdspacevest_shm_command)
+	uint16_t command_size;
+	/// Number of commands in the ring, a power of two
+	uint32_t capacity;
+	/// Process that created the channel, so a new driver can tell a
+	/// live channel from one left behind by a crash
+	uint32_t owner_pid;
+	uint8_t _pad0[48];
+	/// Next position producers will claim
+	volatile uint32_t head;
+	uint8_t _pad1[60];
+	/// Next position the consumer will read
+	volatile uint32_t tail;
+	/// Nonzero while the consumer is blocked waiting for commands
+	volatile uint32_t consumer_waiting;
+	uint8_t _pad2[56];
+} thirdspacevest_shm_header;
+
+/**
+ * A mapped shared memory channel, either end.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	thirdspacevest_shm_header* _header;
+	thirdspacevest_shm_command* _commands;
+	size_t _size;
+	/// Ring capacity, checked when the channel was created or attached.
+	/// Indexing never rereads it from the header, which any process
+	/// with the mapping can overwrite.
+	uint32_t _capacity;
+	/// Nonzero on the end that created the channel and removes it on close
+	int _owner;
+#if defined(WIN32)
+	HANDLE _mapping;
+	/// Auto-reset event producers signal when the consumer is waiting
+	HANDLE _bell;
+#else
+	/// Semaphore producers post when the consumer is waiting, NULL
+	/// where sem_timedwait isn't available and the consumer polls
+	void* _bell;
+	/// Object names, needed to unlink them on close
+	char _name[64];
+	char _bell_name[64];
 #endif
+} thirdspacevest_shm;
+
+/// First byte of every binary daemon message. It can't start a JSON
+/// line, so binary and JSON messages can share one socket.
+#define THIRDSPACEVEST_WIRE_MAGIC 0xB5
+/// Largest binary daemon message, in bytes
+#define THIRDSPACEVEST_WIRE_MAX_SIZE 12
+
+/// Set one cell, 4 bytes: magic, type, cell, speed
+#define THIRDSPACEVEST_WIRE_TRIGGER 1
+/// Set the cells in mask, 12 bytes: magic, type, mask, 0, speeds[8]
+#define THIRDSPACEVEST_WIRE_FRAME 2
+/// Play a predefined effect, 4 bytes: magic, type, effect_id (LE)
+#define THIRDSPACEVEST_WIRE_EFFECT 3
+
+/**
+ * Binary daemon message, decoded. Only the fields for type are used.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// THIRDSPACEVEST_WIRE_TRIGGER, _FRAME or _EFFECT
+	uint8_t type;
+	/// Cell and speed for a trigger
+	uint8_t cell;
+	uint8_t speed;
+	/// Cells a frame sets
+	uint8_t mask;
+	/// Index into the daemon's effect list, same as effect bank IDs
+	uint16_t effect_id;
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+} thirdspacevest_wire_message;
+
+/// Most channels one thirdspacevest_dsp can take, a multiple of the 4
+/// SIMD lanes channels are processed in
+#define THIRDSPACEVEST_DSP_MAX_CHANNELS 16
+
+/**
+ * How one telemetry channel drives the vest, see
+ * thirdspacevest_dsp_add_channel
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Cells driven while the channel is positive
+	uint8_t cell_mask;
+	/// Cells driven while the channel is negative, e.g. the other side
+	/// for lateral g. 0 rectifies the channel onto cell_mask instead.
+	uint8_t negative_mask;
+	/// Speed at full scale
+	uint8_t max_speed;
+	/// Must be 0
+	uint8_t reserved;
+	/// Input magnitude that maps to max_speed, larger values are clamped
+	float full_scale;
+	/// Envelope below this fraction of full_scale drives nothing
+	float threshold;
+	/// Time constant of the envelope rising toward the input, 0 follows
+	/// it instantly
+	float attack_ms;
+	/// Time constant of the envelope falling back, 0 drops instantly
+	float release_ms;
+} thirdspacevest_dsp_channel;
+
+/**
+ * Streaming telemetry stage. Turns blocks of samples into cell speeds
+ * through an envelope follower, threshold and rate limiter per channel,
+ * and only reports the cells whose speed changed meaningfully. Not
+ * thread safe, feed and render it from one thread.
+ *
+ * @ingroup CoreFunctions
+ */
+typedef struct {
+	/// Envelope state per channel, unused lanes stay 0
+	float _envelope[THIRDSPACEVEST_DSP_MAX_CHANNELS];
+	/// Per sample smoothing coefficients, 1 for an instant follower
+	float _attack[THIRDSPACEVEST_DSP_MAX_CHANNELS];
+	float _release[THIRDSPACEVEST_DSP_MAX_CHANNELS];
+	/// Nonzero lanes follow the input's magnitude instead of its value
+	float _rectify[THIRDSPACEVEST_DSP_MAX_CHANNELS];
+	thirdspacevest_dsp_channel _channels[THIRDSPACEVEST_DSP_MAX_CHANNELS];
+	int _channel_count;
+	float _sample_rate_hz;
+	/// Smallest speed change thirdspacevest_dsp_render reports
+	uint8_t _hysteresis;
+	/// Shortest time between two reported changes of one cell
+	uint32_t _min_interval_us;
+	/// Last speed reported for each cell, and when
+	uint8_t _speeds[THIRDSPACEVEST_CELL_COUNT];
+	uint64_t _changed_us[THIRDSPACEVEST_CELL_COUNT];
+	/// Cells reported at least once. The rate limit never holds back a
+	/// cell's first change.
+	uint8_t _reported;
+} thirdspacevest_dsp;
 
 /*******************************************************************************
  *
@@ -145,33 +1035,70 @@ extern "C" {
 	////////////////////////////////////////////////////////////////////////////////////
 	
 	/**
-	 * Returns the number of devices connected, though does not specify device type
-	 *
-	 * @param dev Device pointer
-	 * @param VID Vendor ID, defaults to 0x0590
-	 * @param PID Product ID, defaults to 0x0028
+	 * Creates a USB device. Nothing touches USB yet: the context is set
+	 * up by the first thirdspacevest_get_count or thirdspacevest_open,
+	 * so a missing or broken USB stack shows up there as
+	 * E_NPUTIL_NOT_INITED rather than here.
 	 *
-	 * @return Number of devices connected, or < 0 if error
+	 * @return New device, or NULL if out of memory
 	 */
 	THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_create();
+
+	/**
+	 * Tears a device down. Devices from the _inplace functions are
+	 * deinitialized but their storage is left to the caller.
+	 *
+	 * @param dev Device pointer
+	 */
 	THIRDSPACEVEST_DECLSPEC void thirdspacevest_delete(thirdspacevest_device* dev);
 
 	/**
-	 * Returns the number of devices connected, though does not specify device type
+	 * Returns the number of bytes a device needs, for storage passed to
+	 * thirdspacevest_init_inplace. Use this rather than sizeof, so
+	 * callers built against another version of the header still pass
+	 * enough.
+	 *
+	 * @return Size of thirdspacevest_device in bytes
+	 */
+	THIRDSPACEVEST_DECLSPEC size_t thirdspacevest_device_sizeof();
+
+	/**
+	 * Same as thirdspacevest_create, in storage the caller owns. Nothing
+	 * is allocated, so a device can be set up and torn down any number
+	 * of times (e.g. on every reconnect) without touching the heap.
+	 * Call thirdspacevest_delete when done, then reuse or free storage.
+	 *
+	 * @param storage At least thirdspacevest_device_sizeof() bytes,
+	 * aligned to THIRDSPACEVEST_DEVICE_ALIGN
+	 * @param size Size of storage in bytes
+	 *
+	 * @return storage as a device, or NULL if it is too small or misaligned
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_init_inplace(void* storage, size_t size);
+
+	/**
+	 * Returns the number of vests connected. The first call on a device
+	 * (or the first thirdspacevest_open) sets up the USB context and
+	 * builds the list of attached vests. After that hotplug
+	 * notifications keep the list current, so later calls don't rescan
+	 * the bus.
 	 *
 	 * @param dev Device pointer
 	 *
-	 * @return Number of devices connected, or < 0 if error
+	 * @return Number of devices connected, E_NPUTIL_NOT_INITED if the USB
+	 * context couldn't be set up, or another value < 0 on error
 	 */
 	THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_count(thirdspacevest_device* dev);
 
 	/**
-	 * Returns the number of devices connected, though does not specify device type
+	 * Opens and claims a vest, setting up the USB context first if
+	 * thirdspacevest_get_count hasn't already
 	 *
 	 * @param dev Device pointer
 	 * @param device_index Index of the device to open
 	 *
-	 * @return 0 if ok, otherwise < 0
+	 * @return 0 if ok, E_NPUTIL_NOT_INITED if the USB context couldn't be
+	 * set up or there is no vest at device_index, otherwise < 0
 	 */
 	THIRDSPACEVEST_DECLSPEC int thirdspacevest_open(thirdspacevest_device* dev, uint32_t device_index);
 
@@ -191,7 +1118,8 @@ extern "C" {
 	 * @param index Index of the cell to inflate
 	 * @param speed Speed to inflate the cell at. Higher = faster?
 	 *
-	 * @return 0 if ok, otherwise < 0
+	 * @return 0 if ok, E_NPUTIL_INVALID_PARAM if index isn't a cell while
+	 * the I/O thread or completion sender runs, otherwise < 0
 	 */
 	THIRDSPACEVEST_DECLSPEC int thirdspacevest_send_effect(thirdspacevest_device* dev, uint8_t index, uint8_t speed);
 
@@ -215,10 +1143,1163 @@ extern "C" {
 	 */
 	THIRDSPACEVEST_DECLSPEC int thirdspacevest_write_data(thirdspacevest_device* dev, uint8_t *output_report);	
 
-	THIRDSPACEVEST_DECLSPEC int thirdspacevest_form_checksum(uint8_t index, uint8_t speed);
-	THIRDSPACEVEST_DECLSPEC int thirdspacevest_encipher(unsigned long* data, unsigned long* cache_key);
-	THIRDSPACEVEST_DECLSPEC int thirdspacevest_decipher(unsigned long* data, unsigned long* cache_key);
-	THIRDSPACEVEST_DECLSPEC int thirdspacevest_send_effect(thirdspacevest_device* dev, uint8_t index, uint8_t speed);
+	/**
+	 * Queues a write to the device, followed by a read of the status
+	 * report, without blocking. The callback is run from
+	 * thirdspacevest_handle_events once both transfers have finished.
+	 *
+	 * @param dev Device pointer to write to
+	 * @param output_report Buffer to send (always 10 bytes, copied before return)
+	 * @param callback Function to call on completion, can be NULL
+	 * @param user_data Pointer handed back to the callback
+	 *
+	 * @return 0 if queued, E_NPUTIL_BUSY if all transfer slots are in flight, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_write_data_async(thirdspacevest_device* dev, const uint8_t *output_report, thirdspacevest_async_cb callback, void* user_data);
+
+	/**
+	 * Processes finished asynchronous transfers and runs their callbacks.
+	 * With libusb, devices in a thirdspacevest_group share one context,
+	 * so this runs callbacks for every vest in the group; pump those
+	 * with thirdspacevest_group_handle_events from one thread instead.
+	 *
+	 * @param dev Device pointer
+	 * @param timeout_ms Longest time to wait for a transfer to finish, 0 to poll
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_handle_events(thirdspacevest_device* dev, int timeout_ms);
+
+	/**
+	 * Returns the number of asynchronous transfers still in flight
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return Number of pending transfers
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_pending(thirdspacevest_device* dev);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Transports
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Creates a device on top of a custom transport instead of USB.
+	 *
+	 * @param transport Operations to use, must outlive the device
+	 * @param data Stored in _transport_data for the transport's use
+	 *
+	 * @return New device, or NULL if error
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_create_with_transport(const thirdspacevest_transport* transport, void* data);
+
+	/**
+	 * Same as thirdspacevest_create_with_transport, in storage the caller
+	 * owns. See thirdspacevest_init_inplace.
+	 *
+	 * @param storage At least thirdspacevest_device_sizeof() bytes,
+	 * aligned to THIRDSPACEVEST_DEVICE_ALIGN
+	 * @param size Size of storage in bytes
+	 * @param transport Operations to use, must outlive the device
+	 * @param data Stored in _transport_data for the transport's use
+	 *
+	 * @return storage as a device, or NULL if error
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_init_inplace_with_transport(void* storage, size_t size, const thirdspacevest_transport* transport, void* data);
+
+	/**
+	 * Creates a device on the loopback transport. Packets go nowhere
+	 * and status reads come back zeroed, so load tests can run the real
+	 * encryption and scheduling code at memory speed. It reports one vest.
+	 *
+	 * @param latency_us Time each write and each status read takes. Sync
+	 * transfers spin for it, async ones complete in
+	 * thirdspacevest_handle_events once it has passed. 0 for none.
+	 *
+	 * @return New device, or NULL if error
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_create_null(uint32_t latency_us);
+
+	/**
+	 * Creates a device that writes every packet and status report to a
+	 * capture file, see thirdspacevest_capture_header. Opening, closing
+	 * and I/O are forwarded to another device if one is given; without
+	 * one it behaves like the null transport.
+	 *
+	 * @param path Capture file to create, truncated if it exists
+	 * @param forward Device to pass I/O through to, can be NULL. Still
+	 * owned by the caller, and has to outlive the recorder.
+	 *
+	 * @return New device, or NULL if the file can't be created
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_create_recorder(const char* path, thirdspacevest_device* forward);
+
+	/**
+	 * Writes the packets from a capture file to an open device, keeping
+	 * their original spacing. Each captured status report becomes a
+	 * status read.
+	 *
+	 * @param dev Open device to send to, usually real hardware
+	 * @param path Capture file written by a recorder
+	 * @param speed Playback rate, 1.0 for original timing, <= 0 to send
+	 * as fast as the device accepts them
+	 *
+	 * @return Number of packets written if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_replay_capture(thirdspacevest_device* dev, const char* path, double speed);
+
+	/**
+	 * Starts tracing every command submitted on dev and every transfer
+	 * it makes to a trace file, see thirdspacevest_trace_header.
+	 * Producers never block or lock: records go into a ring that a
+	 * library thread writes out in batches, and if the ring fills up
+	 * the overflow is counted in a THIRDSPACEVEST_TRACE_DROPPED record
+	 * instead. Keeps running across close and reopen.
+	 *
+	 * @param dev Device pointer
+	 * @param path Trace file to create, truncated if it exists
+	 *
+	 * @return 0 if ok, E_NPUTIL_BUSY if a trace is already running, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_start_trace(thirdspacevest_device* dev, const char* path);
+
+	/**
+	 * Writes out everything traced so far and closes the file. Records
+	 * from calls still running on other threads may be left out.
+	 * thirdspacevest_delete stops a running trace too.
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_stop_trace(thirdspacevest_device* dev);
+
+	/**
+	 * Submits the commands from a trace file to an open device again,
+	 * through the same calls and at the same spacing, so the I/O
+	 * thread, completion queue and coalescing see the same load. Traced
+	 * transfers are skipped; trace the replay to compare them. Set the
+	 * device up the way the traced one was (I/O thread, ack mode...)
+	 * first.
+	 *
+	 * @param dev Open device, e.g. from thirdspacevest_create_null
+	 * @param path Trace file from thirdspacevest_start_trace
+	 * @param speed Playback rate, 1.0 for original timing, 4.0 for 4x,
+	 * <= 0 to submit as fast as the calls return
+	 *
+	 * @return Number of commands submitted if ok, otherwise < 0. Commands
+	 * that fail, e.g. with E_NPUTIL_BUSY as they may have the first
+	 * time, are counted rather than stopping the replay.
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_replay_trace(thirdspacevest_device* dev, const char* path, double speed);
+
+	/**
+	 * Creates a device on hidapi instead of the platform backend.
+	 *
+	 * @return New device, or NULL if the library was built without
+	 * hidapi (see WITH_HIDAPI) or hidapi failed to initialize
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_create_hidapi();
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Reconnecting
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Reopens the vest if it went away while open, e.g. after a cable
+	 * glitch. The libusb backend finds it again on the port it was on,
+	 * or by serial if it moved; the Win32 backend by interface path.
+	 * Cells that were running are sent again, since the vest comes back
+	 * with everything off.
+	 *
+	 * With auto reconnect on, sends do this themselves, at most every
+	 * THIRDSPACEVEST_RECONNECT_INTERVAL_MS until the vest is back, and
+	 * right away once a vest arrives. Call it from the thread doing the
+	 * device's USB I/O, not while the I/O thread runs.
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return 0 if the vest is connected, E_NPUTIL_NOT_OPENED if the
+	 * device isn't open, E_NPUTIL_NOT_INITED if the vest isn't attached,
+	 * otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_reconnect(thirdspacevest_device* dev);
+
+	/**
+	 * Returns whether the open vest is still there
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return 1 if open and connected, 0 if closed or the vest went away
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_is_connected(thirdspacevest_device* dev);
+
+	/**
+	 * Turns automatic reconnecting on sends on or off. It's on by
+	 * default; with it off, sends to a lost vest fail until
+	 * thirdspacevest_reconnect brings it back.
+	 *
+	 * @param dev Device pointer
+	 * @param enabled Nonzero to reconnect automatically
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_set_auto_reconnect(thirdspacevest_device* dev, int enabled);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Platform Independent Functions
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Builds the encrypted 10 byte packet for an effect
+	 *
+	 * @param packet Buffer to write into (always 10 bytes)
+	 * @param index Index of the cell to inflate
+	 * @param speed Speed to inflate the cell at
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_form_packet(uint8_t *packet, uint8_t index, uint8_t speed);
+
+	/**
+	 * Builds the packet for an effect encrypted with a given cache key.
+	 * The vest accepts any of them, the index travels in the packet.
+	 *
+	 * @param packet Buffer to write into (always 10 bytes)
+	 * @param index Index of the cell to inflate
+	 * @param speed Speed to inflate the cell at
+	 * @param key_index Offset into THIRDSPACEVEST_CACHE_KEY_TABLE, any byte value
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_form_packet_with_key(uint8_t *packet, uint8_t index, uint8_t speed, uint8_t key_index);
+
+	/**
+	 * Encrypts blocks in place with TEA, the cipher used on the packet
+	 * payload. Runs 8 blocks at a time on AVX2, 4 on SSE2 or NEON, and
+	 * one at a time on anything else; the implementation is picked at
+	 * runtime from what the CPU supports.
+	 *
+	 * @param blocks count blocks of 2 words each, back to back, no
+	 * alignment needed
+	 * @param count Number of blocks
+	 * @param key 4 word key, e.g. from the cache key table
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_encrypt_n(uint32_t* blocks, size_t count, const uint32_t* key);
+
+	/**
+	 * Decrypts blocks in place, undoing thirdspacevest_encrypt_n
+	 *
+	 * @param blocks count blocks of 2 words each, back to back
+	 * @param count Number of blocks
+	 * @param key 4 word key the blocks were encrypted with
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_decrypt_n(uint32_t* blocks, size_t count, const uint32_t* key);
+
+	/**
+	 * Returns which implementation thirdspacevest_encrypt_n uses on this
+	 * CPU: "avx2", "sse2", "neon" or "scalar"
+	 */
+	THIRDSPACEVEST_DECLSPEC const char* thirdspacevest_tea_impl_name();
+
+	/**
+	 * Send an effect to the device without blocking on USB. Up to
+	 * THIRDSPACEVEST_MAX_TRANSFERS effects can be in flight at once;
+	 * call thirdspacevest_handle_events to complete them. Not available
+	 * while the I/O thread or completion sender runs, use
+	 * thirdspacevest_send_effect then.
+	 *
+	 * @param dev Device pointer
+	 * @param index Index of the cell to inflate
+	 * @param speed Speed to inflate the cell at
+	 * @param callback Function to call on completion, can be NULL
+	 * @param user_data Pointer handed back to the callback
+	 *
+	 * @return 0 if queued, E_NPUTIL_BUSY if all transfer slots are in
+	 * flight or a library thread owns the device's I/O, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_send_effect_async(thirdspacevest_device* dev, uint8_t index, uint8_t speed, thirdspacevest_async_cb callback, void* user_data);
+
+	/**
+	 * Sends speeds for several cells in one batch. Cells whose speed
+	 * matches what was last sent are skipped, the remaining packets are
+	 * written back to back, and the status reads are collected once all
+	 * writes are queued.
+	 *
+	 * @param dev Device pointer
+	 * @param speeds Speed for each of the 8 cells, indexed by cell
+	 * @param mask Bitmask of cells to update, bit n selects speeds[n]
+	 *
+	 * @return Number of cells sent if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_send_frame(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask);
+
+	/**
+	 * Chooses how status reads that follow each write are handled.
+	 *
+	 * THIRDSPACEVEST_ACK_SYNC is the original behavior, each effect costs
+	 * a write and a blocking read. THIRDSPACEVEST_ACK_ASYNC returns once
+	 * the write is queued and reads the status in the background, errors
+	 * come back from the next thirdspacevest_send_effect or
+	 * thirdspacevest_get_ack_status call. THIRDSPACEVEST_ACK_NONE never
+	 * reads the status at all.
+	 *
+	 * The mode applies to every write path, including frames and the I/O
+	 * thread.
+	 *
+	 * @param dev Device pointer
+	 * @param mode One of the THIRDSPACEVEST_ACK_* values
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_set_ack_mode(thirdspacevest_device* dev, int mode);
+
+	/**
+	 * Returns the current ack mode
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return One of the THIRDSPACEVEST_ACK_* values
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_ack_mode(thirdspacevest_device* dev);
+
+	/**
+	 * Chooses which cache keys packets are encrypted with.
+	 *
+	 * THIRDSPACEVEST_KEY_FIXED sends every packet with the same key, out
+	 * of the precomputed packet cache. THIRDSPACEVEST_KEY_ROTATING picks
+	 * a key at random for every packet, like the original driver, but
+	 * from THIRDSPACEVEST_ROTATING_KEYS keys chosen once per process
+	 * rather than all 256. Their packets are precomputed too, so a
+	 * rotating packet is a table copy like a fixed one. The first switch
+	 * to rotating in a process builds that table, which takes about a
+	 * millisecond.
+	 *
+	 * @param dev Device pointer
+	 * @param mode One of the THIRDSPACEVEST_KEY_* values
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_set_key_mode(thirdspacevest_device* dev, int mode);
+
+	/**
+	 * Returns the current key mode
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return One of the THIRDSPACEVEST_KEY_* values
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_key_mode(thirdspacevest_device* dev);
+
+	/**
+	 * Collects any status reads that finished in the background and
+	 * returns the first error among them. Only meaningful in
+	 * THIRDSPACEVEST_ACK_ASYNC mode. The error is cleared once returned.
+	 * While a library thread owns the device's I/O this doesn't process
+	 * events itself and only returns errors already collected.
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return 0 if every finished ack was ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_ack_status(thirdspacevest_device* dev);
+
+
+	/**
+	 * Starts a library owned thread that does all USB I/O for this
+	 * device. While it runs, thirdspacevest_send_effect and
+	 * thirdspacevest_send_frame only queue commands for it and return
+	 * right away, and can be called from any number of threads.
+	 *
+	 * The thread keeps one pending speed per cell. A newer command for
+	 * a cell replaces the pending one, even while the thread is blocked
+	 * on USB, so a superseded speed is never sent and nothing is ever
+	 * refused. Latency under event storms is bounded by the 8 cells
+	 * rather than by the number of commands fired at them.
+	 *
+	 * Not available for vests in a thirdspacevest_group on libusb, which
+	 * share one event loop that only the group can pump.
+	 *
+	 * @param dev Opened device pointer
+	 *
+	 * @return 0 if ok, E_NPUTIL_INVALID_PARAM for a vest in a group that
+	 * shares a USB context, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_start_io_thread(thirdspacevest_device* dev);
+
+	/**
+	 * Sends whatever is still queued, then stops the I/O thread. Called
+	 * by thirdspacevest_close if the thread is still running.
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_stop_io_thread(thirdspacevest_device* dev);
+
+	/**
+	 * Queues an effect for the I/O thread. Lock-free and safe to call
+	 * from any thread.
+	 *
+	 * @param dev Device pointer with a running I/O thread
+	 * @param index Index of the cell to inflate
+	 * @param speed Speed to inflate the cell at
+	 *
+	 * @return 0 if queued, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_enqueue_effect(thirdspacevest_device* dev, uint8_t index, uint8_t speed);
+
+	/**
+	 * Copies out the I/O thread command counters
+	 *
+	 * @param dev Device pointer
+	 * @param stats Structure to fill
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_queue_stats(thirdspacevest_device* dev, thirdspacevest_queue_stats* stats);
+
+	/**
+	 * Copies out the device's counters and latency histograms. Safe to
+	 * call from any thread while the device is in use. Each value is read
+	 * atomically, but the set as a whole is not a single snapshot.
+	 *
+	 * @param dev Device pointer
+	 * @param stats Structure to fill
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_stats(thirdspacevest_device* dev, thirdspacevest_stats* stats);
+
+	/**
+	 * Zeroes the counters and histograms returned by
+	 * thirdspacevest_get_stats, including the queue counters
+	 *
+	 * @param dev Device pointer
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_reset_stats(thirdspacevest_device* dev);
+
+	/**
+	 * Returns the smallest value, in microseconds, counted by a
+	 * histogram bucket
+	 *
+	 * @param bucket Bucket index, 0 to THIRDSPACEVEST_HISTOGRAM_BUCKETS - 1
+	 *
+	 * @return Lower bound of the bucket in microseconds
+	 */
+	THIRDSPACEVEST_DECLSPEC uint32_t thirdspacevest_histogram_bucket_us(int bucket);
+
+	/**
+	 * Estimates a percentile from a histogram
+	 *
+	 * @param hist Histogram, usually from thirdspacevest_get_stats
+	 * @param percentile 0-100, e.g. 99 for p99
+	 *
+	 * @return Lower bound in microseconds of the bucket holding the
+	 * percentile, or 0 if the histogram is empty
+	 */
+	THIRDSPACEVEST_DECLSPEC uint32_t thirdspacevest_histogram_percentile(const thirdspacevest_histogram* hist, double percentile);
+
+	/**
+	 * Bounds the USB transfer timeout. Within them, each transfer gets
+	 * the smoothed stage time plus 4 times its deviation, the way TCP
+	 * sets its retransmit timeout, so one stuck transfer doesn't hold
+	 * up everything behind it for long. Every timeout doubles the
+	 * deviation, so a vest that really got slower backs off to max_ms
+	 * instead of timing out forever. The defaults are 10 and 100 ms,
+	 * and the device starts at max_ms until it has samples. Set both to
+	 * the same value for a fixed timeout.
+	 *
+	 * @param dev Device pointer
+	 * @param min_ms Shortest timeout, at least 1
+	 * @param max_ms Longest timeout, at least min_ms
+	 *
+	 * @return 0 if ok, E_NPUTIL_INVALID_PARAM if the bounds are out of order
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_set_timeout_limits(thirdspacevest_device* dev, uint32_t min_ms, uint32_t max_ms);
+
+	/**
+	 * Fills in how far behind the device is, for callers that want to
+	 * thin out their event rate before latency builds up. Safe to call
+	 * from any thread.
+	 *
+	 * @param dev Device pointer
+	 * @param bp Structure to fill
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_backpressure(thirdspacevest_device* dev, thirdspacevest_backpressure* bp);
+
+	/**
+	 * Sets when the device counts as saturated, and who to tell. It
+	 * becomes saturated when the smoothed stage time goes above rtt_us,
+	 * the completion queue is 3/4 full or a transfer times out. It
+	 * recovers once the stage time is back under 3/4 of rtt_us and the
+	 * completion queue is under 1/4 full. The callback runs
+	 * on whichever thread noticed (a caller, the I/O thread or the
+	 * completion sender), once per change, so it should only hand the
+	 * news on. Set it up before sending.
+	 *
+	 * @param dev Device pointer
+	 * @param rtt_us Stage time threshold, 0 for THIRDSPACEVEST_SATURATION_RTT_US
+	 * @param callback Function to call on every change, or NULL to just
+	 * keep thirdspacevest_backpressure.saturated up to date
+	 * @param user_data Passed to callback
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_set_saturation_callback(thirdspacevest_device* dev, uint32_t rtt_us, thirdspacevest_saturation_cb callback, void* user_data);
+
+	/**
+	 * Puts the I/O thread in fixed-rate mode, starting it if needed.
+	 * Once per tick it compares the state set through
+	 * thirdspacevest_set_tick_state with what was last sent, and sends
+	 * only the cells that differ. However often callers update the state,
+	 * USB traffic stays bounded at 8 cells per tick. Commands queued for
+	 * the thread are still sent as they arrive.
+	 *
+	 * @param dev Opened device pointer
+	 * @param rate_hz Ticks per second, 1-1000
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_start_tick(thirdspacevest_device* dev, int rate_hz);
+
+	/**
+	 * Leaves fixed-rate mode. Stops the I/O thread too if
+	 * thirdspacevest_start_tick started it.
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_stop_tick(thirdspacevest_device* dev);
+
+	/**
+	 * Updates the desired per-cell state sampled by tick mode. Lock-free,
+	 * safe to call from any thread and as often as wanted. Only the
+	 * latest value of each cell at tick time is sent.
+	 *
+	 * @param dev Device pointer
+	 * @param speeds Speed for each of the 8 cells, indexed by cell
+	 * @param mask Cells to update, bit n selects speeds[n]. Cells never
+	 * set are left alone by tick mode.
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_set_tick_state(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask);
+
+	/**
+	 * Starts the sequencer thread, which plays effects submitted through
+	 * thirdspacevest_play_effect on a microsecond clock. Output goes
+	 * through the I/O thread, which gets started too if it isn't running.
+	 *
+	 * @param dev Opened device pointer
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_start_sequencer(thirdspacevest_device* dev);
+
+	/**
+	 * Cancels every effect, deflates the cells the sequencer was driving
+	 * and stops the sequencer thread. Called by thirdspacevest_close.
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_stop_sequencer(thirdspacevest_device* dev);
+
+	/**
+	 * Copies an effect timeline into the sequencer and starts playing it
+	 * immediately. Safe to call from any thread. Effects that overlap in
+	 * time mix by taking the highest speed per cell.
+	 *
+	 * @param dev Device pointer with a running sequencer
+	 * @param steps Steps of the effect, in any order
+	 * @param count Number of steps, at most THIRDSPACEVEST_MAX_STEPS
+	 *
+	 * @return Handle for thirdspacevest_cancel_effect (> 0) if ok,
+	 * E_NPUTIL_BUSY if every voice is in use, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_play_effect(thirdspacevest_device* dev, const thirdspacevest_step* steps, int count);
+
+	/**
+	 * Stops an effect early. Cells it was driving fall back to whatever
+	 * the remaining effects mix to. Safe to call from any thread, and on
+	 * effects that already finished.
+	 *
+	 * @param dev Device pointer
+	 * @param handle Handle returned by thirdspacevest_play_effect
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_cancel_effect(thirdspacevest_device* dev, int handle);
+
+	/**
+	 * Adds a source layer to the mixer. Each source writes its own layer
+	 * instead of sending effects directly, and thirdspacevest_mixer_tick
+	 * composites them into one frame.
+	 *
+	 * @param dev Device pointer
+	 * @param priority Layers are blended from lowest to highest priority,
+	 * ties go by creation order
+	 * @param blend One of the THIRDSPACEVEST_BLEND_* values
+	 *
+	 * @return Layer ID (>= 0) if ok, E_NPUTIL_BUSY if every layer is in use,
+	 * otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_mixer_add_layer(thirdspacevest_device* dev, int priority, int blend);
+
+	/**
+	 * Removes a layer. Cells it was driving fall back to the remaining
+	 * layers on the next tick.
+	 *
+	 * @param dev Device pointer
+	 * @param layer Layer ID
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_mixer_remove_layer(thirdspacevest_device* dev, int layer);
+
+	/**
+	 * Sets the speeds a layer contributes. Safe to call from any thread.
+	 *
+	 * @param dev Device pointer
+	 * @param layer Layer ID
+	 * @param speeds Speed for each of the 8 cells, indexed by cell
+	 * @param mask Cells to update, bit n selects speeds[n]. Other cells
+	 * keep their current contribution.
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_mixer_set_layer(thirdspacevest_device* dev, int layer, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask);
+
+	/**
+	 * Stops a layer contributing to some cells. A cleared cell is
+	 * different from a cell set to speed 0, which still replaces or caps
+	 * the layers below it.
+	 *
+	 * @param dev Device pointer
+	 * @param layer Layer ID
+	 * @param mask Cells to clear
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_mixer_clear_layer(thirdspacevest_device* dev, int layer, uint8_t mask);
+
+	/**
+	 * Composites every layer into one frame and sends the cells whose
+	 * final speed changed since the last tick. Cells no layer has ever
+	 * driven are left alone.
+	 *
+	 * @param dev Opened device pointer
+	 *
+	 * @return Number of cells sent or queued if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_mixer_tick(thirdspacevest_device* dev);
+
+	/**
+	 * Projects a hit onto the cells facing it, from a precomputed
+	 * direction table. The cell pointing most directly at the hit gets
+	 * intensity, cells further round get less, cells facing away get 0.
+	 * A hit straight from the front or a side drives the four cells on
+	 * that face equally. No device is needed, and the first call builds
+	 * the table.
+	 *
+	 * @param x Right component of the direction the hit came from
+	 * @param y Up component
+	 * @param z Forward component
+	 * @param intensity Speed for the cell facing the hit
+	 * @param speeds Filled with the speed for each of the 8 cells
+	 *
+	 * @return Bitmask of cells with a nonzero speed
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_project_hit(float x, float y, float z, uint8_t intensity, uint8_t speeds[THIRDSPACEVEST_CELL_COUNT]);
+
+	/**
+	 * Projects every hit in a tick and blends them into one frame, ready
+	 * for thirdspacevest_send_frame or thirdspacevest_mixer_set_layer.
+	 *
+	 * @param hits Hits to project
+	 * @param count Number of hits, 0 gives an empty frame
+	 * @param blend THIRDSPACEVEST_BLEND_MAX, _SUM or _REPLACE, applied
+	 * in array order as if each hit were a mixer layer
+	 * @param speeds Filled with the blended speed for each of the 8 cells
+	 *
+	 * @return Bitmask of cells with a nonzero speed if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_project_hits(const thirdspacevest_hit* hits, int count, int blend, uint8_t speeds[THIRDSPACEVEST_CELL_COUNT]);
+
+	/**
+	 * Creates a telemetry stage with no channels. Every change is
+	 * reported straight away until thirdspacevest_dsp_set_limits says
+	 * otherwise.
+	 *
+	 * @param sample_rate_hz Rate samples are fed at, e.g. SimHub's frame
+	 * rate, used to turn attack and release times into per sample steps
+	 *
+	 * @return Stage pointer if ok, NULL otherwise
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_dsp* thirdspacevest_dsp_create(float sample_rate_hz);
+
+	/**
+	 * Deletes a telemetry stage
+	 *
+	 * @param dsp Stage pointer
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_dsp_delete(thirdspacevest_dsp* dsp);
+
+	/**
+	 * Adds a channel. Channels are numbered in the order they're added,
+	 * which is also their order within each frame of a block passed to
+	 * thirdspacevest_dsp_process.
+	 *
+	 * @param dsp Stage pointer
+	 * @param channel How the channel maps to cells
+	 *
+	 * @return Channel number (>= 0) if ok, E_NPUTIL_BUSY if
+	 * THIRDSPACEVEST_DSP_MAX_CHANNELS are already in use, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_dsp_add_channel(thirdspacevest_dsp* dsp, const thirdspacevest_dsp_channel* channel);
+
+	/**
+	 * Sets how eagerly changes are reported. Cells dropping to 0 skip
+	 * the hysteresis check, so nothing gets stuck on, but still wait out
+	 * the interval.
+	 *
+	 * @param dsp Stage pointer
+	 * @param hysteresis Smallest change in speed worth reporting, at least 1
+	 * @param min_interval_us Shortest time between two reported changes
+	 * of the same cell, 0 for no limit
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_dsp_set_limits(thirdspacevest_dsp* dsp, uint8_t hysteresis, uint32_t min_interval_us);
+
+	/**
+	 * Runs a block of samples through every channel's envelope follower.
+	 * Cheap enough to call with every telemetry update; nothing reaches
+	 * the vest until thirdspacevest_dsp_render.
+	 *
+	 * @param dsp Stage pointer
+	 * @param block frames * channel count samples, one value per channel
+	 * for each frame in turn
+	 * @param frames Number of frames in the block
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_dsp_process(thirdspacevest_dsp* dsp, const float* block, int frames);
+
+	/**
+	 * Maps the envelopes to cell speeds, mixing channels by maximum, then
+	 * applies the hysteresis and rate limit.
+	 *
+	 * @param dsp Stage pointer
+	 * @param now_us Current time on any monotonic microsecond clock
+	 * @param speeds Filled with the last reported speed for each cell
+	 *
+	 * @return Bitmask of cells whose speed changed since the last render
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_dsp_render(thirdspacevest_dsp* dsp, uint64_t now_us, uint8_t speeds[THIRDSPACEVEST_CELL_COUNT]);
+
+	/**
+	 * Renders the stage and writes the changed cells into a mixer layer,
+	 * for the next thirdspacevest_mixer_tick to send.
+	 *
+	 * @param dsp Stage pointer
+	 * @param dev Device pointer
+	 * @param layer Layer ID from thirdspacevest_mixer_add_layer
+	 *
+	 * @return Bitmask of cells that changed if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_dsp_tick(thirdspacevest_dsp* dsp, thirdspacevest_device* dev, int layer);
+
+	/**
+	 * Maps an effect bank file read-only and validates it. Pages are
+	 * shared with every other process that maps the same file.
+	 *
+	 * @param path Path to a .tsvb file
+	 *
+	 * @return Bank pointer if ok, NULL otherwise
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_bank* thirdspacevest_bank_open(const char* path);
+
+	/**
+	 * Unmaps a bank. Any step or name pointers taken from it become
+	 * invalid.
+	 *
+	 * @param bank Bank pointer
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_bank_close(thirdspacevest_bank* bank);
+
+	/**
+	 * Returns the number of effects in the bank. IDs run from 0 to
+	 * count - 1.
+	 *
+	 * @param bank Bank pointer
+	 *
+	 * @return Number of effects
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_bank_get_count(thirdspacevest_bank* bank);
+
+	/**
+	 * Looks up an effect ID by name through the bank's hash index
+	 *
+	 * @param bank Bank pointer
+	 * @param name Effect name, e.g. "machinegun_front"
+	 *
+	 * @return Effect ID if found, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_bank_find(thirdspacevest_bank* bank, const char* name);
+
+	/**
+	 * Returns the name of an effect
+	 *
+	 * @param bank Bank pointer
+	 * @param id Effect ID
+	 *
+	 * @return Name, pointing into the mapping, or NULL if id is out of range
+	 */
+	THIRDSPACEVEST_DECLSPEC const char* thirdspacevest_bank_get_name(thirdspacevest_bank* bank, uint16_t id);
+
+	/**
+	 * Returns the steps of an effect, in the form thirdspacevest_play_effect
+	 * takes them
+	 *
+	 * @param bank Bank pointer
+	 * @param id Effect ID
+	 * @param count Set to the number of steps
+	 *
+	 * @return Steps, pointing into the mapping, or NULL if id is out of range
+	 */
+	THIRDSPACEVEST_DECLSPEC const thirdspacevest_step* thirdspacevest_bank_get_steps(thirdspacevest_bank* bank, uint16_t id, int* count);
+
+	/**
+	 * Returns a precomputed packet from the bank
+	 *
+	 * @param bank Bank pointer
+	 * @param index Cell index, 0-7
+	 * @param speed Speed
+	 *
+	 * @return THIRDSPACEVEST_PACKET_SIZE bytes, or NULL if the bank has no
+	 * packet table or index is out of range
+	 */
+	THIRDSPACEVEST_DECLSPEC const uint8_t* thirdspacevest_bank_get_packet(thirdspacevest_bank* bank, uint8_t index, uint8_t speed);
+
+	/**
+	 * Plays an effect from a bank on the sequencer
+	 *
+	 * @param dev Device pointer with a running sequencer
+	 * @param bank Bank pointer, must stay open until this returns
+	 * @param id Effect ID
+	 *
+	 * @return Same as thirdspacevest_play_effect
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_play_bank_effect(thirdspacevest_device* dev, thirdspacevest_bank* bank, uint16_t id);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Completions
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Starts a library thread that sends frames queued with
+	 * thirdspacevest_send_frame_async, and sets up a handle that turns
+	 * readable when one has been sent. An event loop can wait on that
+	 * together with everything else it serves, then call
+	 * thirdspacevest_dispatch_completions to run the callbacks on its
+	 * own thread.
+	 *
+	 * While it runs, thirdspacevest_send_effect and
+	 * thirdspacevest_send_frame queue their packets on it too (unless
+	 * the I/O thread is running, which takes them first) and return
+	 * without waiting for the vest.
+	 *
+	 * Not available for vests in a thirdspacevest_group on libusb, see
+	 * thirdspacevest_start_io_thread.
+	 *
+	 * @param dev Opened device pointer
+	 *
+	 * @return 0 if ok, E_NPUTIL_INVALID_PARAM for a vest in a group that
+	 * shares a USB context, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_start_completions(thirdspacevest_device* dev);
+
+	/**
+	 * Sends whatever is still queued, stops the sender thread, runs the
+	 * remaining callbacks and closes the completion handle. Called by
+	 * thirdspacevest_close if the thread is still running.
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_stop_completions(thirdspacevest_device* dev);
+
+	/**
+	 * Queues a frame for the sender thread. Once it has gone out,
+	 * callback is run from thirdspacevest_dispatch_completions with the
+	 * result thirdspacevest_send_frame would have returned.
+	 *
+	 * @param dev Device pointer with completions started
+	 * @param speeds Speed for each cell, copied before return
+	 * @param mask Cells to set, bit n selects cell n
+	 * @param callback Function to call once sent, can be NULL
+	 * @param user_data Pointer handed back to the callback
+	 *
+	 * @return 0 if queued, E_NPUTIL_BUSY if
+	 * THIRDSPACEVEST_COMPLETION_QUEUE_SIZE frames are outstanding,
+	 * otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_send_frame_async(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask, thirdspacevest_async_cb callback, void* user_data);
+
+	/**
+	 * Runs the callbacks of every frame sent since the last call, on the
+	 * calling thread, and makes the completion handle unreadable again.
+	 * Never blocks.
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return Number of callbacks run if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_dispatch_completions(thirdspacevest_device* dev);
+
+#if defined(WIN32)
+	/**
+	 * Returns the completion handle: a manual-reset event, signaled
+	 * while sent frames wait for thirdspacevest_dispatch_completions.
+	 * Wait on it with WaitForMultipleObjects or RegisterWaitForSingleObject.
+	 *
+	 * @param dev Device pointer with completions started
+	 *
+	 * @return Event handle, or NULL if completions aren't started
+	 */
+	THIRDSPACEVEST_DECLSPEC HANDLE thirdspacevest_get_completion_handle(thirdspacevest_device* dev);
+#else
+	/**
+	 * Returns the completion handle: a nonblocking file descriptor,
+	 * readable while sent frames wait for
+	 * thirdspacevest_dispatch_completions. Poll it with epoll, kqueue or
+	 * asyncio's add_reader; don't read from or close it.
+	 *
+	 * @param dev Device pointer with completions started
+	 *
+	 * @return File descriptor, or < 0 if completions aren't started
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_completion_fd(thirdspacevest_device* dev);
+#endif
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Shared Memory Channel
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Creates a named shared memory channel that game mods can post
+	 * commands to without going through the daemon socket. Called by
+	 * whoever drives the vest.
+	 *
+	 * @param name Channel name, without any platform prefix (at most 48 characters)
+	 * @param capacity Number of commands the ring holds, a power of two
+	 * up to THIRDSPACEVEST_SHM_MAX_CAPACITY
+	 *
+	 * A name another running driver still serves is refused, on every
+	 * platform. One left behind by a driver that died is taken over.
+	 * The channel is only accessible to the user creating it.
+	 *
+	 * @return New channel, or NULL if it couldn't be created or the name
+	 * is in use
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_shm* thirdspacevest_shm_create(const char* name, uint32_t capacity);
+
+	/**
+	 * Maps an existing channel to post commands to it.
+	 *
+	 * @param name Name the channel was created with
+	 *
+	 * @return Channel, or NULL if it doesn't exist or isn't valid
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_shm* thirdspacevest_shm_attach(const char* name);
+
+	/**
+	 * Unmaps a channel. The creating side also removes the name, already
+	 * attached producers keep their mapping until they close it.
+	 *
+	 * @param shm Channel to close
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_shm_close(thirdspacevest_shm* shm);
+
+	/**
+	 * Puts a command on the channel. Lock-free, safe from any number of
+	 * threads and processes at once.
+	 *
+	 * @param shm Channel to post to
+	 * @param command Command to copy in, sequence is ignored
+	 *
+	 * @return 0 if posted, E_NPUTIL_BUSY if the ring is full
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_shm_post(thirdspacevest_shm* shm, const thirdspacevest_shm_command* command);
+
+	/**
+	 * Takes the oldest command off the channel. Only one thread, on the
+	 * creating side, may take commands.
+	 *
+	 * @param shm Channel to read from
+	 * @param command Filled in if a command was waiting
+	 *
+	 * @return 1 if a command was taken, 0 if the ring was empty
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_shm_poll(thirdspacevest_shm* shm, thirdspacevest_shm_command* command);
+
+	/**
+	 * Blocks until a command is waiting or the timeout runs out.
+	 *
+	 * @param shm Channel to wait on
+	 * @param timeout_ms Longest time to wait
+	 *
+	 * @return 1 if a command is waiting, 0 if the timeout ran out
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_shm_wait(thirdspacevest_shm* shm, int timeout_ms);
+
+	/**
+	 * Takes every waiting command off the channel and applies it to a
+	 * device. Frames go through the I/O thread if it's running, and
+	 * thirdspacevest_send_frame otherwise. Bank effects need the
+	 * sequencer running.
+	 *
+	 * @param shm Channel to read from
+	 * @param dev Open device to drive
+	 * @param bank Bank THIRDSPACEVEST_SHM_BANK_EFFECT IDs refer to, can be NULL
+	 *
+	 * @return Number of commands applied if ok, otherwise the first error
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_shm_dispatch(thirdspacevest_shm* shm, thirdspacevest_device* dev, thirdspacevest_bank* bank);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Daemon Wire Protocol
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Size of a binary daemon message on the wire
+	 *
+	 * @param type THIRDSPACEVEST_WIRE_TRIGGER, _FRAME or _EFFECT
+	 *
+	 * @return Size in bytes if ok, otherwise E_NPUTIL_INVALID_PARAM
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_wire_message_size(uint8_t type);
+
+	/**
+	 * Encodes a binary daemon message. Only valid once the client has
+	 * switched the connection over with a set_framing command.
+	 *
+	 * @param message Message to encode
+	 * @param buffer Buffer to write into
+	 * @param size Size of buffer, THIRDSPACEVEST_WIRE_MAX_SIZE always fits
+	 *
+	 * @return Bytes written if ok, otherwise E_NPUTIL_INVALID_PARAM
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_wire_encode(const thirdspacevest_wire_message* message, uint8_t* buffer, size_t size);
+
+	/**
+	 * Decodes the binary daemon message at the start of a buffer
+	 *
+	 * @param buffer Received bytes
+	 * @param size Number of bytes in buffer
+	 * @param message Filled in with the message
+	 *
+	 * @return Bytes consumed if ok, 0 if buffer only holds the start of a
+	 * message, otherwise E_NPUTIL_INVALID_PARAM. A buffer not starting
+	 * with THIRDSPACEVEST_WIRE_MAGIC is invalid, and is probably JSON.
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_wire_decode(const uint8_t* buffer, size_t size, thirdspacevest_wire_message* message);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Device Groups
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Creates an empty device group. Its USB context is created by the
+	 * first thirdspacevest_group_open.
+	 *
+	 * @return New group, or NULL if out of memory
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_group* thirdspacevest_group_create();
+
+	/**
+	 * Closes and deletes every device in the group, then the group itself
+	 *
+	 * @param group Group pointer
+	 */
+	THIRDSPACEVEST_DECLSPEC void thirdspacevest_group_delete(thirdspacevest_group* group);
+
+	/**
+	 * Opens every connected vest, up to THIRDSPACEVEST_GROUP_MAX, and
+	 * adds them to the group in bus order. The vests are opened and
+	 * claimed on one thread each, so this takes about as long as the
+	 * slowest vest rather than the sum of them.
+	 *
+	 * @param group Group pointer
+	 *
+	 * @return Number of vests in the group if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_group_open(thirdspacevest_group* group);
+
+	/**
+	 * Startup path for a process that wants every vest ready as soon as
+	 * possible: thirdspacevest_group_open, then every cell on every vest
+	 * set to 0 in one thirdspacevest_group_send_frame batch, so the vests
+	 * start from a known state and the first haptic only sends the cells
+	 * it changes.
+	 *
+	 * @param group Group pointer, normally fresh from thirdspacevest_group_create
+	 *
+	 * @return Number of vests in the group if ok, otherwise < 0. The vests
+	 * stay in the group if only the zero frame failed.
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_group_start(thirdspacevest_group* group);
+
+	/**
+	 * Returns the device at a position in the group
+	 *
+	 * @param group Group pointer
+	 * @param index Position in the group, in the order the vests were opened
+	 *
+	 * @return Device pointer, or NULL if index is out of range
+	 */
+	THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_group_get_device(thirdspacevest_group* group, int index);
+
+	/**
+	 * Sends a frame to several vests at once. Packets for every selected
+	 * vest are submitted before any status read is waited on, so the
+	 * whole broadcast costs about one USB round trip regardless of the
+	 * number of vests.
+	 *
+	 * @param group Group pointer
+	 * @param speeds Speed for each of the 8 cells, indexed by cell
+	 * @param mask Bitmask of cells to update, bit n selects speeds[n]
+	 * @param device_mask Bitmask of group positions to send to, bit n selects device n
+	 *
+	 * @return Total number of cells sent if ok, otherwise the first error seen
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_group_send_frame(thirdspacevest_group* group, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask, uint32_t device_mask);
+
+	/**
+	 * Processes finished asynchronous transfers for every device in the
+	 * group and runs their callbacks
+	 *
+	 * @param group Group pointer
+	 * @param timeout_ms Longest time to wait for a transfer to finish, 0 to poll
+	 *
+	 * @return 0 if ok, otherwise < 0
+	 */
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_group_handle_events(thirdspacevest_group* group, int timeout_ms);
+
+	THIRDSPACEVEST_DECLSPEC int thirdspacevest_form_checksum(uint8_t index, uint8_t speed);
 #ifdef __cplusplus
 }
 #endif
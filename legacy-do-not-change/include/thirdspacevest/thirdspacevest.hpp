@@ -0,0 +1,421 @@
+/*
+ * C++20 wrapper for the Third Space Vest User Space Driver
+ *
+ * Copyright (c) 2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#ifndef LIBTHIRDSPACEVEST_HPP
+#define LIBTHIRDSPACEVEST_HPP
+
+/*******************************************************************************
+ *
+ * Header only, on top of the C API. Nothing here allocates or goes
+ * through a vtable: a Vest is one pointer, cell masks are bytes and
+ * effects built from consteval steps are constant arrays, so a send
+ * costs the same as calling the C function directly. Errors come back
+ * as the same < 0 codes, no exceptions are thrown.
+ *
+ ******************************************************************************/
+
+#include "thirdspacevest/thirdspacevest.h"
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+
+namespace thirdspacevest
+{
+	/**
+	 * Cell indices by physical position.
+	 *
+	 *       FRONT                BACK
+	 *   +-----+-----+        +-----+-----+
+	 *   |  2  |  5  | Upper  |  1  |  6  |
+	 *   +-----+-----+        +-----+-----+
+	 *   |  3  |  4  | Lower  |  0  |  7  |
+	 *   +-----+-----+        +-----+-----+
+	 *     L     R              L     R
+	 */
+	namespace cell
+	{
+		inline constexpr uint8_t FRONT_UPPER_LEFT = 2;
+		inline constexpr uint8_t FRONT_UPPER_RIGHT = 5;
+		inline constexpr uint8_t FRONT_LOWER_LEFT = 3;
+		inline constexpr uint8_t FRONT_LOWER_RIGHT = 4;
+		inline constexpr uint8_t BACK_UPPER_LEFT = 1;
+		inline constexpr uint8_t BACK_UPPER_RIGHT = 6;
+		inline constexpr uint8_t BACK_LOWER_LEFT = 0;
+		inline constexpr uint8_t BACK_LOWER_RIGHT = 7;
+	}
+
+	/**
+	 * A set of cells, bit n selects cell n, same as the C mask arguments
+	 */
+	struct CellMask
+	{
+		uint8_t bits = 0;
+
+		constexpr bool contains(uint8_t index) const { return index < THIRDSPACEVEST_CELL_COUNT && (bits >> index) & 1; }
+		constexpr bool empty() const { return bits == 0; }
+		constexpr int count() const
+		{
+			int n = 0;
+			for(uint8_t b = bits; b; b &= b - 1)
+			{
+				++n;
+			}
+			return n;
+		}
+
+		friend constexpr CellMask operator|(CellMask a, CellMask b) { return {(uint8_t)(a.bits | b.bits)}; }
+		friend constexpr CellMask operator&(CellMask a, CellMask b) { return {(uint8_t)(a.bits & b.bits)}; }
+		friend constexpr CellMask operator-(CellMask a, CellMask b) { return {(uint8_t)(a.bits & ~b.bits)}; }
+		friend constexpr CellMask operator~(CellMask a) { return {(uint8_t)(~a.bits & THIRDSPACEVEST_ALL_CELLS)}; }
+		friend constexpr bool operator==(CellMask a, CellMask b) = default;
+	};
+
+	/**
+	 * Mask of the given cells, checked at compile time
+	 */
+	template <uint8_t... Cells>
+	inline constexpr CellMask cells = []
+	{
+		static_assert(((Cells < THIRDSPACEVEST_CELL_COUNT) && ...), "cell index out of range");
+		return CellMask{(uint8_t)((0u | ... | (1u << Cells)))};
+	}();
+
+	inline constexpr CellMask NONE{};
+	inline constexpr CellMask ALL{THIRDSPACEVEST_ALL_CELLS};
+	inline constexpr CellMask FRONT = cells<cell::FRONT_UPPER_LEFT, cell::FRONT_UPPER_RIGHT, cell::FRONT_LOWER_LEFT, cell::FRONT_LOWER_RIGHT>;
+	inline constexpr CellMask BACK = cells<cell::BACK_UPPER_LEFT, cell::BACK_UPPER_RIGHT, cell::BACK_LOWER_LEFT, cell::BACK_LOWER_RIGHT>;
+	inline constexpr CellMask UPPER = cells<cell::FRONT_UPPER_LEFT, cell::FRONT_UPPER_RIGHT, cell::BACK_UPPER_LEFT, cell::BACK_UPPER_RIGHT>;
+	inline constexpr CellMask LOWER = cells<cell::FRONT_LOWER_LEFT, cell::FRONT_LOWER_RIGHT, cell::BACK_LOWER_LEFT, cell::BACK_LOWER_RIGHT>;
+	inline constexpr CellMask LEFT = cells<cell::FRONT_UPPER_LEFT, cell::FRONT_LOWER_LEFT, cell::BACK_UPPER_LEFT, cell::BACK_LOWER_LEFT>;
+	inline constexpr CellMask RIGHT = cells<cell::FRONT_UPPER_RIGHT, cell::FRONT_LOWER_RIGHT, cell::BACK_UPPER_RIGHT, cell::BACK_LOWER_RIGHT>;
+	/// Upper cells on one side, for recoil and punches
+	inline constexpr CellMask LEFT_ARM = UPPER & LEFT;
+	inline constexpr CellMask RIGHT_ARM = UPPER & RIGHT;
+	/// Lower cells, torso hits
+	inline constexpr CellMask TORSO = LOWER;
+
+	static_assert((FRONT | BACK) == ALL && (FRONT & BACK) == NONE);
+	static_assert((UPPER | LOWER) == ALL && (LEFT | RIGHT) == ALL);
+	static_assert(LEFT_ARM.count() == 2 && RIGHT_ARM.count() == 2);
+
+	/// Speeds for every cell, what thirdspacevest_send_frame takes
+	using Frame = std::array<uint8_t, THIRDSPACEVEST_CELL_COUNT>;
+
+	/**
+	 * Frame driving every cell in mask at speed and the rest at base
+	 */
+	constexpr Frame fill(CellMask mask, uint8_t speed, uint8_t base = 0)
+	{
+		Frame frame{};
+		for(uint8_t i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+		{
+			frame[i] = mask.contains(i) ? speed : base;
+		}
+		return frame;
+	}
+
+	/**
+	 * One sequencer step, rejected at compile time if the C library
+	 * would reject it in thirdspacevest_play_effect.
+	 *
+	 * @param mask Cells to drive, not empty
+	 * @param speed Speed for those cells
+	 * @param start_us Start, in microseconds from submission
+	 * @param duration_us Length, start_us + duration_us must fit 32 bits
+	 */
+	consteval thirdspacevest_step step(CellMask mask, uint8_t speed, uint32_t start_us, uint32_t duration_us)
+	{
+		if(mask.empty())
+		{
+			throw "a step needs at least one cell";
+		}
+		if((uint64_t)start_us + duration_us > 0xFFFFFFFFu)
+		{
+			throw "step ends past the 32 bit microsecond clock";
+		}
+		return thirdspacevest_step{mask.bits, speed, 0, start_us, duration_us};
+	}
+
+	/**
+	 * Fixed-size list of steps. Built with effect() and then(), usually as
+	 * a constexpr variable, so the steps end up in read-only data.
+	 */
+	template <std::size_t N>
+	struct Effect
+	{
+		static_assert(N >= 1 && N <= THIRDSPACEVEST_MAX_STEPS, "an effect needs 1 to THIRDSPACEVEST_MAX_STEPS steps");
+
+		std::array<thirdspacevest_step, N> steps;
+
+		/// End of the last step, in microseconds from submission
+		constexpr uint32_t duration_us() const
+		{
+			uint32_t end = 0;
+			for(const thirdspacevest_step& s : steps)
+			{
+				end = s.start_us + s.duration_us > end ? s.start_us + s.duration_us : end;
+			}
+			return end;
+		}
+
+		/// Cells any step drives
+		constexpr CellMask mask() const
+		{
+			CellMask m;
+			for(const thirdspacevest_step& s : steps)
+			{
+				m = m | CellMask{s.cell_mask};
+			}
+			return m;
+		}
+	};
+
+	/**
+	 * Effect out of steps, in the order given
+	 */
+	template <typename... Steps>
+	constexpr Effect<sizeof...(Steps)> effect(const Steps&... steps)
+	{
+		return Effect<sizeof...(Steps)>{{steps...}};
+	}
+
+	/**
+	 * a followed by b, b starting gap_us after a ends
+	 */
+	template <std::size_t A, std::size_t B>
+	constexpr Effect<A + B> then(const Effect<A>& a, const Effect<B>& b, uint32_t gap_us = 0)
+	{
+		Effect<A + B> out{};
+		uint32_t offset = a.duration_us() + gap_us;
+		for(std::size_t i = 0; i < A; ++i)
+		{
+			out.steps[i] = a.steps[i];
+		}
+		for(std::size_t i = 0; i < B; ++i)
+		{
+			out.steps[A + i] = b.steps[i];
+			out.steps[A + i].start_us += offset;
+		}
+		return out;
+	}
+
+	/// Frame and the cells it drives, from project
+	struct Projection
+	{
+		Frame speeds{};
+		CellMask mask;
+	};
+
+	/**
+	 * Hit from direction (x, y, z), see thirdspacevest_project_hit
+	 */
+	inline Projection project(float x, float y, float z, uint8_t intensity) noexcept
+	{
+		Projection p;
+		p.mask.bits = (uint8_t)thirdspacevest_project_hit(x, y, z, intensity, p.speeds.data());
+		return p;
+	}
+
+	/**
+	 * Every hit in a tick blended into one frame, see
+	 * thirdspacevest_project_hits. An invalid blend gives an empty mask.
+	 */
+	inline Projection project(std::span<const thirdspacevest_hit> hits, int blend = THIRDSPACEVEST_BLEND_MAX) noexcept
+	{
+		Projection p;
+		const int ret = thirdspacevest_project_hits(hits.data(), (int)hits.size(), blend, p.speeds.data());
+		p.mask.bits = ret < 0 ? 0 : (uint8_t)ret;
+		return p;
+	}
+
+	/**
+	 * What co_await vest.send(frame) waits on. The frame is queued with
+	 * thirdspacevest_send_frame_async when the coroutine suspends, and
+	 * the coroutine is resumed from thirdspacevest_dispatch_completions,
+	 * on whichever thread the event loop runs it. The result is what
+	 * thirdspacevest_send_frame would have returned; if queueing fails
+	 * the coroutine doesn't suspend and gets the error straight away.
+	 */
+	class [[nodiscard]] SendAwaitable
+	{
+	public:
+		SendAwaitable(thirdspacevest_device* dev, std::span<const uint8_t, THIRDSPACEVEST_CELL_COUNT> speeds, CellMask mask) noexcept
+			: _dev(dev), _speeds(speeds), _mask(mask) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		bool await_suspend(std::coroutine_handle<> handle) noexcept
+		{
+			_handle = handle;
+			// Once queued, complete() can run on another thread and
+			// resume (and destroy) the coroutine before this returns, so
+			// no members are touched after a successful call.
+			const int ret = thirdspacevest_send_frame_async(_dev, _speeds.data(), _mask.bits, &SendAwaitable::complete, this);
+			if(ret < 0)
+			{
+				_status = ret;
+			}
+			return ret >= 0;
+		}
+
+		int await_resume() const noexcept { return _status; }
+
+	private:
+		static void complete(thirdspacevest_device*, int status, void* user_data) noexcept
+		{
+			SendAwaitable* self = static_cast<SendAwaitable*>(user_data);
+			self->_status = status;
+			self->_handle.resume();
+		}
+
+		thirdspacevest_device* _dev;
+		std::span<const uint8_t, THIRDSPACEVEST_CELL_COUNT> _speeds;
+		CellMask _mask;
+		std::coroutine_handle<> _handle;
+		int _status = 0;
+	};
+
+	/**
+	 * Owns one thirdspacevest_device. Move-only; closing and deleting the
+	 * device happens when the owning Vest goes away.
+	 */
+	class Vest
+	{
+	public:
+		/// Empty, owns nothing
+		constexpr Vest() noexcept = default;
+
+		/// Takes ownership of dev, which may be NULL
+		explicit Vest(thirdspacevest_device* dev) noexcept : _dev(dev) {}
+
+		Vest(const Vest&) = delete;
+		Vest& operator=(const Vest&) = delete;
+
+		Vest(Vest&& other) noexcept : _dev(std::exchange(other._dev, nullptr)) {}
+
+		Vest& operator=(Vest&& other) noexcept
+		{
+			if(this != &other)
+			{
+				reset(std::exchange(other._dev, nullptr));
+			}
+			return *this;
+		}
+
+		~Vest() { reset(); }
+
+		/// Vest on the platform's USB backend, empty if that failed
+		static Vest create() noexcept { return Vest(thirdspacevest_create()); }
+
+		/// Vest on the loopback transport, see thirdspacevest_create_null
+		static Vest create_null(uint32_t latency_us = 0) noexcept { return Vest(thirdspacevest_create_null(latency_us)); }
+
+		/// Vest on a custom transport, see thirdspacevest_create_with_transport
+		static Vest create_with_transport(const thirdspacevest_transport* transport, void* data) noexcept
+		{
+			return Vest(thirdspacevest_create_with_transport(transport, data));
+		}
+
+		/// Closes and deletes the current device, then owns dev instead
+		void reset(thirdspacevest_device* dev = nullptr) noexcept
+		{
+			if(_dev)
+			{
+				thirdspacevest_close(_dev);
+				thirdspacevest_delete(_dev);
+			}
+			_dev = dev;
+		}
+
+		/// Gives up ownership without closing
+		[[nodiscard]] thirdspacevest_device* release() noexcept { return std::exchange(_dev, nullptr); }
+
+		thirdspacevest_device* get() const noexcept { return _dev; }
+		explicit operator bool() const noexcept { return _dev != nullptr; }
+
+		int count() const noexcept { return thirdspacevest_get_count(_dev); }
+		int open(uint32_t index = 0) noexcept { return thirdspacevest_open(_dev, index); }
+		int close() noexcept { return thirdspacevest_close(_dev); }
+		bool is_open() const noexcept { return _dev && _dev->_is_open; }
+
+		/// Sets one cell, see thirdspacevest_send_effect
+		int send(uint8_t index, uint8_t speed) noexcept { return thirdspacevest_send_effect(_dev, index, speed); }
+
+		/// Sets every cell in mask to its entry in speeds, see thirdspacevest_send_frame
+		int send_frame(std::span<const uint8_t, THIRDSPACEVEST_CELL_COUNT> speeds, CellMask mask = ALL) noexcept
+		{
+			return thirdspacevest_send_frame(_dev, speeds.data(), mask.bits);
+		}
+
+		/// Sends a frame without blocking, to be co_awaited. Needs
+		/// start_completions, see SendAwaitable.
+		SendAwaitable send(std::span<const uint8_t, THIRDSPACEVEST_CELL_COUNT> speeds, CellMask mask = ALL) noexcept
+		{
+			return SendAwaitable(_dev, speeds, mask);
+		}
+
+		/// See thirdspacevest_start_completions
+		int start_completions() noexcept { return thirdspacevest_start_completions(_dev); }
+		int stop_completions() noexcept { return thirdspacevest_stop_completions(_dev); }
+
+		/// Resumes coroutines whose sends finished, see thirdspacevest_dispatch_completions
+		int dispatch_completions() noexcept { return thirdspacevest_dispatch_completions(_dev); }
+
+#if defined(WIN32)
+		HANDLE completion_handle() const noexcept { return thirdspacevest_get_completion_handle(_dev); }
+#else
+		/// Readable while dispatch_completions has work, see thirdspacevest_get_completion_fd
+		int completion_fd() const noexcept { return thirdspacevest_get_completion_fd(_dev); }
+#endif
+
+		/// Drives every cell in mask at speed in one batch
+		int send_mask(CellMask mask, uint8_t speed) noexcept
+		{
+			const Frame frame = fill(mask, speed);
+			return send_frame(frame, mask);
+		}
+
+		/// Drives the cells a projected hit reaches, leaving the rest alone
+		int send_hit(const Projection& p) noexcept
+		{
+			return p.mask.empty() ? 0 : send_frame(p.speeds, p.mask);
+		}
+
+		/// Plays an effect on the sequencer, see thirdspacevest_play_effect
+		template <std::size_t N>
+		int play(const Effect<N>& e) noexcept
+		{
+			return thirdspacevest_play_effect(_dev, e.steps.data(), (int)N);
+		}
+
+		int cancel(int handle) noexcept { return thirdspacevest_cancel_effect(_dev, handle); }
+		int start_sequencer() noexcept { return thirdspacevest_start_sequencer(_dev); }
+		int stop_sequencer() noexcept { return thirdspacevest_stop_sequencer(_dev); }
+		int set_ack_mode(int mode) noexcept { return thirdspacevest_set_ack_mode(_dev, mode); }
+		int set_key_mode(int mode) noexcept { return thirdspacevest_set_key_mode(_dev, mode); }
+		int get_stats(thirdspacevest_stats& stats) const noexcept { return thirdspacevest_get_stats(_dev, &stats); }
+		int get_backpressure(thirdspacevest_backpressure& bp) const noexcept { return thirdspacevest_get_backpressure(_dev, &bp); }
+		int set_timeout_limits(uint32_t min_ms, uint32_t max_ms) noexcept { return thirdspacevest_set_timeout_limits(_dev, min_ms, max_ms); }
+		int start_trace(const char* path) noexcept { return thirdspacevest_start_trace(_dev, path); }
+		int stop_trace() noexcept { return thirdspacevest_stop_trace(_dev); }
+
+	private:
+		thirdspacevest_device* _dev = nullptr;
+	};
+}
+
+#endif //LIBTHIRDSPACEVEST_HPP
@@ -0,0 +1,781 @@
+/*
+ * Third Space Vest Driver - CPython extension
+ *
+ * Exposes devices as _thirdspacevest.Device so Python callers get packet
+ * forming, sends, frames and sequencer playback from the C library. Every
+ * call that can touch the vest drops the GIL while it runs.
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+#include "thirdspacevest/thirdspacevest.h"
+
+/// _thirdspacevest.Error, an OSError whose errno is the E_NPUTIL_* code
+static PyObject* thirdspacevest_py_error = NULL;
+
+typedef struct {
+	PyObject_HEAD
+	thirdspacevest_device* _dev;
+	/// Serializes library calls, which run without the GIL
+	PyThread_type_lock _lock;
+	/// Nonzero once play_effect started the sequencer
+	int _sequencer_running;
+} thirdspacevest_py_device;
+
+static PyTypeObject thirdspacevest_py_device_type;
+
+static PyObject* thirdspacevest_py_raise(int ret, const char* what)
+{
+	PyObject* args = Py_BuildValue("(is)", ret, what);
+	if(args)
+	{
+		PyErr_SetObject(thirdspacevest_py_error, args);
+		Py_DECREF(args);
+	}
+	return NULL;
+}
+
+/**
+ * Makes sure a device is there, so methods on a Device that failed to
+ * initialize raise instead of crashing.
+ */
+static int thirdspacevest_py_check(thirdspacevest_py_device* self)
+{
+	if(!self->_dev)
+	{
+		PyErr_SetString(PyExc_ValueError, "device has been deleted");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Same as thirdspacevest_py_check, and the vest has to be open. The
+ * library doesn't check this itself on the send paths.
+ */
+static int thirdspacevest_py_check_open(thirdspacevest_py_device* self)
+{
+	if(!thirdspacevest_py_check(self))
+	{
+		return 0;
+	}
+	if(!self->_dev->_is_open)
+	{
+		thirdspacevest_py_raise(E_NPUTIL_NOT_OPENED, "device not open");
+		return 0;
+	}
+	return 1;
+}
+
+static void thirdspacevest_py_lock(thirdspacevest_py_device* self)
+{
+	PyThread_acquire_lock(self->_lock, WAIT_LOCK);
+}
+
+static void thirdspacevest_py_unlock(thirdspacevest_py_device* self)
+{
+	PyThread_release_lock(self->_lock);
+}
+
+static PyObject* thirdspacevest_py_wrap(PyTypeObject* type, thirdspacevest_device* dev)
+{
+	thirdspacevest_py_device* self;
+	if(!dev)
+	{
+		return thirdspacevest_py_raise(E_NPUTIL_NOT_INITED, "could not create device");
+	}
+	self = (thirdspacevest_py_device*)type->tp_alloc(type, 0);
+	if(!self)
+	{
+		thirdspacevest_delete(dev);
+		return NULL;
+	}
+	self->_lock = PyThread_allocate_lock();
+	if(!self->_lock)
+	{
+		thirdspacevest_delete(dev);
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	self->_dev = dev;
+	return (PyObject*)self;
+}
+
+static PyObject* thirdspacevest_py_device_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {NULL};
+	thirdspacevest_device* dev;
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, ":Device", kwlist))
+	{
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	dev = thirdspacevest_create();
+	Py_END_ALLOW_THREADS
+	return thirdspacevest_py_wrap(type, dev);
+}
+
+static void thirdspacevest_py_device_dealloc(thirdspacevest_py_device* self)
+{
+	if(self->_dev)
+	{
+		// Runs the last send_frame_async callbacks, which need the GIL
+		thirdspacevest_stop_completions(self->_dev);
+		Py_BEGIN_ALLOW_THREADS
+		if(self->_dev->_is_open)
+		{
+			thirdspacevest_close(self->_dev);
+		}
+		thirdspacevest_delete(self->_dev);
+		Py_END_ALLOW_THREADS
+	}
+	if(self->_lock)
+	{
+		PyThread_free_lock(self->_lock);
+	}
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* thirdspacevest_py_count(thirdspacevest_py_device* self, PyObject* unused)
+{
+	int ret;
+	if(!thirdspacevest_py_check(self))
+	{
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	thirdspacevest_py_lock(self);
+	ret = thirdspacevest_get_count(self->_dev);
+	thirdspacevest_py_unlock(self);
+	Py_END_ALLOW_THREADS
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "get_count failed");
+	}
+	return PyLong_FromLong(ret);
+}
+
+static PyObject* thirdspacevest_py_open(thirdspacevest_py_device* self, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {"index", NULL};
+	unsigned int index = 0;
+	int ret;
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "|I:open", kwlist, &index) || !thirdspacevest_py_check(self))
+	{
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	thirdspacevest_py_lock(self);
+	ret = self->_dev->_is_open ? E_NPUTIL_INVALID_PARAM : thirdspacevest_open(self->_dev, index);
+	thirdspacevest_py_unlock(self);
+	Py_END_ALLOW_THREADS
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "open failed");
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* thirdspacevest_py_close(thirdspacevest_py_device* self, PyObject* unused)
+{
+	int ret = 0;
+	if(!thirdspacevest_py_check(self))
+	{
+		return NULL;
+	}
+	thirdspacevest_stop_completions(self->_dev);
+	Py_BEGIN_ALLOW_THREADS
+	thirdspacevest_py_lock(self);
+	if(self->_dev->_is_open)
+	{
+		ret = thirdspacevest_close(self->_dev);
+	}
+	self->_sequencer_running = 0;
+	thirdspacevest_py_unlock(self);
+	Py_END_ALLOW_THREADS
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "close failed");
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* thirdspacevest_py_send_effect(thirdspacevest_py_device* self, PyObject* args)
+{
+	unsigned char cell, speed;
+	int ret;
+	if(!PyArg_ParseTuple(args, "bb:send_effect", &cell, &speed) || !thirdspacevest_py_check_open(self))
+	{
+		return NULL;
+	}
+	if(cell >= THIRDSPACEVEST_CELL_COUNT)
+	{
+		PyErr_SetString(PyExc_ValueError, "cell must be 0-7");
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	thirdspacevest_py_lock(self);
+	ret = thirdspacevest_send_effect(self->_dev, cell, speed);
+	thirdspacevest_py_unlock(self);
+	Py_END_ALLOW_THREADS
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "send_effect failed");
+	}
+	Py_RETURN_NONE;
+}
+
+/**
+ * Reads a sequence of 8 speeds
+ */
+static int thirdspacevest_py_speeds(PyObject* obj, uint8_t* speeds)
+{
+	PyObject* seq = PySequence_Fast(obj, "speeds must be a sequence of 8 ints");
+	Py_ssize_t i;
+	long value;
+	if(!seq)
+	{
+		return 0;
+	}
+	if(PySequence_Fast_GET_SIZE(seq) != THIRDSPACEVEST_CELL_COUNT)
+	{
+		PyErr_SetString(PyExc_ValueError, "speeds must be a sequence of 8 ints");
+		Py_DECREF(seq);
+		return 0;
+	}
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		value = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+		if(value < 0 || value > 255)
+		{
+			if(!PyErr_Occurred())
+			{
+				PyErr_SetString(PyExc_ValueError, "speeds must be 0-255");
+			}
+			Py_DECREF(seq);
+			return 0;
+		}
+		speeds[i] = (uint8_t)value;
+	}
+	Py_DECREF(seq);
+	return 1;
+}
+
+static PyObject* thirdspacevest_py_send_frame(thirdspacevest_py_device* self, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {"speeds", "mask", NULL};
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	unsigned char mask = THIRDSPACEVEST_ALL_CELLS;
+	PyObject* obj;
+	int ret;
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|b:send_frame", kwlist, &obj, &mask) ||
+	   !thirdspacevest_py_check_open(self) || !thirdspacevest_py_speeds(obj, speeds))
+	{
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	thirdspacevest_py_lock(self);
+	ret = thirdspacevest_send_frame(self->_dev, speeds, mask);
+	thirdspacevest_py_unlock(self);
+	Py_END_ALLOW_THREADS
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "send_frame failed");
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* thirdspacevest_py_play_effect(thirdspacevest_py_device* self, PyObject* args)
+{
+	thirdspacevest_step steps[THIRDSPACEVEST_MAX_STEPS];
+	PyObject* obj;
+	PyObject* seq;
+	Py_ssize_t count, i;
+	int ret = 0;
+
+	if(!PyArg_ParseTuple(args, "O:play_effect", &obj) || !thirdspacevest_py_check_open(self))
+	{
+		return NULL;
+	}
+	seq = PySequence_Fast(obj, "steps must be a sequence of (cell_mask, speed, start_us, duration_us)");
+	if(!seq)
+	{
+		return NULL;
+	}
+	count = PySequence_Fast_GET_SIZE(seq);
+	if(count < 1 || count > THIRDSPACEVEST_MAX_STEPS)
+	{
+		Py_DECREF(seq);
+		PyErr_Format(PyExc_ValueError, "an effect needs 1 to %d steps", THIRDSPACEVEST_MAX_STEPS);
+		return NULL;
+	}
+	for(i = 0; i < count; ++i)
+	{
+		unsigned char mask, speed;
+		unsigned int start_us, duration_us;
+		if(!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "bbII:play_effect", &mask, &speed, &start_us, &duration_us))
+		{
+			Py_DECREF(seq);
+			return NULL;
+		}
+		steps[i].cell_mask = mask;
+		steps[i].speed = speed;
+		steps[i].reserved = 0;
+		steps[i].start_us = start_us;
+		steps[i].duration_us = duration_us;
+	}
+	Py_DECREF(seq);
+
+	Py_BEGIN_ALLOW_THREADS
+	thirdspacevest_py_lock(self);
+	if(!self->_sequencer_running)
+	{
+		ret = thirdspacevest_start_sequencer(self->_dev);
+		self->_sequencer_running = ret >= 0;
+	}
+	if(ret >= 0)
+	{
+		ret = thirdspacevest_play_effect(self->_dev, steps, (int)count);
+	}
+	thirdspacevest_py_unlock(self);
+	Py_END_ALLOW_THREADS
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "play_effect failed");
+	}
+	return PyLong_FromLong(ret);
+}
+
+static PyObject* thirdspacevest_py_cancel_effect(thirdspacevest_py_device* self, PyObject* args)
+{
+	int handle, ret;
+	if(!PyArg_ParseTuple(args, "i:cancel_effect", &handle) || !thirdspacevest_py_check_open(self))
+	{
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	thirdspacevest_py_lock(self);
+	ret = thirdspacevest_cancel_effect(self->_dev, handle);
+	thirdspacevest_py_unlock(self);
+	Py_END_ALLOW_THREADS
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "cancel_effect failed");
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* thirdspacevest_py_start_completions(thirdspacevest_py_device* self, PyObject* unused)
+{
+	int ret;
+	if(!thirdspacevest_py_check_open(self))
+	{
+		return NULL;
+	}
+	ret = thirdspacevest_start_completions(self->_dev);
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "start_completions failed");
+	}
+	Py_RETURN_NONE;
+}
+
+#if !defined(WIN32)
+static PyObject* thirdspacevest_py_completion_fd(thirdspacevest_py_device* self, PyObject* unused)
+{
+	int fd;
+	if(!thirdspacevest_py_check(self))
+	{
+		return NULL;
+	}
+	fd = thirdspacevest_get_completion_fd(self->_dev);
+	if(fd < 0)
+	{
+		return thirdspacevest_py_raise(fd, "completions not started");
+	}
+	return PyLong_FromLong(fd);
+}
+#endif
+
+/**
+ * Runs a send_frame_async callback. Only called from
+ * thirdspacevest_dispatch_completions, which the binding always calls
+ * with the GIL held.
+ */
+static void thirdspacevest_py_completion_cb(thirdspacevest_device* dev, int status, void* user_data)
+{
+	PyObject* callback = (PyObject*)user_data;
+	PyObject* result = PyObject_CallFunction(callback, "i", status);
+	if(!result)
+	{
+		PyErr_WriteUnraisable(callback);
+	}
+	Py_XDECREF(result);
+	Py_DECREF(callback);
+}
+
+static PyObject* thirdspacevest_py_send_frame_async(thirdspacevest_py_device* self, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {"speeds", "mask", "callback", NULL};
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	unsigned char mask = THIRDSPACEVEST_ALL_CELLS;
+	PyObject* obj;
+	PyObject* callback = Py_None;
+	int ret;
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|bO:send_frame_async", kwlist, &obj, &mask, &callback) ||
+	   !thirdspacevest_py_check_open(self) || !thirdspacevest_py_speeds(obj, speeds))
+	{
+		return NULL;
+	}
+	if(callback != Py_None && !PyCallable_Check(callback))
+	{
+		PyErr_SetString(PyExc_TypeError, "callback must be callable");
+		return NULL;
+	}
+	if(callback == Py_None)
+	{
+		ret = thirdspacevest_send_frame_async(self->_dev, speeds, mask, NULL, NULL);
+	}
+	else
+	{
+		Py_INCREF(callback);
+		ret = thirdspacevest_send_frame_async(self->_dev, speeds, mask, thirdspacevest_py_completion_cb, callback);
+		if(ret < 0)
+		{
+			Py_DECREF(callback);
+		}
+	}
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "send_frame_async failed");
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* thirdspacevest_py_dispatch_completions(thirdspacevest_py_device* self, PyObject* unused)
+{
+	int ret;
+	if(!thirdspacevest_py_check(self))
+	{
+		return NULL;
+	}
+	ret = thirdspacevest_dispatch_completions(self->_dev);
+	if(ret < 0)
+	{
+		return thirdspacevest_py_raise(ret, "dispatch_completions failed");
+	}
+	return PyLong_FromLong(ret);
+}
+
+static PyObject* thirdspacevest_py_set_key_mode(thirdspacevest_py_device* self, PyObject* args)
+{
+	int mode, ret;
+	if(!PyArg_ParseTuple(args, "i:set_key_mode", &mode))
+	{
+		return NULL;
+	}
+	ret = thirdspacevest_set_key_mode(self->_dev, mode);
+	if(ret < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "mode must be KEY_FIXED or KEY_ROTATING");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* thirdspacevest_py_backpressure(thirdspacevest_py_device* self, PyObject* unused)
+{
+	thirdspacevest_backpressure bp;
+	if(!thirdspacevest_py_check(self))
+	{
+		return NULL;
+	}
+	thirdspacevest_get_backpressure(self->_dev, &bp);
+	return Py_BuildValue("{s:I,s:I,s:I,s:I,s:I,s:I,s:O}",
+						 "queue_depth", bp.queue_depth,
+						 "completion_depth", bp.completion_depth,
+						 "in_flight", bp.in_flight,
+						 "rtt_us", bp.rtt_us,
+						 "rtt_var_us", bp.rtt_var_us,
+						 "timeout_ms", bp.timeout_ms,
+						 "saturated", bp.saturated ? Py_True : Py_False);
+}
+
+static PyObject* thirdspacevest_py_set_saturation_threshold(thirdspacevest_py_device* self, PyObject* args)
+{
+	unsigned int rtt_us;
+	if(!PyArg_ParseTuple(args, "I:set_saturation_threshold", &rtt_us) || !thirdspacevest_py_check(self))
+	{
+		return NULL;
+	}
+	// No callback, it could fire on a library thread without the GIL.
+	// Python polls backpressure() instead.
+	thirdspacevest_set_saturation_callback(self->_dev, rtt_us, NULL, NULL);
+	Py_RETURN_NONE;
+}
+
+static PyObject* thirdspacevest_py_is_open(thirdspacevest_py_device* self, void* closure)
+{
+	return PyBool_FromLong(self->_dev && self->_dev->_is_open);
+}
+
+static PyMethodDef thirdspacevest_py_device_methods[] = {
+	{"count", (PyCFunction)thirdspacevest_py_count, METH_NOARGS,
+	 "count() -> int\n\nNumber of vests connected."},
+	{"open", (PyCFunction)thirdspacevest_py_open, METH_VARARGS | METH_KEYWORDS,
+	 "open(index=0)\n\nOpens the index'th vest."},
+	{"close", (PyCFunction)thirdspacevest_py_close, METH_NOARGS,
+	 "close()\n\nStops playback and closes the vest, if open."},
+	{"send_effect", (PyCFunction)thirdspacevest_py_send_effect, METH_VARARGS,
+	 "send_effect(cell, speed)\n\nSets one cell."},
+	{"send_frame", (PyCFunction)thirdspacevest_py_send_frame, METH_VARARGS | METH_KEYWORDS,
+	 "send_frame(speeds, mask=0xFF)\n\nSets every cell in mask to its entry in speeds."},
+	{"play_effect", (PyCFunction)thirdspacevest_py_play_effect, METH_VARARGS,
+	 "play_effect(steps) -> int\n\n"
+	 "Plays (cell_mask, speed, start_us, duration_us) steps on the native\n"
+	 "sequencer, starting it if needed. Returns a handle for cancel_effect."},
+	{"cancel_effect", (PyCFunction)thirdspacevest_py_cancel_effect, METH_VARARGS,
+	 "cancel_effect(handle)\n\nStops an effect early and releases its cells."},
+	{"start_completions", (PyCFunction)thirdspacevest_py_start_completions, METH_NOARGS,
+	 "start_completions()\n\n"
+	 "Starts the sender thread behind send_frame_async. Until close, send_effect\n"
+	 "and send_frame queue on it too and return without waiting for the vest."},
+#if !defined(WIN32)
+	{"completion_fd", (PyCFunction)thirdspacevest_py_completion_fd, METH_NOARGS,
+	 "completion_fd() -> int\n\n"
+	 "File descriptor that is readable while dispatch_completions has callbacks\n"
+	 "to run, for loop.add_reader. Don't read from or close it."},
+#endif
+	{"send_frame_async", (PyCFunction)thirdspacevest_py_send_frame_async, METH_VARARGS | METH_KEYWORDS,
+	 "send_frame_async(speeds, mask=0xFF, callback=None)\n\n"
+	 "Queues a frame for the sender thread. callback(status) runs from\n"
+	 "dispatch_completions once it went out."},
+	{"dispatch_completions", (PyCFunction)thirdspacevest_py_dispatch_completions, METH_NOARGS,
+	 "dispatch_completions() -> int\n\n"
+	 "Runs the callbacks of frames sent since the last call. Never blocks."},
+	{"set_key_mode", (PyCFunction)thirdspacevest_py_set_key_mode, METH_VARARGS,
+	 "set_key_mode(mode)\n\nKEY_FIXED sends cached packets, KEY_ROTATING a new cache key per packet."},
+	{"backpressure", (PyCFunction)thirdspacevest_py_backpressure, METH_NOARGS,
+	 "backpressure() -> dict\n\n"
+	 "queue_depth, completion_depth, in_flight, rtt_us, rtt_var_us, timeout_ms\n"
+	 "and saturated, see thirdspacevest_get_backpressure."},
+	{"set_saturation_threshold", (PyCFunction)thirdspacevest_py_set_saturation_threshold, METH_VARARGS,
+	 "set_saturation_threshold(rtt_us)\n\n"
+	 "Smoothed transfer time above which backpressure() reports saturated, 0 for\n"
+	 "the default."},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef thirdspacevest_py_device_getset[] = {
+	{"is_open", (getter)thirdspacevest_py_is_open, NULL, "True while a vest is open", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject thirdspacevest_py_device_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"_thirdspacevest.Device",
+	sizeof(thirdspacevest_py_device),
+	0,
+	(destructor)thirdspacevest_py_device_dealloc,
+};
+
+static PyObject* thirdspacevest_py_null_device(PyObject* module, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {"latency_us", NULL};
+	unsigned int latency_us = 0;
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "|I:null_device", kwlist, &latency_us))
+	{
+		return NULL;
+	}
+	return thirdspacevest_py_wrap(&thirdspacevest_py_device_type, thirdspacevest_create_null(latency_us));
+}
+
+static PyObject* thirdspacevest_py_form_packet(PyObject* module, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {"cell", "speed", "key_index", NULL};
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	unsigned char cell, speed, key_index = THIRDSPACEVEST_FIXED_KEY_INDEX;
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "bb|b:form_packet", kwlist, &cell, &speed, &key_index))
+	{
+		return NULL;
+	}
+	thirdspacevest_form_packet_with_key(packet, cell, speed, key_index);
+	return PyBytes_FromStringAndSize((const char*)packet, THIRDSPACEVEST_PACKET_SIZE);
+}
+
+/**
+ * (speeds, mask) result of a projection
+ */
+static PyObject* thirdspacevest_py_frame(const uint8_t* speeds, int mask)
+{
+	PyObject* list = PyList_New(THIRDSPACEVEST_CELL_COUNT);
+	int i;
+	if(!list)
+	{
+		return NULL;
+	}
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		PyList_SET_ITEM(list, i, PyLong_FromLong(speeds[i]));
+	}
+	return Py_BuildValue("(Ni)", list, mask);
+}
+
+static PyObject* thirdspacevest_py_project_hit(PyObject* module, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {"x", "y", "z", "intensity", NULL};
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	float x, y, z;
+	unsigned char intensity;
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "fffb:project_hit", kwlist, &x, &y, &z, &intensity))
+	{
+		return NULL;
+	}
+	return thirdspacevest_py_frame(speeds, thirdspacevest_project_hit(x, y, z, intensity, speeds));
+}
+
+/// Hits project_hits converts without a heap allocation
+#define THIRDSPACEVEST_PY_STACK_HITS 32
+
+static PyObject* thirdspacevest_py_project_hits(PyObject* module, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {"hits", "blend", NULL};
+	thirdspacevest_hit stack_hits[THIRDSPACEVEST_PY_STACK_HITS];
+	thirdspacevest_hit* hits = stack_hits;
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	int blend = THIRDSPACEVEST_BLEND_MAX;
+	PyObject* obj;
+	PyObject* seq;
+	Py_ssize_t count, i;
+	int ret;
+
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:project_hits", kwlist, &obj, &blend))
+	{
+		return NULL;
+	}
+	seq = PySequence_Fast(obj, "hits must be a sequence of (x, y, z, intensity)");
+	if(!seq)
+	{
+		return NULL;
+	}
+	count = PySequence_Fast_GET_SIZE(seq);
+	if(count > INT_MAX)
+	{
+		Py_DECREF(seq);
+		PyErr_SetString(PyExc_OverflowError, "too many hits");
+		return NULL;
+	}
+	if(count > THIRDSPACEVEST_PY_STACK_HITS)
+	{
+		hits = PyMem_New(thirdspacevest_hit, count);
+		if(!hits)
+		{
+			Py_DECREF(seq);
+			return PyErr_NoMemory();
+		}
+	}
+	for(i = 0; i < count; ++i)
+	{
+		unsigned char intensity;
+		if(!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "fffb:project_hits", &hits[i].x, &hits[i].y, &hits[i].z, &intensity))
+		{
+			break;
+		}
+		hits[i].intensity = intensity;
+	}
+	Py_DECREF(seq);
+	ret = i == count ? thirdspacevest_project_hits(hits, (int)count, blend, speeds) : 0;
+	if(hits != stack_hits)
+	{
+		PyMem_Free(hits);
+	}
+	if(i != count)
+	{
+		return NULL;
+	}
+	if(ret < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "blend must be BLEND_MAX, BLEND_SUM or BLEND_REPLACE");
+		return NULL;
+	}
+	return thirdspacevest_py_frame(speeds, ret);
+}
+
+static PyMethodDef thirdspacevest_py_methods[] = {
+	{"null_device", (PyCFunction)thirdspacevest_py_null_device, METH_VARARGS | METH_KEYWORDS,
+	 "null_device(latency_us=0) -> Device\n\n"
+	 "Loopback device with one vest, every transfer taking latency_us."},
+	{"form_packet", (PyCFunction)thirdspacevest_py_form_packet, METH_VARARGS | METH_KEYWORDS,
+	 "form_packet(cell, speed, key_index=FIXED_KEY_INDEX) -> bytes\n\nThe encrypted 10 byte report for one cell."},
+	{"project_hit", (PyCFunction)thirdspacevest_py_project_hit, METH_VARARGS | METH_KEYWORDS,
+	 "project_hit(x, y, z, intensity) -> (speeds, mask)\n\n"
+	 "Frame for a hit from direction (x, y, z): +x right, +y up, +z forward.\n"
+	 "mask has a bit set for every cell with a nonzero speed."},
+	{"project_hits", (PyCFunction)thirdspacevest_py_project_hits, METH_VARARGS | METH_KEYWORDS,
+	 "project_hits(hits, blend=BLEND_MAX) -> (speeds, mask)\n\n"
+	 "Blends a sequence of (x, y, z, intensity) hits into one frame."},
+	{NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef thirdspacevest_py_module = {
+	PyModuleDef_HEAD_INIT,
+	"_thirdspacevest",
+	"Native bindings for libthirdspacevest",
+	-1,
+	thirdspacevest_py_methods
+};
+
+PyMODINIT_FUNC PyInit__thirdspacevest(void)
+{
+	PyObject* module;
+
+	thirdspacevest_py_device_type.tp_flags = Py_TPFLAGS_DEFAULT;
+	thirdspacevest_py_device_type.tp_doc = "Device()\n\nA vest on the platform's USB backend, not opened yet.";
+	thirdspacevest_py_device_type.tp_methods = thirdspacevest_py_device_methods;
+	thirdspacevest_py_device_type.tp_getset = thirdspacevest_py_device_getset;
+	thirdspacevest_py_device_type.tp_new = thirdspacevest_py_device_new;
+	if(PyType_Ready(&thirdspacevest_py_device_type) < 0)
+	{
+		return NULL;
+	}
+
+	module = PyModule_Create(&thirdspacevest_py_module);
+	if(!module)
+	{
+		return NULL;
+	}
+	thirdspacevest_py_error = PyErr_NewException("_thirdspacevest.Error", PyExc_OSError, NULL);
+	if(!thirdspacevest_py_error)
+	{
+		Py_DECREF(module);
+		return NULL;
+	}
+	// PyModule_AddObject steals these, the module keeps its own references
+	Py_INCREF(thirdspacevest_py_error);
+	Py_INCREF(&thirdspacevest_py_device_type);
+	if(PyModule_AddObject(module, "Error", thirdspacevest_py_error) < 0 ||
+	   PyModule_AddObject(module, "Device", (PyObject*)&thirdspacevest_py_device_type) < 0)
+	{
+		Py_DECREF(module);
+		return NULL;
+	}
+	PyModule_AddIntConstant(module, "CELL_COUNT", THIRDSPACEVEST_CELL_COUNT);
+	PyModule_AddIntConstant(module, "MAX_STEPS", THIRDSPACEVEST_MAX_STEPS);
+	PyModule_AddIntConstant(module, "KEY_FIXED", THIRDSPACEVEST_KEY_FIXED);
+	PyModule_AddIntConstant(module, "KEY_ROTATING", THIRDSPACEVEST_KEY_ROTATING);
+	PyModule_AddIntConstant(module, "FIXED_KEY_INDEX", THIRDSPACEVEST_FIXED_KEY_INDEX);
+	PyModule_AddIntConstant(module, "BLEND_MAX", THIRDSPACEVEST_BLEND_MAX);
+	PyModule_AddIntConstant(module, "BLEND_SUM", THIRDSPACEVEST_BLEND_SUM);
+	PyModule_AddIntConstant(module, "BLEND_REPLACE", THIRDSPACEVEST_BLEND_REPLACE);
+	return module;
+}
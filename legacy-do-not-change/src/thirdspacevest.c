@@ -11,8 +11,47 @@
  * Read LICENSE_BSD.txt for details.
  */
 
-#include "thirdspacevest/thirdspacevest.h"
+#include "thirdspacevest_internal.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void thirdspacevest_init_state(thirdspacevest_device* dev)
+{
+	thirdspacevest_build_packet_cache();
+	memset(dev->_speeds, 0, sizeof(dev->_speeds));
+	dev->_speeds_known = 0;
+	dev->_pending = 0;
+	dev->_frame_pending = 0;
+	dev->_frame_status = 0;
+	dev->_ack_mode = THIRDSPACEVEST_ACK_SYNC;
+	dev->_ack_status = 0;
+	dev->_key_mode = THIRDSPACEVEST_KEY_FIXED;
+	// Only has to differ between devices and runs, not be secret.
+	dev->_key_counter = (uint32_t)thirdspacevest_time_us() ^ (uint32_t)(uintptr_t)dev;
+	dev->_known_count = 0;
+	dev->_lost = 0;
+	dev->_arrived = 0;
+	dev->_auto_reconnect = 1;
+	dev->_reconnect_us = 0;
+	thirdspacevest_mutex_init(&dev->_known_lock);
+	thirdspacevest_init_io_state(dev);
+	thirdspacevest_init_sequencer_state(dev);
+	thirdspacevest_init_mixer_state(dev);
+	thirdspacevest_init_completion_state(dev);
+	thirdspacevest_init_stats(dev);
+	dev->_trace = NULL;
+	dev->_trace_running = 0;
+}
+
+void thirdspacevest_deinit_state(thirdspacevest_device* dev)
+{
+	thirdspacevest_mutex_destroy(&dev->_known_lock);
+	thirdspacevest_mutex_destroy(&dev->_seq_lock);
+	thirdspacevest_mutex_destroy(&dev->_mix_lock);
+	thirdspacevest_mutex_destroy(&dev->_cq_lock);
+	thirdspacevest_free_trace(dev);
+}
 
 int thirdspacevest_form_checksum(uint8_t index, uint8_t speed)
 {
@@ -51,35 +90,502 @@ void thirdspacevest_decrypt (uint32_t* v, uint32_t* k) {
     v[0]=v0; v[1]=v1;
 }
 
+// Key words for every cache key index. The table is 364 bytes, so all
+// 256 indices a packet can carry have 16 bytes of key after them.
+static uint32_t thirdspacevest_key_schedule[256][4];
+static volatile uint32_t thirdspacevest_key_schedule_once = 0;
+
+static void thirdspacevest_build_key_schedule()
+{
+	int i, j;
+	if(!thirdspacevest_once_begin(&thirdspacevest_key_schedule_once))
+	{
+		return;
+	}
+	for(i = 0; i < 256; ++i)
+	{
+		for(j = 0; j < 4; ++j)
+		{
+			thirdspacevest_key_schedule[i][j] =
+				THIRDSPACEVEST_CACHE_KEY_TABLE[i + (4 * j) + 3] << 24 |
+				THIRDSPACEVEST_CACHE_KEY_TABLE[i + (4 * j) + 2] << 16 |
+				THIRDSPACEVEST_CACHE_KEY_TABLE[i + (4 * j) + 1] << 8 |
+				THIRDSPACEVEST_CACHE_KEY_TABLE[i + (4 * j) + 0] << 0;
+		}
+	}
+	thirdspacevest_once_end(&thirdspacevest_key_schedule_once);
+}
+
 void thirdspacevest_form_cache_key(uint8_t* cache_key_index, uint32_t* key_store)
 {
+	thirdspacevest_build_key_schedule();
+	*cache_key_index = THIRDSPACEVEST_FIXED_KEY_INDEX;
+	memcpy(key_store, thirdspacevest_key_schedule[*cache_key_index], sizeof(thirdspacevest_key_schedule[0]));
+}
+
+/**
+ * Fills in the header and plaintext payload of a packet, returning the
+ * payload as the 2 words TEA works on. The words are copied out rather
+ * than cast in place, since packet+2 isn't aligned for them.
+ */
+static void thirdspacevest_packet_plaintext(uint8_t* packet, uint32_t* block, uint8_t cache_key_index, uint8_t index, uint8_t speed)
+{
+	packet[0] = 0x2;
+	packet[1] = cache_key_index;
+	packet[2] = 0x0;
+	packet[3] = 0x0;
+	packet[4] = 0x0;
+	packet[5] = 0x0;
+	packet[6] = 0x0;
+	packet[7] = thirdspacevest_form_checksum(index, speed);
+	packet[8] = index;
+	packet[9] = speed;
+	memcpy(block, packet + 2, 8);
+}
+
+void thirdspacevest_form_packet_with_key(uint8_t* packet, uint8_t index, uint8_t speed, uint8_t key_index)
+{
+	uint32_t block[2];
+	thirdspacevest_build_key_schedule();
+	thirdspacevest_packet_plaintext(packet, block, key_index, index, speed);
+	thirdspacevest_encrypt(block, thirdspacevest_key_schedule[key_index]);
+	memcpy(packet + 2, block, 8);
+}
+
+void thirdspacevest_encode_packet(uint8_t* packet, uint8_t index, uint8_t speed)
+{
+	thirdspacevest_form_packet_with_key(packet, index, speed, THIRDSPACEVEST_FIXED_KEY_INDEX);
+}
+
+/**
+ * Every packet for every (cell, speed) pair under one cache key. Each
+ * cell's 256 payloads go through the batch cipher together.
+ */
+static void thirdspacevest_build_key_rows(uint8_t rows[THIRDSPACEVEST_CELL_COUNT][256][THIRDSPACEVEST_PACKET_SIZE], uint8_t key_index)
+{
+	uint32_t blocks[256][2];
 	int i, j;
-	srand ( time(NULL) );
-	*cache_key_index = 0x1D;//rand() % 255;
-	for(i = 0; i < 4; ++i)
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		for(j = 0; j < 256; ++j)
+		{
+			thirdspacevest_packet_plaintext(rows[i][j], blocks[j], key_index, i, j);
+		}
+		thirdspacevest_encrypt_n(&blocks[0][0], 256, thirdspacevest_key_schedule[key_index]);
+		for(j = 0; j < 256; ++j)
+		{
+			memcpy(rows[i][j] + 2, blocks[j], 8);
+		}
+	}
+}
+
+// Every packet for the fixed cache key. The key never changes, so each
+// one only has to be encrypted once per process.
+static uint8_t thirdspacevest_packet_cache[THIRDSPACEVEST_CELL_COUNT][256][THIRDSPACEVEST_PACKET_SIZE];
+static volatile uint32_t thirdspacevest_packet_cache_once = 0;
+
+void thirdspacevest_build_packet_cache()
+{
+	if(!thirdspacevest_once_begin(&thirdspacevest_packet_cache_once))
+	{
+		return;
+	}
+	thirdspacevest_build_key_schedule();
+	thirdspacevest_build_key_rows(thirdspacevest_packet_cache, THIRDSPACEVEST_FIXED_KEY_INDEX);
+	thirdspacevest_once_end(&thirdspacevest_packet_cache_once);
+}
+
+// Same tables for THIRDSPACEVEST_ROTATING_KEYS keys picked at random,
+// built the first time any device switches to THIRDSPACEVEST_KEY_ROTATING.
+// About 320KB, left untouched by processes that never rotate.
+static uint8_t thirdspacevest_rotating_keys[THIRDSPACEVEST_ROTATING_KEYS];
+static uint8_t thirdspacevest_rotating_cache[THIRDSPACEVEST_ROTATING_KEYS][THIRDSPACEVEST_CELL_COUNT][256][THIRDSPACEVEST_PACKET_SIZE];
+static volatile uint32_t thirdspacevest_rotating_cache_once = 0;
+
+static void thirdspacevest_build_rotating_cache()
+{
+	uint8_t used[256];
+	uint32_t x;
+	int k;
+	if(!thirdspacevest_once_begin(&thirdspacevest_rotating_cache_once))
+	{
+		return;
+	}
+	thirdspacevest_build_key_schedule();
+	memset(used, 0, sizeof(used));
+	// xorshift32, only has to differ between runs, not be secret
+	x = (uint32_t)thirdspacevest_time_us() | 1;
+	for(k = 0; k < THIRDSPACEVEST_ROTATING_KEYS; ++k)
+	{
+		do
+		{
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+		} while(used[x >> 24]);
+		used[x >> 24] = 1;
+		thirdspacevest_rotating_keys[k] = (uint8_t)(x >> 24);
+		thirdspacevest_build_key_rows(thirdspacevest_rotating_cache[k], thirdspacevest_rotating_keys[k]);
+	}
+	thirdspacevest_once_end(&thirdspacevest_rotating_cache_once);
+}
+
+void thirdspacevest_form_packet(uint8_t* packet, uint8_t index, uint8_t speed)
+{
+	if(index >= THIRDSPACEVEST_CELL_COUNT)
+	{
+		thirdspacevest_encode_packet(packet, index, speed);
+		return;
+	}
+	if(!thirdspacevest_once_done(&thirdspacevest_packet_cache_once))
+	{
+		thirdspacevest_build_packet_cache();
+	}
+	memcpy(packet, thirdspacevest_packet_cache[index][speed], THIRDSPACEVEST_PACKET_SIZE);
+}
+
+/**
+ * Which of the rotating keys the next packet uses. The counter steps by
+ * the golden ratio and is mixed afterwards, so each sending thread
+ * claims its own step atomically and there's no shared generator
+ * state to race on.
+ */
+static int thirdspacevest_next_key_slot(thirdspacevest_device* dev)
+{
+	uint32_t x = thirdspacevest_atomic_fetch_add(&dev->_key_counter, 0x9e3779b9);
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	return (int)(x & (THIRDSPACEVEST_ROTATING_KEYS - 1));
+}
+
+void thirdspacevest_form_device_packet(thirdspacevest_device* dev, uint8_t* packet, uint8_t index, uint8_t speed)
+{
+	uint64_t start = thirdspacevest_time_us();
+	int slot;
+	// The mode is stored after the rotating cache is published, see
+	// thirdspacevest_set_key_mode
+	if(thirdspacevest_atomic_load(&dev->_key_mode) == THIRDSPACEVEST_KEY_ROTATING)
+	{
+		slot = thirdspacevest_next_key_slot(dev);
+		if(index < THIRDSPACEVEST_CELL_COUNT)
+		{
+			memcpy(packet, thirdspacevest_rotating_cache[slot][index][speed], THIRDSPACEVEST_PACKET_SIZE);
+		}
+		else
+		{
+			thirdspacevest_form_packet_with_key(packet, index, speed, thirdspacevest_rotating_keys[slot]);
+		}
+	}
+	else
+	{
+		thirdspacevest_form_packet(packet, index, speed);
+	}
+	thirdspacevest_histogram_record(&dev->_encrypt_latency, thirdspacevest_time_us() - start);
+}
+
+int thirdspacevest_set_key_mode(thirdspacevest_device* dev, int mode)
+{
+	if(mode != THIRDSPACEVEST_KEY_FIXED && mode != THIRDSPACEVEST_KEY_ROTATING)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(mode == THIRDSPACEVEST_KEY_ROTATING)
+	{
+		thirdspacevest_build_rotating_cache();
+	}
+	thirdspacevest_atomic_store(&dev->_key_mode, (uint32_t)mode);
+	return 0;
+}
+
+int thirdspacevest_get_key_mode(thirdspacevest_device* dev)
+{
+	return (int)thirdspacevest_atomic_load(&dev->_key_mode);
+}
+
+int thirdspacevest_set_ack_mode(thirdspacevest_device* dev, int mode)
+{
+	if(mode != THIRDSPACEVEST_ACK_SYNC && mode != THIRDSPACEVEST_ACK_ASYNC && mode != THIRDSPACEVEST_ACK_NONE)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	thirdspacevest_atomic_store(&dev->_ack_mode, (uint32_t)mode);
+	return 0;
+}
+
+int thirdspacevest_get_ack_mode(thirdspacevest_device* dev)
+{
+	return (int)thirdspacevest_atomic_load(&dev->_ack_mode);
+}
+
+static void thirdspacevest_ack_callback(thirdspacevest_device* dev, int status, void* user_data)
+{
+	(void)user_data;
+	if(status < 0 && dev->_ack_status == 0)
+	{
+		dev->_ack_status = status;
+	}
+}
+
+int thirdspacevest_get_ack_status(thirdspacevest_device* dev)
+{
+	int status;
+	// A library thread that owns I/O pumps the events itself.
+	if(dev->_is_open && dev->_pending > 0 && !thirdspacevest_thread_owns_io(dev))
+	{
+		thirdspacevest_handle_events(dev, 0);
+	}
+	status = dev->_ack_status;
+	dev->_ack_status = 0;
+	return status;
+}
+
+static int thirdspacevest_send_effect_background(thirdspacevest_device* dev, const uint8_t* packet)
+{
+	int ret;
+	while((ret = thirdspacevest_write_data_async(dev, packet, thirdspacevest_ack_callback, NULL)) == E_NPUTIL_BUSY)
+	{
+		if(thirdspacevest_handle_events(dev, THIRDSPACEVEST_USB_TIMEOUT) < 0)
+		{
+			break;
+		}
+	}
+	if(ret < 0)
+	{
+		return ret;
+	}
+	// Surface anything an earlier ack reported, this write is still
+	// in flight either way.
+	return thirdspacevest_get_ack_status(dev);
+}
+
+static int thirdspacevest_send_effect_untraced(thirdspacevest_device* dev, uint8_t index, uint8_t speed)
+{
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	uint8_t ret[THIRDSPACEVEST_PACKET_SIZE];
+	uint64_t start, now, end;
+	int result, status;
+	if(thirdspacevest_atomic_load(&dev->_io_running))
+	{
+		return thirdspacevest_enqueue_command(dev, index, speed, 1);
+	}
+	if(thirdspacevest_atomic_load(&dev->_cq_running))
+	{
+		// The sender thread owns USB I/O now, and only sends cells.
+		uint8_t speeds[THIRDSPACEVEST_CELL_COUNT] = {0};
+		if(index >= THIRDSPACEVEST_CELL_COUNT)
+		{
+			return E_NPUTIL_INVALID_PARAM;
+		}
+		speeds[index] = speed;
+		return thirdspacevest_queue_frame(dev, speeds, (uint8_t)(1 << index), 1, NULL, NULL);
+	}
+	thirdspacevest_form_device_packet(dev, packet, index, speed);
+	switch(thirdspacevest_atomic_load(&dev->_ack_mode))
+	{
+	case THIRDSPACEVEST_ACK_ASYNC:
+		result = thirdspacevest_send_effect_background(dev, packet);
+		break;
+	case THIRDSPACEVEST_ACK_NONE:
+		start = thirdspacevest_time_us();
+		result = thirdspacevest_write_data(dev, packet);
+		now = thirdspacevest_time_us();
+		thirdspacevest_record_stage(dev, &dev->_write_latency, now - start);
+		thirdspacevest_trace_transfer(dev, THIRDSPACEVEST_TRACE_WRITE, start, now, result < 0);
+		break;
+	default:
+		start = thirdspacevest_time_us();
+		result = thirdspacevest_write_data(dev, packet);
+		now = thirdspacevest_time_us();
+		thirdspacevest_record_stage(dev, &dev->_write_latency, now - start);
+		thirdspacevest_trace_transfer(dev, THIRDSPACEVEST_TRACE_WRITE, start, now, result < 0);
+		if(result < 0)
+		{
+			break;
+		}
+		status = thirdspacevest_read_data(dev, ret);
+		end = thirdspacevest_time_us();
+		thirdspacevest_record_stage(dev, &dev->_ack_latency, end - now);
+		thirdspacevest_trace_transfer(dev, THIRDSPACEVEST_TRACE_READ, now, end, status < 0);
+		// Sync mode exists to report the ack, so a failed read is the
+		// result.
+		if(status < 0)
+		{
+			result = status;
+		}
+		break;
+	}
+	if(index < THIRDSPACEVEST_CELL_COUNT)
 	{
-		key_store[i] =
-			THIRDSPACEVEST_CACHE_KEY_TABLE[*cache_key_index + (4 * i) + 3] << 24 |
-			THIRDSPACEVEST_CACHE_KEY_TABLE[*cache_key_index + (4 * i) + 2] << 16 |
-			THIRDSPACEVEST_CACHE_KEY_TABLE[*cache_key_index + (4 * i) + 1] << 8 |
-			THIRDSPACEVEST_CACHE_KEY_TABLE[*cache_key_index + (4 * i) + 0] << 0;
+		// After a failure we don't know what the vest ended up with, so
+		// the next frame resends the cell.
+		if(result < 0)
+		{
+			dev->_speeds_known &= ~(1 << index);
+		}
+		else
+		{
+			dev->_speeds[index] = speed;
+			dev->_speeds_known |= (1 << index);
+		}
 	}
+	return result;
 }
 
 int thirdspacevest_send_effect(thirdspacevest_device* dev, uint8_t index, uint8_t speed)
 {
-	uint8_t cache_key_index;
-	uint32_t cache_key[4];
-	int i = 0;
-	thirdspacevest_form_cache_key(&cache_key_index, cache_key);
+	uint64_t start;
+	int ret;
+	if(!thirdspacevest_tracing(dev))
+	{
+		return thirdspacevest_send_effect_untraced(dev, index, speed);
+	}
+	start = thirdspacevest_time_us();
+	ret = thirdspacevest_send_effect_untraced(dev, index, speed);
+	thirdspacevest_trace_call(dev, THIRDSPACEVEST_TRACE_EFFECT, index, speed, NULL, start, ret);
+	return ret;
+}
+
+int thirdspacevest_send_effect_async(thirdspacevest_device* dev, uint8_t index, uint8_t speed, thirdspacevest_async_cb callback, void* user_data)
+{
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	// The transfer slots belong to whichever library thread owns I/O,
+	// and thirdspacevest_send_effect already goes through it.
+	if(thirdspacevest_thread_owns_io(dev))
+	{
+		return E_NPUTIL_BUSY;
+	}
+	thirdspacevest_form_device_packet(dev, packet, index, speed);
+	return thirdspacevest_write_data_async(dev, packet, callback, user_data);
+}
+
+static void thirdspacevest_frame_callback(thirdspacevest_device* dev, int status, void* user_data)
+{
+	uint8_t index = (uint8_t)(uintptr_t)user_data;
+	--dev->_frame_pending;
+	if(status < 0)
+	{
+		// We don't know what the vest ended up with, so make sure the
+		// next frame resends this cell.
+		dev->_speeds_known &= ~(1 << index);
+		if(dev->_frame_status == 0)
+		{
+			dev->_frame_status = status;
+		}
+	}
+}
+
+int thirdspacevest_submit_cell(thirdspacevest_device* dev, uint8_t index, uint8_t speed)
+{
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	int ret;
+
+	thirdspacevest_form_device_packet(dev, packet, index, speed);
+	// Mark the cell before submitting, since the callback can run
+	// inline and clears it again on failure.
+	dev->_speeds[index] = speed;
+	dev->_speeds_known |= (1 << index);
+	++dev->_frame_pending;
+	while((ret = thirdspacevest_write_data_async(dev, packet, thirdspacevest_frame_callback, (void*)(uintptr_t)index)) == E_NPUTIL_BUSY)
+	{
+		if(thirdspacevest_handle_events(dev, THIRDSPACEVEST_USB_TIMEOUT) < 0)
+		{
+			break;
+		}
+	}
+	if(ret < 0)
+	{
+		--dev->_frame_pending;
+		dev->_speeds_known &= ~(1 << index);
+		dev->_frame_status = ret;
+	}
+	return ret;
+}
+
+int thirdspacevest_wait_cells(thirdspacevest_device* dev)
+{
+	int status;
+	while(dev->_frame_pending > 0)
+	{
+		if(thirdspacevest_handle_events(dev, THIRDSPACEVEST_USB_TIMEOUT) < 0)
+		{
+			break;
+		}
+	}
+	status = dev->_frame_status;
+	dev->_frame_status = 0;
+	return status;
+}
+
+int thirdspacevest_send_cells(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask)
+{
+	uint8_t i;
+	int ret;
+	int sent = 0;
+
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		if(!(mask & (1 << i)))
+		{
+			continue;
+		}
+		if(thirdspacevest_submit_cell(dev, i, speeds[i]) < 0)
+		{
+			break;
+		}
+		++sent;
+	}
+
+	ret = thirdspacevest_wait_cells(dev);
+	return ret < 0 ? ret : sent;
+}
+
+uint8_t thirdspacevest_changed_cells(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask)
+{
+	uint8_t i;
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		if((mask & (1 << i)) && (dev->_speeds_known & (1 << i)) && dev->_speeds[i] == speeds[i])
+		{
+			mask &= ~(1 << i);
+		}
+	}
+	return mask;
+}
+
+int thirdspacevest_submit_frame(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask)
+{
+	int ret;
+
+	if(thirdspacevest_atomic_load(&dev->_io_running))
+	{
+		// The I/O thread owns the last sent state, so it does the
+		// unchanged cell check when it picks the cells up.
+		return thirdspacevest_enqueue_cells(dev, speeds, mask, 0);
+	}
+	if(thirdspacevest_atomic_load(&dev->_cq_running))
+	{
+		ret = thirdspacevest_queue_frame(dev, speeds, mask, 0, NULL, NULL);
+		return ret < 0 ? ret : 0;
+	}
+	return thirdspacevest_send_cells(dev, speeds, thirdspacevest_changed_cells(dev, speeds, mask));
+}
+
+int thirdspacevest_send_frame(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask)
+{
+	uint64_t start;
+	int ret;
+	if(!thirdspacevest_tracing(dev))
 	{
-		uint8_t packet[10] = {
-			0x2, cache_key_index,
-			0x0, 0x0, 0x0, 0x0,
-			0x0, thirdspacevest_form_checksum(index, speed), index, speed};
-		uint8_t ret[10];
-		thirdspacevest_encrypt((uint32_t*)(packet+2), cache_key);
-		thirdspacevest_write_data(dev, packet);
-		thirdspacevest_read_data(dev, ret);
+		return thirdspacevest_submit_frame(dev, speeds, mask);
 	}
+	start = thirdspacevest_time_us();
+	ret = thirdspacevest_submit_frame(dev, speeds, mask);
+	thirdspacevest_trace_call(dev, THIRDSPACEVEST_TRACE_FRAME, mask, 0, speeds, start, ret);
+	return ret;
 }
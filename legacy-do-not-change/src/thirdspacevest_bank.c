@@ -0,0 +1,308 @@
+/*
+ * Third Space Vest Driver - Memory mapped effect banks
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/// Size of the optional packet table at the end of a bank
+#define THIRDSPACEVEST_BANK_PACKETS_SIZE (THIRDSPACEVEST_CELL_COUNT * 256 * THIRDSPACEVEST_PACKET_SIZE)
+
+// Banks are used in place, so the records have to match the file byte
+// for byte.
+typedef char thirdspacevest_bank_header_size_check[sizeof(thirdspacevest_bank_header) == 48 ? 1 : -1];
+typedef char thirdspacevest_bank_effect_size_check[sizeof(thirdspacevest_bank_effect) == 16 ? 1 : -1];
+typedef char thirdspacevest_step_size_check[sizeof(thirdspacevest_step) == 12 ? 1 : -1];
+
+static uint32_t thirdspacevest_bank_hash(const char* name)
+{
+	uint32_t hash = 0x811C9DC5;
+	while(*name)
+	{
+		hash ^= (uint8_t)*name++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+/**
+ * Checks that a section lies inside the file and is aligned for its
+ * records.
+ */
+static int thirdspacevest_bank_section_ok(size_t file_size, uint32_t offset, uint32_t count, uint32_t record_size)
+{
+	if(offset % 4)
+	{
+		return 0;
+	}
+	return offset <= file_size && (uint64_t)count * record_size <= file_size - offset;
+}
+
+static int thirdspacevest_bank_validate(thirdspacevest_bank* bank)
+{
+	const thirdspacevest_bank_header* header = (const thirdspacevest_bank_header*)bank->_data;
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	int i, j;
+
+	// Reading the magic as a word also rules out big-endian hosts, which
+	// couldn't use the records in place.
+	if(bank->_size < sizeof(thirdspacevest_bank_header) ||
+	   *(const uint32_t*)header->magic != 0x42565354 ||
+	   header->version != THIRDSPACEVEST_BANK_VERSION ||
+	   header->file_size != bank->_size ||
+	   header->reserved)
+	{
+		return 0;
+	}
+	if(!thirdspacevest_bank_section_ok(bank->_size, header->effects_offset, header->effect_count, sizeof(thirdspacevest_bank_effect)) ||
+	   !thirdspacevest_bank_section_ok(bank->_size, header->steps_offset, header->step_count, sizeof(thirdspacevest_step)) ||
+	   !thirdspacevest_bank_section_ok(bank->_size, header->index_offset, header->index_size, sizeof(uint16_t)) ||
+	   !thirdspacevest_bank_section_ok(bank->_size, header->names_offset, header->names_size, 1))
+	{
+		return 0;
+	}
+	if(header->index_size <= header->effect_count || (header->index_size & (header->index_size - 1)))
+	{
+		return 0;
+	}
+	bank->_header = header;
+	bank->_effects = (const thirdspacevest_bank_effect*)(bank->_data + header->effects_offset);
+	bank->_steps = (const thirdspacevest_step*)(bank->_data + header->steps_offset);
+	bank->_index = (const uint16_t*)(bank->_data + header->index_offset);
+	bank->_names = (const char*)(bank->_data + header->names_offset);
+	bank->_packets = NULL;
+
+	// With the names section NUL-terminated, every name_offset inside it
+	// is a valid string.
+	if(header->names_size == 0 || bank->_names[header->names_size - 1] != 0)
+	{
+		return 0;
+	}
+	for(i = 0; i < header->effect_count; ++i)
+	{
+		const thirdspacevest_bank_effect* effect = &bank->_effects[i];
+		if(effect->name_offset >= header->names_size ||
+		   (uint64_t)effect->first_step + effect->step_count > header->step_count ||
+		   effect->step_count > THIRDSPACEVEST_MAX_STEPS ||
+		   effect->reserved)
+		{
+			return 0;
+		}
+	}
+	for(i = 0; i < (int)header->index_size; ++i)
+	{
+		if(bank->_index[i] > header->effect_count)
+		{
+			return 0;
+		}
+	}
+
+	if(header->packets_offset)
+	{
+		if(!thirdspacevest_bank_section_ok(bank->_size, header->packets_offset, THIRDSPACEVEST_BANK_PACKETS_SIZE, 1))
+		{
+			return 0;
+		}
+		// A table built with another key would make the vest ignore
+		// every packet, so check it once here rather than fail silently.
+		bank->_packets = bank->_data + header->packets_offset;
+		for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+		{
+			for(j = 0; j < 256; ++j)
+			{
+				thirdspacevest_form_packet(packet, i, j);
+				if(memcmp(packet, thirdspacevest_bank_get_packet(bank, i, j), THIRDSPACEVEST_PACKET_SIZE))
+				{
+					return 0;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+#if defined(WIN32)
+
+static int thirdspacevest_bank_map(thirdspacevest_bank* bank, const char* path)
+{
+	HANDLE file;
+	HANDLE mapping;
+	LARGE_INTEGER size;
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		return 0;
+	}
+	if(!GetFileSizeEx(file, &size) || size.QuadPart == 0 || size.QuadPart > 0xFFFFFFFF)
+	{
+		CloseHandle(file);
+		return 0;
+	}
+	mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if(!mapping)
+	{
+		return 0;
+	}
+	// The view keeps the mapping alive on its own.
+	bank->_data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	bank->_size = (size_t)size.QuadPart;
+	return bank->_data != NULL;
+}
+
+static void thirdspacevest_bank_unmap(thirdspacevest_bank* bank)
+{
+	UnmapViewOfFile((LPCVOID)bank->_data);
+}
+
+#else
+
+static int thirdspacevest_bank_map(thirdspacevest_bank* bank, const char* path)
+{
+	struct stat st;
+	void* data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		return 0;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size == 0 || (uint64_t)st.st_size > 0xFFFFFFFF)
+	{
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		return 0;
+	}
+	bank->_data = (const uint8_t*)data;
+	bank->_size = st.st_size;
+	return 1;
+}
+
+static void thirdspacevest_bank_unmap(thirdspacevest_bank* bank)
+{
+	munmap((void*)bank->_data, bank->_size);
+}
+
+#endif
+
+thirdspacevest_bank* thirdspacevest_bank_open(const char* path)
+{
+	thirdspacevest_bank* bank = (thirdspacevest_bank*)malloc(sizeof(thirdspacevest_bank));
+	if(!bank)
+	{
+		return NULL;
+	}
+	memset(bank, 0, sizeof(thirdspacevest_bank));
+	if(!thirdspacevest_bank_map(bank, path))
+	{
+		free(bank);
+		return NULL;
+	}
+	if(!thirdspacevest_bank_validate(bank))
+	{
+		thirdspacevest_bank_unmap(bank);
+		free(bank);
+		return NULL;
+	}
+	return bank;
+}
+
+void thirdspacevest_bank_close(thirdspacevest_bank* bank)
+{
+	thirdspacevest_bank_unmap(bank);
+	free(bank);
+}
+
+int thirdspacevest_bank_get_count(thirdspacevest_bank* bank)
+{
+	return bank->_header->effect_count;
+}
+
+int thirdspacevest_bank_find(thirdspacevest_bank* bank, const char* name)
+{
+	uint32_t hash = thirdspacevest_bank_hash(name);
+	uint32_t mask = bank->_header->index_size - 1;
+	uint32_t i, slot;
+
+	// index_size > effect_count, so there is always an empty bucket to
+	// end the probe on.
+	for(i = 0; i <= mask; ++i)
+	{
+		slot = bank->_index[(hash + i) & mask];
+		if(!slot)
+		{
+			break;
+		}
+		if(bank->_effects[slot - 1].name_hash == hash &&
+		   !strcmp(bank->_names + bank->_effects[slot - 1].name_offset, name))
+		{
+			return slot - 1;
+		}
+	}
+	return E_NPUTIL_INVALID_PARAM;
+}
+
+const char* thirdspacevest_bank_get_name(thirdspacevest_bank* bank, uint16_t id)
+{
+	if(id >= bank->_header->effect_count)
+	{
+		return NULL;
+	}
+	return bank->_names + bank->_effects[id].name_offset;
+}
+
+const thirdspacevest_step* thirdspacevest_bank_get_steps(thirdspacevest_bank* bank, uint16_t id, int* count)
+{
+	if(id >= bank->_header->effect_count)
+	{
+		*count = 0;
+		return NULL;
+	}
+	*count = bank->_effects[id].step_count;
+	return bank->_steps + bank->_effects[id].first_step;
+}
+
+const uint8_t* thirdspacevest_bank_get_packet(thirdspacevest_bank* bank, uint8_t index, uint8_t speed)
+{
+	if(!bank->_packets || index >= THIRDSPACEVEST_CELL_COUNT)
+	{
+		return NULL;
+	}
+	return bank->_packets + ((size_t)index * 256 + speed) * THIRDSPACEVEST_PACKET_SIZE;
+}
+
+int thirdspacevest_play_bank_effect(thirdspacevest_device* dev, thirdspacevest_bank* bank, uint16_t id)
+{
+	const thirdspacevest_step* steps;
+	int count;
+	if(!(steps = thirdspacevest_bank_get_steps(bank, id, &count)))
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	return thirdspacevest_play_effect(dev, steps, count);
+}
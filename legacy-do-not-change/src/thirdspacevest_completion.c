@@ -0,0 +1,334 @@
+/*
+ * Third Space Vest Driver - Completion queue for event loops
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <string.h>
+
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#endif
+
+// Frames move through one ring in three stages: queued by any thread
+// (_cq_done to _cq_tail), sent by the sender thread (_cq_head to
+// _cq_done), then handed back by whichever thread dispatches. The
+// notify handle stays readable while the middle stretch is non-empty,
+// so an event loop only wakes up when it has callbacks to run.
+
+#define THIRDSPACEVEST_CQ_MASK (THIRDSPACEVEST_COMPLETION_QUEUE_SIZE - 1)
+
+void thirdspacevest_init_completion_state(thirdspacevest_device* dev)
+{
+	dev->_cq_head = 0;
+	dev->_cq_done = 0;
+	dev->_cq_tail = 0;
+	dev->_cq_running = 0;
+#if defined(WIN32)
+	dev->_cq_notify = NULL;
+#else
+	dev->_cq_notify[0] = -1;
+	dev->_cq_notify[1] = -1;
+#endif
+	thirdspacevest_mutex_init(&dev->_cq_lock);
+}
+
+#if defined(WIN32)
+
+static int thirdspacevest_notify_open(thirdspacevest_device* dev)
+{
+	dev->_cq_notify = CreateEvent(NULL, TRUE, FALSE, NULL);
+	return dev->_cq_notify ? 0 : E_NPUTIL_DRIVER_ERROR;
+}
+
+static void thirdspacevest_notify_close(thirdspacevest_device* dev)
+{
+	CloseHandle(dev->_cq_notify);
+	dev->_cq_notify = NULL;
+}
+
+static void thirdspacevest_notify_set(thirdspacevest_device* dev)
+{
+	SetEvent(dev->_cq_notify);
+}
+
+static void thirdspacevest_notify_clear(thirdspacevest_device* dev)
+{
+	ResetEvent(dev->_cq_notify);
+}
+
+HANDLE thirdspacevest_get_completion_handle(thirdspacevest_device* dev)
+{
+	return thirdspacevest_atomic_load(&dev->_cq_running) ? dev->_cq_notify : NULL;
+}
+
+#else
+
+static int thirdspacevest_notify_open(thirdspacevest_device* dev)
+{
+#if defined(__linux__)
+	dev->_cq_notify[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	dev->_cq_notify[1] = -1;
+	return dev->_cq_notify[0] >= 0 ? 0 : E_NPUTIL_DRIVER_ERROR;
+#else
+	int i;
+	if(pipe(dev->_cq_notify) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	for(i = 0; i < 2; ++i)
+	{
+		fcntl(dev->_cq_notify[i], F_SETFL, fcntl(dev->_cq_notify[i], F_GETFL) | O_NONBLOCK);
+		fcntl(dev->_cq_notify[i], F_SETFD, FD_CLOEXEC);
+	}
+	return 0;
+#endif
+}
+
+static void thirdspacevest_notify_close(thirdspacevest_device* dev)
+{
+	int i;
+	for(i = 0; i < 2; ++i)
+	{
+		if(dev->_cq_notify[i] >= 0)
+		{
+			close(dev->_cq_notify[i]);
+			dev->_cq_notify[i] = -1;
+		}
+	}
+}
+
+static void thirdspacevest_notify_set(thirdspacevest_device* dev)
+{
+	// A full pipe or a saturated counter is still readable, so failed
+	// writes can be ignored.
+#if defined(__linux__)
+	uint64_t one = 1;
+	ssize_t ret = write(dev->_cq_notify[0], &one, sizeof(one));
+#else
+	uint8_t one = 1;
+	ssize_t ret = write(dev->_cq_notify[1], &one, sizeof(one));
+#endif
+	(void)ret;
+}
+
+static void thirdspacevest_notify_clear(thirdspacevest_device* dev)
+{
+	uint8_t buffer[64];
+	while(read(dev->_cq_notify[0], buffer, sizeof(buffer)) > 0)
+	{
+	}
+}
+
+int thirdspacevest_get_completion_fd(thirdspacevest_device* dev)
+{
+	return thirdspacevest_atomic_load(&dev->_cq_running) ? dev->_cq_notify[0] : E_NPUTIL_NOT_OPENED;
+}
+
+#endif
+
+/**
+ * Hands back sent frames nobody wants a callback for, so callers that
+ * never dispatch don't fill the queue. Called with _cq_lock held.
+ */
+static void thirdspacevest_retire_silent(thirdspacevest_device* dev)
+{
+	while(dev->_cq_head != dev->_cq_done && !dev->_cq[dev->_cq_head & THIRDSPACEVEST_CQ_MASK]._callback)
+	{
+		thirdspacevest_atomic_store(&dev->_cq_head, dev->_cq_head + 1);
+	}
+}
+
+THIRDSPACEVEST_THREAD_FUNC(thirdspacevest_completion_main, arg)
+{
+	thirdspacevest_device* dev = (thirdspacevest_device*)arg;
+	thirdspacevest_completion frame;
+	uint32_t pos;
+	int status, notify;
+
+	for(;;)
+	{
+		thirdspacevest_mutex_lock(&dev->_cq_lock);
+		if(dev->_cq_done == dev->_cq_tail)
+		{
+			thirdspacevest_mutex_unlock(&dev->_cq_lock);
+			if(!thirdspacevest_atomic_load(&dev->_cq_running))
+			{
+				break;
+			}
+			// Hotplug events are ours to deliver unless the I/O thread
+			// owns the transfers, see thirdspacevest_update_devices.
+			if(!thirdspacevest_atomic_load(&dev->_io_running))
+			{
+				thirdspacevest_handle_events(dev, 0);
+			}
+			thirdspacevest_event_wait(&dev->_cq_wakeup, 100);
+			continue;
+		}
+		pos = dev->_cq_done;
+		frame = dev->_cq[pos & THIRDSPACEVEST_CQ_MASK];
+		thirdspacevest_mutex_unlock(&dev->_cq_lock);
+
+		// Same path a blocking caller takes, so the I/O thread, ack
+		// modes and unchanged cell skipping all still apply.
+		if(thirdspacevest_atomic_load(&dev->_io_running))
+		{
+			status = thirdspacevest_submit_frame(dev, frame._speeds, frame._mask);
+		}
+		else
+		{
+			status = thirdspacevest_send_cells(dev, frame._speeds,
+											   frame._force ? frame._mask : thirdspacevest_changed_cells(dev, frame._speeds, frame._mask));
+		}
+
+		thirdspacevest_mutex_lock(&dev->_cq_lock);
+		dev->_cq[pos & THIRDSPACEVEST_CQ_MASK]._status = status;
+		dev->_cq_done = pos + 1;
+		notify = frame._callback != NULL;
+		thirdspacevest_retire_silent(dev);
+		thirdspacevest_mutex_unlock(&dev->_cq_lock);
+		if(notify)
+		{
+			thirdspacevest_notify_set(dev);
+		}
+	}
+	THIRDSPACEVEST_THREAD_RETURN;
+}
+
+int thirdspacevest_start_completions(thirdspacevest_device* dev)
+{
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	if(thirdspacevest_shares_events(dev))
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(thirdspacevest_atomic_load(&dev->_cq_running))
+	{
+		return 0;
+	}
+	if(thirdspacevest_notify_open(dev) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	if(thirdspacevest_event_init(&dev->_cq_wakeup) < 0)
+	{
+		thirdspacevest_notify_close(dev);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	dev->_cq_head = 0;
+	dev->_cq_done = 0;
+	dev->_cq_tail = 0;
+	thirdspacevest_atomic_store(&dev->_cq_running, 1);
+	if(thirdspacevest_thread_start(&dev->_cq_thread, thirdspacevest_completion_main, dev) < 0)
+	{
+		thirdspacevest_atomic_store(&dev->_cq_running, 0);
+		thirdspacevest_event_destroy(&dev->_cq_wakeup);
+		thirdspacevest_notify_close(dev);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return 0;
+}
+
+int thirdspacevest_stop_completions(thirdspacevest_device* dev)
+{
+	if(!thirdspacevest_atomic_load(&dev->_cq_running))
+	{
+		return 0;
+	}
+	thirdspacevest_atomic_store(&dev->_cq_running, 0);
+	thirdspacevest_event_signal(&dev->_cq_wakeup);
+	thirdspacevest_thread_join(&dev->_cq_thread);
+	thirdspacevest_dispatch_completions(dev);
+	thirdspacevest_event_destroy(&dev->_cq_wakeup);
+	thirdspacevest_notify_close(dev);
+	return 0;
+}
+
+int thirdspacevest_queue_frame(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask, uint8_t force, thirdspacevest_async_cb callback, void* user_data)
+{
+	thirdspacevest_completion* frame;
+	if(!thirdspacevest_atomic_load(&dev->_cq_running))
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	thirdspacevest_mutex_lock(&dev->_cq_lock);
+	if(dev->_cq_tail - dev->_cq_head >= THIRDSPACEVEST_COMPLETION_QUEUE_SIZE)
+	{
+		thirdspacevest_mutex_unlock(&dev->_cq_lock);
+		thirdspacevest_check_saturation(dev, 1);
+		return E_NPUTIL_BUSY;
+	}
+	frame = &dev->_cq[dev->_cq_tail & THIRDSPACEVEST_CQ_MASK];
+	memcpy(frame->_speeds, speeds, THIRDSPACEVEST_CELL_COUNT);
+	frame->_mask = mask;
+	frame->_force = force;
+	frame->_callback = callback;
+	frame->_user_data = user_data;
+	frame->_status = 0;
+	thirdspacevest_atomic_store(&dev->_cq_tail, dev->_cq_tail + 1);
+	thirdspacevest_mutex_unlock(&dev->_cq_lock);
+	thirdspacevest_event_signal(&dev->_cq_wakeup);
+	return 0;
+}
+
+int thirdspacevest_send_frame_async(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask, thirdspacevest_async_cb callback, void* user_data)
+{
+	uint64_t start;
+	int ret;
+	if(!thirdspacevest_tracing(dev))
+	{
+		return thirdspacevest_queue_frame(dev, speeds, mask, 0, callback, user_data);
+	}
+	start = thirdspacevest_time_us();
+	ret = thirdspacevest_queue_frame(dev, speeds, mask, 0, callback, user_data);
+	thirdspacevest_trace_call(dev, THIRDSPACEVEST_TRACE_FRAME_ASYNC, mask, 0, speeds, start, ret);
+	return ret;
+}
+
+int thirdspacevest_dispatch_completions(thirdspacevest_device* dev)
+{
+	thirdspacevest_completion frame;
+	int count = 0;
+
+	if(!thirdspacevest_atomic_load(&dev->_cq_running) && dev->_cq_head == dev->_cq_done)
+	{
+		return 0;
+	}
+	// Clear first: a frame finishing from here on sets it again, so a
+	// wakeup is never lost between the clear and the last pop.
+	thirdspacevest_notify_clear(dev);
+	for(;;)
+	{
+		thirdspacevest_mutex_lock(&dev->_cq_lock);
+		if(dev->_cq_head == dev->_cq_done)
+		{
+			thirdspacevest_mutex_unlock(&dev->_cq_lock);
+			break;
+		}
+		frame = dev->_cq[dev->_cq_head & THIRDSPACEVEST_CQ_MASK];
+		thirdspacevest_atomic_store(&dev->_cq_head, dev->_cq_head + 1);
+		thirdspacevest_mutex_unlock(&dev->_cq_lock);
+		// Run outside the lock, callbacks usually queue the next frame.
+		if(frame._callback)
+		{
+			frame._callback(dev, frame._status, frame._user_data);
+			++count;
+		}
+	}
+	return count;
+}
@@ -0,0 +1,264 @@
+/*
+ * Third Space Vest Driver - Streaming telemetry stage
+ *
+ * Envelope followers run over 4 channels at a time, one channel per
+ * SIMD lane, the same way the batch TEA spreads blocks over lanes.
+ * Channels left over after the last full group go through the scalar
+ * version of the same follower.
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// SSE and NEON are part of the base instruction set on x86-64 and
+// AArch64, so unlike the AVX2 cipher there is nothing to detect at
+// runtime.
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define THIRDSPACEVEST_DSP_SSE
+#include <xmmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64) || defined(__ARM_NEON)
+#define THIRDSPACEVEST_DSP_NEON
+#include <arm_neon.h>
+#endif
+
+/**
+ * Per sample step for a time constant. A one pole follower's exact
+ * coefficient is 1 - e^(-1 / samples). This approximation avoids libm,
+ * is 1 for a zero time constant like the exact one, and is within 5%
+ * once the time constant spans 10 samples.
+ */
+static float thirdspacevest_dsp_coefficient(float ms, float sample_rate_hz)
+{
+	return 1.0f / (1.0f + ms * sample_rate_hz * 0.001f);
+}
+
+static float thirdspacevest_dsp_abs(float value)
+{
+	return value < 0 ? -value : value;
+}
+
+/**
+ * One lane of the envelope follower. The envelope moves toward the
+ * input, at the attack rate while the input's magnitude is above it
+ * and the release rate otherwise.
+ */
+static void thirdspacevest_dsp_follow_scalar(thirdspacevest_dsp* dsp, int lane, const float* block, int frames)
+{
+	const int stride = dsp->_channel_count;
+	float env = dsp->_envelope[lane];
+	float target;
+	int i;
+	for(i = 0; i < frames; ++i)
+	{
+		target = block[i * stride + lane];
+		if(dsp->_rectify[lane] != 0)
+		{
+			target = thirdspacevest_dsp_abs(target);
+		}
+		env += (thirdspacevest_dsp_abs(target) > thirdspacevest_dsp_abs(env) ? dsp->_attack[lane] : dsp->_release[lane]) * (target - env);
+	}
+	dsp->_envelope[lane] = env;
+}
+
+#if defined(THIRDSPACEVEST_DSP_SSE)
+
+static void thirdspacevest_dsp_follow_group(thirdspacevest_dsp* dsp, int lane, const float* block, int frames)
+{
+	const int stride = dsp->_channel_count;
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 attack = _mm_loadu_ps(dsp->_attack + lane);
+	const __m128 release = _mm_loadu_ps(dsp->_release + lane);
+	// Sign bit in the lanes that are rectified, so andnot clears it
+	const __m128 rectify = _mm_and_ps(sign, _mm_cmpneq_ps(_mm_loadu_ps(dsp->_rectify + lane), _mm_setzero_ps()));
+	__m128 env = _mm_loadu_ps(dsp->_envelope + lane);
+	__m128 target, rising, step;
+	int i;
+	for(i = 0; i < frames; ++i)
+	{
+		target = _mm_andnot_ps(rectify, _mm_loadu_ps(block + i * stride + lane));
+		rising = _mm_cmpgt_ps(_mm_andnot_ps(sign, target), _mm_andnot_ps(sign, env));
+		step = _mm_or_ps(_mm_and_ps(rising, attack), _mm_andnot_ps(rising, release));
+		env = _mm_add_ps(env, _mm_mul_ps(step, _mm_sub_ps(target, env)));
+	}
+	_mm_storeu_ps(dsp->_envelope + lane, env);
+}
+
+#elif defined(THIRDSPACEVEST_DSP_NEON)
+
+static void thirdspacevest_dsp_follow_group(thirdspacevest_dsp* dsp, int lane, const float* block, int frames)
+{
+	const int stride = dsp->_channel_count;
+	const float32x4_t attack = vld1q_f32(dsp->_attack + lane);
+	const float32x4_t release = vld1q_f32(dsp->_release + lane);
+	const uint32x4_t rectify = vmvnq_u32(vceqq_f32(vld1q_f32(dsp->_rectify + lane), vdupq_n_f32(0)));
+	float32x4_t env = vld1q_f32(dsp->_envelope + lane);
+	float32x4_t target;
+	uint32x4_t rising;
+	int i;
+	for(i = 0; i < frames; ++i)
+	{
+		target = vld1q_f32(block + i * stride + lane);
+		target = vbslq_f32(rectify, vabsq_f32(target), target);
+		rising = vcgtq_f32(vabsq_f32(target), vabsq_f32(env));
+		env = vmlaq_f32(env, vbslq_f32(rising, attack, release), vsubq_f32(target, env));
+	}
+	vst1q_f32(dsp->_envelope + lane, env);
+}
+
+#endif
+
+thirdspacevest_dsp* thirdspacevest_dsp_create(float sample_rate_hz)
+{
+	thirdspacevest_dsp* dsp;
+	if(!(sample_rate_hz > 0))
+	{
+		return NULL;
+	}
+	dsp = (thirdspacevest_dsp*)malloc(sizeof(thirdspacevest_dsp));
+	if(!dsp)
+	{
+		return NULL;
+	}
+	memset(dsp, 0, sizeof(thirdspacevest_dsp));
+	dsp->_sample_rate_hz = sample_rate_hz;
+	dsp->_hysteresis = 1;
+	return dsp;
+}
+
+void thirdspacevest_dsp_delete(thirdspacevest_dsp* dsp)
+{
+	free(dsp);
+}
+
+int thirdspacevest_dsp_add_channel(thirdspacevest_dsp* dsp, const thirdspacevest_dsp_channel* channel)
+{
+	int lane = dsp->_channel_count;
+	if(!(channel->full_scale > 0) || !(channel->threshold >= 0) ||
+	   !(channel->attack_ms >= 0) || !(channel->release_ms >= 0) || channel->reserved)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(lane >= THIRDSPACEVEST_DSP_MAX_CHANNELS)
+	{
+		return E_NPUTIL_BUSY;
+	}
+	dsp->_channels[lane] = *channel;
+	dsp->_envelope[lane] = 0;
+	dsp->_attack[lane] = thirdspacevest_dsp_coefficient(channel->attack_ms, dsp->_sample_rate_hz);
+	dsp->_release[lane] = thirdspacevest_dsp_coefficient(channel->release_ms, dsp->_sample_rate_hz);
+	dsp->_rectify[lane] = channel->negative_mask ? 0.0f : 1.0f;
+	dsp->_channel_count = lane + 1;
+	return lane;
+}
+
+int thirdspacevest_dsp_set_limits(thirdspacevest_dsp* dsp, uint8_t hysteresis, uint32_t min_interval_us)
+{
+	if(!hysteresis)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	dsp->_hysteresis = hysteresis;
+	dsp->_min_interval_us = min_interval_us;
+	return 0;
+}
+
+int thirdspacevest_dsp_process(thirdspacevest_dsp* dsp, const float* block, int frames)
+{
+	int lane = 0;
+	if(frames < 0 || (frames && !block))
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(!frames || !dsp->_channel_count)
+	{
+		return 0;
+	}
+#if defined(THIRDSPACEVEST_DSP_SSE) || defined(THIRDSPACEVEST_DSP_NEON)
+	for(; lane + 4 <= dsp->_channel_count; lane += 4)
+	{
+		thirdspacevest_dsp_follow_group(dsp, lane, block, frames);
+	}
+#endif
+	for(; lane < dsp->_channel_count; ++lane)
+	{
+		thirdspacevest_dsp_follow_scalar(dsp, lane, block, frames);
+	}
+	return 0;
+}
+
+int thirdspacevest_dsp_render(thirdspacevest_dsp* dsp, uint64_t now_us, uint8_t speeds[THIRDSPACEVEST_CELL_COUNT])
+{
+	uint8_t target[THIRDSPACEVEST_CELL_COUNT];
+	uint8_t changed = 0, mask, speed;
+	float level;
+	int i, cell, diff;
+
+	memset(target, 0, sizeof(target));
+	for(i = 0; i < dsp->_channel_count; ++i)
+	{
+		const thirdspacevest_dsp_channel* channel = &dsp->_channels[i];
+		const float env = dsp->_envelope[i];
+		// One NaN sample would otherwise keep the envelope NaN for good.
+		if(env != env)
+		{
+			dsp->_envelope[i] = 0;
+			continue;
+		}
+		level = thirdspacevest_dsp_abs(env) / channel->full_scale;
+		if(level < channel->threshold || level <= 0)
+		{
+			continue;
+		}
+		speed = level >= 1 ? channel->max_speed : (uint8_t)(level * channel->max_speed + 0.5f);
+		mask = env < 0 && channel->negative_mask ? channel->negative_mask : channel->cell_mask;
+		for(cell = 0; cell < THIRDSPACEVEST_CELL_COUNT; ++cell)
+		{
+			if((mask & (1 << cell)) && speed > target[cell])
+			{
+				target[cell] = speed;
+			}
+		}
+	}
+
+	for(cell = 0; cell < THIRDSPACEVEST_CELL_COUNT; ++cell)
+	{
+		diff = target[cell] - dsp->_speeds[cell];
+		if(!diff || (target[cell] && (diff < 0 ? -diff : diff) < dsp->_hysteresis))
+		{
+			continue;
+		}
+		if((dsp->_reported & (1 << cell)) && now_us - dsp->_changed_us[cell] < dsp->_min_interval_us)
+		{
+			continue;
+		}
+		dsp->_speeds[cell] = target[cell];
+		dsp->_changed_us[cell] = now_us;
+		dsp->_reported |= 1 << cell;
+		changed |= 1 << cell;
+	}
+	memcpy(speeds, dsp->_speeds, THIRDSPACEVEST_CELL_COUNT);
+	return changed;
+}
+
+int thirdspacevest_dsp_tick(thirdspacevest_dsp* dsp, thirdspacevest_device* dev, int layer)
+{
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	int changed = thirdspacevest_dsp_render(dsp, thirdspacevest_time_us(), speeds);
+	int ret;
+	if(!changed)
+	{
+		return 0;
+	}
+	ret = thirdspacevest_mixer_set_layer(dev, layer, speeds, (uint8_t)changed);
+	return ret < 0 ? ret : changed;
+}
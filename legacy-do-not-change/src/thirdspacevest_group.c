@@ -0,0 +1,219 @@
+/*
+ * Third Space Vest Driver - Device groups
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <string.h>
+
+/// One vest being opened by thirdspacevest_group_open
+typedef struct {
+	thirdspacevest_group* _group;
+	/// Device to open, created by the opener if NULL
+	thirdspacevest_device* _dev;
+	unsigned int _index;
+	thirdspacevest_thread _thread;
+	/// Nonzero if _thread has to be joined
+	int _started;
+} thirdspacevest_group_opener;
+
+/**
+ * Opens and claims one vest. Leaves op->_dev NULL if that failed.
+ */
+static void thirdspacevest_group_open_one(thirdspacevest_group_opener* op)
+{
+	if(!op->_dev)
+	{
+		op->_dev = thirdspacevest_create_in_group(op->_group);
+		if(!op->_dev)
+		{
+			return;
+		}
+	}
+	if(thirdspacevest_open(op->_dev, op->_index) < 0)
+	{
+		if(op->_dev->_is_open)
+		{
+			thirdspacevest_close(op->_dev);
+		}
+		thirdspacevest_delete(op->_dev);
+		op->_dev = NULL;
+	}
+}
+
+THIRDSPACEVEST_THREAD_FUNC(thirdspacevest_group_open_thread, arg)
+{
+	thirdspacevest_group_open_one((thirdspacevest_group_opener*)arg);
+	THIRDSPACEVEST_THREAD_RETURN;
+}
+
+int thirdspacevest_group_open(thirdspacevest_group* group)
+{
+	thirdspacevest_group_opener openers[THIRDSPACEVEST_GROUP_MAX];
+	thirdspacevest_device* dev;
+	int count, ret, i;
+
+	ret = thirdspacevest_group_init(group);
+	if(ret < 0)
+	{
+		return ret;
+	}
+	dev = thirdspacevest_create_in_group(group);
+	if(!dev)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	count = thirdspacevest_get_count(dev);
+	if(count < 0)
+	{
+		thirdspacevest_delete(dev);
+		return count;
+	}
+	if(count > THIRDSPACEVEST_GROUP_MAX - group->_count)
+	{
+		count = THIRDSPACEVEST_GROUP_MAX - group->_count;
+	}
+	if(count <= 0)
+	{
+		thirdspacevest_delete(dev);
+		return group->_count;
+	}
+
+	// Opening a vest is mostly waiting on the kernel and on control
+	// transfers (descriptor reads, driver detach, claim), so every vest
+	// after the first gets its own thread and they wait concurrently.
+	// The first one goes on this thread with the device that counted.
+	memset(openers, 0, sizeof(openers));
+	for(i = 0; i < count; ++i)
+	{
+		openers[i]._group = group;
+		openers[i]._index = (unsigned int)i;
+	}
+	openers[0]._dev = dev;
+	for(i = 1; i < count; ++i)
+	{
+		openers[i]._started = thirdspacevest_thread_start(&openers[i]._thread, thirdspacevest_group_open_thread, &openers[i]) >= 0;
+	}
+	thirdspacevest_group_open_one(&openers[0]);
+	for(i = 1; i < count; ++i)
+	{
+		if(openers[i]._started)
+		{
+			thirdspacevest_thread_join(&openers[i]._thread);
+		}
+		else
+		{
+			thirdspacevest_group_open_one(&openers[i]);
+		}
+	}
+
+	// Keep bus order, whichever thread finished first
+	for(i = 0; i < count; ++i)
+	{
+		if(openers[i]._dev)
+		{
+			group->_devices[group->_count++] = openers[i]._dev;
+		}
+	}
+	return group->_count;
+}
+
+int thirdspacevest_group_start(thirdspacevest_group* group)
+{
+	uint8_t zeros[THIRDSPACEVEST_CELL_COUNT];
+	int count, ret;
+
+	count = thirdspacevest_group_open(group);
+	if(count <= 0)
+	{
+		return count;
+	}
+	// Every cell on every vest in one batch. This also leaves each
+	// device knowing its cell state, so the first real frame only
+	// sends the cells it changes.
+	memset(zeros, 0, sizeof(zeros));
+	ret = thirdspacevest_group_send_frame(group, zeros, THIRDSPACEVEST_ALL_CELLS, ~0u);
+	return ret < 0 ? ret : count;
+}
+
+thirdspacevest_device* thirdspacevest_group_get_device(thirdspacevest_group* group, int index)
+{
+	if(index < 0 || index >= group->_count)
+	{
+		return NULL;
+	}
+	return group->_devices[index];
+}
+
+int thirdspacevest_group_send_frame(thirdspacevest_group* group, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask, uint32_t device_mask)
+{
+	thirdspacevest_device* dev;
+	uint8_t changed;
+	uint8_t i;
+	int d, ret;
+	int sent = 0;
+	int status = 0;
+	// Vests whose own thread sends, they don't get waited on below
+	uint32_t queued = 0;
+
+	// Queue every packet for every vest first...
+	for(d = 0; d < group->_count; ++d)
+	{
+		if(!(device_mask & (1u << d)))
+		{
+			continue;
+		}
+		dev = group->_devices[d];
+		if(thirdspacevest_thread_owns_io(dev))
+		{
+			queued |= 1u << d;
+			ret = thirdspacevest_send_frame(dev, speeds, mask);
+			if(ret < 0 && status == 0)
+			{
+				status = ret;
+			}
+			continue;
+		}
+		changed = thirdspacevest_changed_cells(dev, speeds, mask);
+		for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+		{
+			if(!(changed & (1 << i)))
+			{
+				continue;
+			}
+			if((ret = thirdspacevest_submit_cell(dev, i, speeds[i])) < 0)
+			{
+				if(status == 0)
+				{
+					status = ret;
+				}
+				break;
+			}
+			++sent;
+		}
+	}
+
+	// ...then collect the status reads. All transfers are already in
+	// flight, so waiting on one vest doesn't hold back the others.
+	for(d = 0; d < group->_count; ++d)
+	{
+		if(!(device_mask & (1u << d)) || (queued & (1u << d)))
+		{
+			continue;
+		}
+		ret = thirdspacevest_wait_cells(group->_devices[d]);
+		if(ret < 0 && status == 0)
+		{
+			status = ret;
+		}
+	}
+	return status < 0 ? status : sent;
+}
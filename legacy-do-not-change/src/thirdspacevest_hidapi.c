@@ -0,0 +1,152 @@
+/*
+ * Third Space Vest Driver - hidapi transport
+ *
+ * Only built into the library with WITH_HIDAPI, otherwise
+ * thirdspacevest_create_hidapi always returns NULL.
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+
+#if defined(THIRDSPACEVEST_HAVE_HIDAPI)
+
+#include <hidapi.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Number of hidapi devices alive, hid_exit runs when it drops to 0
+static volatile uint32_t thirdspacevest_hidapi_users = 0;
+
+static hid_device* thirdspacevest_hidapi_handle(thirdspacevest_device* dev)
+{
+	return (hid_device*)dev->_transport_data;
+}
+
+static int thirdspacevest_hidapi_get_count(thirdspacevest_device* dev)
+{
+	struct hid_device_info* devs = hid_enumerate(THIRDSPACEVEST_VID, THIRDSPACEVEST_PID);
+	struct hid_device_info* cur;
+	int count = 0;
+	for(cur = devs; cur; cur = cur->next)
+	{
+		++count;
+	}
+	hid_free_enumeration(devs);
+	return count;
+}
+
+static int thirdspacevest_hidapi_open(thirdspacevest_device* dev, uint32_t device_index)
+{
+	struct hid_device_info* devs = hid_enumerate(THIRDSPACEVEST_VID, THIRDSPACEVEST_PID);
+	struct hid_device_info* cur = devs;
+	hid_device* handle = NULL;
+	uint32_t i;
+
+	for(i = 0; cur && i < device_index; ++i)
+	{
+		cur = cur->next;
+	}
+	if(cur)
+	{
+		handle = hid_open_path(cur->path);
+	}
+	hid_free_enumeration(devs);
+	if(!handle)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	dev->_transport_data = handle;
+	dev->_pending = 0;
+	dev->_is_open = 1;
+	return 0;
+}
+
+static int thirdspacevest_hidapi_close(thirdspacevest_device* dev)
+{
+	hid_close(thirdspacevest_hidapi_handle(dev));
+	dev->_transport_data = NULL;
+	dev->_is_open = 0;
+	return 0;
+}
+
+static int thirdspacevest_hidapi_write(thirdspacevest_device* dev, uint8_t* output_report)
+{
+	// Report ID 0 first, hidapi pads out to the report length.
+	uint8_t report[THIRDSPACEVEST_PACKET_SIZE + 1];
+	report[0] = 0;
+	memcpy(report + 1, output_report, THIRDSPACEVEST_PACKET_SIZE);
+	if(hid_write(thirdspacevest_hidapi_handle(dev), report, sizeof(report)) < 0)
+	{
+		thirdspacevest_count_error(dev, 0);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return THIRDSPACEVEST_PACKET_SIZE;
+}
+
+static int thirdspacevest_hidapi_read(thirdspacevest_device* dev, uint8_t* input_report)
+{
+	int ret = hid_read_timeout(thirdspacevest_hidapi_handle(dev), input_report, THIRDSPACEVEST_PACKET_SIZE, (int)thirdspacevest_usb_timeout(dev));
+	if(ret <= 0)
+	{
+		// hid_read_timeout returns 0 when nothing arrived in time
+		thirdspacevest_count_error(dev, ret == 0);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return ret;
+}
+
+static void thirdspacevest_hidapi_destroy(thirdspacevest_device* dev)
+{
+	if(thirdspacevest_atomic_fetch_add(&thirdspacevest_hidapi_users, -1) == 1)
+	{
+		hid_exit();
+	}
+}
+
+// hidapi has no async API, so queued packets go out through write/read
+// from thirdspacevest_handle_events.
+static const thirdspacevest_transport thirdspacevest_hidapi_transport = {
+	"hidapi",
+	thirdspacevest_hidapi_get_count,
+	thirdspacevest_hidapi_open,
+	thirdspacevest_hidapi_close,
+	thirdspacevest_hidapi_write,
+	thirdspacevest_hidapi_read,
+	NULL,
+	NULL,
+	thirdspacevest_hidapi_destroy,
+	NULL
+};
+
+thirdspacevest_device* thirdspacevest_create_hidapi()
+{
+	thirdspacevest_device* dev;
+	if(hid_init() < 0)
+	{
+		return NULL;
+	}
+	thirdspacevest_atomic_fetch_add(&thirdspacevest_hidapi_users, 1);
+	dev = thirdspacevest_create_with_transport(&thirdspacevest_hidapi_transport, NULL);
+	if(!dev && thirdspacevest_atomic_fetch_add(&thirdspacevest_hidapi_users, -1) == 1)
+	{
+		hid_exit();
+	}
+	return dev;
+}
+
+#else
+
+thirdspacevest_device* thirdspacevest_create_hidapi()
+{
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ * Third Space Vest Driver - Internal declarations shared between the
+ * platform independent code and the platform backends
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#ifndef LIBTHIRDSPACEVEST_INTERNAL_H
+#define LIBTHIRDSPACEVEST_INTERNAL_H
+
+#include "thirdspacevest/thirdspacevest.h"
+
+/// Longest timeout for a single USB transfer, in milliseconds, and the
+/// one used until round trips have been measured
+#define THIRDSPACEVEST_USB_TIMEOUT 100
+/// Shortest adaptive timeout, in milliseconds
+#define THIRDSPACEVEST_USB_MIN_TIMEOUT 10
+
+/*******************************************************************************
+ *
+ * Atomics
+ *
+ ******************************************************************************/
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define thirdspacevest_atomic_load(ptr) ((uint32_t)InterlockedCompareExchange((volatile LONG*)(ptr), 0, 0))
+#define thirdspacevest_atomic_store(ptr, val) ((void)InterlockedExchange((volatile LONG*)(ptr), (LONG)(val)))
+#define thirdspacevest_atomic_exchange(ptr, val) ((uint32_t)InterlockedExchange((volatile LONG*)(ptr), (LONG)(val)))
+#define thirdspacevest_atomic_cas(ptr, expected, desired) \
+	((uint32_t)InterlockedCompareExchange((volatile LONG*)(ptr), (LONG)(desired), (LONG)(expected)) == (uint32_t)(expected))
+#define thirdspacevest_atomic_fetch_add(ptr, val) ((uint32_t)InterlockedExchangeAdd((volatile LONG*)(ptr), (LONG)(val)))
+#define thirdspacevest_atomic_fence() MemoryBarrier()
+#else
+#define thirdspacevest_atomic_load(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define thirdspacevest_atomic_store(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define thirdspacevest_atomic_exchange(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_ACQ_REL)
+#define thirdspacevest_atomic_cas(ptr, expected, desired) \
+	__sync_bool_compare_and_swap((ptr), (expected), (desired))
+#define thirdspacevest_atomic_fetch_add(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_ACQ_REL)
+#define thirdspacevest_atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/*******************************************************************************
+ *
+ * Threads
+ *
+ ******************************************************************************/
+
+#if defined(WIN32)
+#define THIRDSPACEVEST_THREAD_FUNC(name, arg) static DWORD WINAPI name(LPVOID arg)
+#define THIRDSPACEVEST_THREAD_RETURN return 0
+typedef LPTHREAD_START_ROUTINE thirdspacevest_thread_func;
+#else
+#define THIRDSPACEVEST_THREAD_FUNC(name, arg) static void* name(void* arg)
+#define THIRDSPACEVEST_THREAD_RETURN return NULL
+typedef void* (*thirdspacevest_thread_func)(void*);
+#endif
+
+int thirdspacevest_thread_start(thirdspacevest_thread* thread, thirdspacevest_thread_func func, void* arg);
+void thirdspacevest_thread_join(thirdspacevest_thread* thread);
+
+int thirdspacevest_mutex_init(thirdspacevest_mutex* mutex);
+void thirdspacevest_mutex_destroy(thirdspacevest_mutex* mutex);
+void thirdspacevest_mutex_lock(thirdspacevest_mutex* mutex);
+void thirdspacevest_mutex_unlock(thirdspacevest_mutex* mutex);
+
+int thirdspacevest_event_init(thirdspacevest_event* event);
+void thirdspacevest_event_destroy(thirdspacevest_event* event);
+void thirdspacevest_event_signal(thirdspacevest_event* event);
+/// Returns 0 if signaled, > 0 if the timeout ran out
+int thirdspacevest_event_wait(thirdspacevest_event* event, int timeout_ms);
+
+/// Monotonic clock in microseconds, with an arbitrary epoch
+uint64_t thirdspacevest_time_us();
+/// Gives up the rest of the current time slice
+void thirdspacevest_thread_yield();
+
+/// thirdspacevest_once_begin states after 0, which is not built yet
+#define THIRDSPACEVEST_ONCE_BUILDING 1
+#define THIRDSPACEVEST_ONCE_DONE 2
+
+/**
+ * Guards a one-time initialization, such as a table shared by every
+ * device. Returns nonzero to exactly one caller, which builds and then
+ * calls thirdspacevest_once_end. Everyone else waits for that and gets
+ * 0, after which everything written before thirdspacevest_once_end is
+ * visible to them.
+ *
+ * @param once Zero-initialized state, one per thing being built
+ */
+int thirdspacevest_once_begin(volatile uint32_t* once);
+/// Publishes what the caller of thirdspacevest_once_begin built
+void thirdspacevest_once_end(volatile uint32_t* once);
+/// Nonzero once thirdspacevest_once_end has run, for hot path checks
+#define thirdspacevest_once_done(once) (thirdspacevest_atomic_load(once) == THIRDSPACEVEST_ONCE_DONE)
+
+/*******************************************************************************
+ *
+ * Device helpers
+ *
+ ******************************************************************************/
+
+/**
+ * Creates a device that uses the group's USB context instead of its own,
+ * NULL until thirdspacevest_group_init has run. Implemented by the
+ * backend.
+ */
+thirdspacevest_device* thirdspacevest_create_in_group(thirdspacevest_group* group);
+
+/**
+ * Sets up whatever the group's devices share, the first time it's
+ * needed. Implemented by the backend.
+ *
+ * @return 0 if ok, otherwise < 0
+ */
+int thirdspacevest_group_init(thirdspacevest_group* group);
+
+/**
+ * TEA over the 8 bytes at v, in place. Used for the packet payload.
+ */
+void thirdspacevest_encrypt(uint32_t* v, uint32_t* k);
+void thirdspacevest_decrypt(uint32_t* v, uint32_t* k);
+
+/**
+ * Picks the cache key index for THIRDSPACEVEST_KEY_FIXED and loads the
+ * matching key words.
+ */
+void thirdspacevest_form_cache_key(uint8_t* cache_key_index, uint32_t* key_store);
+
+/**
+ * Builds and encrypts a packet from scratch with the fixed key,
+ * bypassing the packet cache. thirdspacevest_form_packet is the one to
+ * call.
+ */
+void thirdspacevest_encode_packet(uint8_t* packet, uint8_t index, uint8_t speed);
+
+/**
+ * Builds the packet for a send on dev, from the cache or with a fresh
+ * key depending on its key mode, and times it into the encrypt
+ * histogram.
+ */
+void thirdspacevest_form_device_packet(thirdspacevest_device* dev, uint8_t* packet, uint8_t index, uint8_t speed);
+
+/**
+ * Fills the process wide (cell, speed) packet table if it hasn't been
+ * built yet. Called from thirdspacevest_create, and lazily from
+ * thirdspacevest_form_packet.
+ */
+void thirdspacevest_build_packet_cache();
+
+/**
+ * Checks caller storage for the _inplace functions and zeroes it.
+ *
+ * @return storage as a device, or NULL if it is too small or misaligned
+ */
+thirdspacevest_device* thirdspacevest_claim_storage(void* storage, size_t size);
+
+/**
+ * Resets the platform independent part of a device. Called by the
+ * backend's thirdspacevest_init_inplace.
+ */
+void thirdspacevest_init_state(thirdspacevest_device* dev);
+
+/**
+ * Releases what thirdspacevest_init_state set up. Called by the
+ * backend's thirdspacevest_delete.
+ */
+void thirdspacevest_deinit_state(thirdspacevest_device* dev);
+
+/**
+ * Queues the packet for one cell on the async transfer pool, pumping
+ * events while the pool is full. Completion is tracked in
+ * _frame_pending/_frame_status until thirdspacevest_wait_cells.
+ *
+ * @return 0 if queued, otherwise < 0
+ */
+int thirdspacevest_submit_cell(thirdspacevest_device* dev, uint8_t index, uint8_t speed);
+
+/**
+ * Waits for every cell queued by thirdspacevest_submit_cell to finish.
+ *
+ * @return 0 if they all went through, otherwise the first error seen
+ */
+int thirdspacevest_wait_cells(thirdspacevest_device* dev);
+
+/**
+ * Sends every cell in mask, whether or not its speed changed, and waits
+ * for all status reads. Only called from whichever thread owns USB I/O
+ * for the device.
+ *
+ * @return Number of cells sent if ok, otherwise < 0
+ */
+int thirdspacevest_send_cells(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask);
+
+/**
+ * Clears the bits in mask for cells whose speed already matches the
+ * last one sent.
+ */
+uint8_t thirdspacevest_changed_cells(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask);
+
+/**
+ * Hands the cells in mask to the I/O thread, replacing any speed still
+ * waiting for them. Never blocks and never refuses a cell.
+ *
+ * @param force Nonzero to send the cells even if their speed is unchanged
+ *
+ * @return Number of cells queued, otherwise < 0
+ */
+int thirdspacevest_enqueue_cells(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask, uint8_t force);
+
+/**
+ * thirdspacevest_enqueue_cells for a single cell.
+ *
+ * @return 0 if queued, otherwise < 0
+ */
+int thirdspacevest_enqueue_command(thirdspacevest_device* dev, uint8_t index, uint8_t speed, uint8_t force);
+
+/**
+ * Number of bits set in a cell mask.
+ */
+uint32_t thirdspacevest_count_cells(uint32_t mask);
+
+/**
+ * Sets up the I/O thread state. Called from thirdspacevest_init_state.
+ */
+void thirdspacevest_init_io_state(thirdspacevest_device* dev);
+
+/**
+ * Adds one latency sample to a histogram. Lock-free, safe from any
+ * thread.
+ */
+void thirdspacevest_histogram_record(thirdspacevest_histogram* hist, uint64_t us);
+
+/**
+ * Counts a failed transfer, and a timeout too if timed_out is nonzero.
+ */
+void thirdspacevest_count_error(thirdspacevest_device* dev, int timed_out);
+
+/**
+ * Counts a timeout and backs the adaptive timeout off, for transports
+ * that count the failure itself separately.
+ */
+void thirdspacevest_count_timeout(thirdspacevest_device* dev);
+
+/**
+ * Records how long a write or status read took in hist, and feeds it
+ * to the round trip estimate behind thirdspacevest_usb_timeout.
+ */
+void thirdspacevest_record_stage(thirdspacevest_device* dev, thirdspacevest_histogram* hist, uint64_t us);
+
+/**
+ * Timeout for the next USB transfer, in milliseconds
+ */
+uint32_t thirdspacevest_usb_timeout(thirdspacevest_device* dev);
+
+/**
+ * Updates the saturated state and calls the saturation callback if it
+ * changed. overloaded is nonzero when a command was just refused or a
+ * transfer timed out.
+ */
+void thirdspacevest_check_saturation(thirdspacevest_device* dev, int overloaded);
+
+/**
+ * Records that the open vest went away. Called by transports from
+ * whichever thread noticed, the next send reopens it.
+ */
+void thirdspacevest_mark_lost(thirdspacevest_device* dev);
+
+/**
+ * Lets the next send on a lost device try to reopen it right away.
+ * Called by transports when a vest arrives.
+ */
+void thirdspacevest_mark_arrived(thirdspacevest_device* dev);
+
+/**
+ * Zeroes the stats. Called from thirdspacevest_init_state.
+ */
+void thirdspacevest_init_stats(thirdspacevest_device* dev);
+
+/**
+ * Sets up the sequencer voices and lock. Called from
+ * thirdspacevest_init_state.
+ */
+void thirdspacevest_init_sequencer_state(thirdspacevest_device* dev);
+
+/**
+ * Clears the mixer layers and sets up their lock. Called from
+ * thirdspacevest_init_state.
+ */
+void thirdspacevest_init_mixer_state(thirdspacevest_device* dev);
+
+/**
+ * Empties the completion queue and sets up its lock. Called from
+ * thirdspacevest_init_state.
+ */
+void thirdspacevest_init_completion_state(thirdspacevest_device* dev);
+
+/**
+ * Puts a frame on the completion queue, see
+ * thirdspacevest_send_frame_async.
+ *
+ * @param force Nonzero to send the cells even if their speed is unchanged
+ *
+ * @return 0 if queued, E_NPUTIL_BUSY if the queue is full, otherwise < 0
+ */
+int thirdspacevest_queue_frame(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask, uint8_t force, thirdspacevest_async_cb callback, void* user_data);
+
+/**
+ * thirdspacevest_send_frame without tracing, for callers inside the
+ * library that already traced the frame themselves.
+ */
+int thirdspacevest_submit_frame(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask);
+
+/**
+ * Sleeps most of the way to due, then yields the rest so the send lands
+ * close to the captured time.
+ */
+void thirdspacevest_replay_wait(thirdspacevest_event* event, uint64_t due);
+
+/**
+ * Nonzero while the I/O thread or the completion sender drives the
+ * device's transfers. Anything else has to go through their queues
+ * rather than touch _slots or pump the device's events itself.
+ */
+#define thirdspacevest_thread_owns_io(dev) \
+	(thirdspacevest_atomic_load(&(dev)->_io_running) || thirdspacevest_atomic_load(&(dev)->_cq_running))
+
+/**
+ * Nonzero for a device that shares its event loop with the rest of a
+ * thirdspacevest_group. Pumping its events runs every group member's
+ * callbacks, so it can't get a thread of its own.
+ */
+#if defined(WIN32)
+#define thirdspacevest_shares_events(dev) 0
+#else
+#define thirdspacevest_shares_events(dev) ((dev)->_context && !(dev)->_owns_context)
+#endif
+
+/**
+ * Nonzero while thirdspacevest_start_trace is recording, checked before
+ * doing any work for a trace record.
+ */
+#define thirdspacevest_tracing(dev) (thirdspacevest_atomic_load(&(dev)->_trace_running) != 0)
+
+/**
+ * Traces a call to one of the public send functions.
+ *
+ * @param cell Cell index for effects, the cell mask for frames
+ * @param speeds Frame speeds, NULL for effects
+ * @param start_us When the call started
+ * @param result What the call returned
+ */
+void thirdspacevest_trace_call(thirdspacevest_device* dev, uint8_t type, uint8_t cell, uint8_t speed, const uint8_t* speeds, uint64_t start_us, int result);
+
+/**
+ * Traces one USB write or status read, if a trace is running.
+ */
+#define thirdspacevest_trace_transfer(dev, type, start_us, end_us, failed) \
+	do { if(thirdspacevest_tracing(dev)) thirdspacevest_trace_stage((dev), (type), (start_us), (end_us), (failed)); } while(0)
+
+void thirdspacevest_trace_stage(thirdspacevest_device* dev, uint8_t type, uint64_t start_us, uint64_t end_us, int failed);
+
+/**
+ * Stops the device's trace if it is running and frees it, called when
+ * the device is deleted.
+ */
+void thirdspacevest_free_trace(thirdspacevest_device* dev);
+
+#endif //LIBTHIRDSPACEVEST_INTERNAL_H
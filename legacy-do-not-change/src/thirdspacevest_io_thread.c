@@ -0,0 +1,396 @@
+/*
+ * Third Space Vest Driver - Library owned I/O thread
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <string.h>
+
+// Producers never queue commands as such. Each one writes its speeds
+// into _queued_speeds, packed 4 cells to a word like the tick state,
+// then flags the cells in _queued_cells: bits 0-7 mark a cell as
+// waiting, bits 8-15 ask for it to be sent even if its speed is
+// unchanged. The I/O thread takes every flag with one exchange and only
+// then reads the speeds, so it always sends at least the speed that set
+// the flag. A producer that writes while a send is in progress flags
+// the cell again, and it goes out on the next pass. Nothing is ever
+// refused, however long the I/O thread is stuck waiting on USB.
+
+#define THIRDSPACEVEST_QUEUED_FORCE_SHIFT 8
+
+void thirdspacevest_init_io_state(thirdspacevest_device* dev)
+{
+	dev->_queued_speeds[0] = 0;
+	dev->_queued_speeds[1] = 0;
+	dev->_queued_cells = 0;
+	dev->_io_running = 0;
+	dev->_io_sleeping = 0;
+	memset(&dev->_queue_stats, 0, sizeof(dev->_queue_stats));
+	dev->_tick_speeds[0] = 0;
+	dev->_tick_speeds[1] = 0;
+	dev->_tick_mask = 0;
+	dev->_tick_period_us = 0;
+	dev->_tick_sent = 0;
+	dev->_tick_owns_io = 0;
+}
+
+/**
+ * Writes the speeds for the cells in mask into packed words, cell n is
+ * byte n % 4 of word n / 4. Other cells keep whatever they held.
+ */
+static void thirdspacevest_store_speeds(volatile uint32_t words[2], const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask)
+{
+	uint32_t old, word, keep;
+	uint8_t i, j;
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; i += 4)
+	{
+		if(!((mask >> i) & 0xF))
+		{
+			continue;
+		}
+		word = 0;
+		keep = 0xFFFFFFFF;
+		for(j = 0; j < 4; ++j)
+		{
+			if(mask & (1 << (i + j)))
+			{
+				word |= (uint32_t)speeds[i + j] << (8 * j);
+				keep &= ~((uint32_t)0xFF << (8 * j));
+			}
+		}
+		do
+		{
+			old = thirdspacevest_atomic_load(&words[i / 4]);
+		}
+		while(!thirdspacevest_atomic_cas(&words[i / 4], old, (old & keep) | word));
+	}
+}
+
+/**
+ * Unpacks words written by thirdspacevest_store_speeds.
+ */
+static void thirdspacevest_load_speeds(volatile uint32_t words[2], uint8_t speeds[THIRDSPACEVEST_CELL_COUNT])
+{
+	uint32_t word = 0;
+	uint8_t i;
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		if(i % 4 == 0)
+		{
+			word = thirdspacevest_atomic_load(&words[i / 4]);
+		}
+		speeds[i] = (uint8_t)(word >> (8 * (i % 4)));
+	}
+}
+
+uint32_t thirdspacevest_count_cells(uint32_t mask)
+{
+	uint32_t count = 0;
+	for(; mask; mask &= mask - 1)
+	{
+		++count;
+	}
+	return count;
+}
+
+int thirdspacevest_enqueue_cells(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask, uint8_t force)
+{
+	uint32_t old, flags;
+
+	if(!thirdspacevest_atomic_load(&dev->_io_running))
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	if(!mask)
+	{
+		return 0;
+	}
+
+	// Speeds first, so whoever sees the flags sees these speeds or newer.
+	thirdspacevest_store_speeds(dev->_queued_speeds, speeds, mask);
+	flags = mask | (force ? (uint32_t)mask << THIRDSPACEVEST_QUEUED_FORCE_SHIFT : 0);
+	do
+	{
+		old = thirdspacevest_atomic_load(&dev->_queued_cells);
+	}
+	while(!thirdspacevest_atomic_cas(&dev->_queued_cells, old, old | flags));
+	thirdspacevest_atomic_fetch_add(&dev->_queue_stats.queued, thirdspacevest_count_cells(mask));
+	if(old & mask)
+	{
+		thirdspacevest_atomic_fetch_add(&dev->_queue_stats.coalesced, thirdspacevest_count_cells(old & mask));
+	}
+
+	// Pairs with the fence in the I/O thread, so either it sees our
+	// flags before sleeping or we see it sleeping and wake it up.
+	thirdspacevest_atomic_fence();
+	if(thirdspacevest_atomic_load(&dev->_io_sleeping))
+	{
+		thirdspacevest_event_signal(&dev->_io_wakeup);
+	}
+	return (int)thirdspacevest_count_cells(mask);
+}
+
+int thirdspacevest_enqueue_command(thirdspacevest_device* dev, uint8_t index, uint8_t speed, uint8_t force)
+{
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	int ret;
+
+	if(index >= THIRDSPACEVEST_CELL_COUNT)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	speeds[index] = speed;
+	ret = thirdspacevest_enqueue_cells(dev, speeds, (uint8_t)(1 << index), force);
+	return ret < 0 ? ret : 0;
+}
+
+int thirdspacevest_enqueue_effect(thirdspacevest_device* dev, uint8_t index, uint8_t speed)
+{
+	uint64_t start;
+	int ret;
+	if(!thirdspacevest_tracing(dev))
+	{
+		return thirdspacevest_enqueue_command(dev, index, speed, 1);
+	}
+	start = thirdspacevest_time_us();
+	ret = thirdspacevest_enqueue_command(dev, index, speed, 1);
+	thirdspacevest_trace_call(dev, THIRDSPACEVEST_TRACE_ENQUEUE, index, speed, NULL, start, ret);
+	return ret;
+}
+
+/**
+ * Sends every cell flagged since the last pass, each at the newest
+ * speed written for it.
+ *
+ * @return 0 if nothing was waiting, > 0 otherwise
+ */
+static int thirdspacevest_flush_pending(thirdspacevest_device* dev)
+{
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	uint32_t flags = thirdspacevest_atomic_exchange(&dev->_queued_cells, 0);
+	uint8_t mask = (uint8_t)flags;
+	uint8_t force = (uint8_t)(flags >> THIRDSPACEVEST_QUEUED_FORCE_SHIFT);
+	uint8_t i;
+	int submitted = 0;
+
+	if(!mask)
+	{
+		return 0;
+	}
+	thirdspacevest_load_speeds(dev->_queued_speeds, speeds);
+	mask = (uint8_t)(force | thirdspacevest_changed_cells(dev, speeds, mask));
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		if(!(mask & (1 << i)))
+		{
+			continue;
+		}
+		if(thirdspacevest_submit_cell(dev, i, speeds[i]) == 0)
+		{
+			thirdspacevest_atomic_fetch_add(&dev->_queue_stats.sent, 1);
+			++submitted;
+		}
+	}
+	if(submitted)
+	{
+		thirdspacevest_wait_cells(dev);
+	}
+	return 1;
+}
+
+/**
+ * Diffs the tick state against what the vest last acknowledged and
+ * sends only the cells that differ. Cells whose last send failed count
+ * as different, so they get retried on the next tick.
+ */
+static void thirdspacevest_flush_tick(thirdspacevest_device* dev)
+{
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	uint8_t mask = (uint8_t)thirdspacevest_atomic_load(&dev->_tick_mask);
+	uint8_t send;
+	uint8_t i;
+	int submitted = 0;
+
+	thirdspacevest_load_speeds(dev->_tick_speeds, speeds);
+	send = thirdspacevest_changed_cells(dev, speeds, mask) | (dev->_tick_sent & mask & ~dev->_speeds_known);
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		if(!(send & (1 << i)))
+		{
+			continue;
+		}
+		if(thirdspacevest_submit_cell(dev, i, speeds[i]) == 0)
+		{
+			thirdspacevest_atomic_fetch_add(&dev->_queue_stats.sent, 1);
+			dev->_tick_sent |= (1 << i);
+			++submitted;
+		}
+	}
+	if(submitted)
+	{
+		thirdspacevest_wait_cells(dev);
+	}
+}
+
+THIRDSPACEVEST_THREAD_FUNC(thirdspacevest_io_main, arg)
+{
+	thirdspacevest_device* dev = (thirdspacevest_device*)arg;
+	uint64_t next_tick = 0;
+	uint64_t now;
+	uint32_t period;
+	int timeout;
+
+	while(thirdspacevest_atomic_load(&dev->_io_running))
+	{
+		int busy = thirdspacevest_flush_pending(dev);
+		timeout = THIRDSPACEVEST_USB_TIMEOUT;
+		if((period = thirdspacevest_atomic_load(&dev->_tick_period_us)) != 0)
+		{
+			now = thirdspacevest_time_us();
+			if(!next_tick || now >= next_tick)
+			{
+				thirdspacevest_flush_tick(dev);
+				// Stay on the original schedule unless we fell a whole
+				// period behind, then restart it from here.
+				next_tick = (next_tick && next_tick + period > now) ? next_tick + period : now + period;
+			}
+			now = thirdspacevest_time_us();
+			timeout = next_tick > now ? (int)((next_tick - now + 999) / 1000) : 0;
+		}
+		else
+		{
+			next_tick = 0;
+		}
+		if(busy || timeout == 0)
+		{
+			continue;
+		}
+		// Nothing else pumps this device's events while we own it, see
+		// thirdspacevest_update_devices, so hotplug events go out here.
+		thirdspacevest_handle_events(dev, 0);
+		thirdspacevest_atomic_store(&dev->_io_sleeping, 1);
+		thirdspacevest_atomic_fence();
+		if(!thirdspacevest_atomic_load(&dev->_queued_cells))
+		{
+			thirdspacevest_event_wait(&dev->_io_wakeup, timeout);
+		}
+		thirdspacevest_atomic_store(&dev->_io_sleeping, 0);
+	}
+
+	// Flush whatever producers managed to queue before the stop.
+	thirdspacevest_flush_pending(dev);
+	if(thirdspacevest_atomic_load(&dev->_tick_period_us))
+	{
+		thirdspacevest_flush_tick(dev);
+	}
+	THIRDSPACEVEST_THREAD_RETURN;
+}
+
+int thirdspacevest_start_io_thread(thirdspacevest_device* dev)
+{
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	if(thirdspacevest_shares_events(dev))
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(thirdspacevest_atomic_load(&dev->_io_running))
+	{
+		return 0;
+	}
+	if(thirdspacevest_event_init(&dev->_io_wakeup) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	thirdspacevest_atomic_store(&dev->_io_running, 1);
+	if(thirdspacevest_thread_start(&dev->_io_thread, thirdspacevest_io_main, dev) < 0)
+	{
+		thirdspacevest_atomic_store(&dev->_io_running, 0);
+		thirdspacevest_event_destroy(&dev->_io_wakeup);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return 0;
+}
+
+int thirdspacevest_stop_io_thread(thirdspacevest_device* dev)
+{
+	if(!thirdspacevest_atomic_load(&dev->_io_running))
+	{
+		return 0;
+	}
+	thirdspacevest_atomic_store(&dev->_io_running, 0);
+	thirdspacevest_event_signal(&dev->_io_wakeup);
+	thirdspacevest_thread_join(&dev->_io_thread);
+	// Tick mode lives on the I/O thread, so it goes with it.
+	thirdspacevest_atomic_store(&dev->_tick_period_us, 0);
+	dev->_tick_owns_io = 0;
+	thirdspacevest_event_destroy(&dev->_io_wakeup);
+	return 0;
+}
+
+int thirdspacevest_start_tick(thirdspacevest_device* dev, int rate_hz)
+{
+	int ret;
+	if(rate_hz < 1 || rate_hz > 1000)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(!thirdspacevest_atomic_load(&dev->_io_running))
+	{
+		if((ret = thirdspacevest_start_io_thread(dev)) < 0)
+		{
+			return ret;
+		}
+		dev->_tick_owns_io = 1;
+	}
+	thirdspacevest_atomic_store(&dev->_tick_period_us, (uint32_t)(1000000 / rate_hz));
+	thirdspacevest_event_signal(&dev->_io_wakeup);
+	return 0;
+}
+
+int thirdspacevest_stop_tick(thirdspacevest_device* dev)
+{
+	if(!thirdspacevest_atomic_load(&dev->_tick_period_us))
+	{
+		return 0;
+	}
+	thirdspacevest_atomic_store(&dev->_tick_period_us, 0);
+	if(dev->_tick_owns_io)
+	{
+		dev->_tick_owns_io = 0;
+		return thirdspacevest_stop_io_thread(dev);
+	}
+	return 0;
+}
+
+int thirdspacevest_set_tick_state(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask)
+{
+	uint32_t old;
+	thirdspacevest_store_speeds(dev->_tick_speeds, speeds, mask);
+	// Publish the speeds before the cells that use them.
+	do
+	{
+		old = thirdspacevest_atomic_load(&dev->_tick_mask);
+	}
+	while((old | mask) != old && !thirdspacevest_atomic_cas(&dev->_tick_mask, old, old | mask));
+	return 0;
+}
+
+int thirdspacevest_get_queue_stats(thirdspacevest_device* dev, thirdspacevest_queue_stats* stats)
+{
+	stats->queued = thirdspacevest_atomic_load(&dev->_queue_stats.queued);
+	stats->coalesced = thirdspacevest_atomic_load(&dev->_queue_stats.coalesced);
+	stats->dropped = thirdspacevest_atomic_load(&dev->_queue_stats.dropped);
+	stats->sent = thirdspacevest_atomic_load(&dev->_queue_stats.sent);
+	return 0;
+}
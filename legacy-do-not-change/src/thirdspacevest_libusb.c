@@ -12,155 +12,760 @@
  */
 
 
-#include "thirdspacevest/thirdspacevest.h"
+#include "thirdspacevest_internal.h"
 #include <stdlib.h>
+#include <string.h>
 
 #define THIRDSPACEVEST_USB_INTERFACE	0
 
-thirdspacevest_device* thirdspacevest_create()
+static void thirdspacevest_finish_slot(thirdspacevest_transfer_slot* slot, int status)
 {
-	thirdspacevest_device* s = (thirdspacevest_device*)malloc(sizeof(thirdspacevest_device));
-	s->_is_open = 0;
-	s->_is_inited = 0;
-	if(libusb_init(&s->_context) < 0)
+	thirdspacevest_async_cb callback = slot->_callback;
+	void* user_data = slot->_user_data;
+	slot->_in_use = 0;
+	--slot->_dev->_pending;
+	if(callback)
 	{
-		return NULL;
+		callback(slot->_dev, status, user_data);
 	}
-	s->_is_inited = 1;
-	return s;
 }
 
-int thirdspacevest_get_count(thirdspacevest_device* s)
+/**
+ * Records how long the stage that just finished took, and counts it as
+ * an error if it failed. Cancellations come from close, not the vest.
+ *
+ * @return Nonzero if the transfer completed
+ */
+static int thirdspacevest_finish_stage(thirdspacevest_transfer_slot* slot, struct libusb_transfer* transfer, thirdspacevest_histogram* hist)
 {
-	struct libusb_device **devs;
-	struct libusb_device *found = NULL;
-	struct libusb_device *dev;
-	size_t i = 0;
-	int count = 0;
+	const uint8_t type = hist == &slot->_dev->_ack_latency ? THIRDSPACEVEST_TRACE_READ : THIRDSPACEVEST_TRACE_WRITE;
+	uint64_t now;
+	if(transfer->status != LIBUSB_TRANSFER_COMPLETED)
+	{
+		if(transfer->status != LIBUSB_TRANSFER_CANCELLED)
+		{
+			thirdspacevest_count_error(slot->_dev, transfer->status == LIBUSB_TRANSFER_TIMED_OUT);
+			thirdspacevest_trace_transfer(slot->_dev, type, slot->_stage_us, thirdspacevest_time_us(), 1);
+		}
+		if(transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+		{
+			thirdspacevest_mark_lost(slot->_dev);
+		}
+		return 0;
+	}
+	now = thirdspacevest_time_us();
+	thirdspacevest_record_stage(slot->_dev, hist, now - slot->_stage_us);
+	thirdspacevest_trace_transfer(slot->_dev, type, slot->_stage_us, now, 0);
+	slot->_stage_us = now;
+	return 1;
+}
 
-	if (!s->_is_inited)
+static void LIBUSB_CALL thirdspacevest_in_callback(struct libusb_transfer* transfer)
+{
+	thirdspacevest_transfer_slot* slot = (thirdspacevest_transfer_slot*)transfer->user_data;
+	int ok = thirdspacevest_finish_stage(slot, transfer, &slot->_dev->_ack_latency);
+	thirdspacevest_finish_slot(slot, ok ? 0 : E_NPUTIL_DRIVER_ERROR);
+}
+
+static void LIBUSB_CALL thirdspacevest_out_callback(struct libusb_transfer* transfer)
+{
+	thirdspacevest_transfer_slot* slot = (thirdspacevest_transfer_slot*)transfer->user_data;
+	int ret;
+	if(!thirdspacevest_finish_stage(slot, transfer, &slot->_dev->_write_latency))
 	{
-		return E_NPUTIL_NOT_INITED;
+		thirdspacevest_finish_slot(slot, E_NPUTIL_DRIVER_ERROR);
+		return;
+	}
+	if(thirdspacevest_atomic_load(&slot->_dev->_ack_mode) == THIRDSPACEVEST_ACK_NONE)
+	{
+		thirdspacevest_finish_slot(slot, 0);
+		return;
+	}
+	// Same as the blocking path, every write is followed by a status
+	// read so the device never backs up on its IN endpoint.
+	slot->_in_transfer->timeout = thirdspacevest_usb_timeout(slot->_dev);
+	ret = libusb_submit_transfer(slot->_in_transfer);
+	if(ret < 0)
+	{
+		if(ret == LIBUSB_ERROR_NO_DEVICE)
+		{
+			thirdspacevest_mark_lost(slot->_dev);
+		}
+		thirdspacevest_finish_slot(slot, E_NPUTIL_DRIVER_ERROR);
 	}
+}
 
-	if (libusb_get_device_list(s->_context, &devs) < 0)
+static int thirdspacevest_alloc_transfers(thirdspacevest_device* s)
+{
+	int i;
+	s->_pending = 0;
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
 	{
-		return E_NPUTIL_DRIVER_ERROR;
+		thirdspacevest_transfer_slot* slot = &s->_slots[i];
+		slot->_dev = s;
+		slot->_in_use = 0;
+		slot->_out_transfer = libusb_alloc_transfer(0);
+		slot->_in_transfer = libusb_alloc_transfer(0);
+		if(!slot->_out_transfer || !slot->_in_transfer)
+		{
+			// Nothing was submitted yet, so the ones we got can just go.
+			for(; i >= 0; --i)
+			{
+				libusb_free_transfer(s->_slots[i]._out_transfer);
+				libusb_free_transfer(s->_slots[i]._in_transfer);
+				s->_slots[i]._out_transfer = NULL;
+				s->_slots[i]._in_transfer = NULL;
+			}
+			return E_NPUTIL_DRIVER_ERROR;
+		}
+		libusb_fill_bulk_transfer(slot->_out_transfer, s->_device, THIRDSPACEVEST_OUT_ENDPT,
+								  slot->_out_buffer, THIRDSPACEVEST_PACKET_SIZE,
+								  thirdspacevest_out_callback, slot, THIRDSPACEVEST_USB_TIMEOUT);
+		libusb_fill_bulk_transfer(slot->_in_transfer, s->_device, THIRDSPACEVEST_IN_ENDPT,
+								  slot->_in_buffer, THIRDSPACEVEST_PACKET_SIZE,
+								  thirdspacevest_in_callback, slot, THIRDSPACEVEST_USB_TIMEOUT);
 	}
+	return 0;
+}
 
-	while ((dev = devs[i++]) != NULL)
+static void thirdspacevest_free_transfers(thirdspacevest_device* s)
+{
+	int i;
+	// Cancel whatever is still in flight and let the callbacks drain
+	// before the transfers go away underneath libusb.
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
 	{
-		struct libusb_device_descriptor desc;
-		int dev_error_code;
-		dev_error_code = libusb_get_device_descriptor(dev, &desc);
-		if (dev_error_code < 0)
+		if(s->_slots[i]._in_use)
 		{
-			break;
+			libusb_cancel_transfer(s->_slots[i]._out_transfer);
+			libusb_cancel_transfer(s->_slots[i]._in_transfer);
 		}
-		if (desc.idVendor == THIRDSPACEVEST_VID && desc.idProduct == THIRDSPACEVEST_PID)
+	}
+	while(s->_pending > 0)
+	{
+		if(thirdspacevest_handle_events(s, THIRDSPACEVEST_USB_TIMEOUT) < 0)
 		{
-			++count;
+			break;
 		}
 	}
-
-	libusb_free_device_list(devs, 1);
-	return count;
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		libusb_free_transfer(s->_slots[i]._out_transfer);
+		libusb_free_transfer(s->_slots[i]._in_transfer);
+		s->_slots[i]._out_transfer = NULL;
+		s->_slots[i]._in_transfer = NULL;
+	}
 }
 
-int thirdspacevest_open(thirdspacevest_device* s, unsigned int device_index)
+static int thirdspacevest_is_vest(struct libusb_device* dev)
 {
-	int ret;
-	struct libusb_device **devs;
-	struct libusb_device *found = NULL;
-	struct libusb_device *dev;
-	size_t i = 0;
-	int count = 0;
-	int device_error_code = 0;
-
-	if (!s->_is_inited)
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(dev, &desc) < 0)
 	{
-		return E_NPUTIL_NOT_INITED;
+		return 0;
 	}
+	return desc.idVendor == THIRDSPACEVEST_VID && desc.idProduct == THIRDSPACEVEST_PID;
+}
 
-	if ((device_error_code = libusb_get_device_list(s->_context, &devs)) < 0)
+static void thirdspacevest_forget_devices(thirdspacevest_device* s)
+{
+	int i;
+	for(i = 0; i < s->_known_count; ++i)
 	{
-		return E_NPUTIL_DRIVER_ERROR;
+		libusb_unref_device(s->_known[i]);
 	}
+	s->_known_count = 0;
+}
+
+static int LIBUSB_CALL thirdspacevest_hotplug_callback(libusb_context* ctx, libusb_device* dev, libusb_hotplug_event event, void* user_data)
+{
+	thirdspacevest_device* s = (thirdspacevest_device*)user_data;
+	int i;
 
-	while ((dev = devs[i++]) != NULL)
+	(void)ctx;
+	thirdspacevest_mutex_lock(&s->_known_lock);
+	if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
 	{
-		struct libusb_device_descriptor desc;
-		device_error_code = libusb_get_device_descriptor(dev, &desc);
-		if (device_error_code < 0)
+		if(s->_known_count < THIRDSPACEVEST_MAX_DEVICES)
 		{
-			libusb_free_device_list(devs, 1);
-			return E_NPUTIL_NOT_INITED;
+			s->_known[s->_known_count++] = libusb_ref_device(dev);
+		}
+		thirdspacevest_mark_arrived(s);
+	}
+	else
+	{
+		// Don't wait for a transfer to fail to notice our own vest left.
+		if(s->_device && libusb_get_device(s->_device) == dev)
+		{
+			thirdspacevest_mark_lost(s);
 		}
-		if (desc.idVendor == THIRDSPACEVEST_VID && desc.idProduct == THIRDSPACEVEST_PID)
+		for(i = 0; i < s->_known_count; ++i)
 		{
-			if(count == device_index)
+			if(s->_known[i] == dev)
 			{
-				found = dev;
+				libusb_unref_device(s->_known[i]);
+				--s->_known_count;
+				memmove(&s->_known[i], &s->_known[i + 1], (s->_known_count - i) * sizeof(s->_known[0]));
 				break;
 			}
-			++count;
 		}
 	}
+	thirdspacevest_mutex_unlock(&s->_known_lock);
+	return 0;
+}
+
+/**
+ * Walks the bus and rebuilds the enumeration cache. Only used when
+ * libusb can't deliver hotplug events on this platform.
+ */
+static int thirdspacevest_rescan_devices(thirdspacevest_device* s)
+{
+	struct libusb_device **devs;
+	struct libusb_device *dev;
+	size_t i = 0;
 
-	if (found)
+	if (libusb_get_device_list(s->_context, &devs) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+
+	thirdspacevest_mutex_lock(&s->_known_lock);
+	thirdspacevest_forget_devices(s);
+	while ((dev = devs[i++]) != NULL && s->_known_count < THIRDSPACEVEST_MAX_DEVICES)
 	{
-		device_error_code = libusb_open(found, &s->_device);
-		if (device_error_code < 0)
+		if (thirdspacevest_is_vest(dev))
 		{
-			libusb_free_device_list(devs, 1);
-			return E_NPUTIL_NOT_INITED;
+			s->_known[s->_known_count++] = libusb_ref_device(dev);
 		}
 	}
-	else
+	thirdspacevest_mutex_unlock(&s->_known_lock);
+
+	libusb_free_device_list(devs, 1);
+	return 0;
+}
+
+/**
+ * Brings the enumeration cache up to date: delivers any queued hotplug
+ * events, or rescans if hotplug isn't available.
+ *
+ * Pumping events also runs transfer callbacks, which belong to the I/O
+ * thread or completion sender while one of them is running. That
+ * thread's own event loop delivers hotplug events then, and the cache
+ * is read under _known_lock, so it's left to keep the cache current.
+ */
+static int thirdspacevest_update_devices(thirdspacevest_device* s)
+{
+	struct timeval tv = {0, 0};
+	if (!s->_hotplug_registered)
+	{
+		return thirdspacevest_rescan_devices(s);
+	}
+	if (!thirdspacevest_thread_owns_io(s))
+	{
+		libusb_handle_events_timeout_completed(s->_context, &tv, NULL);
+	}
+	return 0;
+}
+
+static void thirdspacevest_init_devices(thirdspacevest_device* s)
+{
+	s->_hotplug_registered = 0;
+	if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		return;
+	}
+	// LIBUSB_HOTPLUG_ENUMERATE runs the callback for every vest that's
+	// already attached before this returns, which fills the cache.
+	if(libusb_hotplug_register_callback(s->_context,
+										LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+										LIBUSB_HOTPLUG_ENUMERATE,
+										THIRDSPACEVEST_VID, THIRDSPACEVEST_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+										thirdspacevest_hotplug_callback, s, &s->_hotplug_handle) == LIBUSB_SUCCESS)
+	{
+		s->_hotplug_registered = 1;
+	}
+}
+
+/**
+ * Creates the USB context the first time the device needs it.
+ * libusb_init walks the whole bus and registering for hotplug walks it
+ * again, so doing it here rather than in thirdspacevest_create keeps
+ * device creation off the startup path until a vest is looked for.
+ */
+static int thirdspacevest_libusb_context(thirdspacevest_device* s)
+{
+	if(s->_context)
 	{
+		return 0;
+	}
+	if(libusb_init(&s->_context) < 0)
+	{
+		s->_context = NULL;
 		return E_NPUTIL_NOT_INITED;
 	}
-	s->_is_open = 1;
+	thirdspacevest_init_devices(s);
+	return 0;
+}
+
+thirdspacevest_group* thirdspacevest_group_create()
+{
+	thirdspacevest_group* g = (thirdspacevest_group*)malloc(sizeof(thirdspacevest_group));
+	if(!g)
+	{
+		return NULL;
+	}
+	g->_count = 0;
+	// Created by thirdspacevest_group_open, see thirdspacevest_group_init
+	g->_context = NULL;
+	return g;
+}
+
+int thirdspacevest_group_init(thirdspacevest_group* group)
+{
+	if(group->_context)
+	{
+		return 0;
+	}
+	if(libusb_init(&group->_context) < 0)
+	{
+		group->_context = NULL;
+		return E_NPUTIL_NOT_INITED;
+	}
+	return 0;
+}
+
+void thirdspacevest_group_delete(thirdspacevest_group* group)
+{
+	int i;
+	for(i = 0; i < group->_count; ++i)
+	{
+		thirdspacevest_close(group->_devices[i]);
+		thirdspacevest_delete(group->_devices[i]);
+	}
+	if(group->_context)
+	{
+		libusb_exit(group->_context);
+	}
+	free(group);
+}
+
+int thirdspacevest_group_handle_events(thirdspacevest_group* group, int timeout_ms)
+{
+	struct timeval tv;
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	if(!group->_context)
+	{
+		return 0;
+	}
+	// One context for the whole group, so one call completes transfers
+	// for every device in it.
+	if(libusb_handle_events_timeout_completed(group->_context, &tv, NULL) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return 0;
+}
+
+static int thirdspacevest_libusb_get_count(thirdspacevest_device* s)
+{
+	int count;
+
+	if (thirdspacevest_libusb_context(s) < 0)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	if (thirdspacevest_update_devices(s) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+
+	thirdspacevest_mutex_lock(&s->_known_lock);
+	count = s->_known_count;
+	thirdspacevest_mutex_unlock(&s->_known_lock);
+	return count;
+}
 
+/**
+ * Reads the serial string of an opened vest into serial, empty if it
+ * doesn't have one.
+ */
+static void thirdspacevest_read_serial(struct libusb_device_handle* handle, char* serial, int size)
+{
+	struct libusb_device_descriptor desc;
+	serial[0] = 0;
+	if(libusb_get_device_descriptor(libusb_get_device(handle), &desc) < 0 || !desc.iSerialNumber ||
+	   libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, (unsigned char*)serial, size) < 0)
+	{
+		serial[0] = 0;
+	}
+}
+
+/**
+ * Remembers where the open vest is plugged in and its serial, so it
+ * can be found again if it drops off the bus.
+ */
+static void thirdspacevest_save_identity(thirdspacevest_device* s)
+{
+	struct libusb_device* dev = libusb_get_device(s->_device);
+	s->_bus = libusb_get_bus_number(dev);
+	s->_port_count = libusb_get_port_numbers(dev, s->_ports, sizeof(s->_ports));
+	if(s->_port_count < 0)
+	{
+		s->_port_count = 0;
+	}
+	thirdspacevest_read_serial(s->_device, s->_serial, sizeof(s->_serial));
+}
+
+/**
+ * Opens dev into s->_device if it's the vest s last had open: plugged
+ * into the same port (unless any_port is set) and with the same serial,
+ * if it reported one.
+ *
+ * @return Nonzero if dev was opened
+ */
+static int thirdspacevest_open_if_same(thirdspacevest_device* s, struct libusb_device* dev, int any_port)
+{
+	uint8_t ports[sizeof(s->_ports)];
+	char serial[sizeof(s->_serial)];
+	int count;
+
+	if(!any_port)
+	{
+		count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+		if(s->_port_count == 0 || count != s->_port_count || libusb_get_bus_number(dev) != s->_bus ||
+		   memcmp(ports, s->_ports, count) != 0)
+		{
+			return 0;
+		}
+	}
+	if(libusb_open(dev, &s->_device) < 0)
+	{
+		s->_device = NULL;
+		return 0;
+	}
+	if(s->_serial[0])
+	{
+		thirdspacevest_read_serial(s->_device, serial, sizeof(serial));
+		if(strcmp(serial, s->_serial) != 0)
+		{
+			libusb_close(s->_device);
+			s->_device = NULL;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Takes the interface from the kernel driver and sets up the transfer
+ * pool on a freshly opened handle. On failure the handle is closed
+ * again, so nothing is left open.
+ */
+static int thirdspacevest_claim(thirdspacevest_device* s)
+{
+	int ret;
 	if(libusb_kernel_driver_active(s->_device, 0))
 	{
 		libusb_detach_kernel_driver(s->_device, 0);
 	}
 	ret = libusb_claim_interface(s->_device, 0);
+	if(ret < 0)
+	{
+		libusb_close(s->_device);
+		s->_device = NULL;
+		return ret;
+	}
 
+	ret = thirdspacevest_alloc_transfers(s);
+	if(ret < 0)
+	{
+		libusb_release_interface(s->_device, 0);
+		libusb_close(s->_device);
+		s->_device = NULL;
+	}
 	return ret;
 }
 
-int thirdspacevest_close(thirdspacevest_device* s)
+static int thirdspacevest_libusb_open(thirdspacevest_device* s, uint32_t device_index)
 {
-	if(!s->_is_open)
+	struct libusb_device *found = NULL;
+	int device_error_code = 0;
+
+	if (thirdspacevest_libusb_context(s) < 0)
 	{
-		return E_NPUTIL_NOT_OPENED;
+		return E_NPUTIL_NOT_INITED;
 	}
-	if (libusb_release_interface(s->_device, 0) < 0)
+	if (thirdspacevest_update_devices(s) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+
+	thirdspacevest_mutex_lock(&s->_known_lock);
+	if (device_index < (unsigned int)s->_known_count)
+	{
+		found = libusb_ref_device(s->_known[device_index]);
+	}
+	thirdspacevest_mutex_unlock(&s->_known_lock);
+
+	if (!found)
 	{
 		return E_NPUTIL_NOT_INITED;
 	}
-	libusb_close(s->_device);
+	device_error_code = libusb_open(found, &s->_device);
+	libusb_unref_device(found);
+	if (device_error_code < 0)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	thirdspacevest_save_identity(s);
+	if ((device_error_code = thirdspacevest_claim(s)) < 0)
+	{
+		return device_error_code;
+	}
+	s->_is_open = 1;
+	return 0;
+}
+
+static int thirdspacevest_libusb_close(thirdspacevest_device* s)
+{
+	thirdspacevest_free_transfers(s);
+	// A vest that went away can't give the interface back, but the
+	// handle still has to go.
+	if (s->_device)
+	{
+		if (libusb_release_interface(s->_device, 0) < 0 && !thirdspacevest_atomic_load(&s->_lost))
+		{
+			return E_NPUTIL_NOT_INITED;
+		}
+		libusb_close(s->_device);
+		s->_device = NULL;
+	}
 	s->_is_open = 0;
 	return 0;
 }
 
-void thirdspacevest_delete(thirdspacevest_device* dev)
+/**
+ * Drops the dead handle, then looks for the vest in the enumeration
+ * cache: first on the port it was on, since it comes back there with a
+ * new address after a glitch, then anywhere by serial.
+ */
+static int thirdspacevest_libusb_reopen(thirdspacevest_device* s)
 {
-	free(dev);
+	struct libusb_device* candidates[THIRDSPACEVEST_MAX_DEVICES];
+	int count, i;
+	int found = 0;
+
+	if (s->_device)
+	{
+		thirdspacevest_free_transfers(s);
+		libusb_release_interface(s->_device, 0);
+		libusb_close(s->_device);
+		s->_device = NULL;
+	}
+	if (thirdspacevest_update_devices(s) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+
+	thirdspacevest_mutex_lock(&s->_known_lock);
+	count = s->_known_count;
+	for(i = 0; i < count; ++i)
+	{
+		candidates[i] = libusb_ref_device(s->_known[i]);
+	}
+	thirdspacevest_mutex_unlock(&s->_known_lock);
+
+	for(i = 0; i < count && !found; ++i)
+	{
+		found = thirdspacevest_open_if_same(s, candidates[i], 0);
+	}
+	for(i = 0; i < count && !found && s->_serial[0]; ++i)
+	{
+		found = thirdspacevest_open_if_same(s, candidates[i], 1);
+	}
+	for(i = 0; i < count; ++i)
+	{
+		libusb_unref_device(candidates[i]);
+	}
+	if (!found)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	thirdspacevest_save_identity(s);
+	return thirdspacevest_claim(s);
 }
 
-int thirdspacevest_read_data(thirdspacevest_device* dev, uint8_t* input_report)
+static void thirdspacevest_libusb_destroy(thirdspacevest_device* dev)
+{
+	if(!dev->_context)
+	{
+		return;
+	}
+	if(dev->_hotplug_registered)
+	{
+		libusb_hotplug_deregister_callback(dev->_context, dev->_hotplug_handle);
+	}
+	thirdspacevest_forget_devices(dev);
+	if(dev->_owns_context)
+	{
+		libusb_exit(dev->_context);
+	}
+}
+
+static int thirdspacevest_libusb_read(thirdspacevest_device* dev, uint8_t* input_report)
 {
 	int trans;
-	int ret = libusb_bulk_transfer(dev->_device, THIRDSPACEVEST_IN_ENDPT, input_report, 10, &trans, 100);
+	int ret = libusb_bulk_transfer(dev->_device, THIRDSPACEVEST_IN_ENDPT, input_report, THIRDSPACEVEST_PACKET_SIZE, &trans, thirdspacevest_usb_timeout(dev));
+	if(ret < 0)
+	{
+		thirdspacevest_count_error(dev, ret == LIBUSB_ERROR_TIMEOUT);
+		if(ret == LIBUSB_ERROR_NO_DEVICE)
+		{
+			thirdspacevest_mark_lost(dev);
+		}
+	}
 	return ret;
 }
 
-int thirdspacevest_write_data(thirdspacevest_device* dev, uint8_t* output_report)
+static int thirdspacevest_libusb_write(thirdspacevest_device* dev, uint8_t* output_report)
 {
 	int trans;
-	return libusb_bulk_transfer(dev->_device, THIRDSPACEVEST_OUT_ENDPT, output_report, 10, &trans, 100);
+	int ret = libusb_bulk_transfer(dev->_device, THIRDSPACEVEST_OUT_ENDPT, output_report, THIRDSPACEVEST_PACKET_SIZE, &trans, thirdspacevest_usb_timeout(dev));
+	if(ret < 0)
+	{
+		thirdspacevest_count_error(dev, ret == LIBUSB_ERROR_TIMEOUT);
+		if(ret == LIBUSB_ERROR_NO_DEVICE)
+		{
+			thirdspacevest_mark_lost(dev);
+		}
+	}
+	return ret;
+}
+
+static int thirdspacevest_libusb_write_async(thirdspacevest_device* dev, const uint8_t* output_report, thirdspacevest_async_cb callback, void* user_data)
+{
+	int i, ret;
+	thirdspacevest_transfer_slot* slot = NULL;
+
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		if(!dev->_slots[i]._in_use)
+		{
+			slot = &dev->_slots[i];
+			break;
+		}
+	}
+	if(!slot)
+	{
+		return E_NPUTIL_BUSY;
+	}
+
+	memcpy(slot->_out_buffer, output_report, THIRDSPACEVEST_PACKET_SIZE);
+	slot->_callback = callback;
+	slot->_user_data = user_data;
+	slot->_stage_us = thirdspacevest_time_us();
+	slot->_out_transfer->timeout = thirdspacevest_usb_timeout(dev);
+	ret = libusb_submit_transfer(slot->_out_transfer);
+	if(ret < 0)
+	{
+		thirdspacevest_count_error(dev, 0);
+		if(ret == LIBUSB_ERROR_NO_DEVICE)
+		{
+			thirdspacevest_mark_lost(dev);
+		}
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	slot->_in_use = 1;
+	++dev->_pending;
+	return 0;
+}
+
+static int thirdspacevest_libusb_handle_events(thirdspacevest_device* dev, int timeout_ms)
+{
+	struct timeval tv;
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	if(!dev->_context)
+	{
+		return 0;
+	}
+	if(libusb_handle_events_timeout_completed(dev->_context, &tv, NULL) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return 0;
+}
+
+static const thirdspacevest_transport thirdspacevest_libusb_transport = {
+	"libusb",
+	thirdspacevest_libusb_get_count,
+	thirdspacevest_libusb_open,
+	thirdspacevest_libusb_close,
+	thirdspacevest_libusb_write,
+	thirdspacevest_libusb_read,
+	thirdspacevest_libusb_write_async,
+	thirdspacevest_libusb_handle_events,
+	thirdspacevest_libusb_destroy,
+	thirdspacevest_libusb_reopen
+};
+
+thirdspacevest_device* thirdspacevest_init_inplace(void* storage, size_t size)
+{
+	thirdspacevest_device* s = thirdspacevest_claim_storage(storage, size);
+	if(!s)
+	{
+		return NULL;
+	}
+	s->_is_open = 0;
+	s->_is_inited = 0;
+	s->_device = NULL;
+	thirdspacevest_init_state(s);
+	s->_transport = &thirdspacevest_libusb_transport;
+	// Created on first use, see thirdspacevest_libusb_context
+	s->_context = NULL;
+	s->_owns_context = 1;
+	s->_is_inited = 1;
+	return s;
+}
+
+thirdspacevest_device* thirdspacevest_create()
+{
+	thirdspacevest_device* s = (thirdspacevest_device*)malloc(sizeof(thirdspacevest_device));
+	if(!s)
+	{
+		return NULL;
+	}
+	if(!thirdspacevest_init_inplace(s, sizeof(thirdspacevest_device)))
+	{
+		free(s);
+		return NULL;
+	}
+	s->_owns_storage = 1;
+	return s;
+}
+
+thirdspacevest_device* thirdspacevest_create_in_group(thirdspacevest_group* group)
+{
+	thirdspacevest_device* s;
+	if(!group->_context)
+	{
+		return NULL;
+	}
+	s = thirdspacevest_claim_storage(malloc(sizeof(thirdspacevest_device)), sizeof(thirdspacevest_device));
+	if(!s)
+	{
+		return NULL;
+	}
+	s->_owns_storage = 1;
+	s->_is_open = 0;
+	s->_device = NULL;
+	thirdspacevest_init_state(s);
+	s->_transport = &thirdspacevest_libusb_transport;
+	s->_context = group->_context;
+	s->_owns_context = 0;
+	s->_is_inited = 1;
+	thirdspacevest_init_devices(s);
+	return s;
 }
 
@@ -0,0 +1,203 @@
+/*
+ * Third Space Vest Driver - Layer mixer
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <string.h>
+
+void thirdspacevest_init_mixer_state(thirdspacevest_device* dev)
+{
+	memset(dev->_layers, 0, sizeof(dev->_layers));
+	memset(dev->_mix_speeds, 0, sizeof(dev->_mix_speeds));
+	thirdspacevest_mutex_init(&dev->_mix_lock);
+}
+
+static int thirdspacevest_layer_valid(thirdspacevest_device* dev, int layer)
+{
+	return layer >= 0 && layer < THIRDSPACEVEST_MAX_LAYERS && dev->_layers[layer]._active;
+}
+
+int thirdspacevest_mixer_add_layer(thirdspacevest_device* dev, int priority, int blend)
+{
+	int i;
+	if(blend != THIRDSPACEVEST_BLEND_MAX && blend != THIRDSPACEVEST_BLEND_SUM && blend != THIRDSPACEVEST_BLEND_REPLACE)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	thirdspacevest_mutex_lock(&dev->_mix_lock);
+	for(i = 0; i < THIRDSPACEVEST_MAX_LAYERS; ++i)
+	{
+		thirdspacevest_layer* layer = &dev->_layers[i];
+		if(layer->_active)
+		{
+			continue;
+		}
+		memset(layer->_speeds, 0, sizeof(layer->_speeds));
+		layer->_mask = 0;
+		layer->_blend = (uint8_t)blend;
+		layer->_priority = priority;
+		layer->_active = 1;
+		thirdspacevest_mutex_unlock(&dev->_mix_lock);
+		return i;
+	}
+	thirdspacevest_mutex_unlock(&dev->_mix_lock);
+	return E_NPUTIL_BUSY;
+}
+
+int thirdspacevest_mixer_remove_layer(thirdspacevest_device* dev, int layer)
+{
+	int ret = 0;
+	thirdspacevest_mutex_lock(&dev->_mix_lock);
+	if(thirdspacevest_layer_valid(dev, layer))
+	{
+		dev->_layers[layer]._active = 0;
+	}
+	else
+	{
+		ret = E_NPUTIL_INVALID_PARAM;
+	}
+	thirdspacevest_mutex_unlock(&dev->_mix_lock);
+	return ret;
+}
+
+int thirdspacevest_mixer_set_layer(thirdspacevest_device* dev, int layer, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT], uint8_t mask)
+{
+	int ret = 0;
+	int i;
+	thirdspacevest_mutex_lock(&dev->_mix_lock);
+	if(thirdspacevest_layer_valid(dev, layer))
+	{
+		for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+		{
+			if(mask & (1 << i))
+			{
+				dev->_layers[layer]._speeds[i] = speeds[i];
+			}
+		}
+		dev->_layers[layer]._mask |= mask;
+	}
+	else
+	{
+		ret = E_NPUTIL_INVALID_PARAM;
+	}
+	thirdspacevest_mutex_unlock(&dev->_mix_lock);
+	return ret;
+}
+
+int thirdspacevest_mixer_clear_layer(thirdspacevest_device* dev, int layer, uint8_t mask)
+{
+	int ret = 0;
+	thirdspacevest_mutex_lock(&dev->_mix_lock);
+	if(thirdspacevest_layer_valid(dev, layer))
+	{
+		dev->_layers[layer]._mask &= ~mask;
+	}
+	else
+	{
+		ret = E_NPUTIL_INVALID_PARAM;
+	}
+	thirdspacevest_mutex_unlock(&dev->_mix_lock);
+	return ret;
+}
+
+/**
+ * Blends every active layer into speeds, lowest priority first. Called
+ * with _mix_lock held.
+ */
+static void thirdspacevest_composite(thirdspacevest_device* dev, uint8_t speeds[THIRDSPACEVEST_CELL_COUNT])
+{
+	int order[THIRDSPACEVEST_MAX_LAYERS];
+	int count = 0;
+	int i, j, cell;
+
+	// Insertion sort, there are only ever a handful of layers and it
+	// keeps creation order for equal priorities.
+	for(i = 0; i < THIRDSPACEVEST_MAX_LAYERS; ++i)
+	{
+		if(!dev->_layers[i]._active)
+		{
+			continue;
+		}
+		for(j = count; j > 0 && dev->_layers[order[j - 1]]._priority > dev->_layers[i]._priority; --j)
+		{
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+		++count;
+	}
+
+	memset(speeds, 0, THIRDSPACEVEST_CELL_COUNT);
+	for(i = 0; i < count; ++i)
+	{
+		const thirdspacevest_layer* layer = &dev->_layers[order[i]];
+		for(cell = 0; cell < THIRDSPACEVEST_CELL_COUNT; ++cell)
+		{
+			int speed;
+			if(!(layer->_mask & (1 << cell)))
+			{
+				continue;
+			}
+			switch(layer->_blend)
+			{
+			case THIRDSPACEVEST_BLEND_SUM:
+				speed = speeds[cell] + layer->_speeds[cell];
+				speeds[cell] = speed > 255 ? 255 : (uint8_t)speed;
+				break;
+			case THIRDSPACEVEST_BLEND_REPLACE:
+				speeds[cell] = layer->_speeds[cell];
+				break;
+			default:
+				if(layer->_speeds[cell] > speeds[cell])
+				{
+					speeds[cell] = layer->_speeds[cell];
+				}
+				break;
+			}
+		}
+	}
+}
+
+int thirdspacevest_mixer_tick(thirdspacevest_device* dev)
+{
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	uint8_t changed = 0;
+	int ret;
+	int i;
+
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	thirdspacevest_mutex_lock(&dev->_mix_lock);
+	thirdspacevest_composite(dev, speeds);
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		// Cells no layer ever drove stay at 0 on both sides, so the mixer
+		// doesn't stomp on effects sent outside of it.
+		if(speeds[i] != dev->_mix_speeds[i])
+		{
+			changed |= (1 << i);
+		}
+	}
+	thirdspacevest_mutex_unlock(&dev->_mix_lock);
+
+	if(!changed)
+	{
+		return 0;
+	}
+	ret = thirdspacevest_send_frame(dev, speeds, changed);
+	if(ret >= 0)
+	{
+		memcpy(dev->_mix_speeds, speeds, sizeof(speeds));
+	}
+	return ret;
+}
@@ -0,0 +1,216 @@
+/*
+ * Third Space Vest Driver - Loopback transport
+ *
+ * Writes go nowhere, status reads come back as zeros, and every
+ * transfer stage takes a fixed latency. Async transfers complete in
+ * thirdspacevest_handle_events like they would on USB, so the pool,
+ * frames and the I/O thread behave the same as on hardware.
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define THIRDSPACEVEST_NULL_WRITING 1
+#define THIRDSPACEVEST_NULL_READING 2
+
+typedef struct {
+	/// Time each transfer stage takes, in microseconds
+	uint32_t _latency_us;
+} thirdspacevest_null_data;
+
+static uint32_t thirdspacevest_null_latency(thirdspacevest_device* dev)
+{
+	return ((thirdspacevest_null_data*)dev->_transport_data)->_latency_us;
+}
+
+static int thirdspacevest_null_get_count(thirdspacevest_device* dev)
+{
+	(void)dev;
+	return 1;
+}
+
+static int thirdspacevest_null_open(thirdspacevest_device* dev, uint32_t device_index)
+{
+	if(device_index != 0)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	dev->_pending = 0;
+	dev->_is_open = 1;
+	return 0;
+}
+
+static int thirdspacevest_null_close(thirdspacevest_device* dev)
+{
+	int i;
+	// Nothing is really in flight, so whatever is left just gets dropped.
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		dev->_slots[i]._in_use = 0;
+	}
+	dev->_pending = 0;
+	dev->_is_open = 0;
+	return 0;
+}
+
+/**
+ * Busy waits for one transfer stage. Sleeping would put the scheduler's
+ * granularity into every measurement.
+ */
+static void thirdspacevest_null_transfer(thirdspacevest_device* dev)
+{
+	uint64_t start = thirdspacevest_time_us();
+	uint32_t latency = thirdspacevest_null_latency(dev);
+	while(thirdspacevest_time_us() - start < latency)
+	{
+	}
+}
+
+static int thirdspacevest_null_write(thirdspacevest_device* dev, uint8_t* output_report)
+{
+	(void)output_report;
+	thirdspacevest_null_transfer(dev);
+	return THIRDSPACEVEST_PACKET_SIZE;
+}
+
+static int thirdspacevest_null_read(thirdspacevest_device* dev, uint8_t* input_report)
+{
+	thirdspacevest_null_transfer(dev);
+	memset(input_report, 0, THIRDSPACEVEST_PACKET_SIZE);
+	return THIRDSPACEVEST_PACKET_SIZE;
+}
+
+static int thirdspacevest_null_write_async(thirdspacevest_device* dev, const uint8_t* output_report, thirdspacevest_async_cb callback, void* user_data)
+{
+	int i;
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		thirdspacevest_transfer_slot* slot = &dev->_slots[i];
+		if(slot->_in_use)
+		{
+			continue;
+		}
+		memcpy(slot->_out_buffer, output_report, THIRDSPACEVEST_PACKET_SIZE);
+		slot->_callback = callback;
+		slot->_user_data = user_data;
+		slot->_stage_us = thirdspacevest_time_us();
+		slot->_in_use = THIRDSPACEVEST_NULL_WRITING;
+		++dev->_pending;
+		return 0;
+	}
+	return E_NPUTIL_BUSY;
+}
+
+/**
+ * Moves every slot whose current stage is due on to the next one.
+ *
+ * @return Number of stages completed
+ */
+static int thirdspacevest_null_advance(thirdspacevest_device* dev, uint32_t latency)
+{
+	int i;
+	int done = 0;
+	uint64_t now = thirdspacevest_time_us();
+
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		thirdspacevest_transfer_slot* slot = &dev->_slots[i];
+		thirdspacevest_async_cb callback;
+		void* user_data;
+
+		if(!slot->_in_use || now - slot->_stage_us < latency)
+		{
+			continue;
+		}
+		++done;
+		if(slot->_in_use == THIRDSPACEVEST_NULL_WRITING)
+		{
+			thirdspacevest_record_stage(dev, &dev->_write_latency, now - slot->_stage_us);
+			thirdspacevest_trace_transfer(dev, THIRDSPACEVEST_TRACE_WRITE, slot->_stage_us, now, 0);
+			if(thirdspacevest_atomic_load(&dev->_ack_mode) != THIRDSPACEVEST_ACK_NONE)
+			{
+				slot->_stage_us = now;
+				slot->_in_use = THIRDSPACEVEST_NULL_READING;
+				continue;
+			}
+		}
+		else
+		{
+			thirdspacevest_record_stage(dev, &dev->_ack_latency, now - slot->_stage_us);
+			thirdspacevest_trace_transfer(dev, THIRDSPACEVEST_TRACE_READ, slot->_stage_us, now, 0);
+			memset(slot->_in_buffer, 0, THIRDSPACEVEST_PACKET_SIZE);
+		}
+		callback = slot->_callback;
+		user_data = slot->_user_data;
+		slot->_in_use = 0;
+		--dev->_pending;
+		if(callback)
+		{
+			callback(dev, 0, user_data);
+		}
+	}
+	return done;
+}
+
+static int thirdspacevest_null_handle_events(thirdspacevest_device* dev, int timeout_ms)
+{
+	uint32_t latency = thirdspacevest_null_latency(dev);
+	uint64_t start = thirdspacevest_time_us();
+
+	// Like libusb_handle_events_timeout_completed, return as soon as
+	// something completed, or once the timeout runs out.
+	while(!thirdspacevest_null_advance(dev, latency))
+	{
+		if(!dev->_pending || thirdspacevest_time_us() - start >= (uint64_t)timeout_ms * 1000)
+		{
+			break;
+		}
+		thirdspacevest_thread_yield();
+	}
+	return 0;
+}
+
+static void thirdspacevest_null_destroy(thirdspacevest_device* dev)
+{
+	free(dev->_transport_data);
+}
+
+static const thirdspacevest_transport thirdspacevest_null_transport = {
+	"null",
+	thirdspacevest_null_get_count,
+	thirdspacevest_null_open,
+	thirdspacevest_null_close,
+	thirdspacevest_null_write,
+	thirdspacevest_null_read,
+	thirdspacevest_null_write_async,
+	thirdspacevest_null_handle_events,
+	thirdspacevest_null_destroy,
+	NULL
+};
+
+thirdspacevest_device* thirdspacevest_create_null(uint32_t latency_us)
+{
+	thirdspacevest_device* dev;
+	thirdspacevest_null_data* data = (thirdspacevest_null_data*)malloc(sizeof(thirdspacevest_null_data));
+	if(!data)
+	{
+		return NULL;
+	}
+	data->_latency_us = latency_us;
+	dev = thirdspacevest_create_with_transport(&thirdspacevest_null_transport, data);
+	if(!dev)
+	{
+		free(data);
+	}
+	return dev;
+}
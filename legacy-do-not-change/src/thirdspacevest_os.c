@@ -0,0 +1,225 @@
+/*
+ * Third Space Vest Driver - Thread and event wrappers
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+
+#if defined(WIN32)
+
+int thirdspacevest_thread_start(thirdspacevest_thread* thread, thirdspacevest_thread_func func, void* arg)
+{
+	*thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+	return *thread ? 0 : E_NPUTIL_DRIVER_ERROR;
+}
+
+void thirdspacevest_thread_join(thirdspacevest_thread* thread)
+{
+	WaitForSingleObject(*thread, INFINITE);
+	CloseHandle(*thread);
+}
+
+int thirdspacevest_mutex_init(thirdspacevest_mutex* mutex)
+{
+	InitializeCriticalSection(mutex);
+	return 0;
+}
+
+void thirdspacevest_mutex_destroy(thirdspacevest_mutex* mutex)
+{
+	DeleteCriticalSection(mutex);
+}
+
+void thirdspacevest_mutex_lock(thirdspacevest_mutex* mutex)
+{
+	EnterCriticalSection(mutex);
+}
+
+void thirdspacevest_mutex_unlock(thirdspacevest_mutex* mutex)
+{
+	LeaveCriticalSection(mutex);
+}
+
+int thirdspacevest_event_init(thirdspacevest_event* event)
+{
+	*event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	return *event ? 0 : E_NPUTIL_DRIVER_ERROR;
+}
+
+void thirdspacevest_event_destroy(thirdspacevest_event* event)
+{
+	CloseHandle(*event);
+}
+
+void thirdspacevest_event_signal(thirdspacevest_event* event)
+{
+	SetEvent(*event);
+}
+
+int thirdspacevest_event_wait(thirdspacevest_event* event, int timeout_ms)
+{
+	return WaitForSingleObject(*event, timeout_ms) == WAIT_OBJECT_0 ? 0 : 1;
+}
+
+uint64_t thirdspacevest_time_us()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER now;
+	if(!frequency.QuadPart)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000 +
+		(uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+void thirdspacevest_thread_yield()
+{
+	SwitchToThread();
+}
+
+#else
+
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/time.h>
+
+int thirdspacevest_thread_start(thirdspacevest_thread* thread, thirdspacevest_thread_func func, void* arg)
+{
+	return pthread_create(thread, NULL, func, arg) == 0 ? 0 : E_NPUTIL_DRIVER_ERROR;
+}
+
+void thirdspacevest_thread_join(thirdspacevest_thread* thread)
+{
+	pthread_join(*thread, NULL);
+}
+
+int thirdspacevest_mutex_init(thirdspacevest_mutex* mutex)
+{
+	return pthread_mutex_init(mutex, NULL) == 0 ? 0 : E_NPUTIL_DRIVER_ERROR;
+}
+
+void thirdspacevest_mutex_destroy(thirdspacevest_mutex* mutex)
+{
+	pthread_mutex_destroy(mutex);
+}
+
+void thirdspacevest_mutex_lock(thirdspacevest_mutex* mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+void thirdspacevest_mutex_unlock(thirdspacevest_mutex* mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+int thirdspacevest_event_init(thirdspacevest_event* event)
+{
+	event->_signaled = 0;
+	if(pthread_mutex_init(&event->_lock, NULL) != 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	if(pthread_cond_init(&event->_cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&event->_lock);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return 0;
+}
+
+void thirdspacevest_event_destroy(thirdspacevest_event* event)
+{
+	pthread_cond_destroy(&event->_cond);
+	pthread_mutex_destroy(&event->_lock);
+}
+
+void thirdspacevest_event_signal(thirdspacevest_event* event)
+{
+	pthread_mutex_lock(&event->_lock);
+	event->_signaled = 1;
+	pthread_cond_signal(&event->_cond);
+	pthread_mutex_unlock(&event->_lock);
+}
+
+int thirdspacevest_event_wait(thirdspacevest_event* event, int timeout_ms)
+{
+	struct timeval now;
+	struct timespec deadline;
+	int ret = 0;
+
+	// gettimeofday rather than clock_gettime, OS X doesn't have the latter
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + (long)(timeout_ms % 1000) * 1000000;
+	if(deadline.tv_nsec >= 1000000000)
+	{
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&event->_lock);
+	while(!event->_signaled && ret != ETIMEDOUT)
+	{
+		ret = pthread_cond_timedwait(&event->_cond, &event->_lock, &deadline);
+	}
+	ret = event->_signaled ? 0 : 1;
+	event->_signaled = 0;
+	pthread_mutex_unlock(&event->_lock);
+	return ret;
+}
+
+uint64_t thirdspacevest_time_us()
+{
+#if defined(CLOCK_MONOTONIC)
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+#endif
+}
+
+void thirdspacevest_thread_yield()
+{
+	sched_yield();
+}
+
+#endif
+
+int thirdspacevest_once_begin(volatile uint32_t* once)
+{
+	uint32_t state;
+	for(;;)
+	{
+		state = thirdspacevest_atomic_load(once);
+		if(state == THIRDSPACEVEST_ONCE_DONE)
+		{
+			return 0;
+		}
+		if(state == 0 && thirdspacevest_atomic_cas(once, 0, THIRDSPACEVEST_ONCE_BUILDING))
+		{
+			return 1;
+		}
+		// Someone else is building, wait for them to publish
+		thirdspacevest_thread_yield();
+	}
+}
+
+void thirdspacevest_once_end(volatile uint32_t* once)
+{
+	thirdspacevest_atomic_store(once, THIRDSPACEVEST_ONCE_DONE);
+}
@@ -0,0 +1,240 @@
+/*
+ * Third Space Vest Driver - Capture recording and replay
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	FILE* _file;
+	/// Serializes records from the caller and the I/O thread
+	thirdspacevest_mutex _lock;
+	/// thirdspacevest_time_us when the recorder was created
+	uint64_t _start_us;
+	/// Device I/O is passed through to, or NULL
+	thirdspacevest_device* _forward;
+	/// Nonzero if open opened _forward, so close has to close it
+	int _opened_forward;
+} thirdspacevest_record_data;
+
+static thirdspacevest_record_data* thirdspacevest_record_get(thirdspacevest_device* dev)
+{
+	return (thirdspacevest_record_data*)dev->_transport_data;
+}
+
+static void thirdspacevest_record_append(thirdspacevest_record_data* rec, uint8_t direction, const uint8_t* data, int failed)
+{
+	thirdspacevest_capture_record record;
+	memset(&record, 0, sizeof(record));
+	record.time_us = thirdspacevest_time_us() - rec->_start_us;
+	record.direction = direction;
+	record.failed = failed ? 1 : 0;
+	memcpy(record.data, data, THIRDSPACEVEST_PACKET_SIZE);
+	thirdspacevest_mutex_lock(&rec->_lock);
+	fwrite(&record, sizeof(record), 1, rec->_file);
+	thirdspacevest_mutex_unlock(&rec->_lock);
+}
+
+static int thirdspacevest_record_get_count(thirdspacevest_device* dev)
+{
+	thirdspacevest_record_data* rec = thirdspacevest_record_get(dev);
+	return rec->_forward ? thirdspacevest_get_count(rec->_forward) : 1;
+}
+
+static int thirdspacevest_record_open(thirdspacevest_device* dev, uint32_t device_index)
+{
+	thirdspacevest_record_data* rec = thirdspacevest_record_get(dev);
+	int ret;
+	if(rec->_forward && !rec->_forward->_is_open)
+	{
+		if((ret = thirdspacevest_open(rec->_forward, device_index)) < 0)
+		{
+			return ret;
+		}
+		rec->_opened_forward = 1;
+	}
+	dev->_is_open = 1;
+	return 0;
+}
+
+static int thirdspacevest_record_close(thirdspacevest_device* dev)
+{
+	thirdspacevest_record_data* rec = thirdspacevest_record_get(dev);
+	int ret = 0;
+	if(rec->_opened_forward)
+	{
+		ret = thirdspacevest_close(rec->_forward);
+		rec->_opened_forward = 0;
+	}
+	thirdspacevest_mutex_lock(&rec->_lock);
+	fflush(rec->_file);
+	thirdspacevest_mutex_unlock(&rec->_lock);
+	dev->_is_open = 0;
+	return ret;
+}
+
+static int thirdspacevest_record_write(thirdspacevest_device* dev, uint8_t* output_report)
+{
+	thirdspacevest_record_data* rec = thirdspacevest_record_get(dev);
+	int ret = THIRDSPACEVEST_PACKET_SIZE;
+	if(rec->_forward)
+	{
+		ret = thirdspacevest_write_data(rec->_forward, output_report);
+	}
+	thirdspacevest_record_append(rec, THIRDSPACEVEST_CAPTURE_OUT, output_report, ret < 0);
+	return ret;
+}
+
+static int thirdspacevest_record_read(thirdspacevest_device* dev, uint8_t* input_report)
+{
+	thirdspacevest_record_data* rec = thirdspacevest_record_get(dev);
+	int ret = THIRDSPACEVEST_PACKET_SIZE;
+	memset(input_report, 0, THIRDSPACEVEST_PACKET_SIZE);
+	if(rec->_forward)
+	{
+		ret = thirdspacevest_read_data(rec->_forward, input_report);
+	}
+	thirdspacevest_record_append(rec, THIRDSPACEVEST_CAPTURE_IN, input_report, ret < 0);
+	return ret;
+}
+
+static void thirdspacevest_record_destroy(thirdspacevest_device* dev)
+{
+	thirdspacevest_record_data* rec = thirdspacevest_record_get(dev);
+	fclose(rec->_file);
+	thirdspacevest_mutex_destroy(&rec->_lock);
+	free(rec);
+}
+
+// No async calls, the library runs queued packets through write/read
+// from thirdspacevest_handle_events, so all of them end up in the file.
+static const thirdspacevest_transport thirdspacevest_record_transport = {
+	"record",
+	thirdspacevest_record_get_count,
+	thirdspacevest_record_open,
+	thirdspacevest_record_close,
+	thirdspacevest_record_write,
+	thirdspacevest_record_read,
+	NULL,
+	NULL,
+	thirdspacevest_record_destroy,
+	NULL
+};
+
+thirdspacevest_device* thirdspacevest_create_recorder(const char* path, thirdspacevest_device* forward)
+{
+	thirdspacevest_capture_header header;
+	thirdspacevest_record_data* rec;
+	thirdspacevest_device* dev;
+
+	rec = (thirdspacevest_record_data*)malloc(sizeof(thirdspacevest_record_data));
+	if(!rec)
+	{
+		return NULL;
+	}
+	rec->_file = fopen(path, "wb");
+	if(!rec->_file)
+	{
+		free(rec);
+		return NULL;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "TSVC", 4);
+	header.version = THIRDSPACEVEST_CAPTURE_VERSION;
+	header.record_size = sizeof(thirdspacevest_capture_record);
+	fwrite(&header, sizeof(header), 1, rec->_file);
+	thirdspacevest_mutex_init(&rec->_lock);
+	rec->_start_us = thirdspacevest_time_us();
+	rec->_forward = forward;
+	rec->_opened_forward = 0;
+
+	dev = thirdspacevest_create_with_transport(&thirdspacevest_record_transport, rec);
+	if(!dev)
+	{
+		fclose(rec->_file);
+		thirdspacevest_mutex_destroy(&rec->_lock);
+		free(rec);
+	}
+	return dev;
+}
+
+void thirdspacevest_replay_wait(thirdspacevest_event* event, uint64_t due)
+{
+	uint64_t now;
+	while((now = thirdspacevest_time_us()) < due)
+	{
+		if(due - now > 2000)
+		{
+			thirdspacevest_event_wait(event, (int)((due - now) / 1000) - 1);
+		}
+		else
+		{
+			thirdspacevest_thread_yield();
+		}
+	}
+}
+
+int thirdspacevest_replay_capture(thirdspacevest_device* dev, const char* path, double speed)
+{
+	thirdspacevest_capture_header header;
+	thirdspacevest_capture_record record;
+	thirdspacevest_event event;
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	uint64_t start;
+	FILE* file;
+	int sent = 0;
+	int ret = 0;
+
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	file = fopen(path, "rb");
+	if(!file)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "TSVC", 4) ||
+	   header.version != THIRDSPACEVEST_CAPTURE_VERSION || header.record_size != sizeof(record))
+	{
+		fclose(file);
+		return E_NPUTIL_INVALID_PARAM;
+	}
+
+	thirdspacevest_event_init(&event);
+	start = thirdspacevest_time_us();
+	while(fread(&record, sizeof(record), 1, file) == 1)
+	{
+		if(speed > 0)
+		{
+			thirdspacevest_replay_wait(&event, start + (uint64_t)(record.time_us / speed));
+		}
+		if(record.direction == THIRDSPACEVEST_CAPTURE_IN)
+		{
+			// The report itself doesn't matter, the vest just expects to
+			// be read from at the same points.
+			thirdspacevest_read_data(dev, packet);
+			continue;
+		}
+		memcpy(packet, record.data, THIRDSPACEVEST_PACKET_SIZE);
+		if((ret = thirdspacevest_write_data(dev, packet)) < 0)
+		{
+			break;
+		}
+		++sent;
+	}
+	thirdspacevest_event_destroy(&event);
+	fclose(file);
+	return ret < 0 ? ret : sent;
+}
@@ -0,0 +1,323 @@
+/*
+ * Third Space Vest Driver - Effect sequencer
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <string.h>
+
+/// Longest the sequencer sleeps when nothing is scheduled, in microseconds
+#define THIRDSPACEVEST_SEQ_IDLE_US 100000
+/// How close to a deadline the sequencer stops sleeping and starts
+/// yielding, since OS sleeps are only good to about a millisecond
+#define THIRDSPACEVEST_SEQ_SPIN_US 1500
+/// Retry delay when the I/O thread ring is full
+#define THIRDSPACEVEST_SEQ_RETRY_US 1000
+
+void thirdspacevest_init_sequencer_state(thirdspacevest_device* dev)
+{
+	memset(dev->_voices, 0, sizeof(dev->_voices));
+	memset(dev->_seq_speeds, 0, sizeof(dev->_seq_speeds));
+	dev->_seq_running = 0;
+	dev->_seq_dirty = 0;
+	dev->_seq_owns_io = 0;
+	thirdspacevest_mutex_init(&dev->_seq_lock);
+}
+
+/**
+ * Mixes every live step at the given time into speeds, and retires
+ * effects that have finished. Called with _seq_lock held.
+ *
+ * @return Clock time of the next step boundary
+ */
+static uint64_t thirdspacevest_mix_voices(thirdspacevest_device* dev, uint64_t now, uint8_t speeds[THIRDSPACEVEST_CELL_COUNT])
+{
+	uint64_t next = now + THIRDSPACEVEST_SEQ_IDLE_US;
+	int i, j, k;
+
+	memset(speeds, 0, THIRDSPACEVEST_CELL_COUNT);
+	for(i = 0; i < THIRDSPACEVEST_MAX_VOICES; ++i)
+	{
+		thirdspacevest_voice* voice = &dev->_voices[i];
+		uint64_t elapsed;
+		if(!voice->_active)
+		{
+			continue;
+		}
+		elapsed = now - voice->_start_us;
+		if(elapsed >= voice->_end_us)
+		{
+			voice->_active = 0;
+			continue;
+		}
+		for(j = 0; j < voice->_step_count; ++j)
+		{
+			const thirdspacevest_step* step = &voice->_steps[j];
+			uint64_t end = (uint64_t)step->start_us + step->duration_us;
+			if(elapsed < step->start_us)
+			{
+				if(voice->_start_us + step->start_us < next)
+				{
+					next = voice->_start_us + step->start_us;
+				}
+				continue;
+			}
+			if(elapsed >= end)
+			{
+				continue;
+			}
+			if(voice->_start_us + end < next)
+			{
+				next = voice->_start_us + end;
+			}
+			for(k = 0; k < THIRDSPACEVEST_CELL_COUNT; ++k)
+			{
+				if((step->cell_mask & (1 << k)) && step->speed > speeds[k])
+				{
+					speeds[k] = step->speed;
+				}
+			}
+		}
+	}
+	return next;
+}
+
+/**
+ * Queues whatever cells differ from the last mix.
+ *
+ * @return 0 if everything was queued, otherwise < 0
+ */
+static int thirdspacevest_output_mix(thirdspacevest_device* dev, const uint8_t speeds[THIRDSPACEVEST_CELL_COUNT])
+{
+	uint8_t i;
+	uint8_t mask = 0;
+	int ret;
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		// Cells no effect ever touched stay at 0 on both sides, so the
+		// sequencer never stomps on effects sent outside of it.
+		if(speeds[i] != dev->_seq_speeds[i])
+		{
+			mask |= (1 << i);
+		}
+	}
+	if((ret = thirdspacevest_enqueue_cells(dev, speeds, mask, 0)) < 0)
+	{
+		return ret;
+	}
+	memcpy(dev->_seq_speeds, speeds, THIRDSPACEVEST_CELL_COUNT);
+	return 0;
+}
+
+/**
+ * Sleeps until the deadline, or until an effect is added or cancelled.
+ */
+static void thirdspacevest_wait_until(thirdspacevest_device* dev, uint64_t deadline)
+{
+	uint64_t now = thirdspacevest_time_us();
+	if(deadline > now + THIRDSPACEVEST_SEQ_SPIN_US)
+	{
+		if(thirdspacevest_event_wait(&dev->_seq_wakeup, (int)((deadline - now - THIRDSPACEVEST_SEQ_SPIN_US) / 1000)) == 0)
+		{
+			return;
+		}
+	}
+	while(thirdspacevest_time_us() < deadline &&
+		  !thirdspacevest_atomic_load(&dev->_seq_dirty) &&
+		  thirdspacevest_atomic_load(&dev->_seq_running))
+	{
+		thirdspacevest_thread_yield();
+	}
+}
+
+THIRDSPACEVEST_THREAD_FUNC(thirdspacevest_sequencer_main, arg)
+{
+	thirdspacevest_device* dev = (thirdspacevest_device*)arg;
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	uint64_t now, next;
+
+	while(thirdspacevest_atomic_load(&dev->_seq_running))
+	{
+		thirdspacevest_atomic_store(&dev->_seq_dirty, 0);
+		now = thirdspacevest_time_us();
+		thirdspacevest_mutex_lock(&dev->_seq_lock);
+		next = thirdspacevest_mix_voices(dev, now, speeds);
+		thirdspacevest_mutex_unlock(&dev->_seq_lock);
+		if(thirdspacevest_output_mix(dev, speeds) < 0 && next > now + THIRDSPACEVEST_SEQ_RETRY_US)
+		{
+			next = now + THIRDSPACEVEST_SEQ_RETRY_US;
+		}
+		thirdspacevest_wait_until(dev, next);
+	}
+	THIRDSPACEVEST_THREAD_RETURN;
+}
+
+int thirdspacevest_start_sequencer(thirdspacevest_device* dev)
+{
+	int ret;
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	if(thirdspacevest_atomic_load(&dev->_seq_running))
+	{
+		return 0;
+	}
+	dev->_seq_owns_io = 0;
+	if(!thirdspacevest_atomic_load(&dev->_io_running))
+	{
+		if((ret = thirdspacevest_start_io_thread(dev)) < 0)
+		{
+			return ret;
+		}
+		dev->_seq_owns_io = 1;
+	}
+	if(thirdspacevest_event_init(&dev->_seq_wakeup) < 0)
+	{
+		ret = E_NPUTIL_DRIVER_ERROR;
+		goto fail;
+	}
+	memset(dev->_seq_speeds, 0, sizeof(dev->_seq_speeds));
+	thirdspacevest_atomic_store(&dev->_seq_running, 1);
+	if(thirdspacevest_thread_start(&dev->_seq_thread, thirdspacevest_sequencer_main, dev) < 0)
+	{
+		thirdspacevest_atomic_store(&dev->_seq_running, 0);
+		thirdspacevest_event_destroy(&dev->_seq_wakeup);
+		ret = E_NPUTIL_DRIVER_ERROR;
+		goto fail;
+	}
+	return 0;
+fail:
+	if(dev->_seq_owns_io)
+	{
+		thirdspacevest_stop_io_thread(dev);
+		dev->_seq_owns_io = 0;
+	}
+	return ret;
+}
+
+int thirdspacevest_stop_sequencer(thirdspacevest_device* dev)
+{
+	uint8_t speeds[THIRDSPACEVEST_CELL_COUNT];
+	int i;
+	if(!thirdspacevest_atomic_load(&dev->_seq_running))
+	{
+		return 0;
+	}
+	thirdspacevest_atomic_store(&dev->_seq_running, 0);
+	thirdspacevest_event_signal(&dev->_seq_wakeup);
+	thirdspacevest_thread_join(&dev->_seq_thread);
+	thirdspacevest_event_destroy(&dev->_seq_wakeup);
+
+	thirdspacevest_mutex_lock(&dev->_seq_lock);
+	for(i = 0; i < THIRDSPACEVEST_MAX_VOICES; ++i)
+	{
+		dev->_voices[i]._active = 0;
+	}
+	thirdspacevest_mutex_unlock(&dev->_seq_lock);
+
+	// Let go of any cell an effect was still holding up.
+	memset(speeds, 0, sizeof(speeds));
+	while(thirdspacevest_output_mix(dev, speeds) == E_NPUTIL_BUSY)
+	{
+		thirdspacevest_thread_yield();
+	}
+	if(dev->_seq_owns_io)
+	{
+		thirdspacevest_stop_io_thread(dev);
+		dev->_seq_owns_io = 0;
+	}
+	return 0;
+}
+
+int thirdspacevest_play_effect(thirdspacevest_device* dev, const thirdspacevest_step* steps, int count)
+{
+	thirdspacevest_voice* voice = NULL;
+	uint32_t end = 0;
+	int handle;
+	int i;
+
+	if(!thirdspacevest_atomic_load(&dev->_seq_running))
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	if(!steps || count <= 0 || count > THIRDSPACEVEST_MAX_STEPS)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	for(i = 0; i < count; ++i)
+	{
+		uint64_t step_end = (uint64_t)steps[i].start_us + steps[i].duration_us;
+		if(step_end > 0xFFFFFFFF || steps[i].reserved)
+		{
+			return E_NPUTIL_INVALID_PARAM;
+		}
+		if(step_end > end)
+		{
+			end = (uint32_t)step_end;
+		}
+	}
+
+	thirdspacevest_mutex_lock(&dev->_seq_lock);
+	for(i = 0; i < THIRDSPACEVEST_MAX_VOICES; ++i)
+	{
+		if(!dev->_voices[i]._active)
+		{
+			voice = &dev->_voices[i];
+			break;
+		}
+	}
+	if(!voice)
+	{
+		thirdspacevest_mutex_unlock(&dev->_seq_lock);
+		return E_NPUTIL_BUSY;
+	}
+	memcpy(voice->_steps, steps, count * sizeof(thirdspacevest_step));
+	voice->_step_count = count;
+	voice->_end_us = end;
+	// Keep handles positive and inside an int once the slot is folded in.
+	voice->_generation = (voice->_generation + 1) % (0x7FFFFFFF / THIRDSPACEVEST_MAX_VOICES);
+	if(!voice->_generation)
+	{
+		voice->_generation = 1;
+	}
+	voice->_start_us = thirdspacevest_time_us();
+	voice->_active = 1;
+	handle = (int)voice->_generation * THIRDSPACEVEST_MAX_VOICES + i;
+	thirdspacevest_mutex_unlock(&dev->_seq_lock);
+
+	thirdspacevest_atomic_store(&dev->_seq_dirty, 1);
+	thirdspacevest_event_signal(&dev->_seq_wakeup);
+	return handle;
+}
+
+int thirdspacevest_cancel_effect(thirdspacevest_device* dev, int handle)
+{
+	thirdspacevest_voice* voice;
+	if(handle < THIRDSPACEVEST_MAX_VOICES)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	voice = &dev->_voices[handle % THIRDSPACEVEST_MAX_VOICES];
+	thirdspacevest_mutex_lock(&dev->_seq_lock);
+	if(voice->_generation == (uint32_t)(handle / THIRDSPACEVEST_MAX_VOICES))
+	{
+		voice->_active = 0;
+	}
+	thirdspacevest_mutex_unlock(&dev->_seq_lock);
+
+	if(thirdspacevest_atomic_load(&dev->_seq_running))
+	{
+		thirdspacevest_atomic_store(&dev->_seq_dirty, 1);
+		thirdspacevest_event_signal(&dev->_seq_wakeup);
+	}
+	return 0;
+}
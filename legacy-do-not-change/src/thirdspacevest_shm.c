@@ -0,0 +1,533 @@
+/*
+ * Third Space Vest Driver - Shared memory command channel
+ *
+ * The ring is the same bounded MPSC queue as the I/O thread's (see
+ * thirdspacevest_io_thread.c), laid out in a named mapping so that
+ * producers can live in other processes.
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/// Longest channel name accepted, leaving room for prefixes and suffixes
+#define THIRDSPACEVEST_SHM_MAX_NAME 48
+
+// Producers and consumer can be built by different compilers, so the
+// layout is pinned.
+typedef char thirdspacevest_shm_command_size_check[sizeof(thirdspacevest_shm_command) == 16 ? 1 : -1];
+typedef char thirdspacevest_shm_header_size_check[sizeof(thirdspacevest_shm_header) == 192 ? 1 : -1];
+
+static size_t thirdspacevest_shm_size(uint32_t capacity)
+{
+	return sizeof(thirdspacevest_shm_header) + (size_t)capacity * sizeof(thirdspacevest_shm_command);
+}
+
+/**
+ * Checks a mapping someone else created before it gets used.
+ */
+static int thirdspacevest_shm_valid(const thirdspacevest_shm_header* header, size_t size)
+{
+	if(size < sizeof(thirdspacevest_shm_header) || memcmp(header->magic, "TSVQ", 4) ||
+	   header->version != THIRDSPACEVEST_SHM_VERSION || header->command_size != sizeof(thirdspacevest_shm_command))
+	{
+		return 0;
+	}
+	if(!header->capacity || header->capacity > THIRDSPACEVEST_SHM_MAX_CAPACITY ||
+	   (header->capacity & (header->capacity - 1)) || thirdspacevest_shm_size(header->capacity) > size)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+static void thirdspacevest_shm_init_ring(thirdspacevest_shm* shm, uint32_t capacity)
+{
+	thirdspacevest_shm_header* header = shm->_header;
+	uint32_t i;
+	memset(header, 0, thirdspacevest_shm_size(capacity));
+	header->version = THIRDSPACEVEST_SHM_VERSION;
+	header->command_size = sizeof(thirdspacevest_shm_command);
+	header->capacity = capacity;
+#if defined(WIN32)
+	header->owner_pid = (uint32_t)GetCurrentProcessId();
+#else
+	header->owner_pid = (uint32_t)getpid();
+#endif
+	for(i = 0; i < capacity; ++i)
+	{
+		shm->_commands[i].sequence = i;
+	}
+	// Magic goes in last, attaching before it's there fails validation
+	// instead of seeing a half built ring.
+	thirdspacevest_atomic_fence();
+	memcpy(header->magic, "TSVQ", 4);
+}
+
+#if defined(WIN32)
+
+static thirdspacevest_shm* thirdspacevest_shm_map(const char* name, uint32_t capacity)
+{
+	thirdspacevest_shm* shm;
+	MEMORY_BASIC_INFORMATION info;
+	char path[THIRDSPACEVEST_SHM_MAX_NAME + 16];
+
+	shm = (thirdspacevest_shm*)malloc(sizeof(thirdspacevest_shm));
+	if(!shm)
+	{
+		return NULL;
+	}
+	memset(shm, 0, sizeof(thirdspacevest_shm));
+	shm->_owner = capacity > 0;
+
+	_snprintf(path, sizeof(path), "Local\\%s", name);
+	path[sizeof(path) - 1] = 0;
+	if(shm->_owner)
+	{
+		shm->_size = thirdspacevest_shm_size(capacity);
+		shm->_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)shm->_size, path);
+		// Mappings go away with their last handle, so an existing one
+		// means another driver is still serving this name.
+		if(shm->_mapping && GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			CloseHandle(shm->_mapping);
+			shm->_mapping = NULL;
+		}
+	}
+	else
+	{
+		shm->_mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, path);
+	}
+	if(!shm->_mapping)
+	{
+		free(shm);
+		return NULL;
+	}
+	shm->_header = (thirdspacevest_shm_header*)MapViewOfFile(shm->_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if(!shm->_header)
+	{
+		CloseHandle(shm->_mapping);
+		free(shm);
+		return NULL;
+	}
+	shm->_commands = (thirdspacevest_shm_command*)(shm->_header + 1);
+	if(!shm->_owner)
+	{
+		VirtualQuery(shm->_header, &info, sizeof(info));
+		shm->_size = info.RegionSize;
+	}
+
+	_snprintf(path, sizeof(path), "Local\\%s.bell", name);
+	path[sizeof(path) - 1] = 0;
+	shm->_bell = shm->_owner ? CreateEventA(NULL, FALSE, FALSE, path) : OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, path);
+	return shm;
+}
+
+static void thirdspacevest_shm_unmap(thirdspacevest_shm* shm)
+{
+	if(shm->_bell)
+	{
+		CloseHandle(shm->_bell);
+	}
+	UnmapViewOfFile(shm->_header);
+	CloseHandle(shm->_mapping);
+}
+
+static void thirdspacevest_shm_ring_bell(thirdspacevest_shm* shm)
+{
+	SetEvent(shm->_bell);
+}
+
+static void thirdspacevest_shm_wait_bell(thirdspacevest_shm* shm, int timeout_ms)
+{
+	WaitForSingleObject(shm->_bell, timeout_ms);
+}
+
+#else
+
+/**
+ * Unlike Windows mappings, names outlive a driver that crashed. Checks
+ * whether the process that created an existing channel is gone, so the
+ * name can be reused. A channel without a complete header counts as
+ * left behind too.
+ */
+static int thirdspacevest_shm_abandoned(const char* name)
+{
+	const thirdspacevest_shm_header* header;
+	struct stat st;
+	pid_t pid = 0;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0)
+	{
+		// Already gone, or belongs to someone we can't touch anyway
+		return errno == ENOENT;
+	}
+	if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(thirdspacevest_shm_header))
+	{
+		header = (const thirdspacevest_shm_header*)mmap(NULL, sizeof(thirdspacevest_shm_header), PROT_READ, MAP_SHARED, fd, 0);
+		if(header != MAP_FAILED)
+		{
+			if(!memcmp(header->magic, "TSVQ", 4))
+			{
+				pid = (pid_t)thirdspacevest_atomic_load(&header->owner_pid);
+			}
+			munmap((void*)header, sizeof(thirdspacevest_shm_header));
+		}
+	}
+	close(fd);
+	// EPERM means the process exists, just not as us.
+	return pid <= 0 || (kill(pid, 0) < 0 && errno == ESRCH);
+}
+
+static thirdspacevest_shm* thirdspacevest_shm_map(const char* name, uint32_t capacity)
+{
+	thirdspacevest_shm* shm;
+	struct stat st;
+	void* data;
+	int fd;
+
+	shm = (thirdspacevest_shm*)malloc(sizeof(thirdspacevest_shm));
+	if(!shm)
+	{
+		return NULL;
+	}
+	memset(shm, 0, sizeof(thirdspacevest_shm));
+	shm->_owner = capacity > 0;
+	snprintf(shm->_name, sizeof(shm->_name), "/%s", name);
+	snprintf(shm->_bell_name, sizeof(shm->_bell_name), "/%s.bell", name);
+
+	if(shm->_owner)
+	{
+		// Same as Windows, a name another driver still serves is in
+		// use. Only one left behind by a dead driver gets replaced.
+		fd = shm_open(shm->_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if(fd < 0 && errno == EEXIST && thirdspacevest_shm_abandoned(shm->_name))
+		{
+			shm_unlink(shm->_name);
+			fd = shm_open(shm->_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		}
+		if(fd >= 0 && ftruncate(fd, thirdspacevest_shm_size(capacity)) < 0)
+		{
+			close(fd);
+			shm_unlink(shm->_name);
+			fd = -1;
+		}
+	}
+	else
+	{
+		fd = shm_open(shm->_name, O_RDWR, 0);
+	}
+	if(fd < 0 || fstat(fd, &st) < 0)
+	{
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+		free(shm);
+		return NULL;
+	}
+	shm->_size = st.st_size;
+	data = mmap(NULL, shm->_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		if(shm->_owner)
+		{
+			shm_unlink(shm->_name);
+		}
+		free(shm);
+		return NULL;
+	}
+	shm->_header = (thirdspacevest_shm_header*)data;
+	shm->_commands = (thirdspacevest_shm_command*)(shm->_header + 1);
+
+#if !defined(__APPLE__)
+	if(shm->_owner)
+	{
+		sem_unlink(shm->_bell_name);
+		shm->_bell = sem_open(shm->_bell_name, O_CREAT, 0600, 0);
+	}
+	else
+	{
+		shm->_bell = sem_open(shm->_bell_name, 0);
+	}
+	if(shm->_bell == SEM_FAILED)
+	{
+		shm->_bell = NULL;
+	}
+#endif
+	return shm;
+}
+
+static void thirdspacevest_shm_unmap(thirdspacevest_shm* shm)
+{
+#if !defined(__APPLE__)
+	if(shm->_bell)
+	{
+		sem_close((sem_t*)shm->_bell);
+	}
+	if(shm->_owner)
+	{
+		sem_unlink(shm->_bell_name);
+	}
+#endif
+	munmap(shm->_header, shm->_size);
+	if(shm->_owner)
+	{
+		shm_unlink(shm->_name);
+	}
+}
+
+static void thirdspacevest_shm_ring_bell(thirdspacevest_shm* shm)
+{
+#if !defined(__APPLE__)
+	sem_post((sem_t*)shm->_bell);
+#endif
+}
+
+static void thirdspacevest_shm_wait_bell(thirdspacevest_shm* shm, int timeout_ms)
+{
+#if !defined(__APPLE__)
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if(ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000;
+	}
+	while(sem_timedwait((sem_t*)shm->_bell, &ts) < 0 && errno == EINTR)
+	{
+	}
+#endif
+}
+
+#endif
+
+thirdspacevest_shm* thirdspacevest_shm_create(const char* name, uint32_t capacity)
+{
+	thirdspacevest_shm* shm;
+	if(!name || !*name || strlen(name) > THIRDSPACEVEST_SHM_MAX_NAME ||
+	   !capacity || capacity > THIRDSPACEVEST_SHM_MAX_CAPACITY || (capacity & (capacity - 1)))
+	{
+		return NULL;
+	}
+	shm = thirdspacevest_shm_map(name, capacity);
+	if(shm)
+	{
+		thirdspacevest_shm_init_ring(shm, capacity);
+		shm->_capacity = capacity;
+	}
+	return shm;
+}
+
+thirdspacevest_shm* thirdspacevest_shm_attach(const char* name)
+{
+	thirdspacevest_shm* shm;
+	if(!name || !*name || strlen(name) > THIRDSPACEVEST_SHM_MAX_NAME)
+	{
+		return NULL;
+	}
+	shm = thirdspacevest_shm_map(name, 0);
+	if(!shm)
+	{
+		return NULL;
+	}
+	// Read once and checked again, since a producer could change the
+	// header between thirdspacevest_shm_valid and here.
+	shm->_capacity = thirdspacevest_atomic_load(&shm->_header->capacity);
+	if(!thirdspacevest_shm_valid(shm->_header, shm->_size) || !shm->_capacity ||
+	   (shm->_capacity & (shm->_capacity - 1)) || thirdspacevest_shm_size(shm->_capacity) > shm->_size)
+	{
+		thirdspacevest_shm_close(shm);
+		return NULL;
+	}
+	return shm;
+}
+
+void thirdspacevest_shm_close(thirdspacevest_shm* shm)
+{
+	thirdspacevest_shm_unmap(shm);
+	free(shm);
+}
+
+int thirdspacevest_shm_post(thirdspacevest_shm* shm, const thirdspacevest_shm_command* command)
+{
+	thirdspacevest_shm_header* header = shm->_header;
+	uint32_t mask = shm->_capacity - 1;
+	thirdspacevest_shm_command* cmd;
+	uint32_t pos;
+	int32_t dif;
+
+	pos = thirdspacevest_atomic_load(&header->head);
+	for(;;)
+	{
+		cmd = &shm->_commands[pos & mask];
+		dif = (int32_t)(thirdspacevest_atomic_load(&cmd->sequence) - pos);
+		if(dif == 0)
+		{
+			if(thirdspacevest_atomic_cas(&header->head, pos, pos + 1))
+			{
+				break;
+			}
+		}
+		else if(dif < 0)
+		{
+			return E_NPUTIL_BUSY;
+		}
+		pos = thirdspacevest_atomic_load(&header->head);
+	}
+
+	cmd->type = command->type;
+	cmd->mask = command->mask;
+	cmd->effect_id = command->effect_id;
+	memcpy(cmd->speeds, command->speeds, THIRDSPACEVEST_CELL_COUNT);
+	thirdspacevest_atomic_store(&cmd->sequence, pos + 1);
+
+	// Same handshake as the I/O thread ring: either the consumer sees
+	// this command before it blocks, or we see it blocked.
+	thirdspacevest_atomic_fence();
+	if(shm->_bell && thirdspacevest_atomic_load(&header->consumer_waiting))
+	{
+		thirdspacevest_shm_ring_bell(shm);
+	}
+	return 0;
+}
+
+static int thirdspacevest_shm_empty(thirdspacevest_shm* shm)
+{
+	uint32_t pos = shm->_header->tail;
+	return thirdspacevest_atomic_load(&shm->_commands[pos & (shm->_capacity - 1)].sequence) != pos + 1;
+}
+
+int thirdspacevest_shm_poll(thirdspacevest_shm* shm, thirdspacevest_shm_command* command)
+{
+	thirdspacevest_shm_header* header = shm->_header;
+	uint32_t pos = header->tail;
+	thirdspacevest_shm_command* cmd = &shm->_commands[pos & (shm->_capacity - 1)];
+
+	if(thirdspacevest_atomic_load(&cmd->sequence) != pos + 1)
+	{
+		return 0;
+	}
+	memcpy(command, cmd, sizeof(thirdspacevest_shm_command));
+	thirdspacevest_atomic_store(&cmd->sequence, pos + shm->_capacity);
+	thirdspacevest_atomic_store(&header->tail, pos + 1);
+	return 1;
+}
+
+int thirdspacevest_shm_wait(thirdspacevest_shm* shm, int timeout_ms)
+{
+	thirdspacevest_shm_header* header = shm->_header;
+	uint64_t deadline = thirdspacevest_time_us() + (uint64_t)timeout_ms * 1000;
+	uint64_t now;
+
+	while(thirdspacevest_shm_empty(shm))
+	{
+		now = thirdspacevest_time_us();
+		if(now >= deadline)
+		{
+			return 0;
+		}
+		if(!shm->_bell)
+		{
+			// Nothing to block on, so poll once a millisecond.
+#if defined(WIN32)
+			Sleep(1);
+#else
+			usleep(1000);
+#endif
+			continue;
+		}
+		thirdspacevest_atomic_store(&header->consumer_waiting, 1);
+		thirdspacevest_atomic_fence();
+		// The bell can still hold rings for commands already taken, so
+		// waking up doesn't mean there's anything new. Go around again.
+		if(thirdspacevest_shm_empty(shm))
+		{
+			thirdspacevest_shm_wait_bell(shm, (int)((deadline - now + 999) / 1000));
+		}
+		thirdspacevest_atomic_store(&header->consumer_waiting, 0);
+	}
+	return 1;
+}
+
+/**
+ * Applies one frame, through the ring if the I/O thread owns the vest.
+ */
+static int thirdspacevest_shm_frame(thirdspacevest_device* dev, const thirdspacevest_shm_command* command)
+{
+	uint8_t i;
+	int ret = 0;
+	if(!thirdspacevest_atomic_load(&dev->_io_running))
+	{
+		return thirdspacevest_send_frame(dev, command->speeds, command->mask);
+	}
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		if((command->mask & (1 << i)) && !ret)
+		{
+			ret = thirdspacevest_enqueue_effect(dev, i, command->speeds[i]);
+		}
+	}
+	return ret;
+}
+
+int thirdspacevest_shm_dispatch(thirdspacevest_shm* shm, thirdspacevest_device* dev, thirdspacevest_bank* bank)
+{
+	thirdspacevest_shm_command command;
+	int count = 0;
+	int status = 0;
+	int ret;
+
+	while(thirdspacevest_shm_poll(shm, &command))
+	{
+		switch(command.type)
+		{
+		case THIRDSPACEVEST_SHM_FRAME:
+			ret = thirdspacevest_shm_frame(dev, &command);
+			break;
+		case THIRDSPACEVEST_SHM_BANK_EFFECT:
+			ret = bank ? thirdspacevest_play_bank_effect(dev, bank, command.effect_id) : E_NPUTIL_INVALID_PARAM;
+			break;
+		default:
+			ret = E_NPUTIL_INVALID_PARAM;
+			break;
+		}
+		// One bad command from a mod shouldn't hold up the rest.
+		if(ret < 0)
+		{
+			if(!status)
+			{
+				status = ret;
+			}
+			continue;
+		}
+		++count;
+	}
+	return status < 0 ? status : count;
+}
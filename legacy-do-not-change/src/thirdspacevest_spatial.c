@@ -0,0 +1,197 @@
+/*
+ * Third Space Vest Driver - Hit direction to cell projection
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <float.h>
+#include <string.h>
+
+// Directions are binned with an octahedral map: dividing by
+// |x| + |y| + |z| puts the vector on the unit octahedron, and its x and
+// y then index a square grid per hemisphere. That costs a division
+// per axis and hit, with no trig or square roots.
+
+/// Grid cells along each side of a hemisphere, about 6 degrees per bin
+#define THIRDSPACEVEST_SPATIAL_BINS 33
+
+// Each cell points out of its corner of the vest, e.g. front upper
+// left is (-1, 1, 1): x right, y up, z forward.
+static const int8_t thirdspacevest_cell_directions[THIRDSPACEVEST_CELL_COUNT][3] =
+{
+	{-1, -1, -1},	// 0 back lower left
+	{-1, 1, -1},	// 1 back upper left
+	{-1, 1, 1},		// 2 front upper left
+	{-1, -1, 1},	// 3 front lower left
+	{1, -1, 1},		// 4 front lower right
+	{1, 1, 1},		// 5 front upper right
+	{1, 1, -1},		// 6 back upper right
+	{1, -1, -1}		// 7 back lower right
+};
+
+// Weight of every cell for every bin, 255 for the cell facing the hit
+// most directly. Indexed by hemisphere (0 back, 1 front), x bin, y bin.
+static uint8_t thirdspacevest_spatial_table[2][THIRDSPACEVEST_SPATIAL_BINS][THIRDSPACEVEST_SPATIAL_BINS][THIRDSPACEVEST_CELL_COUNT];
+static volatile uint32_t thirdspacevest_spatial_table_once = 0;
+
+static void thirdspacevest_build_spatial_table()
+{
+	float dir[3], weights[THIRDSPACEVEST_CELL_COUNT], peak, dot;
+	int face, i, j, cell;
+	if(!thirdspacevest_once_begin(&thirdspacevest_spatial_table_once))
+	{
+		return;
+	}
+	for(face = 0; face < 2; ++face)
+	{
+		for(i = 0; i < THIRDSPACEVEST_SPATIAL_BINS; ++i)
+		{
+			for(j = 0; j < THIRDSPACEVEST_SPATIAL_BINS; ++j)
+			{
+				dir[0] = (float)(2 * i) / (THIRDSPACEVEST_SPATIAL_BINS - 1) - 1.0f;
+				dir[1] = (float)(2 * j) / (THIRDSPACEVEST_SPATIAL_BINS - 1) - 1.0f;
+				dir[2] = 1.0f - (dir[0] < 0 ? -dir[0] : dir[0]) - (dir[1] < 0 ? -dir[1] : dir[1]);
+				// Corners of the grid are never looked up, clamping them
+				// onto the equator keeps the weights sensible anyway.
+				if(dir[2] < 0)
+				{
+					dir[2] = 0;
+				}
+				if(!face)
+				{
+					dir[2] = -dir[2];
+				}
+				// Squared cosine between the hit and each cell, zero for
+				// cells facing away. Every vector's length cancels out
+				// once the weights are scaled to the peak, so nothing
+				// needs normalizing.
+				peak = 0;
+				for(cell = 0; cell < THIRDSPACEVEST_CELL_COUNT; ++cell)
+				{
+					dot = dir[0] * thirdspacevest_cell_directions[cell][0] +
+						dir[1] * thirdspacevest_cell_directions[cell][1] +
+						dir[2] * thirdspacevest_cell_directions[cell][2];
+					weights[cell] = dot > 0 ? dot * dot : 0;
+					if(weights[cell] > peak)
+					{
+						peak = weights[cell];
+					}
+				}
+				for(cell = 0; cell < THIRDSPACEVEST_CELL_COUNT; ++cell)
+				{
+					thirdspacevest_spatial_table[face][i][j][cell] = peak > 0 ? (uint8_t)(weights[cell] * 255 / peak + 0.5f) : 255;
+				}
+			}
+		}
+	}
+	thirdspacevest_once_end(&thirdspacevest_spatial_table_once);
+}
+
+/**
+ * Table row for a direction, NULL if it doesn't have one
+ */
+static const uint8_t* thirdspacevest_spatial_lookup(float x, float y, float z)
+{
+	float sum = (x < 0 ? -x : x) + (y < 0 ? -y : y) + (z < 0 ? -z : z);
+	const float half = (THIRDSPACEVEST_SPATIAL_BINS - 1) * 0.5f;
+	int i, j;
+	// Also false for NaN and infinities, which would otherwise index
+	// anywhere.
+	if(!(sum > 0 && sum <= FLT_MAX))
+	{
+		return NULL;
+	}
+	if(!thirdspacevest_once_done(&thirdspacevest_spatial_table_once))
+	{
+		thirdspacevest_build_spatial_table();
+	}
+	// Dividing first keeps huge vectors from overflowing, and x / sum
+	// can't leave [-1, 1] since adding magnitudes never rounds down
+	// below one of them.
+	i = (int)((x / sum + 1.0f) * half + 0.5f);
+	j = (int)((y / sum + 1.0f) * half + 0.5f);
+	return thirdspacevest_spatial_table[z >= 0][i][j];
+}
+
+/**
+ * Speeds one hit adds to each cell, returns the cells it reaches
+ */
+static uint8_t thirdspacevest_project_one(const thirdspacevest_hit* hit, uint8_t speeds[THIRDSPACEVEST_CELL_COUNT])
+{
+	const uint8_t* weights = thirdspacevest_spatial_lookup(hit->x, hit->y, hit->z);
+	uint8_t mask = 0;
+	int cell;
+	for(cell = 0; cell < THIRDSPACEVEST_CELL_COUNT; ++cell)
+	{
+		// Without a direction, e.g. a zero vector, every cell is hit fully.
+		speeds[cell] = weights ? (uint8_t)((hit->intensity * weights[cell] + 127) / 255) : hit->intensity;
+		if(speeds[cell])
+		{
+			mask |= 1 << cell;
+		}
+	}
+	return mask;
+}
+
+int thirdspacevest_project_hit(float x, float y, float z, uint8_t intensity, uint8_t speeds[THIRDSPACEVEST_CELL_COUNT])
+{
+	thirdspacevest_hit hit;
+	hit.x = x;
+	hit.y = y;
+	hit.z = z;
+	hit.intensity = intensity;
+	return thirdspacevest_project_one(&hit, speeds);
+}
+
+int thirdspacevest_project_hits(const thirdspacevest_hit* hits, int count, int blend, uint8_t speeds[THIRDSPACEVEST_CELL_COUNT])
+{
+	uint8_t hit_speeds[THIRDSPACEVEST_CELL_COUNT];
+	uint8_t mask = 0, hit_mask;
+	int i, cell, speed;
+	if(blend != THIRDSPACEVEST_BLEND_MAX && blend != THIRDSPACEVEST_BLEND_SUM && blend != THIRDSPACEVEST_BLEND_REPLACE)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(count < 0 || (count && !hits))
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	memset(speeds, 0, THIRDSPACEVEST_CELL_COUNT);
+	for(i = 0; i < count; ++i)
+	{
+		hit_mask = thirdspacevest_project_one(&hits[i], hit_speeds);
+		for(cell = 0; cell < THIRDSPACEVEST_CELL_COUNT; ++cell)
+		{
+			if(!(hit_mask & (1 << cell)))
+			{
+				continue;
+			}
+			switch(blend)
+			{
+			case THIRDSPACEVEST_BLEND_SUM:
+				speed = speeds[cell] + hit_speeds[cell];
+				speeds[cell] = speed > 255 ? 255 : (uint8_t)speed;
+				break;
+			case THIRDSPACEVEST_BLEND_REPLACE:
+				speeds[cell] = hit_speeds[cell];
+				break;
+			default:
+				if(hit_speeds[cell] > speeds[cell])
+				{
+					speeds[cell] = hit_speeds[cell];
+				}
+				break;
+			}
+		}
+		mask |= hit_mask;
+	}
+	return mask;
+}
@@ -0,0 +1,277 @@
+/*
+ * Third Space Vest Driver - Counters and latency histograms
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <string.h>
+
+static int thirdspacevest_histogram_bucket(uint32_t us)
+{
+	int exp = 0;
+	int bucket;
+	if(us < 4)
+	{
+		return us;
+	}
+	while((us >> exp) > 1)
+	{
+		++exp;
+	}
+	// Top two bits below the leading one pick the quarter of the octave.
+	bucket = 4 * (exp - 1) + ((us >> (exp - 2)) & 3);
+	return bucket < THIRDSPACEVEST_HISTOGRAM_BUCKETS ? bucket : THIRDSPACEVEST_HISTOGRAM_BUCKETS - 1;
+}
+
+uint32_t thirdspacevest_histogram_bucket_us(int bucket)
+{
+	if(bucket < 4)
+	{
+		return bucket < 0 ? 0 : bucket;
+	}
+	if(bucket >= THIRDSPACEVEST_HISTOGRAM_BUCKETS)
+	{
+		bucket = THIRDSPACEVEST_HISTOGRAM_BUCKETS - 1;
+	}
+	return (uint32_t)(4 + (bucket & 3)) << (bucket / 4 - 1);
+}
+
+void thirdspacevest_histogram_record(thirdspacevest_histogram* hist, uint64_t us)
+{
+	uint32_t value = us > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)us;
+	uint32_t max;
+	thirdspacevest_atomic_fetch_add(&hist->buckets[thirdspacevest_histogram_bucket(value)], 1);
+	thirdspacevest_atomic_fetch_add(&hist->count, 1);
+	while(value > (max = thirdspacevest_atomic_load(&hist->max_us)) &&
+		  !thirdspacevest_atomic_cas(&hist->max_us, max, value))
+	{
+	}
+}
+
+uint32_t thirdspacevest_histogram_percentile(const thirdspacevest_histogram* hist, double percentile)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	int i;
+	if(!hist->count)
+	{
+		return 0;
+	}
+	if(percentile < 0)
+	{
+		percentile = 0;
+	}
+	target = (uint64_t)(hist->count * (percentile > 100 ? 100 : percentile) / 100.0 + 0.5);
+	if(!target)
+	{
+		target = 1;
+	}
+	for(i = 0; i < THIRDSPACEVEST_HISTOGRAM_BUCKETS; ++i)
+	{
+		seen += hist->buckets[i];
+		if(seen >= target)
+		{
+			return thirdspacevest_histogram_bucket_us(i);
+		}
+	}
+	return thirdspacevest_histogram_bucket_us(THIRDSPACEVEST_HISTOGRAM_BUCKETS - 1);
+}
+
+static void thirdspacevest_histogram_copy(thirdspacevest_histogram* dst, thirdspacevest_histogram* src)
+{
+	int i;
+	dst->count = 0;
+	for(i = 0; i < THIRDSPACEVEST_HISTOGRAM_BUCKETS; ++i)
+	{
+		dst->buckets[i] = thirdspacevest_atomic_load(&src->buckets[i]);
+		dst->count += dst->buckets[i];
+	}
+	dst->max_us = thirdspacevest_atomic_load(&src->max_us);
+}
+
+static void thirdspacevest_histogram_reset(thirdspacevest_histogram* hist)
+{
+	int i;
+	for(i = 0; i < THIRDSPACEVEST_HISTOGRAM_BUCKETS; ++i)
+	{
+		thirdspacevest_atomic_store(&hist->buckets[i], 0);
+	}
+	thirdspacevest_atomic_store(&hist->count, 0);
+	thirdspacevest_atomic_store(&hist->max_us, 0);
+}
+
+void thirdspacevest_count_error(thirdspacevest_device* dev, int timed_out)
+{
+	thirdspacevest_atomic_fetch_add(&dev->_errors, 1);
+	if(timed_out)
+	{
+		thirdspacevest_count_timeout(dev);
+	}
+}
+
+void thirdspacevest_count_timeout(thirdspacevest_device* dev)
+{
+	// Deviation large enough that the timeout reaches the maximum
+	const uint32_t ceiling = thirdspacevest_atomic_load(&dev->_timeout_max_ms) * 4000;
+	uint32_t var = thirdspacevest_atomic_load(&dev->_rtt_var_us4);
+	thirdspacevest_atomic_fetch_add(&dev->_timeouts, 1);
+	// Like TCP doubling its retransmit timeout. Without this a vest that
+	// got slower than the timeout would never produce a sample again.
+	thirdspacevest_atomic_store(&dev->_rtt_var_us4, var >= ceiling / 2 ? ceiling : var * 2 + 4);
+	thirdspacevest_check_saturation(dev, 1);
+}
+
+void thirdspacevest_record_stage(thirdspacevest_device* dev, thirdspacevest_histogram* hist, uint64_t us)
+{
+	// Capped well below the point where the scaled values overflow
+	const int32_t sample = us < 1 ? 1 : us > (1 << 24) ? (1 << 24) : (int32_t)us;
+	uint32_t rtt = thirdspacevest_atomic_load(&dev->_rtt_us8);
+	uint32_t var = thirdspacevest_atomic_load(&dev->_rtt_var_us4);
+	int32_t err;
+
+	thirdspacevest_histogram_record(hist, us);
+	// Jacobson/Karels as in RFC 6298, gains of 1/8 and 1/4 in fixed
+	// point. Threads recording at once can lose a sample to each other,
+	// which an average like this doesn't notice.
+	if(!rtt)
+	{
+		rtt = (uint32_t)sample * 8;
+		var = (uint32_t)sample * 2;
+	}
+	else
+	{
+		err = sample - (int32_t)(rtt >> 3);
+		rtt += err;
+		var += (err < 0 ? -err : err) - (var >> 2);
+	}
+	thirdspacevest_atomic_store(&dev->_rtt_us8, rtt);
+	thirdspacevest_atomic_store(&dev->_rtt_var_us4, var);
+	thirdspacevest_check_saturation(dev, 0);
+}
+
+uint32_t thirdspacevest_usb_timeout(thirdspacevest_device* dev)
+{
+	const uint32_t rtt = thirdspacevest_atomic_load(&dev->_rtt_us8);
+	const uint32_t min = thirdspacevest_atomic_load(&dev->_timeout_min_ms);
+	const uint32_t max = thirdspacevest_atomic_load(&dev->_timeout_max_ms);
+	uint64_t ms;
+	if(!rtt)
+	{
+		return max;
+	}
+	ms = ((uint64_t)(rtt >> 3) + thirdspacevest_atomic_load(&dev->_rtt_var_us4) + 999) / 1000;
+	return ms < min ? min : ms > max ? max : (uint32_t)ms;
+}
+
+int thirdspacevest_set_timeout_limits(thirdspacevest_device* dev, uint32_t min_ms, uint32_t max_ms)
+{
+	if(!min_ms || min_ms > max_ms || max_ms > 1000000)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	thirdspacevest_atomic_store(&dev->_timeout_min_ms, min_ms);
+	thirdspacevest_atomic_store(&dev->_timeout_max_ms, max_ms);
+	return 0;
+}
+
+void thirdspacevest_check_saturation(thirdspacevest_device* dev, int overloaded)
+{
+	const uint32_t threshold = thirdspacevest_atomic_load(&dev->_saturation_rtt_us);
+	const uint32_t rtt = thirdspacevest_atomic_load(&dev->_rtt_us8) >> 3;
+	const uint32_t completions = thirdspacevest_atomic_load(&dev->_cq_tail) - thirdspacevest_atomic_load(&dev->_cq_head);
+	uint32_t was = thirdspacevest_atomic_load(&dev->_saturated);
+	uint32_t now;
+
+	if(!was && (overloaded || rtt > threshold ||
+				completions * 4 >= THIRDSPACEVEST_COMPLETION_QUEUE_SIZE * 3))
+	{
+		now = 1;
+	}
+	else if(was && !overloaded && rtt * 4 < threshold * 3 &&
+			completions * 4 < THIRDSPACEVEST_COMPLETION_QUEUE_SIZE)
+	{
+		now = 0;
+	}
+	else
+	{
+		return;
+	}
+	// Whoever wins the swap reports it, so every change is reported once.
+	if(thirdspacevest_atomic_cas(&dev->_saturated, was, now) && dev->_saturation_cb)
+	{
+		dev->_saturation_cb(dev, (int)now, dev->_saturation_data);
+	}
+}
+
+void thirdspacevest_set_saturation_callback(thirdspacevest_device* dev, uint32_t rtt_us, thirdspacevest_saturation_cb callback, void* user_data)
+{
+	dev->_saturation_cb = callback;
+	dev->_saturation_data = user_data;
+	thirdspacevest_atomic_store(&dev->_saturation_rtt_us, rtt_us ? rtt_us : THIRDSPACEVEST_SATURATION_RTT_US);
+}
+
+int thirdspacevest_get_backpressure(thirdspacevest_device* dev, thirdspacevest_backpressure* bp)
+{
+	bp->queue_depth = thirdspacevest_count_cells(thirdspacevest_atomic_load(&dev->_queued_cells) & THIRDSPACEVEST_ALL_CELLS);
+	bp->completion_depth = thirdspacevest_atomic_load(&dev->_cq_tail) - thirdspacevest_atomic_load(&dev->_cq_head);
+	bp->in_flight = (uint32_t)thirdspacevest_get_pending(dev);
+	bp->rtt_us = thirdspacevest_atomic_load(&dev->_rtt_us8) >> 3;
+	bp->rtt_var_us = thirdspacevest_atomic_load(&dev->_rtt_var_us4) >> 2;
+	bp->timeout_ms = thirdspacevest_usb_timeout(dev);
+	bp->saturated = thirdspacevest_atomic_load(&dev->_saturated);
+	return 0;
+}
+
+void thirdspacevest_init_stats(thirdspacevest_device* dev)
+{
+	dev->_timeouts = 0;
+	dev->_errors = 0;
+	dev->_reconnects = 0;
+	dev->_rtt_us8 = 0;
+	dev->_rtt_var_us4 = 0;
+	dev->_timeout_min_ms = THIRDSPACEVEST_USB_MIN_TIMEOUT;
+	dev->_timeout_max_ms = THIRDSPACEVEST_USB_TIMEOUT;
+	dev->_saturation_rtt_us = THIRDSPACEVEST_SATURATION_RTT_US;
+	dev->_saturation_cb = NULL;
+	dev->_saturation_data = NULL;
+	dev->_saturated = 0;
+	memset(&dev->_encrypt_latency, 0, sizeof(dev->_encrypt_latency));
+	memset(&dev->_write_latency, 0, sizeof(dev->_write_latency));
+	memset(&dev->_ack_latency, 0, sizeof(dev->_ack_latency));
+}
+
+int thirdspacevest_get_stats(thirdspacevest_device* dev, thirdspacevest_stats* stats)
+{
+	thirdspacevest_get_queue_stats(dev, &stats->queue);
+	stats->timeouts = thirdspacevest_atomic_load(&dev->_timeouts);
+	stats->errors = thirdspacevest_atomic_load(&dev->_errors);
+	stats->reconnects = thirdspacevest_atomic_load(&dev->_reconnects);
+	// count is rebuilt from the buckets, so percentiles computed from the
+	// copy always add up even while samples are being recorded.
+	thirdspacevest_histogram_copy(&stats->encrypt, &dev->_encrypt_latency);
+	thirdspacevest_histogram_copy(&stats->write, &dev->_write_latency);
+	thirdspacevest_histogram_copy(&stats->ack, &dev->_ack_latency);
+	return 0;
+}
+
+void thirdspacevest_reset_stats(thirdspacevest_device* dev)
+{
+	thirdspacevest_atomic_store(&dev->_queue_stats.queued, 0);
+	thirdspacevest_atomic_store(&dev->_queue_stats.coalesced, 0);
+	thirdspacevest_atomic_store(&dev->_queue_stats.dropped, 0);
+	thirdspacevest_atomic_store(&dev->_queue_stats.sent, 0);
+	thirdspacevest_atomic_store(&dev->_timeouts, 0);
+	thirdspacevest_atomic_store(&dev->_errors, 0);
+	thirdspacevest_atomic_store(&dev->_reconnects, 0);
+	thirdspacevest_histogram_reset(&dev->_encrypt_latency);
+	thirdspacevest_histogram_reset(&dev->_write_latency);
+	thirdspacevest_histogram_reset(&dev->_ack_latency);
+}
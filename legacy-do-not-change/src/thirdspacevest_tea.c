@@ -0,0 +1,380 @@
+/*
+ * Third Space Vest Driver - Batch TEA
+ *
+ * Runs the packet cipher over many blocks at once, one block per SIMD
+ * lane. TEA only uses 32 bit adds, shifts and xors, so every lane does
+ * exactly what thirdspacevest_encrypt does, just alongside 3 or 7
+ * others.
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define THIRDSPACEVEST_TEA_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64) || defined(__ARM_NEON)
+#define THIRDSPACEVEST_TEA_NEON
+#include <arm_neon.h>
+#endif
+
+// GCC and clang only emit AVX2 inside functions that ask for it, so
+// the rest of the library still runs on CPUs without it.
+#if defined(__GNUC__)
+#define THIRDSPACEVEST_TARGET(isa) __attribute__((target(isa)))
+#else
+#define THIRDSPACEVEST_TARGET(isa)
+#endif
+
+#define THIRDSPACEVEST_TEA_DELTA 0x9e3779b9
+#define THIRDSPACEVEST_TEA_ROUNDS 32
+
+typedef void (*thirdspacevest_tea_func)(uint32_t* blocks, size_t count, const uint32_t* key);
+
+static void thirdspacevest_encrypt_scalar(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	size_t i;
+	for(i = 0; i < count; ++i)
+	{
+		thirdspacevest_encrypt(blocks + i * 2, (uint32_t*)key);
+	}
+}
+
+static void thirdspacevest_decrypt_scalar(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	size_t i;
+	for(i = 0; i < count; ++i)
+	{
+		thirdspacevest_decrypt(blocks + i * 2, (uint32_t*)key);
+	}
+}
+
+#if defined(THIRDSPACEVEST_TEA_X86)
+
+/*
+ * Blocks are stored v0 v1 v0 v1 ..., so each pair of loads gets split
+ * into a vector of v0s and a vector of v1s and put back together the
+ * same way afterwards. Which lane ends up holding which block doesn't
+ * matter as long as the store undoes the load.
+ */
+
+THIRDSPACEVEST_TARGET("sse2")
+static void thirdspacevest_encrypt_sse2(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	const __m128i k0 = _mm_set1_epi32((int)key[0]);
+	const __m128i k1 = _mm_set1_epi32((int)key[1]);
+	const __m128i k2 = _mm_set1_epi32((int)key[2]);
+	const __m128i k3 = _mm_set1_epi32((int)key[3]);
+	const __m128i delta = _mm_set1_epi32((int)THIRDSPACEVEST_TEA_DELTA);
+	int i;
+
+	for(; count >= 4; count -= 4, blocks += 8)
+	{
+		__m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)blocks), _MM_SHUFFLE(3, 1, 2, 0));
+		__m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(blocks + 4)), _MM_SHUFFLE(3, 1, 2, 0));
+		__m128i v0 = _mm_unpacklo_epi64(a, b);
+		__m128i v1 = _mm_unpackhi_epi64(a, b);
+		__m128i sum = _mm_setzero_si128();
+		for(i = 0; i < THIRDSPACEVEST_TEA_ROUNDS; ++i)
+		{
+			sum = _mm_add_epi32(sum, delta);
+			v0 = _mm_add_epi32(v0, _mm_xor_si128(_mm_xor_si128(_mm_add_epi32(_mm_slli_epi32(v1, 4), k0),
+															   _mm_add_epi32(v1, sum)),
+												 _mm_add_epi32(_mm_srli_epi32(v1, 5), k1)));
+			v1 = _mm_add_epi32(v1, _mm_xor_si128(_mm_xor_si128(_mm_add_epi32(_mm_slli_epi32(v0, 4), k2),
+															   _mm_add_epi32(v0, sum)),
+												 _mm_add_epi32(_mm_srli_epi32(v0, 5), k3)));
+		}
+		_mm_storeu_si128((__m128i*)blocks, _mm_unpacklo_epi32(v0, v1));
+		_mm_storeu_si128((__m128i*)(blocks + 4), _mm_unpackhi_epi32(v0, v1));
+	}
+	thirdspacevest_encrypt_scalar(blocks, count, key);
+}
+
+THIRDSPACEVEST_TARGET("sse2")
+static void thirdspacevest_decrypt_sse2(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	const __m128i k0 = _mm_set1_epi32((int)key[0]);
+	const __m128i k1 = _mm_set1_epi32((int)key[1]);
+	const __m128i k2 = _mm_set1_epi32((int)key[2]);
+	const __m128i k3 = _mm_set1_epi32((int)key[3]);
+	const __m128i delta = _mm_set1_epi32((int)THIRDSPACEVEST_TEA_DELTA);
+	int i;
+
+	for(; count >= 4; count -= 4, blocks += 8)
+	{
+		__m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)blocks), _MM_SHUFFLE(3, 1, 2, 0));
+		__m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(blocks + 4)), _MM_SHUFFLE(3, 1, 2, 0));
+		__m128i v0 = _mm_unpacklo_epi64(a, b);
+		__m128i v1 = _mm_unpackhi_epi64(a, b);
+		__m128i sum = _mm_set1_epi32((int)(THIRDSPACEVEST_TEA_DELTA * THIRDSPACEVEST_TEA_ROUNDS));
+		for(i = 0; i < THIRDSPACEVEST_TEA_ROUNDS; ++i)
+		{
+			v1 = _mm_sub_epi32(v1, _mm_xor_si128(_mm_xor_si128(_mm_add_epi32(_mm_slli_epi32(v0, 4), k2),
+															   _mm_add_epi32(v0, sum)),
+												 _mm_add_epi32(_mm_srli_epi32(v0, 5), k3)));
+			v0 = _mm_sub_epi32(v0, _mm_xor_si128(_mm_xor_si128(_mm_add_epi32(_mm_slli_epi32(v1, 4), k0),
+															   _mm_add_epi32(v1, sum)),
+												 _mm_add_epi32(_mm_srli_epi32(v1, 5), k1)));
+			sum = _mm_sub_epi32(sum, delta);
+		}
+		_mm_storeu_si128((__m128i*)blocks, _mm_unpacklo_epi32(v0, v1));
+		_mm_storeu_si128((__m128i*)(blocks + 4), _mm_unpackhi_epi32(v0, v1));
+	}
+	thirdspacevest_decrypt_scalar(blocks, count, key);
+}
+
+// The AVX2 shuffles and unpacks work within each 128 bit half, so this
+// is the SSE2 version run on two halves at once.
+
+THIRDSPACEVEST_TARGET("avx2")
+static void thirdspacevest_encrypt_avx2(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	const __m256i k0 = _mm256_set1_epi32((int)key[0]);
+	const __m256i k1 = _mm256_set1_epi32((int)key[1]);
+	const __m256i k2 = _mm256_set1_epi32((int)key[2]);
+	const __m256i k3 = _mm256_set1_epi32((int)key[3]);
+	const __m256i delta = _mm256_set1_epi32((int)THIRDSPACEVEST_TEA_DELTA);
+	int i;
+
+	for(; count >= 8; count -= 8, blocks += 16)
+	{
+		__m256i a = _mm256_shuffle_epi32(_mm256_loadu_si256((const __m256i*)blocks), _MM_SHUFFLE(3, 1, 2, 0));
+		__m256i b = _mm256_shuffle_epi32(_mm256_loadu_si256((const __m256i*)(blocks + 8)), _MM_SHUFFLE(3, 1, 2, 0));
+		__m256i v0 = _mm256_unpacklo_epi64(a, b);
+		__m256i v1 = _mm256_unpackhi_epi64(a, b);
+		__m256i sum = _mm256_setzero_si256();
+		for(i = 0; i < THIRDSPACEVEST_TEA_ROUNDS; ++i)
+		{
+			sum = _mm256_add_epi32(sum, delta);
+			v0 = _mm256_add_epi32(v0, _mm256_xor_si256(_mm256_xor_si256(_mm256_add_epi32(_mm256_slli_epi32(v1, 4), k0),
+																		_mm256_add_epi32(v1, sum)),
+													   _mm256_add_epi32(_mm256_srli_epi32(v1, 5), k1)));
+			v1 = _mm256_add_epi32(v1, _mm256_xor_si256(_mm256_xor_si256(_mm256_add_epi32(_mm256_slli_epi32(v0, 4), k2),
+																		_mm256_add_epi32(v0, sum)),
+													   _mm256_add_epi32(_mm256_srli_epi32(v0, 5), k3)));
+		}
+		_mm256_storeu_si256((__m256i*)blocks, _mm256_unpacklo_epi32(v0, v1));
+		_mm256_storeu_si256((__m256i*)(blocks + 8), _mm256_unpackhi_epi32(v0, v1));
+	}
+	thirdspacevest_encrypt_sse2(blocks, count, key);
+}
+
+THIRDSPACEVEST_TARGET("avx2")
+static void thirdspacevest_decrypt_avx2(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	const __m256i k0 = _mm256_set1_epi32((int)key[0]);
+	const __m256i k1 = _mm256_set1_epi32((int)key[1]);
+	const __m256i k2 = _mm256_set1_epi32((int)key[2]);
+	const __m256i k3 = _mm256_set1_epi32((int)key[3]);
+	const __m256i delta = _mm256_set1_epi32((int)THIRDSPACEVEST_TEA_DELTA);
+	int i;
+
+	for(; count >= 8; count -= 8, blocks += 16)
+	{
+		__m256i a = _mm256_shuffle_epi32(_mm256_loadu_si256((const __m256i*)blocks), _MM_SHUFFLE(3, 1, 2, 0));
+		__m256i b = _mm256_shuffle_epi32(_mm256_loadu_si256((const __m256i*)(blocks + 8)), _MM_SHUFFLE(3, 1, 2, 0));
+		__m256i v0 = _mm256_unpacklo_epi64(a, b);
+		__m256i v1 = _mm256_unpackhi_epi64(a, b);
+		__m256i sum = _mm256_set1_epi32((int)(THIRDSPACEVEST_TEA_DELTA * THIRDSPACEVEST_TEA_ROUNDS));
+		for(i = 0; i < THIRDSPACEVEST_TEA_ROUNDS; ++i)
+		{
+			v1 = _mm256_sub_epi32(v1, _mm256_xor_si256(_mm256_xor_si256(_mm256_add_epi32(_mm256_slli_epi32(v0, 4), k2),
+																		_mm256_add_epi32(v0, sum)),
+													   _mm256_add_epi32(_mm256_srli_epi32(v0, 5), k3)));
+			v0 = _mm256_sub_epi32(v0, _mm256_xor_si256(_mm256_xor_si256(_mm256_add_epi32(_mm256_slli_epi32(v1, 4), k0),
+																		_mm256_add_epi32(v1, sum)),
+													   _mm256_add_epi32(_mm256_srli_epi32(v1, 5), k1)));
+			sum = _mm256_sub_epi32(sum, delta);
+		}
+		_mm256_storeu_si256((__m256i*)blocks, _mm256_unpacklo_epi32(v0, v1));
+		_mm256_storeu_si256((__m256i*)(blocks + 8), _mm256_unpackhi_epi32(v0, v1));
+	}
+	thirdspacevest_decrypt_sse2(blocks, count, key);
+}
+
+#if defined(_MSC_VER)
+static int thirdspacevest_cpu_has_sse2()
+{
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+}
+
+static int thirdspacevest_cpu_has_avx2()
+{
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7)
+	{
+		return 0;
+	}
+	// The OS has to save the YMM registers across context switches too
+	__cpuid(info, 1);
+	if(!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+	{
+		return 0;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+}
+#else
+static int thirdspacevest_cpu_has_sse2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static int thirdspacevest_cpu_has_avx2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#elif defined(THIRDSPACEVEST_TEA_NEON)
+
+// vld2q/vst2q split and rejoin the v0 v1 pairs directly.
+
+static void thirdspacevest_encrypt_neon(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	const uint32x4_t k0 = vdupq_n_u32(key[0]);
+	const uint32x4_t k1 = vdupq_n_u32(key[1]);
+	const uint32x4_t k2 = vdupq_n_u32(key[2]);
+	const uint32x4_t k3 = vdupq_n_u32(key[3]);
+	const uint32x4_t delta = vdupq_n_u32(THIRDSPACEVEST_TEA_DELTA);
+	int i;
+
+	for(; count >= 4; count -= 4, blocks += 8)
+	{
+		uint32x4x2_t v = vld2q_u32(blocks);
+		uint32x4_t sum = vdupq_n_u32(0);
+		for(i = 0; i < THIRDSPACEVEST_TEA_ROUNDS; ++i)
+		{
+			sum = vaddq_u32(sum, delta);
+			v.val[0] = vaddq_u32(v.val[0], veorq_u32(veorq_u32(vaddq_u32(vshlq_n_u32(v.val[1], 4), k0),
+															   vaddq_u32(v.val[1], sum)),
+													 vaddq_u32(vshrq_n_u32(v.val[1], 5), k1)));
+			v.val[1] = vaddq_u32(v.val[1], veorq_u32(veorq_u32(vaddq_u32(vshlq_n_u32(v.val[0], 4), k2),
+															   vaddq_u32(v.val[0], sum)),
+													 vaddq_u32(vshrq_n_u32(v.val[0], 5), k3)));
+		}
+		vst2q_u32(blocks, v);
+	}
+	thirdspacevest_encrypt_scalar(blocks, count, key);
+}
+
+static void thirdspacevest_decrypt_neon(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	const uint32x4_t k0 = vdupq_n_u32(key[0]);
+	const uint32x4_t k1 = vdupq_n_u32(key[1]);
+	const uint32x4_t k2 = vdupq_n_u32(key[2]);
+	const uint32x4_t k3 = vdupq_n_u32(key[3]);
+	const uint32x4_t delta = vdupq_n_u32(THIRDSPACEVEST_TEA_DELTA);
+	int i;
+
+	for(; count >= 4; count -= 4, blocks += 8)
+	{
+		uint32x4x2_t v = vld2q_u32(blocks);
+		uint32x4_t sum = vdupq_n_u32(THIRDSPACEVEST_TEA_DELTA * THIRDSPACEVEST_TEA_ROUNDS);
+		for(i = 0; i < THIRDSPACEVEST_TEA_ROUNDS; ++i)
+		{
+			v.val[1] = vsubq_u32(v.val[1], veorq_u32(veorq_u32(vaddq_u32(vshlq_n_u32(v.val[0], 4), k2),
+															   vaddq_u32(v.val[0], sum)),
+													 vaddq_u32(vshrq_n_u32(v.val[0], 5), k3)));
+			v.val[0] = vsubq_u32(v.val[0], veorq_u32(veorq_u32(vaddq_u32(vshlq_n_u32(v.val[1], 4), k0),
+															   vaddq_u32(v.val[1], sum)),
+													 vaddq_u32(vshrq_n_u32(v.val[1], 5), k1)));
+			sum = vsubq_u32(sum, delta);
+		}
+		vst2q_u32(blocks, v);
+	}
+	thirdspacevest_decrypt_scalar(blocks, count, key);
+}
+
+#endif
+
+static thirdspacevest_tea_func thirdspacevest_encrypt_impl = NULL;
+static thirdspacevest_tea_func thirdspacevest_decrypt_impl = NULL;
+static volatile uint32_t thirdspacevest_tea_once = 0;
+
+/**
+ * Picks the widest implementation this CPU runs, once per process.
+ */
+static void thirdspacevest_pick_tea()
+{
+	thirdspacevest_tea_func encrypt = thirdspacevest_encrypt_scalar;
+	thirdspacevest_tea_func decrypt = thirdspacevest_decrypt_scalar;
+	if(!thirdspacevest_once_begin(&thirdspacevest_tea_once))
+	{
+		return;
+	}
+#if defined(THIRDSPACEVEST_TEA_X86)
+	if(thirdspacevest_cpu_has_avx2())
+	{
+		encrypt = thirdspacevest_encrypt_avx2;
+		decrypt = thirdspacevest_decrypt_avx2;
+	}
+	else if(thirdspacevest_cpu_has_sse2())
+	{
+		encrypt = thirdspacevest_encrypt_sse2;
+		decrypt = thirdspacevest_decrypt_sse2;
+	}
+#elif defined(THIRDSPACEVEST_TEA_NEON)
+	encrypt = thirdspacevest_encrypt_neon;
+	decrypt = thirdspacevest_decrypt_neon;
+#endif
+	thirdspacevest_decrypt_impl = decrypt;
+	thirdspacevest_encrypt_impl = encrypt;
+	thirdspacevest_once_end(&thirdspacevest_tea_once);
+}
+
+void thirdspacevest_encrypt_n(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	if(!thirdspacevest_once_done(&thirdspacevest_tea_once))
+	{
+		thirdspacevest_pick_tea();
+	}
+	thirdspacevest_encrypt_impl(blocks, count, key);
+}
+
+void thirdspacevest_decrypt_n(uint32_t* blocks, size_t count, const uint32_t* key)
+{
+	if(!thirdspacevest_once_done(&thirdspacevest_tea_once))
+	{
+		thirdspacevest_pick_tea();
+	}
+	thirdspacevest_decrypt_impl(blocks, count, key);
+}
+
+const char* thirdspacevest_tea_impl_name()
+{
+	if(!thirdspacevest_once_done(&thirdspacevest_tea_once))
+	{
+		thirdspacevest_pick_tea();
+	}
+#if defined(THIRDSPACEVEST_TEA_X86)
+	if(thirdspacevest_encrypt_impl == thirdspacevest_encrypt_avx2)
+	{
+		return "avx2";
+	}
+	if(thirdspacevest_encrypt_impl == thirdspacevest_encrypt_sse2)
+	{
+		return "sse2";
+	}
+#elif defined(THIRDSPACEVEST_TEA_NEON)
+	return "neon";
+#endif
+	return "scalar";
+}
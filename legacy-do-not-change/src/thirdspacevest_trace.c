@@ -0,0 +1,364 @@
+/*
+ * Third Space Vest Driver - Command and transfer tracing
+ *
+ * Producers claim a ring slot by bumping the head, and each slot's
+ * sequence number says whether it's free, so they never wait on
+ * anything. A writer thread drains the ring in
+ * batches, so file I/O stays off the threads being measured.
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Ring slots, must be a power of 2. 512k of memory, and seconds of
+/// a real vest; only the null device can outrun the writer.
+#define THIRDSPACEVEST_TRACE_RING_SIZE 16384
+#define THIRDSPACEVEST_TRACE_RING_MASK (THIRDSPACEVEST_TRACE_RING_SIZE - 1)
+/// Records written per fwrite
+#define THIRDSPACEVEST_TRACE_BATCH 256
+/// How long the writer sleeps when nobody wakes it, in milliseconds
+#define THIRDSPACEVEST_TRACE_FLUSH_MS 20
+
+typedef struct {
+	/// Ring position this slot is free for, or that + 1 once written
+	volatile uint32_t _sequence;
+	thirdspacevest_trace_record _record;
+} thirdspacevest_trace_slot;
+
+struct thirdspacevest_trace {
+	thirdspacevest_trace_slot _ring[THIRDSPACEVEST_TRACE_RING_SIZE];
+	/// Next position to claim, shared by all producers
+	volatile uint32_t _head;
+	/// Next position the writer drains
+	volatile uint32_t _tail;
+	/// Records that didn't fit, and how many of those were written out
+	volatile uint32_t _dropped;
+	uint32_t _dropped_written;
+	/// Set by thirdspacevest_stop_trace, the writer drains and exits
+	volatile uint32_t _stopping;
+	/// thirdspacevest_time_us when the trace started
+	uint64_t _start_us;
+	FILE* _file;
+	thirdspacevest_thread _thread;
+	thirdspacevest_event _wakeup;
+};
+
+/**
+ * Claims a slot and fills it in, or counts the record as dropped.
+ */
+static void thirdspacevest_trace_push(thirdspacevest_trace* trace, const thirdspacevest_trace_record* record)
+{
+	thirdspacevest_trace_slot* slot;
+	uint32_t pos;
+	int32_t dif;
+
+	pos = thirdspacevest_atomic_load(&trace->_head);
+	for(;;)
+	{
+		slot = &trace->_ring[pos & THIRDSPACEVEST_TRACE_RING_MASK];
+		dif = (int32_t)(thirdspacevest_atomic_load(&slot->_sequence) - pos);
+		if(dif == 0)
+		{
+			if(thirdspacevest_atomic_cas(&trace->_head, pos, pos + 1))
+			{
+				break;
+			}
+		}
+		else if(dif < 0)
+		{
+			thirdspacevest_atomic_fetch_add(&trace->_dropped, 1);
+			return;
+		}
+		pos = thirdspacevest_atomic_load(&trace->_head);
+	}
+	slot->_record = *record;
+	thirdspacevest_atomic_store(&slot->_sequence, pos + 1);
+	// Wake the writer every quarter ring so bursts don't have to wait
+	// out its timeout and overflow.
+	if(((pos + 1) & (THIRDSPACEVEST_TRACE_RING_SIZE / 4 - 1)) == 0)
+	{
+		thirdspacevest_event_signal(&trace->_wakeup);
+	}
+}
+
+/**
+ * Common part of every record, returns 0 if the call started before
+ * this trace did, e.g. it was still running across a stop and start.
+ */
+static int thirdspacevest_trace_begin(thirdspacevest_trace* trace, thirdspacevest_trace_record* record, uint8_t type, uint64_t start_us, uint64_t end_us)
+{
+	uint64_t duration = end_us - start_us;
+	if(start_us < trace->_start_us)
+	{
+		return 0;
+	}
+	memset(record, 0, sizeof(*record));
+	record->time_us = start_us - trace->_start_us;
+	record->duration_us = duration > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)duration;
+	record->type = type;
+	return 1;
+}
+
+void thirdspacevest_trace_call(thirdspacevest_device* dev, uint8_t type, uint8_t cell, uint8_t speed, const uint8_t* speeds, uint64_t start_us, int result)
+{
+	thirdspacevest_trace_record record;
+	if(!thirdspacevest_trace_begin(dev->_trace, &record, type, start_us, thirdspacevest_time_us()))
+	{
+		return;
+	}
+	record.cell = cell;
+	record.speed = speed;
+	record.status = (int8_t)(result < -128 ? -128 : result > 127 ? 127 : result);
+	if(speeds)
+	{
+		memcpy(record.speeds, speeds, THIRDSPACEVEST_CELL_COUNT);
+	}
+	thirdspacevest_trace_push(dev->_trace, &record);
+}
+
+void thirdspacevest_trace_stage(thirdspacevest_device* dev, uint8_t type, uint64_t start_us, uint64_t end_us, int failed)
+{
+	thirdspacevest_trace_record record;
+	if(!thirdspacevest_trace_begin(dev->_trace, &record, type, start_us, end_us))
+	{
+		return;
+	}
+	record.status = failed ? -1 : 0;
+	thirdspacevest_trace_push(dev->_trace, &record);
+}
+
+/**
+ * Writes out every record published so far, stopping at the first slot
+ * that is claimed but not filled in yet.
+ */
+static void thirdspacevest_trace_drain(thirdspacevest_trace* trace)
+{
+	thirdspacevest_trace_record batch[THIRDSPACEVEST_TRACE_BATCH];
+	thirdspacevest_trace_slot* slot;
+	uint32_t pos, dropped;
+	int count = 0;
+
+	for(;;)
+	{
+		pos = trace->_tail;
+		slot = &trace->_ring[pos & THIRDSPACEVEST_TRACE_RING_MASK];
+		if(thirdspacevest_atomic_load(&slot->_sequence) != pos + 1)
+		{
+			break;
+		}
+		batch[count++] = slot->_record;
+		thirdspacevest_atomic_store(&slot->_sequence, pos + THIRDSPACEVEST_TRACE_RING_SIZE);
+		thirdspacevest_atomic_store(&trace->_tail, pos + 1);
+		if(count == THIRDSPACEVEST_TRACE_BATCH)
+		{
+			fwrite(batch, sizeof(batch[0]), count, trace->_file);
+			count = 0;
+		}
+	}
+
+	dropped = thirdspacevest_atomic_load(&trace->_dropped);
+	if(dropped != trace->_dropped_written)
+	{
+		if(count == THIRDSPACEVEST_TRACE_BATCH)
+		{
+			fwrite(batch, sizeof(batch[0]), count, trace->_file);
+			count = 0;
+		}
+		memset(&batch[count], 0, sizeof(batch[0]));
+		batch[count].time_us = thirdspacevest_time_us() - trace->_start_us;
+		batch[count].duration_us = dropped - trace->_dropped_written;
+		batch[count].type = THIRDSPACEVEST_TRACE_DROPPED;
+		++count;
+		trace->_dropped_written = dropped;
+	}
+	if(count)
+	{
+		fwrite(batch, sizeof(batch[0]), count, trace->_file);
+	}
+}
+
+THIRDSPACEVEST_THREAD_FUNC(thirdspacevest_trace_thread, arg)
+{
+	thirdspacevest_trace* trace = (thirdspacevest_trace*)arg;
+	uint32_t stopping;
+	for(;;)
+	{
+		// Read before draining, so stop's last records are always
+		// picked up by the final pass.
+		stopping = thirdspacevest_atomic_load(&trace->_stopping);
+		thirdspacevest_trace_drain(trace);
+		if(stopping)
+		{
+			break;
+		}
+		thirdspacevest_event_wait(&trace->_wakeup, THIRDSPACEVEST_TRACE_FLUSH_MS);
+	}
+	THIRDSPACEVEST_THREAD_RETURN;
+}
+
+int thirdspacevest_start_trace(thirdspacevest_device* dev, const char* path)
+{
+	thirdspacevest_trace_header header;
+	thirdspacevest_trace* trace;
+	uint32_t i;
+
+	if(thirdspacevest_tracing(dev))
+	{
+		return E_NPUTIL_BUSY;
+	}
+	if(!path)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	trace = dev->_trace;
+	if(!trace)
+	{
+		trace = (thirdspacevest_trace*)malloc(sizeof(thirdspacevest_trace));
+		if(!trace)
+		{
+			return E_NPUTIL_DRIVER_ERROR;
+		}
+		memset(trace, 0, sizeof(thirdspacevest_trace));
+		for(i = 0; i < THIRDSPACEVEST_TRACE_RING_SIZE; ++i)
+		{
+			trace->_ring[i]._sequence = i;
+		}
+		if(thirdspacevest_event_init(&trace->_wakeup) < 0)
+		{
+			free(trace);
+			return E_NPUTIL_DRIVER_ERROR;
+		}
+		dev->_trace = trace;
+	}
+	// The ring isn't reset for a new trace, a call still running from
+	// the last one may be about to publish into it.
+
+	trace->_file = fopen(path, "wb");
+	if(!trace->_file)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "TSVT", 4);
+	header.version = THIRDSPACEVEST_TRACE_VERSION;
+	header.record_size = sizeof(thirdspacevest_trace_record);
+	if(fwrite(&header, sizeof(header), 1, trace->_file) != 1)
+	{
+		fclose(trace->_file);
+		trace->_file = NULL;
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+
+	trace->_start_us = thirdspacevest_time_us();
+	trace->_dropped_written = thirdspacevest_atomic_load(&trace->_dropped);
+	trace->_stopping = 0;
+	if(thirdspacevest_thread_start(&trace->_thread, thirdspacevest_trace_thread, trace) < 0)
+	{
+		fclose(trace->_file);
+		trace->_file = NULL;
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	thirdspacevest_atomic_store(&dev->_trace_running, 1);
+	return 0;
+}
+
+int thirdspacevest_stop_trace(thirdspacevest_device* dev)
+{
+	thirdspacevest_trace* trace = dev->_trace;
+	int ret = 0;
+	if(!thirdspacevest_atomic_exchange(&dev->_trace_running, 0))
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	thirdspacevest_atomic_store(&trace->_stopping, 1);
+	thirdspacevest_event_signal(&trace->_wakeup);
+	thirdspacevest_thread_join(&trace->_thread);
+	if(fclose(trace->_file) != 0)
+	{
+		ret = E_NPUTIL_DRIVER_ERROR;
+	}
+	trace->_file = NULL;
+	return ret;
+}
+
+void thirdspacevest_free_trace(thirdspacevest_device* dev)
+{
+	if(!dev->_trace)
+	{
+		return;
+	}
+	thirdspacevest_stop_trace(dev);
+	thirdspacevest_event_destroy(&dev->_trace->_wakeup);
+	free(dev->_trace);
+	dev->_trace = NULL;
+}
+
+int thirdspacevest_replay_trace(thirdspacevest_device* dev, const char* path, double speed)
+{
+	thirdspacevest_trace_header header;
+	thirdspacevest_trace_record record;
+	thirdspacevest_event event;
+	uint64_t start;
+	FILE* file;
+	int sent = 0;
+
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	file = fopen(path, "rb");
+	if(!file)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "TSVT", 4) ||
+	   header.version != THIRDSPACEVEST_TRACE_VERSION || header.record_size != sizeof(record))
+	{
+		fclose(file);
+		return E_NPUTIL_INVALID_PARAM;
+	}
+
+	thirdspacevest_event_init(&event);
+	start = thirdspacevest_time_us();
+	while(fread(&record, sizeof(record), 1, file) == 1)
+	{
+		if(record.type < THIRDSPACEVEST_TRACE_EFFECT || record.type > THIRDSPACEVEST_TRACE_FRAME_ASYNC)
+		{
+			continue;
+		}
+		if(speed > 0)
+		{
+			thirdspacevest_replay_wait(&event, start + (uint64_t)(record.time_us / speed));
+		}
+		switch(record.type)
+		{
+		case THIRDSPACEVEST_TRACE_EFFECT:
+			thirdspacevest_send_effect(dev, record.cell, record.speed);
+			break;
+		case THIRDSPACEVEST_TRACE_ENQUEUE:
+			thirdspacevest_enqueue_effect(dev, record.cell, record.speed);
+			break;
+		case THIRDSPACEVEST_TRACE_FRAME:
+			thirdspacevest_send_frame(dev, record.speeds, record.cell);
+			break;
+		default:
+			thirdspacevest_send_frame_async(dev, record.speeds, record.cell, NULL, NULL);
+			break;
+		}
+		++sent;
+	}
+	thirdspacevest_event_destroy(&event);
+	fclose(file);
+	return sent;
+}
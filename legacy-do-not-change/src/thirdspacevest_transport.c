@@ -0,0 +1,345 @@
+/*
+ * Third Space Vest Driver - Transport dispatch
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+size_t thirdspacevest_device_sizeof()
+{
+	return sizeof(thirdspacevest_device);
+}
+
+thirdspacevest_device* thirdspacevest_claim_storage(void* storage, size_t size)
+{
+	if(!storage || size < sizeof(thirdspacevest_device) ||
+	   ((uintptr_t)storage & (THIRDSPACEVEST_DEVICE_ALIGN - 1)))
+	{
+		return NULL;
+	}
+	memset(storage, 0, sizeof(thirdspacevest_device));
+	return (thirdspacevest_device*)storage;
+}
+
+thirdspacevest_device* thirdspacevest_create_with_transport(const thirdspacevest_transport* transport, void* data)
+{
+	thirdspacevest_device* dev = (thirdspacevest_device*)malloc(sizeof(thirdspacevest_device));
+	if(!dev)
+	{
+		return NULL;
+	}
+	if(!thirdspacevest_init_inplace_with_transport(dev, sizeof(thirdspacevest_device), transport, data))
+	{
+		free(dev);
+		return NULL;
+	}
+	dev->_owns_storage = 1;
+	return dev;
+}
+
+thirdspacevest_device* thirdspacevest_init_inplace_with_transport(void* storage, size_t size, const thirdspacevest_transport* transport, void* data)
+{
+	thirdspacevest_device* dev;
+	int i;
+	if(!transport || !transport->get_count || !transport->open || !transport->close ||
+	   !transport->write || !transport->read || !transport->write_async != !transport->handle_events)
+	{
+		return NULL;
+	}
+	dev = thirdspacevest_claim_storage(storage, size);
+	if(!dev)
+	{
+		return NULL;
+	}
+	thirdspacevest_init_state(dev);
+	dev->_transport = transport;
+	dev->_transport_data = data;
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		dev->_slots[i]._dev = dev;
+	}
+	dev->_is_inited = 1;
+	return dev;
+}
+
+void thirdspacevest_delete(thirdspacevest_device* dev)
+{
+	if(dev->_transport->destroy)
+	{
+		dev->_transport->destroy(dev);
+	}
+	thirdspacevest_deinit_state(dev);
+	if(dev->_owns_storage)
+	{
+		free(dev);
+	}
+}
+
+int thirdspacevest_get_count(thirdspacevest_device* dev)
+{
+	if(!dev->_is_inited)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	return dev->_transport->get_count(dev);
+}
+
+int thirdspacevest_open(thirdspacevest_device* dev, unsigned int device_index)
+{
+	if(!dev->_is_inited)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	thirdspacevest_atomic_store(&dev->_lost, 0);
+	return dev->_transport->open(dev, device_index);
+}
+
+int thirdspacevest_close(thirdspacevest_device* dev)
+{
+	int ret;
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	thirdspacevest_stop_completions(dev);
+	thirdspacevest_stop_sequencer(dev);
+	thirdspacevest_stop_io_thread(dev);
+	ret = dev->_transport->close(dev);
+	if(!dev->_is_open)
+	{
+		thirdspacevest_atomic_store(&dev->_lost, 0);
+	}
+	return ret;
+}
+
+void thirdspacevest_mark_lost(thirdspacevest_device* dev)
+{
+	thirdspacevest_atomic_store(&dev->_lost, 1);
+}
+
+void thirdspacevest_mark_arrived(thirdspacevest_device* dev)
+{
+	if(thirdspacevest_atomic_load(&dev->_lost))
+	{
+		thirdspacevest_atomic_store(&dev->_arrived, 1);
+	}
+}
+
+/**
+ * Puts the cells back the way they were before the vest went away. It
+ * comes back with every cell off, so only running cells are sent, and
+ * _speeds then matches the vest everywhere.
+ */
+static void thirdspacevest_replay_cells(thirdspacevest_device* dev)
+{
+	uint8_t packet[THIRDSPACEVEST_PACKET_SIZE];
+	uint8_t status[THIRDSPACEVEST_PACKET_SIZE];
+	uint8_t i;
+
+	dev->_speeds_known = THIRDSPACEVEST_ALL_CELLS;
+	for(i = 0; i < THIRDSPACEVEST_CELL_COUNT; ++i)
+	{
+		if(dev->_speeds[i] == 0)
+		{
+			continue;
+		}
+		thirdspacevest_form_device_packet(dev, packet, i, dev->_speeds[i]);
+		if(dev->_transport->write(dev, packet) < 0)
+		{
+			dev->_speeds_known &= ~(1 << i);
+			continue;
+		}
+		if(thirdspacevest_atomic_load(&dev->_ack_mode) != THIRDSPACEVEST_ACK_NONE)
+		{
+			dev->_transport->read(dev, status);
+		}
+	}
+}
+
+int thirdspacevest_reconnect(thirdspacevest_device* dev)
+{
+	int ret;
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	if(!thirdspacevest_atomic_load(&dev->_lost))
+	{
+		return 0;
+	}
+	if(!dev->_transport->reopen)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	dev->_reconnect_us = thirdspacevest_time_us();
+	thirdspacevest_atomic_store(&dev->_arrived, 0);
+	ret = dev->_transport->reopen(dev);
+	if(ret < 0)
+	{
+		return ret;
+	}
+	thirdspacevest_atomic_store(&dev->_lost, 0);
+	thirdspacevest_atomic_fetch_add(&dev->_reconnects, 1);
+	thirdspacevest_replay_cells(dev);
+	return 0;
+}
+
+int thirdspacevest_is_connected(thirdspacevest_device* dev)
+{
+	return dev->_is_open && !thirdspacevest_atomic_load(&dev->_lost);
+}
+
+void thirdspacevest_set_auto_reconnect(thirdspacevest_device* dev, int enabled)
+{
+	dev->_auto_reconnect = enabled;
+}
+
+/**
+ * Gives a lost vest another chance to come back before a transfer, if
+ * auto reconnect is on and it's time for another attempt.
+ *
+ * @return Nonzero if the vest is still gone
+ */
+static int thirdspacevest_link_down(thirdspacevest_device* dev)
+{
+	if(!thirdspacevest_atomic_load(&dev->_lost))
+	{
+		return 0;
+	}
+	if(!dev->_auto_reconnect)
+	{
+		return 1;
+	}
+	if(thirdspacevest_time_us() - dev->_reconnect_us < THIRDSPACEVEST_RECONNECT_INTERVAL_MS * 1000 &&
+	   !thirdspacevest_atomic_load(&dev->_arrived))
+	{
+		return 1;
+	}
+	return thirdspacevest_reconnect(dev) < 0;
+}
+
+int thirdspacevest_read_data(thirdspacevest_device* dev, uint8_t* input_report)
+{
+	if(thirdspacevest_link_down(dev))
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return dev->_transport->read(dev, input_report);
+}
+
+int thirdspacevest_write_data(thirdspacevest_device* dev, uint8_t* output_report)
+{
+	if(thirdspacevest_link_down(dev))
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return dev->_transport->write(dev, output_report);
+}
+
+/**
+ * Claims a free slot for a transport without async support. The packet
+ * goes out from thirdspacevest_run_slots.
+ */
+static int thirdspacevest_queue_slot(thirdspacevest_device* dev, const uint8_t* output_report, thirdspacevest_async_cb callback, void* user_data)
+{
+	int i;
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		thirdspacevest_transfer_slot* slot = &dev->_slots[i];
+		if(slot->_in_use)
+		{
+			continue;
+		}
+		memcpy(slot->_out_buffer, output_report, THIRDSPACEVEST_PACKET_SIZE);
+		slot->_callback = callback;
+		slot->_user_data = user_data;
+		slot->_in_use = 1;
+		++dev->_pending;
+		return 0;
+	}
+	return E_NPUTIL_BUSY;
+}
+
+/**
+ * Sends every queued slot with the transport's blocking calls, in the
+ * order they're laid out, and runs their callbacks.
+ */
+static void thirdspacevest_run_slots(thirdspacevest_device* dev)
+{
+	int i;
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		thirdspacevest_transfer_slot* slot = &dev->_slots[i];
+		thirdspacevest_async_cb callback;
+		void* user_data;
+		uint64_t start, now;
+		int status;
+
+		if(!slot->_in_use)
+		{
+			continue;
+		}
+		start = thirdspacevest_time_us();
+		status = dev->_transport->write(dev, slot->_out_buffer);
+		now = thirdspacevest_time_us();
+		thirdspacevest_record_stage(dev, &dev->_write_latency, now - start);
+		thirdspacevest_trace_transfer(dev, THIRDSPACEVEST_TRACE_WRITE, start, now, status < 0);
+		if(status >= 0 && thirdspacevest_atomic_load(&dev->_ack_mode) != THIRDSPACEVEST_ACK_NONE)
+		{
+			status = dev->_transport->read(dev, (uint8_t*)slot->_in_buffer);
+			start = thirdspacevest_time_us();
+			thirdspacevest_record_stage(dev, &dev->_ack_latency, start - now);
+			thirdspacevest_trace_transfer(dev, THIRDSPACEVEST_TRACE_READ, now, start, status < 0);
+		}
+		callback = slot->_callback;
+		user_data = slot->_user_data;
+		slot->_in_use = 0;
+		--dev->_pending;
+		if(callback)
+		{
+			callback(dev, status < 0 ? E_NPUTIL_DRIVER_ERROR : 0, user_data);
+		}
+	}
+}
+
+int thirdspacevest_write_data_async(thirdspacevest_device* dev, const uint8_t* output_report, thirdspacevest_async_cb callback, void* user_data)
+{
+	if(!dev->_is_open)
+	{
+		return E_NPUTIL_NOT_OPENED;
+	}
+	if(thirdspacevest_link_down(dev))
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	if(!dev->_transport->write_async)
+	{
+		return thirdspacevest_queue_slot(dev, output_report, callback, user_data);
+	}
+	return dev->_transport->write_async(dev, output_report, callback, user_data);
+}
+
+int thirdspacevest_handle_events(thirdspacevest_device* dev, int timeout_ms)
+{
+	if(!dev->_transport->handle_events)
+	{
+		thirdspacevest_run_slots(dev);
+		return 0;
+	}
+	return dev->_transport->handle_events(dev, timeout_ms);
+}
+
+int thirdspacevest_get_pending(thirdspacevest_device* dev)
+{
+	return dev->_pending;
+}
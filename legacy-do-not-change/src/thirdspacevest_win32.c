@@ -11,42 +11,34 @@
  * Read LICENSE_BSD.txt for details.
  */
 
+// CancelIoEx needs Vista or later, CM_Register_Notification needs 8
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
 
-#include "thirdspacevest/thirdspacevest.h"
+#include "thirdspacevest_internal.h"
 
 #include <api/setupapi.h>
 #include <api/hidsdi.h>
+#include <cfgmgr32.h>
+#include <tchar.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
-//Application global variables
-DWORD								ActualBytesRead;
-DWORD								BytesRead;
-HIDP_CAPS							Capabilities;
-DWORD								cbBytesRead;
-PSP_DEVICE_INTERFACE_DETAIL_DATA	detailData;
-DWORD								dwError;
-char								FeatureReport[256];
-HANDLE								hEventObject;
-HANDLE								hDevInfo;
-GUID								HidGuid;
-OVERLAPPED							HIDOverlapped;
-char								InputReport[256];
-ULONG								Length;
-LPOVERLAPPED						lpOverLap;
-BOOL								MyDeviceDetected = FALSE;
-TCHAR*								MyDevicePathName;
-DWORD								NumberOfBytesRead;
-char								OutputReport[256];
-DWORD								ReportType;
-ULONG								Required;
-TCHAR*								ValueToDisplay;
-
-void GetDeviceCapabilities(HANDLE DeviceHandle)
+// Everything about an opened vest lives in thirdspacevest_device, so
+// separate devices (or separate threads each owning a device) never
+// share state here.
+
+#define THIRDSPACEVEST_SLOT_WRITING 1
+#define THIRDSPACEVEST_SLOT_READING 2
+
+static void thirdspacevest_get_capabilities(thirdspacevest_device* dev)
 {
-	//Get the Capabilities structure for the 
+	//Get the Capabilities structure for the device
 
 	PHIDP_PREPARSED_DATA	PreparsedData;
+	HIDP_CAPS				Capabilities;
 
 	/*
 	  API function: HidD_GetPreparsedData
@@ -57,14 +49,12 @@ void GetDeviceCapabilities(HANDLE DeviceHandle)
 	*/
 
 	HidD_GetPreparsedData
-		(DeviceHandle,
+		(dev->_dev,
 		 &PreparsedData);
 
 	/*
 	  API function: HidP_GetCaps
 	  Learn the device's capabilities.
-	  For standard devices such as joysticks, you can find out the specific
-	  capabilities of the 
 	  For a custom device, the software will probably know what the device is capable of,
 	  and the call only verifies the information.
 	  Requires: the pointer to the buffer returned by HidD_GetPreparsedData.
@@ -76,22 +66,147 @@ void GetDeviceCapabilities(HANDLE DeviceHandle)
 		 &Capabilities);
 
 	HidD_FreePreparsedData(PreparsedData);
+
+	// Report ID byte plus the 10 byte packet, unless the device says otherwise
+	dev->_input_report_length = Capabilities.InputReportByteLength;
+	dev->_output_report_length = Capabilities.OutputReportByteLength;
+	if(dev->_input_report_length == 0 || dev->_input_report_length > THIRDSPACEVEST_MAX_REPORT)
+	{
+		dev->_input_report_length = THIRDSPACEVEST_PACKET_SIZE + 1;
+	}
+	if(dev->_output_report_length == 0 || dev->_output_report_length > THIRDSPACEVEST_MAX_REPORT)
+	{
+		dev->_output_report_length = THIRDSPACEVEST_PACKET_SIZE + 1;
+	}
+}
+
+static int thirdspacevest_alloc_slots(thirdspacevest_device* dev)
+{
+	int i;
+	dev->_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if(!dev->_overlapped.hEvent)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		thirdspacevest_transfer_slot* slot = &dev->_slots[i];
+		memset(&slot->_overlapped, 0, sizeof(OVERLAPPED));
+		slot->_dev = dev;
+		slot->_in_use = 0;
+		slot->_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if(!slot->_overlapped.hEvent)
+		{
+			return E_NPUTIL_DRIVER_ERROR;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Counts a failed call, and marks the device lost if it failed because
+ * the vest is gone rather than just slow.
+ */
+static void thirdspacevest_count_failure(thirdspacevest_device* dev)
+{
+	DWORD error = GetLastError();
+	thirdspacevest_count_error(dev, 0);
+	if(error == ERROR_DEVICE_NOT_CONNECTED || error == ERROR_GEN_FAILURE)
+	{
+		thirdspacevest_mark_lost(dev);
+	}
+}
+
+static void thirdspacevest_finish_slot(thirdspacevest_transfer_slot* slot, int status)
+{
+	thirdspacevest_async_cb callback = slot->_callback;
+	void* user_data = slot->_user_data;
+	slot->_in_use = 0;
+	--slot->_dev->_pending;
+	if(callback)
+	{
+		callback(slot->_dev, status, user_data);
+	}
+}
+
+static void thirdspacevest_free_slots(thirdspacevest_device* dev)
+{
+	DWORD transferred;
+	int i;
+	// Cancel whatever is still in flight and wait for the driver to let
+	// go of the buffers before the events are closed.
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		thirdspacevest_transfer_slot* slot = &dev->_slots[i];
+		if(slot->_in_use)
+		{
+			CancelIoEx(dev->_dev, &slot->_overlapped);
+			GetOverlappedResult(dev->_dev, &slot->_overlapped, &transferred, TRUE);
+			thirdspacevest_finish_slot(slot, E_NPUTIL_DRIVER_ERROR);
+		}
+		if(slot->_overlapped.hEvent)
+		{
+			CloseHandle(slot->_overlapped.hEvent);
+			slot->_overlapped.hEvent = NULL;
+		}
+	}
+	if(dev->_overlapped.hEvent)
+	{
+		CloseHandle(dev->_overlapped.hEvent);
+		dev->_overlapped.hEvent = NULL;
+	}
+}
+
+/**
+ * Checks the interface path for our VID/PID, so only vests get opened
+ * while enumerating instead of every HID on the system.
+ */
+static int thirdspacevest_path_is_vest(const TCHAR* path)
+{
+	static const TCHAR pattern[] = TEXT("vid_1bd7&pid_5000");
+	size_t i, j;
+	for(i = 0; path[i]; ++i)
+	{
+		for(j = 0; pattern[j] && path[i + j] && _totlower(path[i + j]) == pattern[j]; ++j)
+		{
+		}
+		if(!pattern[j])
+		{
+			return 1;
+		}
+	}
+	return 0;
 }
 
-int thirdspacevest_open_win32(thirdspacevest_device* dev, unsigned int device_index, int get_count)
+/**
+ * Walks the HID interfaces and rebuilds the list of attached vests.
+ */
+static int thirdspacevest_rescan_devices(thirdspacevest_device* dev)
 {
 	//Use a series of API calls to find a HID with a specified Vendor IF and Product ID.
 
 	HIDD_ATTRIBUTES						Attributes;
 	SP_DEVICE_INTERFACE_DATA			devInfoData;
+	// Room for any path short enough to keep, so walking the HIDs
+	// doesn't allocate. Longer ones are skipped below.
+	union
+	{
+		SP_DEVICE_INTERFACE_DETAIL_DATA data;
+		BYTE bytes[FIELD_OFFSET(SP_DEVICE_INTERFACE_DETAIL_DATA, DevicePath) + MAX_PATH * sizeof(TCHAR)];
+	}									detailBuffer;
+	PSP_DEVICE_INTERFACE_DETAIL_DATA	detailData = &detailBuffer.data;
+	HANDLE								hDevInfo;
+	HANDLE								hidHandle;
+	GUID								HidGuid;
 	BOOL								LastDevice = FALSE;
 	int									MemberIndex = 0;
 	LONG								Result;
-	int									device_count = 0;
+	ULONG								Length;
+	ULONG								Required;
 
-	Length = 0;
-	detailData = NULL;
-	dev->_dev = NULL;
+	// Mark the cache valid before walking, so an arrival that lands
+	// mid-scan invalidates it again rather than getting lost.
+	thirdspacevest_atomic_store(&dev->_known_valid, 1);
 
 	/*
 	  API function: HidD_GetHidGuid
@@ -112,25 +227,29 @@ int thirdspacevest_open_win32(thirdspacevest_device* dev, unsigned int device_in
 		 NULL,
 		 NULL,
 		 DIGCF_PRESENT|DIGCF_INTERFACEDEVICE);
+	if(hDevInfo == INVALID_HANDLE_VALUE)
+	{
+		thirdspacevest_atomic_store(&dev->_known_valid, 0);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
 
 	devInfoData.cbSize = sizeof(devInfoData);
 
-	//Step through the available devices looking for the one we want.
-	//Quit on detecting the desired device or checking all available devices without success.
+	thirdspacevest_mutex_lock(&dev->_known_lock);
+	dev->_known_count = 0;
 
-	MemberIndex = 0;
-	LastDevice = FALSE;
+	//Step through the available devices, remembering every vest.
 
 	do
 	{
 		/*
 		  API function: SetupDiEnumDeviceInterfaces
 		  On return, MyDeviceInterfaceData contains the handle to a
-		  SP_DEVICE_INTERFACE_DATA structure for a detected 
+		  SP_DEVICE_INTERFACE_DATA structure for a detected device.
 		  Requires:
 		  The DeviceInfoSet returned in SetupDiGetClassDevs.
 		  The HidGuid returned in GetHidGuid.
-		  An index to specify a 
+		  An index to specify a device.
 		*/
 
 		Result=SetupDiEnumDeviceInterfaces
@@ -147,24 +266,16 @@ int thirdspacevest_open_win32(thirdspacevest_device* dev, unsigned int device_in
 			/*
 			  API function: SetupDiGetDeviceInterfaceDetail
 			  Returns: an SP_DEVICE_INTERFACE_DETAIL_DATA structure
-			  containing information about a 
+			  containing information about a device.
 			  To retrieve the information, call this function twice.
 			  The first time returns the size of the structure in Length.
 			  The second time returns a pointer to the data in DeviceInfoSet.
-			  Requires:
-			  A DeviceInfoSet returned by SetupDiGetClassDevs
-			  The SP_DEVICE_INTERFACE_DATA structure returned by SetupDiEnumDeviceInterfaces.
-
-			  The final parameter is an optional pointer to an SP_DEV_INFO_DATA structure.
-			  This application doesn't retrieve or use the structure.
-			  If retrieving the structure, set
-			  MyDeviceInfoData.cbSize = length of MyDeviceInfoData.
-			  and pass the structure's address.
 			*/
 
 			//Get the Length value.
 			//The call will return with a "buffer too small" error which can be ignored.
 
+			Length = 0;
 			Result = SetupDiGetDeviceInterfaceDetail
 				(hDevInfo,
 				 &devInfoData,
@@ -173,17 +284,13 @@ int thirdspacevest_open_win32(thirdspacevest_device* dev, unsigned int device_in
 				 &Length,
 				 NULL);
 
-			//Allocate memory for the hDevInfo structure, using the returned Length.
-
- 			detailData = (PSP_DEVICE_INTERFACE_DETAIL_DATA)malloc(Length);
-
 			//Set cbSize in the detailData structure.
 
 			detailData -> cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA);
 
 			//Call the function again, this time passing it the returned buffer size.
 
-			Result = SetupDiGetDeviceInterfaceDetail
+			Result = Length <= sizeof(detailBuffer) && SetupDiGetDeviceInterfaceDetail
 				(hDevInfo,
 				 &devInfoData,
 				 detailData,
@@ -191,141 +298,533 @@ int thirdspacevest_open_win32(thirdspacevest_device* dev, unsigned int device_in
 				 &Required,
 				 NULL);
 
-			// Open a handle to the 
-			// To enable retrieving information about a system mouse or keyboard,
-			// don't request Read or Write access for this handle.
-
-			/*
-			  API function: CreateFile
-			  Returns: a handle that enables reading and writing to the 
-			  Requires:
-			  The DevicePath in the detailData structure
-			  returned by SetupDiGetDeviceInterfaceDetail.
-			*/
-
-			
-			dev->_dev =CreateFile
-				(detailData->DevicePath,
-				 GENERIC_READ | GENERIC_WRITE,
-				 FILE_SHARE_READ|FILE_SHARE_WRITE,
-				 (LPSECURITY_ATTRIBUTES)NULL,
-				 OPEN_EXISTING,
-				 0,
-				 NULL);
-
-			/*
-			  API function: HidD_GetAttributes
-			  Requests information from the 
-			  Requires: the handle returned by CreateFile.
-			  Returns: a HIDD_ATTRIBUTES structure containing
-			  the Vendor ID, Product ID, and Product Version Number.
-			  Use this information to decide if the detected device is
-			  the one we're looking for.
-			*/
-
-			//Set the Size to the number of bytes in the structure.
-
-			Attributes.Size = sizeof(Attributes);
-
-			Result = HidD_GetAttributes
-				(dev->_dev,
-				 &Attributes);
-
-			//Is it the desired device?
-
-			MyDeviceDetected = FALSE;
-
-			if ((Attributes.VendorID == THIRDSPACEVEST_VID && Attributes.ProductID == THIRDSPACEVEST_PID))
+			if (Result && thirdspacevest_path_is_vest(detailData->DevicePath) &&
+				_tcslen(detailData->DevicePath) < MAX_PATH &&
+				dev->_known_count < THIRDSPACEVEST_MAX_DEVICES)
 			{
-				if(get_count)
-				{
-					++device_count;
-					CloseHandle(dev->_dev);
-				}
-				else
+				/*
+				  API function: HidD_GetAttributes
+				  Requests information from the device.
+				  Requires: a handle returned by CreateFile. No access
+				  rights are needed just to read the attributes.
+				  Returns: a HIDD_ATTRIBUTES structure containing
+				  the Vendor ID, Product ID, and Product Version Number.
+				*/
+
+				hidHandle = CreateFile
+					(detailData->DevicePath,
+					 0,
+					 FILE_SHARE_READ|FILE_SHARE_WRITE,
+					 (LPSECURITY_ATTRIBUTES)NULL,
+					 OPEN_EXISTING,
+					 0,
+					 NULL);
+
+				if (hidHandle != INVALID_HANDLE_VALUE)
 				{
-					MyDeviceDetected = TRUE;
-					MyDevicePathName = detailData->DevicePath;
-					GetDeviceCapabilities(dev->_dev);
-					break;
+					Attributes.Size = sizeof(Attributes);
+					if (HidD_GetAttributes(hidHandle, &Attributes) &&
+						Attributes.VendorID == THIRDSPACEVEST_VID && Attributes.ProductID == THIRDSPACEVEST_PID)
+					{
+						_tcscpy(dev->_known_paths[dev->_known_count++], detailData->DevicePath);
+					}
+					CloseHandle(hidHandle);
 				}
 			}
-			else
-			{
-				CloseHandle(dev->_dev);
-			}
-			free(detailData);
 		}  //if (Result != 0)
 
 		else
 		{
 			LastDevice=TRUE;
 		}
-		//If we haven't found the device yet, and haven't tried every available device,
-		//try the next one.
 		MemberIndex = MemberIndex + 1;
 	}
 	while (!LastDevice);
+	thirdspacevest_mutex_unlock(&dev->_known_lock);
 	SetupDiDestroyDeviceInfoList(hDevInfo);
-	if(get_count) return device_count;
-	if(MyDeviceDetected) return 0;
-	return -1;
+	return 0;
 }
 
-THIRDSPACEVEST_DECLSPEC int thirdspacevest_get_count(thirdspacevest_device* dev)
+static DWORD CALLBACK thirdspacevest_notification_callback(HCMNOTIFICATION notify, PVOID context, CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA event_data, DWORD event_data_size)
 {
-	return thirdspacevest_open_win32(dev, 0, 1);
+	thirdspacevest_device* dev = (thirdspacevest_device*)context;
+	if(action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL || action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL)
+	{
+		thirdspacevest_atomic_store(&dev->_known_valid, 0);
+	}
+	if(action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL)
+	{
+		thirdspacevest_mark_arrived(dev);
+	}
+	return ERROR_SUCCESS;
 }
 
-THIRDSPACEVEST_DECLSPEC int thirdspacevest_open(thirdspacevest_device* dev, unsigned int device_index)
+/**
+ * Registers for HID interface arrival/removal, so the enumeration
+ * cache only gets rebuilt when something actually changed.
+ */
+static void thirdspacevest_init_devices(thirdspacevest_device* dev)
 {
-	return thirdspacevest_open_win32(dev, device_index, 0);
+	CM_NOTIFY_FILTER filter;
+	HCMNOTIFICATION notification;
+
+	dev->_known_valid = 0;
+	dev->_notification = NULL;
+	memset(&filter, 0, sizeof(filter));
+	filter.cbSize = sizeof(filter);
+	filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+	HidD_GetHidGuid(&filter.u.DeviceInterface.ClassGuid);
+	if(CM_Register_Notification(&filter, dev, thirdspacevest_notification_callback, &notification) == CR_SUCCESS)
+	{
+		dev->_notification = notification;
+	}
 }
 
-THIRDSPACEVEST_DECLSPEC int thirdspacevest_close(thirdspacevest_device* dev)
+/**
+ * Rescans if the cache is stale. Without a notification registration
+ * the cache can't be trusted, so every call rescans.
+ */
+static int thirdspacevest_update_devices(thirdspacevest_device* dev)
 {
-	CloseHandle(dev->_dev);
-	return 0;
+	if(dev->_notification && thirdspacevest_atomic_load(&dev->_known_valid))
+	{
+		return 0;
+	}
+	return thirdspacevest_rescan_devices(dev);
 }
 
-THIRDSPACEVEST_DECLSPEC int thirdspacevest_read_data(thirdspacevest_device* dev, unsigned char *input_report)
+static int thirdspacevest_win32_get_count(thirdspacevest_device* dev)
 {
-	int Result;
-	char read[64];
-	Result = ReadFile
-		(dev->_dev,
-		 read,
-		 Capabilities.InputReportByteLength,
-		 &NumberOfBytesRead,
+	int count;
+	if (thirdspacevest_update_devices(dev) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	thirdspacevest_mutex_lock(&dev->_known_lock);
+	count = dev->_known_count;
+	thirdspacevest_mutex_unlock(&dev->_known_lock);
+	return count;
+}
+
+/**
+ * Opens the HID interface at path for overlapped I/O and sets up the
+ * transfer slots. Leaves nothing open if either fails.
+ */
+static int thirdspacevest_open_path(thirdspacevest_device* dev, const TCHAR* path)
+{
+	int ret;
+
+	/*
+	  API function: CreateFile
+	  Returns: a handle that enables reading and writing to the device.
+	  FILE_FLAG_OVERLAPPED lets the read/write calls wait with a
+	  timeout and lets several transfers be in flight at once.
+	*/
+
+	dev->_dev = CreateFile
+		(path,
+		 GENERIC_READ | GENERIC_WRITE,
+		 FILE_SHARE_READ|FILE_SHARE_WRITE,
+		 (LPSECURITY_ATTRIBUTES)NULL,
+		 OPEN_EXISTING,
+		 FILE_FLAG_OVERLAPPED,
 		 NULL);
-	memcpy(input_report, read+1, 10);
-	return Result;
+	if (dev->_dev == INVALID_HANDLE_VALUE)
+	{
+		dev->_dev = NULL;
+		return E_NPUTIL_NOT_INITED;
+	}
+
+	thirdspacevest_get_capabilities(dev);
+	ret = thirdspacevest_alloc_slots(dev);
+	if (ret < 0)
+	{
+		// Closes whichever events were created before the failure
+		thirdspacevest_free_slots(dev);
+		CloseHandle(dev->_dev);
+		dev->_dev = NULL;
+	}
+	return ret;
 }
 
-THIRDSPACEVEST_DECLSPEC int thirdspacevest_write_data(thirdspacevest_device* dev, unsigned char *output_report)
+static int thirdspacevest_win32_open(thirdspacevest_device* dev, uint32_t device_index)
 {
-	int Result;
-	char command[64];
-	command[0] = 0x0;
-	memcpy((command+1), output_report, 10);
-	Result = WriteFile
-		(dev->_dev,
-		 command,
-		 Capabilities.OutputReportByteLength,
-		 &NumberOfBytesRead,
-		 (LPOVERLAPPED) &HIDOverlapped);
-	return Result;
+	TCHAR path[MAX_PATH];
+	int found = 0;
+	int ret;
+
+	if (thirdspacevest_update_devices(dev) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	thirdspacevest_mutex_lock(&dev->_known_lock);
+	if (device_index < (unsigned int)dev->_known_count)
+	{
+		_tcscpy(path, dev->_known_paths[device_index]);
+		found = 1;
+	}
+	thirdspacevest_mutex_unlock(&dev->_known_lock);
+	if (!found)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+
+	ret = thirdspacevest_open_path(dev, path);
+	if (ret == 0)
+	{
+		_tcscpy(dev->_open_path, path);
+		dev->_is_open = 1;
+	}
+	return ret;
+}
+
+static int thirdspacevest_win32_close(thirdspacevest_device* dev)
+{
+	thirdspacevest_free_slots(dev);
+	if (dev->_dev)
+	{
+		CloseHandle(dev->_dev);
+	}
+	dev->_dev = NULL;
+	dev->_is_open = 0;
+	return 0;
+}
+
+/**
+ * Drops the dead handle and opens the vest again if its interface path
+ * is back. Windows gives a vest replugged into the same port the same
+ * path.
+ */
+static int thirdspacevest_win32_reopen(thirdspacevest_device* dev)
+{
+	int found = 0;
+	int i;
+
+	if (dev->_dev)
+	{
+		thirdspacevest_free_slots(dev);
+		CloseHandle(dev->_dev);
+		dev->_dev = NULL;
+	}
+	if (thirdspacevest_update_devices(dev) < 0)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	thirdspacevest_mutex_lock(&dev->_known_lock);
+	for (i = 0; i < dev->_known_count && !found; ++i)
+	{
+		found = _tcsicmp(dev->_known_paths[i], dev->_open_path) == 0;
+	}
+	thirdspacevest_mutex_unlock(&dev->_known_lock);
+	if (!found)
+	{
+		return E_NPUTIL_NOT_INITED;
+	}
+	return thirdspacevest_open_path(dev, dev->_open_path);
+}
+
+/**
+ * Waits out one blocking stage on the device's own overlapped
+ * structure, cancelling it if the device doesn't answer in time.
+ */
+static int thirdspacevest_wait_overlapped(thirdspacevest_device* dev)
+{
+	DWORD transferred;
+	if(WaitForSingleObject(dev->_overlapped.hEvent, thirdspacevest_usb_timeout(dev)) != WAIT_OBJECT_0)
+	{
+		CancelIoEx(dev->_dev, &dev->_overlapped);
+		GetOverlappedResult(dev->_dev, &dev->_overlapped, &transferred, TRUE);
+		thirdspacevest_count_error(dev, 1);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	if(!GetOverlappedResult(dev->_dev, &dev->_overlapped, &transferred, FALSE))
+	{
+		thirdspacevest_count_failure(dev);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return 0;
+}
+
+static int thirdspacevest_win32_read(thirdspacevest_device* dev, uint8_t* input_report)
+{
+	unsigned char read[THIRDSPACEVEST_MAX_REPORT];
+	int ret;
+	if(!ReadFile(dev->_dev, read, dev->_input_report_length, NULL, &dev->_overlapped) &&
+	   GetLastError() != ERROR_IO_PENDING)
+	{
+		thirdspacevest_count_failure(dev);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	ret = thirdspacevest_wait_overlapped(dev);
+	if(ret == 0)
+	{
+		memcpy(input_report, read+1, THIRDSPACEVEST_PACKET_SIZE);
+	}
+	return ret;
+}
+
+static int thirdspacevest_win32_write(thirdspacevest_device* dev, uint8_t* output_report)
+{
+	unsigned char command[THIRDSPACEVEST_MAX_REPORT];
+	memset(command, 0, sizeof(command));
+	memcpy((command+1), output_report, THIRDSPACEVEST_PACKET_SIZE);
+	if(!WriteFile(dev->_dev, command, dev->_output_report_length, NULL, &dev->_overlapped) &&
+	   GetLastError() != ERROR_IO_PENDING)
+	{
+		thirdspacevest_count_failure(dev);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	return thirdspacevest_wait_overlapped(dev);
+}
+
+static int thirdspacevest_win32_write_async(thirdspacevest_device* dev, const uint8_t* output_report, thirdspacevest_async_cb callback, void* user_data)
+{
+	thirdspacevest_transfer_slot* slot = NULL;
+	int i;
+
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		if(!dev->_slots[i]._in_use)
+		{
+			slot = &dev->_slots[i];
+			break;
+		}
+	}
+	if(!slot)
+	{
+		return E_NPUTIL_BUSY;
+	}
+
+	memset(slot->_out_buffer, 0, sizeof(slot->_out_buffer));
+	memcpy(slot->_out_buffer + 1, output_report, THIRDSPACEVEST_PACKET_SIZE);
+	slot->_callback = callback;
+	slot->_user_data = user_data;
+	slot->_stage_us = thirdspacevest_time_us();
+	if(!WriteFile(dev->_dev, slot->_out_buffer, dev->_output_report_length, NULL, &slot->_overlapped) &&
+	   GetLastError() != ERROR_IO_PENDING)
+	{
+		thirdspacevest_count_failure(dev);
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	slot->_in_use = THIRDSPACEVEST_SLOT_WRITING;
+	slot->_issued = GetTickCount();
+	++dev->_pending;
+	return 0;
+}
+
+/**
+ * Moves a slot whose current stage finished on to the status read, or
+ * completes it.
+ */
+static void thirdspacevest_advance_slot(thirdspacevest_transfer_slot* slot)
+{
+	thirdspacevest_device* dev = slot->_dev;
+	const uint8_t type = slot->_in_use == THIRDSPACEVEST_SLOT_READING ? THIRDSPACEVEST_TRACE_READ : THIRDSPACEVEST_TRACE_WRITE;
+	DWORD transferred;
+	uint64_t now;
+
+	if(!GetOverlappedResult(dev->_dev, &slot->_overlapped, &transferred, FALSE))
+	{
+		thirdspacevest_count_failure(dev);
+		thirdspacevest_trace_transfer(dev, type, slot->_stage_us, thirdspacevest_time_us(), 1);
+		thirdspacevest_finish_slot(slot, E_NPUTIL_DRIVER_ERROR);
+		return;
+	}
+	now = thirdspacevest_time_us();
+	thirdspacevest_record_stage(dev, slot->_in_use == THIRDSPACEVEST_SLOT_READING ? &dev->_ack_latency : &dev->_write_latency,
+								now - slot->_stage_us);
+	thirdspacevest_trace_transfer(dev, type, slot->_stage_us, now, 0);
+	slot->_stage_us = now;
+	if(slot->_in_use == THIRDSPACEVEST_SLOT_READING ||
+	   thirdspacevest_atomic_load(&dev->_ack_mode) == THIRDSPACEVEST_ACK_NONE)
+	{
+		thirdspacevest_finish_slot(slot, 0);
+		return;
+	}
+	// Same as the blocking path, every write is followed by a status
+	// read so the device never backs up on its input reports.
+	slot->_in_use = THIRDSPACEVEST_SLOT_READING;
+	slot->_issued = GetTickCount();
+	if(!ReadFile(dev->_dev, slot->_in_buffer, dev->_input_report_length, NULL, &slot->_overlapped) &&
+	   GetLastError() != ERROR_IO_PENDING)
+	{
+		thirdspacevest_count_failure(dev);
+		thirdspacevest_finish_slot(slot, E_NPUTIL_DRIVER_ERROR);
+	}
+}
+
+static int thirdspacevest_win32_handle_events(thirdspacevest_device* dev, int timeout_ms)
+{
+	HANDLE events[THIRDSPACEVEST_MAX_TRANSFERS];
+	DWORD count = 0;
+	DWORD now, timeout;
+	DWORD ret;
+	int i;
+
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		if(dev->_slots[i]._in_use)
+		{
+			events[count++] = dev->_slots[i]._overlapped.hEvent;
+		}
+	}
+	if(count == 0)
+	{
+		return 0;
+	}
+
+	ret = WaitForMultipleObjects(count, events, FALSE, timeout_ms);
+	if(ret == WAIT_FAILED)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+
+	// More than one slot may have finished, so check all of them rather
+	// than just the one WaitForMultipleObjects reported. Anything stuck
+	// past the transfer timeout gets cancelled and completes on a later
+	// call with an error.
+	now = GetTickCount();
+	timeout = thirdspacevest_usb_timeout(dev);
+	for(i = 0; i < THIRDSPACEVEST_MAX_TRANSFERS; ++i)
+	{
+		thirdspacevest_transfer_slot* slot = &dev->_slots[i];
+		if(!slot->_in_use)
+		{
+			continue;
+		}
+		if(HasOverlappedIoCompleted(&slot->_overlapped))
+		{
+			thirdspacevest_advance_slot(slot);
+		}
+		else if(now - slot->_issued > timeout)
+		{
+			// The cancelled transfer completes as a failure next pass,
+			// which counts the error.
+			if(CancelIoEx(dev->_dev, &slot->_overlapped))
+			{
+				thirdspacevest_count_timeout(dev);
+			}
+		}
+	}
+	return 0;
+}
+
+static void thirdspacevest_win32_destroy(thirdspacevest_device* dev)
+{
+	if(dev->_notification)
+	{
+		CM_Unregister_Notification((HCMNOTIFICATION)dev->_notification);
+	}
+}
+
+static const thirdspacevest_transport thirdspacevest_win32_transport = {
+	"win32",
+	thirdspacevest_win32_get_count,
+	thirdspacevest_win32_open,
+	thirdspacevest_win32_close,
+	thirdspacevest_win32_write,
+	thirdspacevest_win32_read,
+	thirdspacevest_win32_write_async,
+	thirdspacevest_win32_handle_events,
+	thirdspacevest_win32_destroy,
+	thirdspacevest_win32_reopen
+};
+
+THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_init_inplace(void* storage, size_t size)
+{
+	thirdspacevest_device* s = thirdspacevest_claim_storage(storage, size);
+	if(!s)
+	{
+		return NULL;
+	}
+	s->_is_open = 0;
+	s->_is_inited = 1;
+	thirdspacevest_init_state(s);
+	s->_transport = &thirdspacevest_win32_transport;
+	thirdspacevest_init_devices(s);
+	return s;
 }
 
 THIRDSPACEVEST_DECLSPEC thirdspacevest_device* thirdspacevest_create()
 {
 	thirdspacevest_device* s = (thirdspacevest_device*)malloc(sizeof(thirdspacevest_device));
-	s->_is_open = 0;
-	s->_is_inited = 1;	
+	if(!s)
+	{
+		return NULL;
+	}
+	thirdspacevest_init_inplace(s, sizeof(thirdspacevest_device));
+	s->_owns_storage = 1;
 	return s;
 }
 
-THIRDSPACEVEST_DECLSPEC void thirdspacevest_delete(thirdspacevest_device* dev)
+thirdspacevest_device* thirdspacevest_create_in_group(thirdspacevest_group* group)
+{
+	(void)group;
+	return thirdspacevest_create();
+}
+
+THIRDSPACEVEST_DECLSPEC thirdspacevest_group* thirdspacevest_group_create()
+{
+	thirdspacevest_group* g = (thirdspacevest_group*)malloc(sizeof(thirdspacevest_group));
+	if(!g)
+	{
+		return NULL;
+	}
+	g->_count = 0;
+	return g;
+}
+
+int thirdspacevest_group_init(thirdspacevest_group* group)
+{
+	// Every device opens its own handle, there's no shared context
+	(void)group;
+	return 0;
+}
+
+THIRDSPACEVEST_DECLSPEC void thirdspacevest_group_delete(thirdspacevest_group* group)
+{
+	int i;
+	for(i = 0; i < group->_count; ++i)
+	{
+		thirdspacevest_close(group->_devices[i]);
+		thirdspacevest_delete(group->_devices[i]);
+	}
+	free(group);
+}
+
+THIRDSPACEVEST_DECLSPEC int thirdspacevest_group_handle_events(thirdspacevest_group* group, int timeout_ms)
 {
-	free(dev);
+	HANDLE events[MAXIMUM_WAIT_OBJECTS];
+	DWORD count = 0;
+	int i, j;
+
+	// Wait on in-flight slots from every device at once, then let each
+	// device sort out which of its own slots finished.
+	for(i = 0; i < group->_count && count < MAXIMUM_WAIT_OBJECTS; ++i)
+	{
+		thirdspacevest_device* dev = group->_devices[i];
+		for(j = 0; j < THIRDSPACEVEST_MAX_TRANSFERS && count < MAXIMUM_WAIT_OBJECTS; ++j)
+		{
+			if(dev->_slots[j]._in_use)
+			{
+				events[count++] = dev->_slots[j]._overlapped.hEvent;
+			}
+		}
+	}
+	if(count == 0)
+	{
+		return 0;
+	}
+	if(WaitForMultipleObjects(count, events, FALSE, timeout_ms) == WAIT_FAILED)
+	{
+		return E_NPUTIL_DRIVER_ERROR;
+	}
+	for(i = 0; i < group->_count; ++i)
+	{
+		if(thirdspacevest_handle_events(group->_devices[i], 0) < 0)
+		{
+			return E_NPUTIL_DRIVER_ERROR;
+		}
+	}
+	return 0;
 }
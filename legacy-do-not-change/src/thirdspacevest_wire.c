@@ -0,0 +1,113 @@
+/*
+ * Third Space Vest Driver - Binary daemon wire protocol
+ *
+ * Fixed size messages for the hot commands (triggers, frames, effect
+ * IDs) once a daemon client has switched its connection over. Control
+ * commands stay JSON lines on the same socket.
+ *
+ * Copyright (c) 2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libthirdspacevest/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "thirdspacevest_internal.h"
+#include <string.h>
+
+int thirdspacevest_wire_message_size(uint8_t type)
+{
+	switch(type)
+	{
+	case THIRDSPACEVEST_WIRE_TRIGGER:
+	case THIRDSPACEVEST_WIRE_EFFECT:
+		return 4;
+	case THIRDSPACEVEST_WIRE_FRAME:
+		return 12;
+	default:
+		return E_NPUTIL_INVALID_PARAM;
+	}
+}
+
+int thirdspacevest_wire_encode(const thirdspacevest_wire_message* message, uint8_t* buffer, size_t size)
+{
+	int length = thirdspacevest_wire_message_size(message->type);
+	if(length < 0 || size < (size_t)length)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	buffer[0] = THIRDSPACEVEST_WIRE_MAGIC;
+	buffer[1] = message->type;
+	switch(message->type)
+	{
+	case THIRDSPACEVEST_WIRE_TRIGGER:
+		if(message->cell >= THIRDSPACEVEST_CELL_COUNT)
+		{
+			return E_NPUTIL_INVALID_PARAM;
+		}
+		buffer[2] = message->cell;
+		buffer[3] = message->speed;
+		break;
+	case THIRDSPACEVEST_WIRE_FRAME:
+		buffer[2] = message->mask;
+		buffer[3] = 0;
+		memcpy(buffer + 4, message->speeds, THIRDSPACEVEST_CELL_COUNT);
+		break;
+	case THIRDSPACEVEST_WIRE_EFFECT:
+		buffer[2] = message->effect_id & 0xFF;
+		buffer[3] = message->effect_id >> 8;
+		break;
+	}
+	return length;
+}
+
+int thirdspacevest_wire_decode(const uint8_t* buffer, size_t size, thirdspacevest_wire_message* message)
+{
+	int length;
+	if(size < 1)
+	{
+		return 0;
+	}
+	if(buffer[0] != THIRDSPACEVEST_WIRE_MAGIC)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(size < 2)
+	{
+		return 0;
+	}
+	length = thirdspacevest_wire_message_size(buffer[1]);
+	if(length < 0)
+	{
+		return E_NPUTIL_INVALID_PARAM;
+	}
+	if(size < (size_t)length)
+	{
+		return 0;
+	}
+
+	memset(message, 0, sizeof(thirdspacevest_wire_message));
+	message->type = buffer[1];
+	switch(message->type)
+	{
+	case THIRDSPACEVEST_WIRE_TRIGGER:
+		if(buffer[2] >= THIRDSPACEVEST_CELL_COUNT)
+		{
+			return E_NPUTIL_INVALID_PARAM;
+		}
+		message->cell = buffer[2];
+		message->speed = buffer[3];
+		break;
+	case THIRDSPACEVEST_WIRE_FRAME:
+		message->mask = buffer[2];
+		memcpy(message->speeds, buffer + 4, THIRDSPACEVEST_CELL_COUNT);
+		break;
+	case THIRDSPACEVEST_WIRE_EFFECT:
+		message->effect_id = (uint16_t)(buffer[2] | (buffer[3] << 8));
+		break;
+	}
+	return length;
+}
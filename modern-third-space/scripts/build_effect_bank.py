@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+"""
+Effect Bank Builder
+
+Writes every effect in vest/effects.py to a binary effect bank (.tsvb)
+that the native library and the daemon can memory-map.
+
+Usage:
+    python3 scripts/build_effect_bank.py [output.tsvb] [--no-packets]
+
+Exit codes:
+    0 - Bank written
+    1 - Bank could not be built
+"""
+
+import argparse
+import sys
+from pathlib import Path
+
+sys.path.insert(0, str(Path(__file__).parent.parent / "src"))
+
+from modern_third_space.vest.effect_bank import EffectBank, build_bank  # noqa: E402
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build a binary effect bank")
+    parser.add_argument("output", nargs="?", default="effects.tsvb", help="Bank file to write")
+    parser.add_argument("--no-packets", action="store_true", help="Leave out the precomputed packet table")
+    args = parser.parse_args()
+
+    try:
+        data = build_bank(with_packets=not args.no_packets)
+    except ValueError as e:
+        print(f"[ERROR] {e}")
+        return 1
+
+    Path(args.output).write_bytes(data)
+    bank = EffectBank(data)
+    print(f"[OK] Wrote {bank.effect_count} effects ({len(data)} bytes) to {args.output}")
+    for effect_id in range(bank.effect_count):
+        print(f"  {effect_id:5d}  {bank.name(effect_id)}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
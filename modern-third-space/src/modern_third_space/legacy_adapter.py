@@ -4,9 +4,11 @@ Helpers to access the vendored legacy driver.
 
 from __future__ import annotations
 
+import os
 from typing import Type
 
 from .legacy_port import ThirdSpaceVest
+from .legacy_port.native import NativeThirdSpaceVest, native_available
 
 
 class LegacyLoaderError(RuntimeError):
@@ -14,6 +16,13 @@ class LegacyLoaderError(RuntimeError):
 
 
 def load_vest_class() -> Type["ThirdSpaceVest"]:
-    """Return the vendored `ThirdSpaceVest` class."""
+    """
+    Return the vest class to drive hardware with.
+
+    Uses the native `_thirdspacevest` extension when it is installed,
+    unless THIRDSPACE_NATIVE=0 is set, and falls back to the vendored
+    pure Python `ThirdSpaceVest`.
+    """
+    if native_available() and os.environ.get("THIRDSPACE_NATIVE", "1") != "0":
+        return NativeThirdSpaceVest
     return ThirdSpaceVest
-
@@ -0,0 +1,196 @@
+"""
+ThirdSpaceVest on top of the native libthirdspacevest extension.
+
+`_thirdspacevest` is built from `legacy-do-not-change` with
+`-DBUILD_PYTHON=ON`. Packets are formed from the library's precomputed
+table and sent from C with the GIL released, instead of running 32 TEA
+rounds in the interpreter for every command.
+
+NativeThirdSpaceVest has the same interface the controller uses on
+ThirdSpaceVest, plus send_frame, send_frame_async, send_hit,
+play_effect and backpressure.
+"""
+
+from __future__ import annotations
+
+import asyncio
+from typing import Any, Dict, List, Optional, Sequence, Tuple
+
+try:
+    import _thirdspacevest
+except ImportError:
+    _thirdspacevest = None  # type: ignore
+
+try:
+    import usb.core
+except ImportError:
+    usb = None  # type: ignore
+
+
+def native_available() -> bool:
+    """True if the `_thirdspacevest` extension can be imported."""
+    return _thirdspacevest is not None
+
+
+class NativeThirdSpaceVest:
+    """
+    Drop-in replacement for ThirdSpaceVest backed by the C library.
+    """
+
+    TSV_VENDOR_ID = 0x1BD7
+    TSV_PRODUCT_ID = 0x5000
+
+    def __init__(self, device=None):
+        """
+        Args:
+            device: `_thirdspacevest.Device` to drive, a new USB one by default
+        """
+        if _thirdspacevest is None:
+            raise ImportError("_thirdspacevest extension is not installed")
+        self._device = device if device is not None else _thirdspacevest.Device()
+        # PyUSB device matching the opened vest, only used for its
+        # bus/address/serial. None if PyUSB isn't installed.
+        self.tsv_device = None
+        # Event loop watching the completion fd, see send_frame_async
+        self._completion_loop: Optional[asyncio.AbstractEventLoop] = None
+
+    def _find_index(self, bus: int, address: int) -> Optional[int]:
+        """
+        Map a USB location to the library's device index. Both enumerate
+        through libusb's device list, so PyUSB's order is the same.
+        """
+        if usb is None:
+            return None
+        devices = list(usb.core.find(
+            find_all=True,
+            idVendor=self.TSV_VENDOR_ID,
+            idProduct=self.TSV_PRODUCT_ID,
+        ) or [])
+        for index, device in enumerate(devices):
+            if device.bus == bus and device.address == address:
+                self.tsv_device = device
+                return index
+        return None
+
+    def _find_usb_device(self, index: int) -> None:
+        if usb is None:
+            return
+        devices = list(usb.core.find(
+            find_all=True,
+            idVendor=self.TSV_VENDOR_ID,
+            idProduct=self.TSV_PRODUCT_ID,
+        ) or [])
+        if index < len(devices):
+            self.tsv_device = devices[index]
+
+    def open(self, index: int = 0, bus: Optional[int] = None, address: Optional[int] = None) -> bool:
+        """
+        Opens a vest, by position or by USB location.
+
+        Returns True if open successful, False otherwise.
+        """
+        if bus is not None and address is not None:
+            found = self._find_index(bus, address)
+            if found is None:
+                return False
+            index = found
+        else:
+            self._find_usb_device(index)
+        try:
+            self._device.open(index)
+        except _thirdspacevest.Error:
+            self.tsv_device = None
+            return False
+        return True
+
+    def close(self) -> None:
+        """Closes the vest, if it is open."""
+        if self._completion_loop is not None:
+            if not self._completion_loop.is_closed():
+                self._completion_loop.remove_reader(self._device.completion_fd())
+            self._completion_loop = None
+        self._device.close()
+        self.tsv_device = None
+
+    def send_actuator_command(self, index: int, speed: int, cache_key_index: Optional[int] = None) -> None:
+        """
+        Given a cell index and a speed, send an event to the vest.
+
+        cache_key_index is accepted for compatibility and ignored, the
+        library always uses its fixed key.
+        """
+        self._device.send_effect(index, speed)
+
+    def send_frame(self, speeds: Sequence[int], mask: int = 0xFF) -> None:
+        """Set every cell in mask to its entry in speeds in one batch."""
+        self._device.send_frame(list(speeds), mask)
+
+    async def send_frame_async(self, speeds: Sequence[int], mask: int = 0xFF) -> None:
+        """
+        Same as send_frame without blocking the event loop. The library's
+        sender thread does the USB work and its completion fd is watched
+        with add_reader, so no executor thread is involved. Loops without
+        add_reader (the Windows proactor) fall back to an executor.
+        """
+        loop = asyncio.get_running_loop()
+        if self._completion_loop is not loop:
+            try:
+                self._watch_completions(loop)
+            except (NotImplementedError, AttributeError):
+                await loop.run_in_executor(None, self.send_frame, speeds, mask)
+                return
+        future = loop.create_future()
+
+        def done(status: int) -> None:
+            if future.done():
+                return
+            if status < 0:
+                future.set_exception(_thirdspacevest.Error(status, "send_frame_async failed"))
+            else:
+                future.set_result(None)
+
+        self._device.send_frame_async(list(speeds), mask, done)
+        await future
+
+    def _watch_completions(self, loop: asyncio.AbstractEventLoop) -> None:
+        """Start the sender thread and dispatch its callbacks on loop."""
+        self._device.start_completions()
+        fd = self._device.completion_fd()
+        if self._completion_loop is not None and not self._completion_loop.is_closed():
+            self._completion_loop.remove_reader(fd)
+        loop.add_reader(fd, self._device.dispatch_completions)
+        self._completion_loop = loop
+
+    def send_hit(self, x: float, y: float, z: float, intensity: int) -> int:
+        """
+        Drive the cells facing a hit from direction (x, y, z), relative
+        to the wearer: +x right, +y up, +z forward. The mapping comes
+        from the library's lookup table, see _thirdspacevest.project_hit.
+        Cells the hit doesn't reach are left alone.
+
+        Returns the mask of cells driven.
+        """
+        speeds, mask = _thirdspacevest.project_hit(x, y, z, intensity)
+        if mask:
+            self._device.send_frame(speeds, mask)
+        return mask
+
+    def backpressure(self) -> Dict[str, Any]:
+        """
+        Queue depths, smoothed transfer time and adaptive timeout, plus
+        whether the vest counts as saturated. Cheap enough to call after
+        every send, see thirdspacevest_get_backpressure.
+        """
+        return self._device.backpressure()
+
+    def play_effect(self, steps: List[Tuple[int, int, int, int]]) -> int:
+        """
+        Play (cell_mask, speed, start_us, duration_us) steps on the native
+        sequencer, see effect_bank.effect_steps. Returns a handle for
+        cancel_effect.
+        """
+        return self._device.play_effect(steps)
+
+    def cancel_effect(self, handle: int) -> None:
+        """Stop an effect started with play_effect."""
+        self._device.cancel_effect(handle)
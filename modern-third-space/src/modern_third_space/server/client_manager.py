@@ -11,7 +11,7 @@ import uuid
 from dataclasses import dataclass, field
 from typing import Dict, Optional, Set
 
-from .protocol import Event, event_client_connected, event_client_disconnected
+from .protocol import FRAMING_JSON, Command, Event, event_client_connected, event_client_disconnected
 
 
 @dataclass
@@ -21,6 +21,9 @@ class Client:
     writer: asyncio.StreamWriter
     name: Optional[str] = None
     version: Optional[str] = None
+    # Negotiated with set_framing
+    framing: str = FRAMING_JSON
+    wire_target: Optional[Command] = None  # Device binary messages go to
     
     def __hash__(self) -> int:
         return hash(self.id)
@@ -14,12 +14,13 @@ Usage:
 from __future__ import annotations
 
 import asyncio
+import dataclasses
 import json
 import logging
 import signal
-from typing import Any, Dict, Optional
+from typing import Any, Dict, List, Optional, Set, Tuple
 
-from ..vest import VestController, VestStatus, list_devices, get_effect, all_effects_to_dict, effect_to_dict
+from ..vest import VestController, VestStatus, list_devices, get_effect, all_effects_to_dict, effect_to_dict, EFFECTS
 from .client_manager import Client, ClientManager
 from .vest_registry import VestControllerRegistry
 from .player_manager import PlayerManager
@@ -41,6 +42,7 @@ from .protocol import (
     event_cs2_game_event,
     event_device_connected,
     event_device_disconnected,
+    event_device_saturated,
     event_main_device_changed,
     event_mock_device_created,
     event_mock_device_removed,
@@ -93,6 +95,16 @@ from .protocol import (
     event_effect_completed,
     response_play_effect,
     response_list_effects,
+    # Binary framing
+    FRAMING_BINARY,
+    FRAMING_JSON,
+    WIRE_EFFECT,
+    WIRE_FRAME,
+    WIRE_MAGIC,
+    WireMessage,
+    decode_wire,
+    response_set_framing,
+    wire_message_size,
 )
 
 logger = logging.getLogger(__name__)
@@ -127,6 +139,8 @@ class VestDaemon:
         self._clients = ClientManager()
         self._server: Optional[asyncio.Server] = None
         self._running = False
+        # Devices last reported as saturated, see _backpressure_event
+        self._saturated_devices: Set[str] = set()
         
         # CS2 GSI manager
         self._cs2_manager = CS2Manager(
@@ -148,6 +162,40 @@ class VestDaemon:
         
         self._loop: Optional[asyncio.AbstractEventLoop] = None
     
+    def _backpressure_event(self, device_id: Optional[str], controller: VestController) -> Optional[Event]:
+        """
+        Check a device's back-pressure after a trigger. Returns a
+        device_saturated / device_recovered event when its state changed
+        since the last check, None otherwise (or without the native
+        driver, which is the only one that measures it).
+        """
+        if device_id is None:
+            return None
+        backpressure = controller.backpressure()
+        if not isinstance(backpressure, dict):
+            return None
+        saturated = bool(backpressure.get("saturated"))
+        if saturated == (device_id in self._saturated_devices):
+            return None
+        if saturated:
+            self._saturated_devices.add(device_id)
+        else:
+            self._saturated_devices.discard(device_id)
+        return event_device_saturated(device_id, backpressure)
+
+    async def _broadcast_backpressure(self, device_id: Optional[str], controller: VestController) -> None:
+        """
+        Broadcast a back-pressure change after a trigger, see
+        _backpressure_event. The trigger has already succeeded by then,
+        so a failure here is logged rather than raised.
+        """
+        try:
+            pressure_event = self._backpressure_event(device_id, controller)
+            if pressure_event is not None:
+                await self._clients.broadcast(pressure_event)
+        except Exception:
+            logger.exception(f"Error broadcasting back-pressure for {device_id}")
+
     @property
     def selected_device(self) -> Optional[Dict[str, Any]]:
         """Currently selected device."""
@@ -218,20 +266,36 @@ class VestDaemon:
                 # Read a line (command)
                 try:
                     line = await asyncio.wait_for(
-                        reader.readline(),
+                        self._read_message(reader, client),
                         timeout=None,  # No timeout, wait indefinitely
                     )
                 except asyncio.CancelledError:
                     break
-                except (ConnectionResetError, BrokenPipeError, OSError) as e:
+                except (ConnectionResetError, BrokenPipeError, OSError, asyncio.IncompleteReadError) as e:
                     # Client disconnected abruptly (common on Windows)
                     logger.debug(f"Client {client.id} connection lost: {e}")
                     break
+                except ValueError as e:
+                    # Unknown binary message, there's no way to find the
+                    # start of the next one
+                    await self._clients.send_to_client(client, response_error(str(e)).to_json())
+                    break
                 
                 if not line:
                     # Client disconnected
                     break
                 
+                # Binary messages only answer when they fail
+                if line[0] == WIRE_MAGIC:
+                    try:
+                        response = await self._handle_wire(client, decode_wire(line))
+                    except Exception as e:
+                        logger.exception(f"Error handling binary message from {client.id}")
+                        response = response_error(str(e))
+                    if response:
+                        await self._clients.send_to_client(client, response.to_json())
+                    continue
+                
                 # Parse and handle command
                 try:
                     line_str = line.decode().strip()
@@ -272,6 +336,61 @@ class VestDaemon:
             logger.info(f"Client {client.id} disconnected")
             print(f"📴 Client {client.id} disconnected")
     
+    async def _read_message(self, reader: asyncio.StreamReader, client: Client) -> bytes:
+        """
+        Read one JSON line, or one binary message once the client has
+        switched to binary framing.
+        
+        Returns b"" when the client disconnected.
+        """
+        if client.framing != FRAMING_BINARY:
+            return await reader.readline()
+        first = await reader.read(1)
+        if not first or first[0] != WIRE_MAGIC:
+            return first + await reader.readline() if first else first
+        header = first + await reader.readexactly(1)
+        return header + await reader.readexactly(wire_message_size(header) - len(header))
+    
+    async def _handle_wire(self, client: Client, message: WireMessage) -> Optional[Response]:
+        """
+        Handle a binary message as the equivalent trigger or play_effect
+        command, aimed at whatever the client's set_framing targeted.
+        
+        Returns a response only if it failed.
+        """
+        target = client.wire_target or Command(cmd=CommandType.TRIGGER.value)
+        
+        if message.type == WIRE_EFFECT:
+            names = list(EFFECTS)
+            if message.effect_id >= len(names):
+                return response_error(f"Unknown effect ID: {message.effect_id}")
+            response = await self._cmd_play_effect(dataclasses.replace(
+                target, cmd=CommandType.PLAY_EFFECT.value, effect_name=names[message.effect_id]))
+            return None if response.success else response
+        
+        if message.type == WIRE_FRAME:
+            speeds, mask = list(message.speeds), message.mask
+        else:
+            speeds, mask = [0] * 8, 1 << message.cell
+            speeds[message.cell] = message.speed
+        return await self._wire_trigger(target, speeds, mask)
+    
+    async def _wire_trigger(self, target: Command, speeds: List[int], mask: int) -> Optional[Response]:
+        """
+        Send a binary trigger or frame as one controller frame. Binary
+        clients are the hot path, so unlike _cmd_trigger this doesn't
+        broadcast effect_triggered per cell, only a back-pressure change.
+        
+        Returns a response only if it failed.
+        """
+        device_id, controller, error = await self._trigger_controller(target)
+        if error is not None:
+            return error
+        if not controller.trigger_frame(speeds, mask):
+            return response_error(controller.status().last_error or "Failed to trigger effect", target.req_id)
+        await self._broadcast_backpressure(device_id, controller)
+        return None
+    
     async def _handle_command(self, client: Client, command: Command) -> Optional[Response]:
         """
         Handle a command and return a response.
@@ -287,6 +406,10 @@ class VestDaemon:
         if cmd_type == CommandType.PING:
             return await self._cmd_ping(command)
         
+        # Connection framing
+        if cmd_type == CommandType.SET_FRAMING:
+            return await self._cmd_set_framing(client, command)
+        
         # Device discovery & selection
         if cmd_type == CommandType.LIST:
             return await self._cmd_list(command)
@@ -425,6 +548,22 @@ class VestDaemon:
             req_id=command.req_id,
         )
     
+    async def _cmd_set_framing(self, client: Client, command: Command) -> Response:
+        """
+        Switch the client between JSON-only and binary framing.
+        
+        Binary triggers, frames and effects go to the device this command
+        names (device_id, player_id or game_id+player_num), or the main
+        device.
+        """
+        framing = command.framing or FRAMING_JSON
+        if framing not in (FRAMING_JSON, FRAMING_BINARY):
+            return response_error(f"Unknown framing: {framing}", command.req_id)
+        
+        client.framing = framing
+        client.wire_target = dataclasses.replace(command, req_id=None, framing=None)
+        return response_set_framing(framing, effect_ids=list(EFFECTS), req_id=command.req_id)
+    
     async def _cmd_list(self, command: Command) -> Response:
         """List available devices (includes real USB devices and mock devices)."""
         # Get real USB devices
@@ -946,6 +1085,35 @@ class VestDaemon:
         if command.cell is None or command.speed is None:
             return response_error("Must specify cell and speed", command.req_id)
         
+        target_device_id, controller, error = await self._trigger_controller(command)
+        if error is not None:
+            return error
+        
+        # Trigger the effect
+        success = controller.trigger_effect(command.cell, command.speed)
+        
+        if success:
+            # Broadcast effect triggered event (include resolved device_id)
+            await self._clients.broadcast(event_effect_triggered(
+                command.cell, 
+                command.speed,
+                device_id=target_device_id
+            ))
+            await self._broadcast_backpressure(target_device_id, controller)
+            return response_ok(command.req_id)
+        else:
+            error_msg = controller.status().last_error or "Failed to trigger effect"
+            return response_error(error_msg, command.req_id)
+    
+    async def _trigger_controller(
+        self, command: Command
+    ) -> Tuple[Optional[str], Optional[VestController], Optional[Response]]:
+        """
+        Find the connected controller a trigger is aimed at, auto-connecting
+        the main device if needed.
+        
+        Returns (device_id, controller, None), or (None, None, error).
+        """
         # Resolve device_id using fallback logic
         target_device_id = self._resolve_device_id(command)
         
@@ -955,7 +1123,7 @@ class VestDaemon:
         # If no controller found, try to auto-connect main device (backward compatibility)
         if controller is None:
             if self._selected_device is None:
-                return response_error("No device selected and no device_id specified", command.req_id)
+                return None, None, response_error("No device selected and no device_id specified", command.req_id)
             
             # Auto-connect main device
             try:
@@ -966,26 +1134,12 @@ class VestDaemon:
                 self._controller = controller  # Update for backward compatibility
                 await self._clients.broadcast(event_connected(self._selected_device))
             except ValueError as e:
-                return response_error(str(e), command.req_id)
+                return None, None, response_error(str(e), command.req_id)
         
         # Check if connected
         if not controller.status().connected:
-            return response_error("Device not connected", command.req_id)
-        
-        # Trigger the effect
-        success = controller.trigger_effect(command.cell, command.speed)
-        
-        if success:
-            # Broadcast effect triggered event (include resolved device_id)
-            await self._clients.broadcast(event_effect_triggered(
-                command.cell, 
-                command.speed,
-                device_id=target_device_id
-            ))
-            return response_ok(command.req_id)
-        else:
-            error_msg = controller.status().last_error or "Failed to trigger effect"
-            return response_error(error_msg, command.req_id)
+            return None, None, response_error("Device not connected", command.req_id)
+        return target_device_id, controller, None
     
     async def _cmd_stop(self, command: Command) -> Response:
         """Stop all effects (on specified device_id or all devices)."""
@@ -1152,6 +1306,10 @@ class VestDaemon:
                 self._clients.broadcast(event),
                 self._loop,
             )
+            asyncio.run_coroutine_threadsafe(
+                self._broadcast_backpressure(main_device_id, controller),
+                self._loop,
+            )
     
     # -------------------------------------------------------------------------
     # Half-Life: Alyx command handlers
@@ -1252,6 +1410,10 @@ class VestDaemon:
                 self._clients.broadcast(event),
                 self._loop,
             )
+            asyncio.run_coroutine_threadsafe(
+                self._broadcast_backpressure(main_device_id, controller),
+                self._loop,
+            )
     
     # -------------------------------------------------------------------------
     # Left 4 Dead 2 commands
@@ -1335,6 +1497,10 @@ class VestDaemon:
                 self._clients.broadcast(event),
                 self._loop,
             )
+            asyncio.run_coroutine_threadsafe(
+                self._broadcast_backpressure(main_device_id, controller),
+                self._loop,
+            )
     
     # -------------------------------------------------------------------------
     # Predefined Effects command handlers
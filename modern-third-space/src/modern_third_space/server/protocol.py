@@ -2,7 +2,10 @@
 Protocol definitions for the vest daemon.
 
 This module defines the JSON message format for communication between
-clients and the daemon. All messages are newline-delimited JSON.
+clients and the daemon. All messages are newline-delimited JSON, unless
+a client switches to binary framing with set_framing, after which
+triggers, frames and effect IDs may also be sent as fixed-size binary
+messages (see "Binary framing" below).
 
 Message Types:
 - Commands: Client → Daemon requests
@@ -13,6 +16,7 @@ Message Types:
 from __future__ import annotations
 
 import json
+import struct
 import time
 from dataclasses import dataclass, field, asdict
 from typing import Any, Dict, List, Optional, Union
@@ -23,6 +27,8 @@ class CommandType(Enum):
     """Valid command types from clients."""
     # Health check
     PING = "ping"
+    # Connection framing
+    SET_FRAMING = "set_framing"
     # Device discovery & selection
     LIST = "list"
     SELECT_DEVICE = "select_device"
@@ -81,6 +87,9 @@ class EventType(Enum):
     DEVICE_CONNECTED = "device_connected"
     DEVICE_DISCONNECTED = "device_disconnected"
     MAIN_DEVICE_CHANGED = "main_device_changed"
+    # Back-pressure: the vest is falling behind / caught up again
+    DEVICE_SATURATED = "device_saturated"
+    DEVICE_RECOVERED = "device_recovered"
     # Mock device events
     MOCK_DEVICE_CREATED = "mock_device_created"
     MOCK_DEVICE_REMOVED = "mock_device_removed"
@@ -151,6 +160,8 @@ class Command:
     player_id: Optional[str] = None  # Target global player's device
     game_id: Optional[str] = None  # Game identifier for game-specific mapping
     player_num: Optional[int] = None  # Player number (1, 2, 3...) for game-specific mapping
+    # Framing negotiation
+    framing: Optional[str] = None  # "json" or "binary"
     
     @classmethod
     def from_dict(cls, data: Dict[str, Any]) -> "Command":
@@ -178,6 +189,7 @@ class Command:
             player_id=data.get("player_id"),
             game_id=data.get("game_id"),
             player_num=data.get("player_num"),
+            framing=data.get("framing"),
         )
     
     @classmethod
@@ -277,6 +289,9 @@ class Response:
     # Predefined effects response
     effects: Optional[List[Dict[str, Any]]] = None
     categories: Optional[List[str]] = None
+    # Framing response
+    framing: Optional[str] = None
+    effect_ids: Optional[List[str]] = None  # Effect names, indexed by binary effect ID
     
     def to_dict(self) -> Dict[str, Any]:
         """Convert to dictionary, excluding None values."""
@@ -350,6 +365,19 @@ def event_device_disconnected(device_id: str) -> Event:
         device_id=device_id,
     )
 
+def event_device_saturated(device_id: str, backpressure: Dict[str, Any]) -> Event:
+    """
+    Create a device_saturated or device_recovered event, depending on
+    backpressure["saturated"]. params carries the full back-pressure
+    snapshot (queue depths, rtt_us, timeout_ms...) so integrations can
+    decide how much to thin their event rate.
+    """
+    return Event(
+        event=(EventType.DEVICE_SATURATED if backpressure.get("saturated") else EventType.DEVICE_RECOVERED).value,
+        device_id=device_id,
+        params=backpressure,
+    )
+
 def event_mock_device_created(device: Dict[str, Any], device_id: str) -> Event:
     """Create a mock_device_created event."""
     event_data = device.copy()
@@ -851,3 +879,104 @@ def response_list_effects(
         categories=categories,
     )
 
+
+# -------------------------------------------------------------------------
+# Binary framing
+# -------------------------------------------------------------------------
+#
+# After {"cmd": "set_framing", "framing": "binary"} is acknowledged, a
+# client may send these instead of trigger/play_effect JSON lines. JSON
+# lines keep working for everything else: binary messages start with
+# WIRE_MAGIC, which can't start a JSON line. Binary messages get no
+# response unless they fail. The layout matches thirdspacevest_wire_*
+# in the native library.
+
+FRAMING_JSON = "json"
+FRAMING_BINARY = "binary"
+
+WIRE_MAGIC = 0xB5
+WIRE_TRIGGER = 1  # magic, type, cell, speed
+WIRE_FRAME = 2    # magic, type, mask, 0, speeds[8]
+WIRE_EFFECT = 3   # magic, type, effect_id (u16 LE)
+
+WIRE_SIZES = {
+    WIRE_TRIGGER: 4,
+    WIRE_FRAME: 12,
+    WIRE_EFFECT: 4,
+}
+
+_WIRE_TRIGGER = struct.Struct("<BBBB")
+_WIRE_FRAME = struct.Struct("<BBBx8s")
+_WIRE_EFFECT = struct.Struct("<BBH")
+
+
+@dataclass
+class WireMessage:
+    """A decoded binary message. Only the fields for its type are set."""
+    type: int
+    cell: Optional[int] = None
+    speed: Optional[int] = None
+    mask: Optional[int] = None
+    speeds: Optional[List[int]] = None
+    effect_id: Optional[int] = None
+
+
+def encode_trigger(cell: int, speed: int) -> bytes:
+    """Binary equivalent of a trigger command."""
+    if not 0 <= cell < 8:
+        raise ValueError(f"Invalid cell: {cell}")
+    return _WIRE_TRIGGER.pack(WIRE_MAGIC, WIRE_TRIGGER, cell, speed)
+
+def encode_frame(speeds: List[int], mask: int = 0xFF) -> bytes:
+    """Sets every cell in mask to its entry in speeds in one message."""
+    if len(speeds) != 8:
+        raise ValueError("A frame needs 8 speeds")
+    return _WIRE_FRAME.pack(WIRE_MAGIC, WIRE_FRAME, mask, bytes(speeds))
+
+def encode_effect(effect_id: int) -> bytes:
+    """Binary equivalent of play_effect, see response_set_framing."""
+    return _WIRE_EFFECT.pack(WIRE_MAGIC, WIRE_EFFECT, effect_id)
+
+def wire_message_size(header: bytes) -> int:
+    """
+    Size of the binary message starting with these two bytes.
+    
+    Raises ValueError if they don't start a binary message.
+    """
+    if len(header) < 2 or header[0] != WIRE_MAGIC or header[1] not in WIRE_SIZES:
+        raise ValueError("Not a binary message")
+    return WIRE_SIZES[header[1]]
+
+def decode_wire(data: bytes) -> WireMessage:
+    """
+    Decode one complete binary message.
+    
+    Raises ValueError if data isn't exactly one valid message.
+    """
+    if len(data) != wire_message_size(data[:2]):
+        raise ValueError("Truncated binary message")
+    kind = data[1]
+    if kind == WIRE_TRIGGER:
+        _, _, cell, speed = _WIRE_TRIGGER.unpack(data)
+        if cell >= 8:
+            raise ValueError(f"Invalid cell: {cell}")
+        return WireMessage(type=kind, cell=cell, speed=speed)
+    if kind == WIRE_FRAME:
+        _, _, mask, speeds = _WIRE_FRAME.unpack(data)
+        return WireMessage(type=kind, mask=mask, speeds=list(speeds))
+    _, _, effect_id = _WIRE_EFFECT.unpack(data)
+    return WireMessage(type=kind, effect_id=effect_id)
+
+def response_set_framing(
+    framing: str,
+    effect_ids: Optional[List[str]] = None,
+    req_id: Optional[str] = None,
+) -> Response:
+    """Response to set_framing, with the effect names binary IDs refer to."""
+    return Response(
+        response="set_framing",
+        req_id=req_id,
+        success=True,
+        framing=framing,
+        effect_ids=effect_ids,
+    )
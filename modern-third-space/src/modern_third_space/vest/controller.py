@@ -15,7 +15,7 @@ This module should NOT contain:
 from __future__ import annotations
 
 import contextlib
-from typing import Any, Dict, Optional
+from typing import Any, Dict, Optional, Sequence
 
 from .status import VestStatus
 from .discovery import list_devices
@@ -216,16 +216,68 @@ class VestController:
             self._vest.send_actuator_command(cell_index, speed)
             return True
         except Exception as exc:
+            self._record_error(exc)
+            return False
+
+    def trigger_frame(self, speeds: Sequence[int], mask: int = 0xFF) -> bool:
+        """
+        Set every cell in mask to its entry in speeds.
+        
+        The native driver sends the whole frame in one batch, see
+        NativeThirdSpaceVest.send_frame. The pure Python driver gets one
+        command per cell.
+        
+        Returns:
+            True if the frame was sent, False otherwise
+        """
+        if self._vest is None:
+            self.connect()
+        if self._vest is None:
             self._status = VestStatus(
-                connected=self._status.connected,
-                device_vendor_id=self._status.device_vendor_id,
-                device_product_id=self._status.device_product_id,
-                device_bus=self._status.device_bus,
-                device_address=self._status.device_address,
-                device_serial_number=self._status.device_serial_number,
-                last_error=str(exc),
+                connected=False,
+                last_error="Unable to connect to vest"
             )
             return False
+        try:
+            send_frame = getattr(self._vest, "send_frame", None)
+            if send_frame is not None:
+                send_frame(speeds, mask)
+            else:
+                for cell in range(8):
+                    if mask & (1 << cell):
+                        self._vest.send_actuator_command(cell, speeds[cell])
+            return True
+        except Exception as exc:
+            self._record_error(exc)
+            return False
+
+    def _record_error(self, exc: Exception) -> None:
+        """Keep the connection details, with exc as the last error."""
+        self._status = VestStatus(
+            connected=self._status.connected,
+            device_vendor_id=self._status.device_vendor_id,
+            device_product_id=self._status.device_product_id,
+            device_bus=self._status.device_bus,
+            device_address=self._status.device_address,
+            device_serial_number=self._status.device_serial_number,
+            last_error=str(exc),
+        )
+
+    def backpressure(self) -> Optional[Dict[str, Any]]:
+        """
+        How far behind the vest is, from the native driver: queue_depth,
+        completion_depth, in_flight, rtt_us, rtt_var_us, timeout_ms and
+        saturated. None when not connected or on the pure Python driver,
+        which doesn't measure it.
+        """
+        get = getattr(self._vest, "backpressure", None)
+        if get is None:
+            return None
+        with contextlib.suppress(Exception):
+            backpressure = get()
+            if isinstance(backpressure, dict):
+                return backpressure
+        return None
 
     def stop_all(self) -> None:
         """
@@ -0,0 +1,231 @@
+"""
+Binary effect banks (.tsvb) for the Third Space Vest.
+
+A bank holds every effect pattern in a form the native library can
+memory-map and use in place (see ``thirdspacevest_bank_open`` in
+``thirdspacevest.h``): fixed-size step records, a hashed name index and,
+optionally, the encrypted packet for every (cell, speed) pair. Effects
+are addressed by a 16-bit ID, their position in the bank, so the daemon
+and plugins can trigger them without passing names around.
+
+IDs follow the order of the effects passed to ``build_bank`` (for the
+default bank, the order of ``EFFECTS``). Resolve names to IDs once per
+loaded bank rather than hard-coding them.
+
+Usage:
+    from modern_third_space.vest.effect_bank import EffectBank, write_bank
+
+    write_bank("effects.tsvb")
+    bank = EffectBank.open("effects.tsvb")
+    effect_id = bank.find("machinegun_front")
+    for cell_mask, speed, start_us, duration_us in bank.steps(effect_id):
+        ...
+"""
+
+from __future__ import annotations
+
+import mmap
+import struct
+from dataclasses import dataclass
+from typing import Iterable, List, Optional, Tuple
+
+from .effects import EFFECTS, Effect
+from ..legacy_port.thirdspace import ThirdSpaceVest
+
+MAGIC = b"TSVB"
+VERSION = 1
+
+# Must match thirdspacevest_bank_header, thirdspacevest_bank_effect and
+# thirdspacevest_step in thirdspacevest.h
+HEADER = struct.Struct("<4sHHIIIIIIIIII")
+EFFECT = struct.Struct("<IIIHH")
+STEP = struct.Struct("<BBHII")
+
+CELL_COUNT = 8
+PACKET_SIZE = 10
+MAX_STEPS = 64
+
+# Cache key index the native library encrypts packets with, unless its
+# key mode is rotating
+CACHE_KEY_INDEX = 0x1D
+
+
+def name_hash(name: str) -> int:
+    """FNV-1a hash used by the bank's name index."""
+    h = 0x811C9DC5
+    for b in name.encode("utf-8"):
+        h = ((h ^ b) * 0x01000193) & 0xFFFFFFFF
+    return h
+
+
+def _tea_encrypt(v0: int, v1: int, key: List[int]) -> Tuple[int, int]:
+    total = 0
+    for _ in range(32):
+        total = (total + 0x9E3779B9) & 0xFFFFFFFF
+        v0 = (v0 + ((((v1 << 4) + key[0]) ^ (v1 + total) ^ ((v1 >> 5) + key[1])) & 0xFFFFFFFF)) & 0xFFFFFFFF
+        v1 = (v1 + ((((v0 << 4) + key[2]) ^ (v0 + total) ^ ((v0 >> 5) + key[3])) & 0xFFFFFFFF)) & 0xFFFFFFFF
+    return v0, v1
+
+
+def form_packet(index: int, speed: int, key_index: int = CACHE_KEY_INDEX) -> bytes:
+    """
+    Build the packet the native library sends for a cell/speed pair.
+
+    Mirrors thirdspacevest_form_packet_with_key byte for byte, which
+    reads the payload and key as little-endian words.
+    """
+    table = ThirdSpaceVest.CACHE_KEY_TABLE
+    key = [
+        struct.unpack_from("<I", bytes(table[key_index + 4 * i:key_index + 4 * i + 4]))[0]
+        for i in range(4)
+    ]
+    checksum = ThirdSpaceVest().form_checksum(index, speed)
+    payload = bytes([0, 0, 0, 0, 0, checksum & 0xFF, index, speed])
+    v0, v1 = struct.unpack("<II", payload)
+    v0, v1 = _tea_encrypt(v0, v1, key)
+    return bytes([0x02, key_index]) + struct.pack("<II", v0, v1)
+
+
+def effect_steps(effect: Effect) -> List[Tuple[int, int, int, int]]:
+    """
+    Flatten an effect into (cell_mask, speed, start_us, duration_us)
+    records, laying its steps out back to back the way they play.
+    """
+    records = []
+    cursor_ms = 0
+    for step in effect.steps:
+        mask = 0
+        for cell in step.cells:
+            mask |= 1 << cell
+        records.append((mask, step.speed, cursor_ms * 1000, step.duration_ms * 1000))
+        cursor_ms += step.duration_ms + step.delay_ms
+    return records
+
+
+def _align(data: bytearray) -> None:
+    data.extend(b"\0" * (-len(data) % 4))
+
+
+def build_bank(effects: Optional[Iterable[Effect]] = None, with_packets: bool = True) -> bytes:
+    """Serialize effects (all of EFFECTS by default) into a bank."""
+    effects = list(EFFECTS.values() if effects is None else effects)
+    if len(effects) > 0xFFFF:
+        raise ValueError("a bank holds at most 65535 effects")
+
+    records = []
+    steps = []
+    names = bytearray()
+    for effect in effects:
+        flat = effect_steps(effect)
+        if len(flat) > MAX_STEPS:
+            raise ValueError(f"{effect.name} has more than {MAX_STEPS} steps")
+        records.append((len(names), name_hash(effect.name), len(steps), len(flat)))
+        steps.extend(flat)
+        names.extend(effect.name.encode("utf-8") + b"\0")
+    if not names:
+        names.append(0)
+
+    index_size = 1
+    while index_size <= len(effects) * 2:
+        index_size *= 2
+    index = [0] * index_size
+    for effect_id, record in enumerate(records):
+        slot = record[1] & (index_size - 1)
+        while index[slot]:
+            slot = (slot + 1) & (index_size - 1)
+        index[slot] = effect_id + 1
+
+    data = bytearray(HEADER.size)
+    effects_offset = len(data)
+    for name_offset, hashed, first_step, step_count in records:
+        data += EFFECT.pack(name_offset, hashed, first_step, step_count, 0)
+    steps_offset = len(data)
+    for mask, speed, start_us, duration_us in steps:
+        data += STEP.pack(mask, speed, 0, start_us, duration_us)
+    index_offset = len(data)
+    data += struct.pack(f"<{index_size}H", *index)
+    _align(data)
+    names_offset = len(data)
+    data += names
+    _align(data)
+    packets_offset = 0
+    if with_packets:
+        packets_offset = len(data)
+        for index_ in range(CELL_COUNT):
+            for speed in range(256):
+                data += form_packet(index_, speed)
+
+    HEADER.pack_into(
+        data, 0, MAGIC, VERSION, len(effects), len(data),
+        effects_offset, steps_offset, len(steps),
+        index_offset, index_size, names_offset, len(names),
+        packets_offset, 0,
+    )
+    return bytes(data)
+
+
+def write_bank(path: str, effects: Optional[Iterable[Effect]] = None, with_packets: bool = True) -> None:
+    """Build a bank and write it to path."""
+    with open(path, "wb") as f:
+        f.write(build_bank(effects, with_packets))
+
+
+@dataclass
+class EffectBank:
+    """Read-only view of a bank, usually memory-mapped."""
+    data: bytes
+
+    def __post_init__(self):
+        if len(self.data) < HEADER.size:
+            raise ValueError("not an effect bank")
+        (magic, version, self.effect_count, file_size,
+         self._effects_offset, self._steps_offset, self._step_count,
+         self._index_offset, self._index_size, self._names_offset, self._names_size,
+         self._packets_offset, _) = HEADER.unpack_from(self.data, 0)
+        if magic != MAGIC or version != VERSION or file_size != len(self.data):
+            raise ValueError("not an effect bank, or an unsupported version")
+
+    @classmethod
+    def open(cls, path: str) -> "EffectBank":
+        """Map a bank file read-only."""
+        with open(path, "rb") as f:
+            return cls(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ))
+
+    def _effect(self, effect_id: int) -> Tuple[int, int, int, int, int]:
+        if not 0 <= effect_id < self.effect_count:
+            raise IndexError(effect_id)
+        return EFFECT.unpack_from(self.data, self._effects_offset + effect_id * EFFECT.size)
+
+    def name(self, effect_id: int) -> str:
+        """Name of an effect."""
+        start = self._names_offset + self._effect(effect_id)[0]
+        end = self.data.index(b"\0", start)
+        return bytes(self.data[start:end]).decode("utf-8")
+
+    def find(self, name: str) -> Optional[int]:
+        """Effect ID for a name, or None."""
+        hashed = name_hash(name)
+        mask = self._index_size - 1
+        for i in range(self._index_size):
+            slot = struct.unpack_from("<H", self.data, self._index_offset + ((hashed + i) & mask) * 2)[0]
+            if not slot:
+                break
+            if self._effect(slot - 1)[1] == hashed and self.name(slot - 1) == name:
+                return slot - 1
+        return None
+
+    def steps(self, effect_id: int) -> List[Tuple[int, int, int, int]]:
+        """(cell_mask, speed, start_us, duration_us) records of an effect."""
+        _, _, first_step, step_count, _ = self._effect(effect_id)
+        records = []
+        for i in range(first_step, first_step + step_count):
+            mask, speed, _, start_us, duration_us = STEP.unpack_from(self.data, self._steps_offset + i * STEP.size)
+            records.append((mask, speed, start_us, duration_us))
+        return records
+
+    def packet(self, index: int, speed: int) -> Optional[bytes]:
+        """Precomputed packet for a cell/speed pair, if the bank has them."""
+        if not self._packets_offset or not 0 <= index < CELL_COUNT or not 0 <= speed < 256:
+            return None
+        start = self._packets_offset + (index * 256 + speed) * PACKET_SIZE
+        return bytes(self.data[start:start + PACKET_SIZE])
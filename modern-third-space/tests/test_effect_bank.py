@@ -0,0 +1,95 @@
+"""
+Tests for the binary effect bank format.
+
+These tests verify that banks built from EFFECTS round-trip through the
+reader, and that the layout matches what the native loader expects.
+"""
+
+import pytest
+from modern_third_space.vest.effects import EFFECTS, Effect, EffectCategory, EffectStep
+from modern_third_space.vest.effect_bank import (
+    HEADER,
+    PACKET_SIZE,
+    EffectBank,
+    build_bank,
+    effect_steps,
+    form_packet,
+    name_hash,
+)
+
+
+class TestEffectBank:
+    """Test suite for effect bank building and reading."""
+
+    def test_header(self):
+        """Test header fields and section alignment."""
+        data = build_bank()
+        fields = HEADER.unpack_from(data, 0)
+        assert fields[0] == b"TSVB"
+        assert fields[2] == len(EFFECTS)
+        assert fields[3] == len(data)
+        for offset in (fields[4], fields[5], fields[7], fields[9], fields[11]):
+            assert offset % 4 == 0
+
+    def test_every_effect_found_by_name(self):
+        """Test that every name resolves to its position in EFFECTS."""
+        bank = EffectBank(build_bank())
+        for effect_id, name in enumerate(EFFECTS):
+            assert bank.find(name) == effect_id
+            assert bank.name(effect_id) == name
+        assert bank.find("not_an_effect") is None
+
+    def test_steps_are_laid_out_back_to_back(self):
+        """Test that durations and delays become absolute start offsets."""
+        effect = Effect(
+            name="test",
+            display_name="Test",
+            category=EffectCategory.SPECIAL,
+            description="",
+            steps=[
+                EffectStep(cells=[0, 7], speed=5, duration_ms=100, delay_ms=50),
+                EffectStep(cells=[2], speed=9, duration_ms=20),
+            ],
+        )
+        assert effect_steps(effect) == [
+            (0x81, 5, 0, 100000),
+            (0x04, 9, 150000, 20000),
+        ]
+        bank = EffectBank(build_bank([effect]))
+        assert bank.steps(0) == effect_steps(effect)
+
+    def test_packets(self):
+        """Test that the packet table matches form_packet."""
+        bank = EffectBank(build_bank())
+        assert bank.packet(3, 7) == form_packet(3, 7)
+        assert len(bank.packet(7, 255)) == PACKET_SIZE
+        assert bank.packet(8, 0) is None
+
+    def test_known_packet(self):
+        """Test one packet against the bytes the C library produces."""
+        assert form_packet(3, 7) == bytes([0x02, 0x1D, 0x20, 0x63, 0xCC, 0xC0, 0xF6, 0x6B, 0xD7, 0x8A])
+
+    def test_no_packets(self):
+        """Test banks built without a packet table."""
+        bank = EffectBank(build_bank(with_packets=False))
+        assert bank.packet(0, 0) is None
+        assert bank.effect_count == len(EFFECTS)
+
+    def test_empty_bank(self):
+        """Test that a bank with no effects is still valid."""
+        bank = EffectBank(build_bank([], with_packets=False))
+        assert bank.effect_count == 0
+        assert bank.find("anything") is None
+
+    def test_rejects_garbage(self):
+        """Test that truncated or foreign data is rejected."""
+        data = build_bank()
+        with pytest.raises(ValueError):
+            EffectBank(data[:100])
+        with pytest.raises(ValueError):
+            EffectBank(b"XXXX" + data[4:])
+
+    def test_name_hash(self):
+        """Test FNV-1a against a known value."""
+        assert name_hash("") == 0x811C9DC5
+        assert name_hash("a") == 0xE40C292C
@@ -0,0 +1,202 @@
+"""
+Tests for the native `_thirdspacevest` extension.
+
+These tests drive a null transport device, so they need the extension
+built with -DBUILD_PYTHON=ON but no vest. They are skipped otherwise.
+"""
+
+import asyncio
+import select
+import threading
+import time
+
+import pytest
+
+_thirdspacevest = pytest.importorskip("_thirdspacevest")
+
+from modern_third_space.legacy_port.native import NativeThirdSpaceVest
+from modern_third_space.vest.cell_layout import BACK_CELLS, FRONT_CELLS, LEFT_SIDE, RIGHT_SIDE, UPPER_CELLS, Cell
+from modern_third_space.vest.effect_bank import effect_steps, form_packet
+from modern_third_space.vest.effects import EFFECTS
+
+
+class TestNativeBinding:
+    """Test suite for the extension and NativeThirdSpaceVest."""
+
+    def test_packets_match_python(self):
+        """Test that the native packet table matches the pure Python encoder."""
+        for cell in range(_thirdspacevest.CELL_COUNT):
+            for speed in range(16):
+                assert _thirdspacevest.form_packet(cell, speed) == form_packet(cell, speed)
+
+    def test_every_key_matches_python(self):
+        """Test that every cache key index a rotating device can pick encrypts like Python."""
+        for key_index in range(256):
+            assert _thirdspacevest.form_packet(5, 9, key_index=key_index) == form_packet(5, 9, key_index)
+
+    def test_key_mode(self):
+        """Test that both key modes send and bad modes are rejected."""
+        device = _thirdspacevest.null_device()
+        device.open()
+        device.set_key_mode(_thirdspacevest.KEY_ROTATING)
+        device.send_effect(2, 7)
+        device.send_frame([3] * 8)
+        device.set_key_mode(_thirdspacevest.KEY_FIXED)
+        device.send_effect(2, 7)
+        with pytest.raises(ValueError):
+            device.set_key_mode(2)
+        device.close()
+
+    def test_send_paths(self):
+        """Test triggers, frames and effects on an open device."""
+        vest = NativeThirdSpaceVest(_thirdspacevest.null_device())
+        assert vest.open() is True
+        vest.send_actuator_command(3, 10, cache_key_index=0x07)
+        vest.send_frame([5] * 8, mask=0x0F)
+        handle = vest.play_effect(effect_steps(next(iter(EFFECTS.values()))))
+        vest.cancel_effect(handle)
+        vest.close()
+
+    def test_project_hit_faces(self):
+        """Test that hits straight at a face drive exactly that face's cells."""
+        faces = [
+            ((0, 0, 1), FRONT_CELLS),
+            ((0, 0, -1), BACK_CELLS),
+            ((-1, 0, 0), LEFT_SIDE),
+            ((1, 0, 0), RIGHT_SIDE),
+            ((0, 1, 0), UPPER_CELLS),
+        ]
+        for direction, cells in faces:
+            speeds, mask = _thirdspacevest.project_hit(*direction, 200)
+            assert mask == sum(1 << cell for cell in cells)
+            assert [speeds[cell] for cell in cells] == [200] * 4
+
+    def test_project_hit_corner(self):
+        """Test that a diagonal hit peaks at the cell on that corner."""
+        speeds, mask = _thirdspacevest.project_hit(-1, 1, 1, 150)
+        assert speeds[Cell.FRONT_UPPER_LEFT] == 150
+        assert max(speed for cell, speed in enumerate(speeds) if cell != Cell.FRONT_UPPER_LEFT) < 50
+        assert speeds[Cell.BACK_LOWER_RIGHT] == 0
+        assert _thirdspacevest.project_hit(0, 0, 0, 9) == ([9] * 8, 0xFF)
+
+    def test_project_hits_blend(self):
+        """Test that batched hits blend like mixer layers."""
+        hits = [(0, 0, 1, 100), (1, 0, 0, 100)]
+        speeds, mask = _thirdspacevest.project_hits(hits, _thirdspacevest.BLEND_SUM)
+        assert speeds[Cell.FRONT_UPPER_RIGHT] == 200
+        assert speeds[Cell.FRONT_UPPER_LEFT] == 100
+        assert speeds[Cell.BACK_UPPER_RIGHT] == 100
+        assert mask == sum(1 << cell for cell in set(FRONT_CELLS) | set(RIGHT_SIDE))
+        speeds, _ = _thirdspacevest.project_hits(hits)
+        assert speeds[Cell.FRONT_UPPER_RIGHT] == 100
+        # Larger than the stack buffer
+        assert _thirdspacevest.project_hits([(0, 0, -1, 1)] * 100, _thirdspacevest.BLEND_SUM)[0][Cell.BACK_LOWER_LEFT] == 100
+        assert _thirdspacevest.project_hits([]) == ([0] * 8, 0)
+        with pytest.raises(ValueError):
+            _thirdspacevest.project_hits(hits, 9)
+        with pytest.raises(TypeError):
+            _thirdspacevest.project_hits([(0, 0, 1)])
+
+    def test_send_hit(self):
+        """Test that send_hit drives only the cells the hit reaches."""
+        vest = NativeThirdSpaceVest(_thirdspacevest.null_device())
+        assert vest.open() is True
+        assert vest.send_hit(0, 0, -2.5, 8) == sum(1 << cell for cell in BACK_CELLS)
+        vest.close()
+
+    def test_errors(self):
+        """Test that bad arguments and closed devices raise."""
+        device = _thirdspacevest.null_device()
+        with pytest.raises(_thirdspacevest.Error):
+            device.send_effect(0, 5)
+        device.open()
+        with pytest.raises(ValueError):
+            device.send_effect(8, 5)
+        with pytest.raises(ValueError):
+            device.play_effect([])
+        device.close()
+
+    def test_releases_gil(self):
+        """Test that other threads run while a send blocks in the library."""
+        device = _thirdspacevest.null_device(latency_us=50000)
+        device.open()
+        ticks = []
+        done = threading.Event()
+
+        def count():
+            while not done.is_set():
+                ticks.append(time.monotonic())
+                time.sleep(0.001)
+
+        thread = threading.Thread(target=count)
+        thread.start()
+        try:
+            device.send_effect(0, 5)
+        finally:
+            done.set()
+            thread.join()
+            device.close()
+        assert len(ticks) > 5
+
+    def test_backpressure(self):
+        """Test that transfer times are tracked and the saturation threshold applies."""
+        vest = NativeThirdSpaceVest(_thirdspacevest.null_device(latency_us=2000))
+        vest.open()
+        fresh = vest.backpressure()
+        assert fresh["rtt_us"] == 0 and fresh["timeout_ms"] == 100
+        assert fresh["saturated"] is False
+        for cell in range(8):
+            vest.send_actuator_command(cell, 3)
+        measured = vest.backpressure()
+        assert 2000 <= measured["rtt_us"] < 50000
+        assert 10 <= measured["timeout_ms"] < 100
+        assert measured["queue_depth"] == 0 and measured["in_flight"] == 0
+        vest._device.set_saturation_threshold(1000)
+        vest.send_actuator_command(0, 0)
+        assert vest.backpressure()["saturated"] is True
+        vest._device.set_saturation_threshold(0)
+        vest.send_actuator_command(0, 0)
+        assert vest.backpressure()["saturated"] is False
+        vest.close()
+
+    def test_completion_fd(self):
+        """Test that the fd turns readable once a frame went out and callbacks run on dispatch."""
+        device = _thirdspacevest.null_device(latency_us=1000)
+        device.open()
+        device.start_completions()
+        statuses = []
+        device.send_frame_async([4] * 8, 0x0F, statuses.append)
+        fd = device.completion_fd()
+        readable, _, _ = select.select([fd], [], [], 2.0)
+        assert readable == [fd]
+        assert device.dispatch_completions() == 1
+        assert statuses == [4]
+        assert select.select([fd], [], [], 0)[0] == []
+        device.send_frame_async([4] * 8, 0x0F, statuses.append)
+        device.close()
+        assert statuses == [4, 0]
+
+    def test_send_frame_async(self):
+        """Test that frames sent from a coroutine complete on the event loop."""
+        vest = NativeThirdSpaceVest(_thirdspacevest.null_device(latency_us=2000))
+        vest.open()
+
+        async def run():
+            ticks = 0
+
+            async def count():
+                nonlocal ticks
+                while True:
+                    ticks += 1
+                    await asyncio.sleep(0)
+
+            counter = asyncio.ensure_future(count())
+            await asyncio.gather(*(vest.send_frame_async([speed] * 8) for speed in range(1, 6)))
+            counter.cancel()
+            return ticks
+
+        try:
+            # The loop keeps running other tasks while the frames go out
+            assert asyncio.run(run()) > 5
+        finally:
+            vest.close()
@@ -0,0 +1,166 @@
+"""
+Tests for binary framing on the daemon socket.
+
+These tests verify the wire encoding against the bytes the native
+thirdspacevest_wire_* functions produce, and that a client can mix JSON
+control commands with binary messages once it negotiated binary framing.
+"""
+
+import asyncio
+from unittest.mock import AsyncMock, Mock, patch
+
+import pytest
+from modern_third_space.server.client_manager import Client
+from modern_third_space.server.daemon import VestDaemon
+from modern_third_space.server.protocol import (
+    FRAMING_BINARY,
+    FRAMING_JSON,
+    WIRE_FRAME,
+    WIRE_TRIGGER,
+    Command,
+    CommandType,
+    decode_wire,
+    encode_effect,
+    encode_frame,
+    encode_trigger,
+    response_error,
+    response_ok,
+    response_play_effect,
+    wire_message_size,
+)
+from modern_third_space.vest.effects import EFFECTS
+
+
+class TestWireEncoding:
+    """Test suite for binary message encoding."""
+
+    def test_known_bytes(self):
+        """Test each message against the native encoder's output."""
+        assert encode_trigger(3, 7) == bytes([0xB5, 0x01, 0x03, 0x07])
+        assert encode_frame([1, 2, 3, 4, 5, 6, 7, 8], 0x81) == bytes(
+            [0xB5, 0x02, 0x81, 0x00, 1, 2, 3, 4, 5, 6, 7, 8])
+        assert encode_effect(0x1234) == bytes([0xB5, 0x03, 0x34, 0x12])
+
+    def test_round_trip(self):
+        """Test that decoding gives back what was encoded."""
+        message = decode_wire(encode_trigger(7, 10))
+        assert (message.type, message.cell, message.speed) == (WIRE_TRIGGER, 7, 10)
+        message = decode_wire(encode_frame([9] * 8))
+        assert (message.type, message.mask, message.speeds) == (WIRE_FRAME, 0xFF, [9] * 8)
+        assert decode_wire(encode_effect(25)).effect_id == 25
+
+    def test_sizes(self):
+        """Test that the size comes from the first two bytes alone."""
+        for data in (encode_trigger(0, 0), encode_frame([0] * 8), encode_effect(0)):
+            assert wire_message_size(data[:2]) == len(data)
+            assert 4 <= len(data) <= 12
+
+    def test_rejects_bad_messages(self):
+        """Test that JSON, unknown types, bad cells and short data are rejected."""
+        with pytest.raises(ValueError):
+            wire_message_size(b'{"')
+        with pytest.raises(ValueError):
+            wire_message_size(bytes([0xB5, 0x7F]))
+        with pytest.raises(ValueError):
+            decode_wire(bytes([0xB5, 0x01, 0x08, 0x00]))
+        with pytest.raises(ValueError):
+            decode_wire(encode_frame([0] * 8)[:8])
+        with pytest.raises(ValueError):
+            encode_trigger(8, 0)
+
+
+def make_client() -> Client:
+    return Client(id="test", writer=Mock())
+
+
+class TestFramingNegotiation:
+    """Test suite for set_framing and binary dispatch in the daemon."""
+
+    def test_set_framing(self):
+        """Test switching a client to binary and back."""
+        async def run():
+            daemon = VestDaemon(host="127.0.0.1", port=0)
+            client = make_client()
+            response = await daemon._handle_command(client, Command(
+                cmd=CommandType.SET_FRAMING.value, framing="binary", device_id="vest_1", req_id="1"))
+            assert response.success is True
+            assert response.framing == FRAMING_BINARY
+            assert response.effect_ids == list(EFFECTS)
+            assert client.framing == FRAMING_BINARY
+            assert client.wire_target.device_id == "vest_1"
+
+            response = await daemon._handle_command(client, Command(
+                cmd=CommandType.SET_FRAMING.value, framing="json"))
+            assert client.framing == FRAMING_JSON
+
+            response = await daemon._handle_command(client, Command(
+                cmd=CommandType.SET_FRAMING.value, framing="protobuf"))
+            assert response.response == "error"
+            assert client.framing == FRAMING_JSON
+        asyncio.run(run())
+
+    def test_mixed_stream(self):
+        """Test that JSON lines and binary messages split correctly."""
+        async def run():
+            daemon = VestDaemon(host="127.0.0.1", port=0)
+            client = make_client()
+            client.framing = FRAMING_BINARY
+            reader = asyncio.StreamReader()
+            reader.feed_data(encode_trigger(1, 5) + b'{"cmd": "ping"}\n' + encode_frame([2] * 8) + encode_effect(3))
+            reader.feed_eof()
+            assert await daemon._read_message(reader, client) == encode_trigger(1, 5)
+            assert await daemon._read_message(reader, client) == b'{"cmd": "ping"}\n'
+            assert await daemon._read_message(reader, client) == encode_frame([2] * 8)
+            assert await daemon._read_message(reader, client) == encode_effect(3)
+            assert await daemon._read_message(reader, client) == b""
+        asyncio.run(run())
+
+    def test_json_client_reads_lines(self):
+        """Test that clients that never negotiated keep plain line reads."""
+        async def run():
+            daemon = VestDaemon(host="127.0.0.1", port=0)
+            reader = asyncio.StreamReader()
+            reader.feed_data(b'{"cmd": "ping"}\n')
+            reader.feed_eof()
+            assert await daemon._read_message(reader, make_client()) == b'{"cmd": "ping"}\n'
+        asyncio.run(run())
+
+    def test_frame_is_one_controller_call(self):
+        """Test that a frame goes out as one controller frame, on the negotiated target, with no per-cell events."""
+        async def run():
+            daemon = VestDaemon(host="127.0.0.1", port=0)
+            client = make_client()
+            client.wire_target = Command(cmd=CommandType.SET_FRAMING.value, player_id="p1")
+            controller = Mock()
+            controller.trigger_frame.return_value = True
+            controller.backpressure.return_value = None
+            with patch.object(daemon, "_trigger_controller", new_callable=AsyncMock,
+                              return_value=("dev", controller, None)) as resolve, \
+                 patch.object(daemon._clients, "broadcast", new_callable=AsyncMock) as broadcast:
+                speeds = [0, 1, 2, 3, 4, 5, 6, 7]
+                assert await daemon._handle_wire(client, decode_wire(encode_frame(speeds, 0x05))) is None
+                assert resolve.call_count == 1
+                assert resolve.call_args.args[0].player_id == "p1"
+                controller.trigger_frame.assert_called_once_with(speeds, 0x05)
+                assert await daemon._handle_wire(client, decode_wire(encode_trigger(3, 9))) is None
+                assert controller.trigger_frame.call_args.args == ([0, 0, 0, 9, 0, 0, 0, 0], 0x08)
+                broadcast.assert_not_called()
+        asyncio.run(run())
+
+    def test_failures_answer(self):
+        """Test that failed binary messages answer with an error and successes stay silent."""
+        async def run():
+            daemon = VestDaemon(host="127.0.0.1", port=0)
+            client = make_client()
+            with patch.object(daemon, "_trigger_controller", new_callable=AsyncMock,
+                              return_value=(None, None, response_error("Device not connected"))):
+                response = await daemon._handle_wire(client, decode_wire(encode_trigger(0, 5)))
+                assert response.message == "Device not connected"
+            with patch.object(daemon, "_cmd_play_effect", new_callable=AsyncMock,
+                              return_value=response_play_effect(success=True)) as play:
+                assert await daemon._handle_wire(client, decode_wire(encode_effect(0))) is None
+                assert play.call_args.args[0].effect_name == list(EFFECTS)[0]
+            response = await daemon._handle_wire(client, decode_wire(encode_effect(len(EFFECTS))))
+            assert response.response == "error"
+        asyncio.run(run())
+